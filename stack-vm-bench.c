@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "stack-vm.h"
+
+// --------------- 基准测试 ---------------
+// 微基准各自反复执行一种热点操作（变量访问、属性读写、字符串拼接、打印、块作用域、调用），
+// 宏基准执行仓库中的示例脚本。每个基准编译一次，在同一个虚拟机上先预热，
+// 再采集若干个样本：每个样本连续执行模块多次（次数在预热时标定，使样本不短于
+// BENCH_SAMPLE_NS），取中位数计算每秒操作数，用中位数绝对偏差衡量波动。
+// 分配次数来自内存池统计，指令数来自一次不计时的剖析执行
+
+// 编译器（stack-vm-compiler.c 不定义 COMPILER_TEST 时不含 main）
+Module* compile(const char* source, size_t length, bool optimize);
+const char* map_file(const char* filename, size_t* size);
+void unmap_file(const char* data, size_t size);
+
+#define BENCH_REPEAT 1000              // 微基准中重复的语句份数
+#define BENCH_DEFAULT_WARMUP 5         // 预热的样本数
+#define BENCH_DEFAULT_ITERATIONS 25    // 计时的样本数
+#define BENCH_SAMPLE_NS 2000000.0      // 每个样本的最短时长（纳秒）
+#define BENCH_MAX_RUNS 100000          // 每个样本最多执行的次数
+
+// 微基准：prefix + body × BENCH_REPEAT + suffix，body 每份包含 ops 次被测操作
+typedef struct {
+    const char* name;
+    const char* prefix;
+    const char* body;
+    const char* suffix;
+    int ops;
+} MicroBench;
+
+static const MicroBench micro_benches[] = {
+    {"global_var",   "var a = 1; var b = 2; var c = 0;\n", "c = a + b;\n", "", 1},
+    {"slot_var",     "function f(a, b) { var c = 0;\n", "c = a + b;\n", "return c; }\nf(1, 2);\n", 1},
+    {"block_var",    "{ var a = 1; var b = 2; var c = 0;\n", "c = a + b;\n", "}\n", 1},
+    {"prop_get",     "var o = {x: 1, y: 2}; var t = 0;\n", "t = o.y;\n", "", 1},
+    {"prop_set",     "var o = {x: 1, y: 2};\n", "o.y = 3;\n", "", 1},
+    {"prop_sum",     "var o = {x: 1, y: 2}; var t = 0;\n", "t = o.x + o.y;\n", "", 1},
+    {"sub_num",      "var a = 7; var b = 2; var c = 0;\n", "c = a - b;\n", "", 1},
+    {"mul_div",      "var a = 7; var b = 2; var c = 0;\n", "c = a * b / a;\n", "", 2},
+    {"compare",      "var a = 7; var b = 2; var c = false;\n", "c = a < b;\n", "", 1},
+    {"prop_add",     "var o = 0;\n", "o = {}; o.x = 1; o.y = 2; o.z = 3;\n", "", 3},
+    {"prop_dict",    "var o = {k0: 0, k1: 1, k2: 2, k3: 3, k4: 4, k5: 5, k6: 6, k7: 7, k8: 8, k9: 9,\n"
+                     "k10: 10, k11: 11, k12: 12, k13: 13, k14: 14, k15: 15, k16: 16, k17: 17, k18: 18, k19: 19,\n"
+                     "k20: 20, k21: 21, k22: 22, k23: 23, k24: 24, k25: 25, k26: 26, k27: 27, k28: 28, k29: 29,\n"
+                     "k30: 30, k31: 31, k32: 32, k33: 33, k34: 34, k35: 35, k36: 36, k37: 37, k38: 38, k39: 39}; var t = 0;\n",
+                     "t = o.k37;\n", "", 1},
+    {"concat_str",   "var s = \"abc\"; var t = \"\";\n", "t = s + \"def\";\n", "", 1},
+    {"concat_num",   "var s = \"n=\"; var n = 42; var t = \"\";\n", "t = s + n;\n", "", 1},
+    {"concat_rope",  "var t = \"0123456789012345678901234567890123456789012345678901234567890123\";\n",
+                     "t = t + \"x\";\n", "", 1},
+    {"print",        "var n = 42;\n", "print(\"value\", n);\n", "", 1},
+    {"block_scope",  "", "{ var u = 1; }\n", "", 1},
+    {"call",         "function id(x) { return x; }\n", "id(1);\n", "", 1},
+    {"call_nested",  "function g(x) { return x; } function f(x) { return g(x); }\n", "f(1);\n", "", 2},
+    {"call_arith",   "var o = {x: 1, y: 2};\n"
+                     "function f(o, a) { var s = a + 1; s = s + o.x; s = s + o.y; return s; }\n",
+                     "f(o, 2);\n", "", 1},
+};
+
+// js_example.txt 去掉条件和循环（编译器尚不支持）后的部分
+static const char js_example_source[] =
+    "var x = 10;\n"
+    "var y = 20;\n"
+    "var z = x + y;\n"
+    "print(\"x + y = \", z);\n"
+    "var str1 = \"Hello\";\n"
+    "var str2 = \"World\";\n"
+    "var str3 = str1 + \" \" + str2;\n"
+    "print(str3);\n"
+    "var obj = {\n"
+    "    name: \"Stack VM\",\n"
+    "    version: 1.0,\n"
+    "    active: true\n"
+    "};\n"
+    "print(\"对象名称: \", obj.name);\n"
+    "print(\"对象版本: \", obj.version);\n"
+    "function add(a, b) {\n"
+    "    return a + b;\n"
+    "}\n"
+    "var result = add(5, 3);\n"
+    "print(\"add(5, 3) = \", result);\n"
+    "var outerVar = 100;\n"
+    "function outerFunc() {\n"
+    "    var innerVar = 200;\n"
+    "    function innerFunc() {\n"
+    "        print(\"外部变量: \", outerVar);\n"
+    "        print(\"内部变量: \", innerVar);\n"
+    "    }\n"
+    "    innerFunc();\n"
+    "}\n"
+    "outerFunc();\n";
+
+// 宏基准：从文件读取的脚本（source 为 NULL）或内置的源码，每次执行算一次操作
+typedef struct {
+    const char* name;
+    const char* path;
+    const char* source;
+} MacroBench;
+
+static const MacroBench macro_benches[] = {
+    {"js_example",       NULL, js_example_source},
+    {"compatible_test1", "compatible_test1.txt", NULL},
+    {"compatible_test2", "compatible_test2.txt", NULL},
+    {"compatible_test3", "compatible_test3.txt", NULL},
+    {"compatible_test3a", "compatible_test3a.txt", NULL},
+    {"compatible_test3b", "compatible_test3b.txt", NULL},
+    {"compatible_test3c", "compatible_test3c.txt", NULL},
+};
+
+typedef struct {
+    int warmup;
+    int iterations;
+    bool csv;
+    bool registers;        // 用寄存器字节码执行
+    const char** filters;
+    int filter_count;
+} BenchOptions;
+
+typedef struct {
+    double ops_per_sec;
+    double median_ns;      // 每次操作的耗时（样本中位数）
+    double min_ns;
+    double mad_percent;    // 中位数绝对偏差占中位数的百分比
+    double allocs;         // 每次操作的内存池分配次数
+    double instructions;   // 每次操作执行的指令数
+} BenchResult;
+
+// 基准的输出全部丢弃（打印基准仍然经过格式化和缓冲）
+static void discard_output(void* user_data, const char* data, size_t length) {
+    (void)data;
+    *(size_t*)user_data += length;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double* values, int count) {
+    qsort(values, count, sizeof(double), compare_double);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static bool bench_selected(const BenchOptions* options, const char* name) {
+    if (options->filter_count == 0) {
+        return true;
+    }
+    for (int i = 0; i < options->filter_count; i++) {
+        if (strstr(name, options->filters[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 执行一个样本：加载后连续执行 runs 次，返回耗时（纳秒），分配次数累加到 allocs
+static bool run_sample(StackVM* vm, const Module* module, int runs, double* elapsed, size_t* allocs) {
+    if (vm_load(vm, module) != VM_OK) {
+        return false;
+    }
+    PoolStats before, after;
+    vm_pool_stats(vm, &before);
+    double start = now_ns();
+    for (int i = 0; i < runs; i++) {
+        if (vm_run(vm) != VM_OK) {
+            return false;
+        }
+    }
+    *elapsed = now_ns() - start;
+    vm_pool_stats(vm, &after);
+    *allocs += after.alloc_count - before.alloc_count;
+    // 每个样本从干净的虚拟机开始，样本之间互不影响
+    return vm_reset(vm) == VM_OK;
+}
+
+static bool run_bench(const Module* module, int ops, const BenchOptions* options, BenchResult* result) {
+    size_t output_bytes = 0;
+    VMConfig config = {0};
+    config.output = discard_output;
+    config.output_user_data = &output_bytes;
+    StackVM* vm = vm_create(&config);
+    double* samples = malloc(options->iterations * sizeof(double));
+    bool ok = vm && samples;
+
+    // 指令数：一次不计时的剖析执行
+    VMProfile* profile = ok ? vm_profile_create(module) : NULL;
+    ok = profile && vm_load(vm, module) == VM_OK;
+    if (ok) {
+        vm_set_profile(vm, profile);
+        ok = vm_run(vm) == VM_OK;
+        vm_set_profile(vm, NULL);
+        result->instructions = (double)profile->instructions / ops;
+        ok = vm_reset(vm) == VM_OK && ok;
+    }
+    vm_profile_free(profile);
+
+    // 预热并标定每个样本的执行次数
+    int runs = 1;
+    double elapsed = 0;
+    size_t allocs = 0;
+    for (int i = 0; ok && i < options->warmup; i++) {
+        ok = run_sample(vm, module, runs, &elapsed, &allocs);
+        while (ok && elapsed < BENCH_SAMPLE_NS && runs < BENCH_MAX_RUNS) {
+            runs *= 2;
+            ok = run_sample(vm, module, runs, &elapsed, &allocs);
+        }
+    }
+
+    allocs = 0;
+    for (int i = 0; ok && i < options->iterations; i++) {
+        ok = run_sample(vm, module, runs, &elapsed, &allocs);
+        samples[i] = elapsed / ((double)runs * ops);
+    }
+    if (ok) {
+        int n = options->iterations;
+        result->median_ns = median(samples, n);
+        result->min_ns = samples[0];
+        for (int i = 0; i < n; i++) {
+            samples[i] = samples[i] > result->median_ns ? samples[i] - result->median_ns
+                                                        : result->median_ns - samples[i];
+        }
+        result->mad_percent = 100.0 * median(samples, n) / result->median_ns;
+        result->ops_per_sec = 1e9 / result->median_ns;
+        result->allocs = (double)allocs / ((double)n * runs * ops);
+    } else if (vm) {
+        fprintf(stderr, "错误：%s\n", vm_error_message(vm));
+    } else {
+        fprintf(stderr, "内存分配失败！\n");
+    }
+    free(samples);
+    vm_destroy(vm);
+    return ok;
+}
+
+static void print_header(const BenchOptions* options) {
+    if (options->csv) {
+        printf("name,ops_per_sec,ns_per_op,min_ns_per_op,mad_percent,allocs_per_op,instructions_per_op\n");
+    } else {
+        printf("%-26s %14s %12s %12s %8s %10s %10s\n",
+               "benchmark", "ops/sec", "ns/op", "min ns/op", "mad", "allocs/op", "insts/op");
+    }
+}
+
+static void print_result(const BenchOptions* options, const char* name, const BenchResult* r) {
+    if (options->csv) {
+        printf("%s,%.0f,%.2f,%.2f,%.2f,%.3f,%.2f\n", name, r->ops_per_sec, r->median_ns, r->min_ns,
+               r->mad_percent, r->allocs, r->instructions);
+    } else {
+        printf("%-26s %14.0f %12.2f %12.2f %7.2f%% %10.3f %10.2f\n", name, r->ops_per_sec, r->median_ns,
+               r->min_ns, r->mad_percent, r->allocs, r->instructions);
+    }
+    fflush(stdout);
+}
+
+static char* micro_source(const MicroBench* bench, size_t* length) {
+    size_t prefix = strlen(bench->prefix), body = strlen(bench->body), suffix = strlen(bench->suffix);
+    *length = prefix + body * BENCH_REPEAT + suffix;
+    char* source = malloc(*length + 1);
+    if (!source) {
+        return NULL;
+    }
+    char* p = source;
+    memcpy(p, bench->prefix, prefix);
+    p += prefix;
+    for (int i = 0; i < BENCH_REPEAT; i++) {
+        memcpy(p, bench->body, body);
+        p += body;
+    }
+    memcpy(p, bench->suffix, suffix);
+    p[suffix] = '\0';
+    return source;
+}
+
+static void print_usage(void) {
+    printf("stack-vm-bench - Stack VM 基准测试\n");
+    printf("\n");
+    printf("用法: stack-vm-bench [选项] [名称...]\n");
+    printf("      只运行名称中包含任一参数的基准（微基准名称以 micro/ 开头，宏基准以 macro/ 开头）\n");
+    printf("\n");
+    printf("选项:\n");
+    printf("  -h, --help      显示此帮助信息\n");
+    printf("  -w <次数>       预热的样本数（默认 %d）\n", BENCH_DEFAULT_WARMUP);
+    printf("  -n <次数>       计时的样本数（默认 %d）\n", BENCH_DEFAULT_ITERATIONS);
+    printf("  --csv           以 CSV 格式输出，便于保存和比较\n");
+    printf("  --registers     用寄存器字节码执行（指令数一列按寄存器指令统计）\n");
+    printf("\n");
+    printf("宏基准从当前目录读取示例脚本，应在仓库根目录运行（make bench）\n");
+}
+
+static Module* bench_compile(const char* source, size_t length, const BenchOptions* options) {
+    Module* module = compile(source, length, true);
+    if (module && options->registers) {
+        module->flags |= MODULE_REGISTER_TIER;
+    }
+    return module;
+}
+
+static bool parse_count(const char* text, int minimum, int* value) {
+    char* end;
+    long n = strtol(text, &end, 10);
+    if (*end != '\0' || n < minimum || n > 1000000) {
+        return false;
+    }
+    *value = (int)n;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options = {BENCH_DEFAULT_WARMUP, BENCH_DEFAULT_ITERATIONS, false, false, NULL, 0};
+    const char* filters[argc];
+    options.filters = filters;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage();
+            return 0;
+        } else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "-n") == 0) {
+            bool warmup = argv[i][1] == 'w';
+            if (i + 1 >= argc ||
+                !parse_count(argv[++i], warmup ? 0 : 1, warmup ? &options.warmup : &options.iterations)) {
+                fprintf(stderr, "错误：选项 '%s' 需要一个%s整数参数\n", argv[i - 1], warmup ? "非负" : "正");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            options.csv = true;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            options.registers = true;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "错误：未知选项 '%s'\n", argv[i]);
+            print_usage();
+            return 1;
+        } else {
+            filters[options.filter_count++] = argv[i];
+        }
+    }
+
+    int failed = 0;
+    char name[64];
+    BenchResult result;
+    print_header(&options);
+    for (size_t i = 0; i < sizeof(micro_benches) / sizeof(micro_benches[0]); i++) {
+        const MicroBench* bench = &micro_benches[i];
+        snprintf(name, sizeof(name), "micro/%s", bench->name);
+        if (!bench_selected(&options, name)) {
+            continue;
+        }
+        size_t length;
+        char* source = micro_source(bench, &length);
+        if (!source) {
+            fprintf(stderr, "内存分配失败！\n");
+            return 1;
+        }
+        Module* module = bench_compile(source, length, &options);
+        if (run_bench(module, bench->ops * BENCH_REPEAT, &options, &result)) {
+            print_result(&options, name, &result);
+        } else {
+            fprintf(stderr, "错误：基准 %s 执行失败\n", name);
+            failed++;
+        }
+        module_free(module);
+        free(source);
+    }
+
+    for (size_t i = 0; i < sizeof(macro_benches) / sizeof(macro_benches[0]); i++) {
+        const MacroBench* bench = &macro_benches[i];
+        snprintf(name, sizeof(name), "macro/%s", bench->name);
+        if (!bench_selected(&options, name)) {
+            continue;
+        }
+        size_t length = 0;
+        const char* source = bench->source;
+        if (source) {
+            length = strlen(source);
+        } else if (!(source = map_file(bench->path, &length))) {
+            fprintf(stderr, "错误：基准 %s 无法读取 '%s'\n", name, bench->path);
+            failed++;
+            continue;
+        }
+        Module* module = bench_compile(source, length, &options);
+        if (run_bench(module, 1, &options, &result)) {
+            print_result(&options, name, &result);
+        } else {
+            fprintf(stderr, "错误：基准 %s 执行失败\n", name);
+            failed++;
+        }
+        module_free(module);
+        if (!bench->source) {
+            unmap_file(source, length);
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}
@@ -3,13 +3,27 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // 导入虚拟机的指令枚举
 #include "stack-vm.h"
+#include "stack-vm-sched.h"
 
 // 编译器的常量定义
-#define MAX_TOKEN_LEN 64
-#define MAX_BYTECODE_LEN 512
+#define MAX_SCOPE_DEPTH 32
+#define MAX_FRAME_SLOTS 255
+#define MAX_ENV_SLOTS 255 // 块作用域堆环境的槽位数（OP_PUSH_ENV 的 1 字节操作数）
+
+typedef struct CompilerSession CompilerSession;
+
+// 编译错误：提示已经写到标准错误。编译服务中释放本次编译的缓冲区后跳回编译入口
+// （compiler_session_compile），其余情况直接退出进程
+VM_NORETURN void compile_fail(void);
 
 // 词法分析器的标记类型
 typedef enum {
@@ -27,6 +41,7 @@ typedef enum {
 
 // 关键字枚举
 typedef enum {
+    KW_NONE = -1,
     KW_VAR,
     KW_PRINT,
     KW_FUNCTION,
@@ -35,30 +50,171 @@ typedef enum {
     KW_ELSE
 } Keyword;
 
+// 源码片段：指向源码缓冲区的（指针，长度）。编译期间源码一直有效，
+// 标记和名字都直接引用源码，不复制、也不限制长度
+typedef struct {
+    const char* chars;
+    int length;
+} Span;
+
 // 标记结构体
 typedef struct {
     TokenType type;
-    char lexeme[MAX_TOKEN_LEN];
+    Span lexeme;      // 字符串字面量不含引号
+    Keyword keyword;  // TOKEN_KEYWORD 的具体关键字，其余为 KW_NONE
     int line;
     int col;
 } Token;
 
-// 词法分析器结构体
+// 词法分析器结构体（源码不要求以 '\0' 结尾）
 typedef struct {
     const char* source;
-    int pos;
+    size_t length;
+    size_t pos;
     int line;
     int col;
     Token current;
 } Lexer;
 
+// 编译期块作用域中的一个变量
+typedef struct {
+    Span name;
+    int slot;                 // 堆环境槽位或栈帧槽位
+    bool in_frame;            // true 表示变量放在栈帧槽位中
+} ScopeVar;
+
+// 编译期块作用域：记录块内声明的变量及其存放位置。
+// 函数中未被内层函数捕获的变量放在栈帧槽位中，其余变量放在块作用域的堆环境中
+typedef struct {
+    ScopeVar* vars;           // 按倍数增长，同一深度的作用域先后复用，编译结束时释放
+    int var_count;
+    int var_capacity;
+    int env_slots;            // 堆环境的槽位数（OP_PUSH_ENV 的操作数）
+    bool has_env;             // 运行时是否为该作用域创建堆环境
+    int saved_next_slot;      // 进入作用域时的栈帧槽位分配位置，退出时恢复以复用槽位
+} Scope;
+
+// 正在编译的函数：主程序和每个函数体各有一份独立的指令缓冲区，编译结束后依次拼接
+typedef struct FunctionState {
+    struct FunctionState* enclosing;
+    bool is_main;
+    uint8_t* bytecode;        // 指令缓冲区，按倍数增长，编译结束后直接转交
+    int bc_pos;
+    int bc_capacity;
+    DebugLine* lines;         // 调试信息：每条语句起始指令对应的源码位置（相对本函数）
+    int line_count;
+    int line_capacity;
+    int scope_base;           // 本函数的第一个作用域在 Parser::scopes 中的下标
+    int arity;
+    int next_slot;            // 下一个可分配的栈帧槽位
+    int slot_count;           // 栈帧槽位数（历史最大值）
+    Span* captured;           // 在内层函数中出现过的标识符（逃逸分析结果）
+    int captured_count;
+} FunctionState;
+
+// 编译完成的函数
+typedef struct {
+    uint8_t* code;
+    int code_len;
+    DebugLine* lines;
+    int line_count;
+    FunctionInfo info;        // entry 在拼接时确定
+} CompiledFunction;
+
+// 编译期常量池：数值、字符串字面量和名字去重后按编号引用
+typedef struct {
+    Constant* constants;
+    int count;
+    int capacity;
+    char* string_data;   // 所有字符串常量的内容依次存放于此
+    int string_len;
+    int string_capacity;
+    int* index;          // 去重索引（开放寻址，存放常量编号 + 1，0 表示空槽）
+    int index_capacity;
+    bool tracing;        // 为 true 时记下每次 pool_add 得到的常量编号（编译服务登记顶层函数用）
+    int* trace;
+    int trace_count;
+    int trace_capacity;
+} ConstantPool;
+
+// 编译服务的函数缓存项：一个顶层函数声明的源码及其（窥孔优化之前的）编译结果，
+// 包括其中嵌套的函数。指令中的常量、函数和内联缓存编号都是本项内的相对编号，
+// 行号相对函数声明所在的行；复用时按本次编译的分配情况重新编号
+typedef struct FunctionCacheEntry {
+    uint64_t hash;                 // 源码文本和起始列的哈希
+    char* text;                    // 从 function 关键字到函数体的右花括号
+    int text_length;
+    int col;                       // 起始列（决定了同一行中其余标记的列号）
+    CompiledFunction* functions;   // 函数本身在前，嵌套的函数按编号依次在后
+    int function_count;
+    Constant* constants;           // 编译时依次加入常量池的常量，复用时按同样的顺序加入
+    int constant_count;
+    char* string_data;
+    int cache_count;               // 用到的内联缓存数
+    unsigned last_used;            // 最近一次用到本项的编译序号
+    struct FunctionCacheEntry* next;
+} FunctionCacheEntry;
+
+// 本次编译中重新编译的顶层函数，编译成功后存入函数缓存
+typedef struct {
+    const char* text;
+    int text_length;
+    int line;
+    int col;
+    uint64_t hash;
+    int first_function;            // 函数编号范围 [first_function, function_end)
+    int function_end;
+    int first_cache;               // 内联缓存编号范围
+    int cache_end;
+    int trace_begin;               // ConstantPool::trace 中的范围
+    int trace_end;
+} PendingFunction;
+
 // 语法分析器结构体
 typedef struct {
     Lexer* lexer;
-    uint8_t bytecode[MAX_BYTECODE_LEN];
-    int bc_pos;
+    FunctionState* fn;             // 当前正在编译的函数
+    ConstantPool pool;
+    Scope scopes[MAX_SCOPE_DEPTH]; // 块作用域栈（不含全局作用域，跨越嵌套的函数）
+    int scope_depth;               // 当前打开的块作用域数，0 表示位于全局作用域
+    int cache_count;               // 已分配的属性内联缓存数
+    CompiledFunction* functions;   // 函数表（按函数声明出现的顺序编号）
+    int function_count;
+    int function_capacity;
+    CompilerSession* session;      // 编译服务的会话，普通编译为 NULL
+    PendingFunction* pending;
+    int pending_count;
+    int pending_capacity;
 } Parser;
 
+// 一次编译的全部状态：编译服务中出错跳回时据此释放已经分配的缓冲区
+typedef struct {
+    Lexer lexer;
+    Parser parser;
+    FunctionState main_fn;      // 主程序是最外层的函数编译状态
+} CompileState;
+
+#define SESSION_BUCKETS 1024     // 函数缓存的哈希桶数（2 的幂）
+#define SESSION_MAX_ENTRIES 4096 // 超过时淘汰最近一次编译没有用到的函数
+
+// 编译会话：多次编译之间保留函数缓存、作用域的变量缓冲区和常量池的去重索引
+struct CompilerSession {
+    CompileState state;            // 编译服务的编译状态（普通编译放在栈上）
+    FunctionCacheEntry* buckets[SESSION_BUCKETS];
+    int entry_count;
+    unsigned generation;           // 已开始的编译次数
+    int reused;                    // 最近一次编译中直接复用的顶层函数数
+    int compiled;                  // 最近一次编译中重新编译的顶层函数数
+    ScopeVar* scope_vars[MAX_SCOPE_DEPTH];
+    int scope_capacity[MAX_SCOPE_DEPTH];
+    int* pool_index;
+    int pool_index_capacity;
+    jmp_buf error_jump;            // 编译出错时跳回 compiler_session_compile
+};
+
+// 正在编译服务中编译的会话（普通编译为 NULL）
+static CompilerSession* compile_error_session = NULL;
+
 // 辅助函数：判断字符是否为空白字符
 bool is_whitespace(char c) {
     return c == ' ' || c == '\t' || c == '\n' || c == '\r';
@@ -79,32 +235,88 @@ bool is_alnum(char c) {
     return is_alpha(c) || is_digit(c) || c == '_' || c == '$';
 }
 
-// 辅助函数：检查是否为关键字
-int is_keyword(const char* lexeme) {
-    if (strcmp(lexeme, "var") == 0) return KW_VAR;
-    if (strcmp(lexeme, "print") == 0) return KW_PRINT;
-    if (strcmp(lexeme, "function") == 0) return KW_FUNCTION;
-    if (strcmp(lexeme, "return") == 0) return KW_RETURN;
-    if (strcmp(lexeme, "if") == 0) return KW_IF;
-    if (strcmp(lexeme, "else") == 0) return KW_ELSE;
-    return -1;
+// 两个源码片段内容是否相同
+bool span_equal(Span a, Span b) {
+    return a.length == b.length && memcmp(a.chars, b.chars, a.length) == 0;
+}
+
+// 保留字：关键字和 true/false/undefined/null 字面量
+typedef struct {
+    const char* text;
+    TokenType type;
+    Keyword keyword;
+} ReservedWord;
+
+// 保留字的完美哈希表：(2 * 长度 + 6 * 首字符 + 末字符) % 16 对全部保留字两两不同，
+// 一次取模、一次比较即可判断标识符是否为保留字
+#define RESERVED_HASH(chars, length) \
+    ((2 * (unsigned)(length) + 6 * (unsigned char)(chars)[0] + (unsigned char)(chars)[(length) - 1]) & 15)
+
+static const ReservedWord reserved_words[16] = {
+    [0]  = {"if",        TOKEN_KEYWORD,   KW_IF},
+    [2]  = {"function",  TOKEN_KEYWORD,   KW_FUNCTION},
+    [3]  = {"false",     TOKEN_BOOLEAN,   KW_NONE},
+    [4]  = {"undefined", TOKEN_UNDEFINED, KW_NONE},
+    [5]  = {"true",      TOKEN_BOOLEAN,   KW_NONE},
+    [6]  = {"return",    TOKEN_KEYWORD,   KW_RETURN},
+    [8]  = {"null",      TOKEN_NULL,      KW_NONE},
+    [11] = {"else",      TOKEN_KEYWORD,   KW_ELSE},
+    [12] = {"var",       TOKEN_KEYWORD,   KW_VAR},
+    [14] = {"print",     TOKEN_KEYWORD,   KW_PRINT},
+};
+
+// 查找保留字，不是保留字返回 NULL
+const ReservedWord* reserved_lookup(Span word) {
+    const ReservedWord* entry = &reserved_words[RESERVED_HASH(word.chars, word.length)];
+    if (entry->text && (int)strlen(entry->text) == word.length &&
+        memcmp(entry->text, word.chars, word.length) == 0) {
+        return entry;
+    }
+    return NULL;
+}
+
+// 标记的第一个字符（EOF 为 '\0'），用于判断单字符的运算符和标点
+char token_char(const Token* token) {
+    return token->lexeme.length > 0 ? token->lexeme.chars[0] : '\0';
+}
+
+// 数值字面量的值
+double token_number(const Token* token) {
+    char buf[64];
+    int length = token->lexeme.length;
+    char* text = length < (int)sizeof(buf) ? buf : malloc(length + 1);
+    if (!text) {
+        fprintf(stderr, "内存分配失败！\n");
+        compile_fail();
+    }
+    memcpy(text, token->lexeme.chars, length);
+    text[length] = '\0';
+    double value = atof(text);
+    if (text != buf) {
+        free(text);
+    }
+    return value;
 }
 
 // 初始化词法分析器
-void lexer_init(Lexer* lexer, const char* source) {
+void lexer_init(Lexer* lexer, const char* source, size_t length) {
     lexer->source = source;
+    lexer->length = length;
     lexer->pos = 0;
     lexer->line = 1;
     lexer->col = 1;
 }
 
-// 获取下一个字符
+// 获取下一个字符（源码末尾返回 '\0'）
 char lexer_peek(Lexer* lexer) {
-    return lexer->source[lexer->pos];
+    return lexer->pos < lexer->length ? lexer->source[lexer->pos] : '\0';
 }
 
-// 消费当前字符
+// 消费当前字符（源码末尾返回 '\0'，位置不变）
 char lexer_consume(Lexer* lexer) {
+    if (lexer->pos >= lexer->length) {
+        return '\0';
+    }
     char c = lexer->source[lexer->pos++];
     if (c == '\n') {
         lexer->line++;
@@ -170,45 +382,51 @@ void lexer_skip_whitespace(Lexer* lexer) {
     }
 }
 
+// 记录从 start 到当前位置的源码片段
+void lexer_span(Lexer* lexer, Token* token, size_t start) {
+    token->lexeme.chars = lexer->source + start;
+    token->lexeme.length = (int)(lexer->pos - start);
+}
+
 // 解析数字
 void lexer_number(Lexer* lexer, Token* token) {
-    int start = lexer->pos;
+    size_t start = lexer->pos;
     while (is_digit(lexer_peek(lexer)) || lexer_peek(lexer) == '.') {
         lexer_consume(lexer);
     }
-    int len = lexer->pos - start;
-    strncpy(token->lexeme, &lexer->source[start], len);
-    token->lexeme[len] = '\0';
+    lexer_span(lexer, token, start);
     token->type = TOKEN_NUMBER;
 }
 
 // 解析字符串
 void lexer_string(Lexer* lexer, Token* token) {
+    int line = lexer->line;
     lexer_consume(lexer); // 跳过开头的引号
-    int start = lexer->pos;
-    while (lexer_peek(lexer) != '"' && lexer_peek(lexer) != '\0') {
+    size_t start = lexer->pos;
+    while (lexer_peek(lexer) != '"') {
+        if (lexer->pos >= lexer->length) {
+            fprintf(stderr, "错误：第 %d 行的字符串字面量没有结束\n", line);
+            compile_fail();
+        }
         lexer_consume(lexer);
     }
-    int len = lexer->pos - start;
-    strncpy(token->lexeme, &lexer->source[start], len);
-    token->lexeme[len] = '\0';
+    lexer_span(lexer, token, start);
     token->type = TOKEN_STRING;
     lexer_consume(lexer); // 跳过结尾的引号
 }
 
-// 解析标识符或关键字
+// 解析标识符、关键字或 true/false/undefined/null
 void lexer_identifier(Lexer* lexer, Token* token) {
-    int start = lexer->pos;
+    size_t start = lexer->pos;
     while (is_alnum(lexer_peek(lexer))) {
         lexer_consume(lexer);
     }
-    int len = lexer->pos - start;
-    strncpy(token->lexeme, &lexer->source[start], len);
-    token->lexeme[len] = '\0';
+    lexer_span(lexer, token, start);
     
-    int keyword = is_keyword(token->lexeme);
-    if (keyword != -1) {
-        token->type = TOKEN_KEYWORD;
+    const ReservedWord* reserved = reserved_lookup(token->lexeme);
+    if (reserved) {
+        token->type = reserved->type;
+        token->keyword = reserved->keyword;
     } else {
         token->type = TOKEN_IDENTIFIER;
     }
@@ -216,17 +434,20 @@ void lexer_identifier(Lexer* lexer, Token* token) {
 
 // 获取下一个标记
 void lexer_next_token(Lexer* lexer, Token* token) {
+    lexer_skip_whitespace(lexer);
+    
+    // 记录跳过空白和注释之后的位置，即标记真正的起点
     token->line = lexer->line;
     token->col = lexer->col;
-    
-    lexer_skip_whitespace(lexer);
+    token->keyword = KW_NONE;
     
     char c = lexer_peek(lexer);
+    size_t start = lexer->pos;
     
     switch (c) {
         case '\0':
             token->type = TOKEN_EOF;
-            token->lexeme[0] = '\0';
+            lexer_span(lexer, token, start);
             break;
         case '0': case '1': case '2': case '3': case '4':
         case '5': case '6': case '7': case '8': case '9':
@@ -237,34 +458,50 @@ void lexer_next_token(Lexer* lexer, Token* token) {
             break;
         case '+': case '-': case '*': case '/':
             token->type = TOKEN_OPERATOR;
-            token->lexeme[0] = lexer_consume(lexer);
-            token->lexeme[1] = '\0';
+            lexer_consume(lexer);
+            lexer_span(lexer, token, start);
+            break;
+        case '<': case '>':
+            // < > <= >=
+            token->type = TOKEN_OPERATOR;
+            lexer_consume(lexer);
+            lexer_match(lexer, '=');
+            lexer_span(lexer, token, start);
+            break;
+        case '!':
+            // != !==（单独的 '!' 作为未知运算符交给语法分析报错）
+            token->type = TOKEN_OPERATOR;
+            lexer_consume(lexer);
+            if (lexer_match(lexer, '=')) {
+                lexer_match(lexer, '=');
+            }
+            lexer_span(lexer, token, start);
+            break;
+        case '=':
+            // == === 是运算符，单独的 '=' 是赋值标点
+            lexer_consume(lexer);
+            if (lexer_match(lexer, '=')) {
+                lexer_match(lexer, '=');
+                token->type = TOKEN_OPERATOR;
+            } else {
+                token->type = TOKEN_PUNCTUATOR;
+            }
+            lexer_span(lexer, token, start);
             break;
-        case '=': case ';': case '(': case ')': case '{': case '}':
+        case ';': case '(': case ')': case '{': case '}':
         case '.': case ':': case ',':
             token->type = TOKEN_PUNCTUATOR;
-            token->lexeme[0] = lexer_consume(lexer);
-            token->lexeme[1] = '\0';
+            lexer_consume(lexer);
+            lexer_span(lexer, token, start);
             break;
         default:
-            if (c == '\0') {
-                token->type = TOKEN_EOF;
-                token->lexeme[0] = '\0';
-            } else if (is_alpha(c) || c == '_' || c == '$') {
+            if (is_alpha(c) || c == '_' || c == '$') {
                 lexer_identifier(lexer, token);
-                // 检查是否为布尔值、undefined或null
-                if (strcmp(token->lexeme, "true") == 0 || strcmp(token->lexeme, "false") == 0) {
-                    token->type = TOKEN_BOOLEAN;
-                } else if (strcmp(token->lexeme, "undefined") == 0) {
-                    token->type = TOKEN_UNDEFINED;
-                } else if (strcmp(token->lexeme, "null") == 0) {
-                    token->type = TOKEN_NULL;
-                }
             } else {
                 // 未知字符，简单消费它
                 token->type = TOKEN_OPERATOR;
-                token->lexeme[0] = lexer_consume(lexer);
-                token->lexeme[1] = '\0';
+                lexer_consume(lexer);
+                lexer_span(lexer, token, start);
             }
             break;
     }
@@ -273,7 +510,21 @@ void lexer_next_token(Lexer* lexer, Token* token) {
 // 初始化语法分析器
 void parser_init(Parser* parser, Lexer* lexer) {
     parser->lexer = lexer;
-    parser->bc_pos = 0;
+    parser->fn = NULL;
+    parser->scope_depth = 0;
+    for (int i = 0; i < MAX_SCOPE_DEPTH; i++) {
+        parser->scopes[i].vars = NULL;
+        parser->scopes[i].var_capacity = 0;
+    }
+    parser->cache_count = 0;
+    memset(&parser->pool, 0, sizeof(ConstantPool));
+    parser->functions = NULL;
+    parser->function_count = 0;
+    parser->function_capacity = 0;
+    parser->session = NULL;
+    parser->pending = NULL;
+    parser->pending_count = 0;
+    parser->pending_capacity = 0;
     // 预读第一个标记
     lexer_next_token(lexer, &parser->lexer->current);
 }
@@ -284,9 +535,14 @@ bool parser_check(Parser* parser, TokenType type) {
 }
 
 // 检查当前标记是否为特定关键字
-bool parser_check_keyword(Parser* parser, const char* keyword) {
+bool parser_check_keyword(Parser* parser, Keyword keyword) {
     return parser->lexer->current.type == TOKEN_KEYWORD && 
-           strcmp(parser->lexer->current.lexeme, keyword) == 0;
+           parser->lexer->current.keyword == keyword;
+}
+
+// 当前标记的第一个字符（判断标点和运算符）
+char parser_char(Parser* parser) {
+    return token_char(&parser->lexer->current);
 }
 
 // 匹配并消费特定类型的标记
@@ -299,7 +555,7 @@ bool parser_match(Parser* parser, TokenType type) {
 }
 
 // 匹配并消费特定关键字
-bool parser_match_keyword(Parser* parser, const char* keyword) {
+bool parser_match_keyword(Parser* parser, Keyword keyword) {
     if (parser_check_keyword(parser, keyword)) {
         lexer_next_token(parser->lexer, &parser->lexer->current);
         return true;
@@ -309,61 +565,433 @@ bool parser_match_keyword(Parser* parser, const char* keyword) {
 
 // 生成字节码：添加一个字节
 void emit_byte(Parser* parser, uint8_t byte) {
-    if (parser->bc_pos >= MAX_BYTECODE_LEN) {
-        fprintf(stderr, "字节码超出最大长度限制！\n");
-        exit(1);
+    FunctionState* fn = parser->fn;
+    if (fn->bc_pos == fn->bc_capacity) {
+        fn->bc_capacity = fn->bc_capacity < 256 ? 256 : fn->bc_capacity * 2;
+        fn->bytecode = realloc(fn->bytecode, fn->bc_capacity);
+        if (!fn->bytecode) {
+            fprintf(stderr, "内存分配失败！\n");
+            compile_fail();
+        }
     }
-    parser->bytecode[parser->bc_pos++] = byte;
+    fn->bytecode[fn->bc_pos++] = byte;
 }
 
-// 生成字节码：添加一个双精度浮点数
-void emit_double(Parser* parser, double value) {
-    if (parser->bc_pos + sizeof(double) > MAX_BYTECODE_LEN) {
-        fprintf(stderr, "字节码超出最大长度限制！\n");
-        exit(1);
+// 生成字节码：添加一个 2 字节小端整数
+void emit_u16(Parser* parser, uint16_t value) {
+    emit_byte(parser, (uint8_t)(value & 0xFF));
+    emit_byte(parser, (uint8_t)(value >> 8));
+}
+
+// 常量池：计算常量的去重哈希
+uint32_t constant_hash(ConstantPool* pool, ConstantType type, double number,
+                       const char* chars, int length) {
+    (void)pool;
+    if (type == CONST_NUMBER) {
+        return hash_string((const char*)&number, sizeof(double));
     }
-    memcpy(&parser->bytecode[parser->bc_pos], &value, sizeof(double));
-    parser->bc_pos += sizeof(double);
+    return hash_string(chars, length) ^ 0x9e3779b9u;
 }
 
-// 生成字节码：添加一个字符串
-void emit_string(Parser* parser, const char* str) {
-    int len = strlen(str);
-    if (len > 255) {
-        fprintf(stderr, "字符串太长，超过255字节限制！\n");
-        exit(1);
+// 常量池：扩容去重索引并重新散列
+void pool_grow_index(ConstantPool* pool) {
+    int capacity = pool->index_capacity < 64 ? 64 : pool->index_capacity * 2;
+    int* index = calloc(capacity, sizeof(int));
+    if (!index) {
+        fprintf(stderr, "内存分配失败！\n");
+        compile_fail();
     }
-    if (parser->bc_pos + 1 + len > MAX_BYTECODE_LEN) {
-        fprintf(stderr, "字节码超出最大长度限制！\n");
-        exit(1);
+    for (int i = 0; i < pool->count; i++) {
+        Constant* c = &pool->constants[i];
+        // 数值常量的 as.offset 与数值共用存储，只为字符串常量计算内容的地址
+        uint32_t h = c->type == CONST_NUMBER
+                         ? constant_hash(pool, CONST_NUMBER, c->as.number, NULL, 0)
+                         : constant_hash(pool, CONST_STRING, 0, pool->string_data + c->as.offset, c->length);
+        uint32_t slot = h & (capacity - 1);
+        while (index[slot]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        index[slot] = i + 1;
+    }
+    free(pool->index);
+    pool->index = index;
+    pool->index_capacity = capacity;
+}
+
+// 常量池：判断已有常量是否与给定值相同
+bool constant_matches(ConstantPool* pool, Constant* c, ConstantType type, double number,
+                      const char* chars, int length) {
+    if (c->type != (uint32_t)type) return false;
+    if (type == CONST_NUMBER) {
+        return memcmp(&c->as.number, &number, sizeof(double)) == 0;
+    }
+    return (int)c->length == length &&
+           memcmp(pool->string_data + c->as.offset, chars, length) == 0;
+}
+
+// 常量池：记录模式下记下 pool_add 得到的常量编号，返回该编号
+int pool_trace(ConstantPool* pool, int index) {
+    if (!pool->tracing) {
+        return index;
+    }
+    if (pool->trace_count == pool->trace_capacity) {
+        pool->trace_capacity = pool->trace_capacity < 64 ? 64 : pool->trace_capacity * 2;
+        pool->trace = realloc(pool->trace, pool->trace_capacity * sizeof(int));
+        if (!pool->trace) {
+            fprintf(stderr, "内存分配失败！\n");
+            compile_fail();
+        }
+    }
+    pool->trace[pool->trace_count++] = index;
+    return index;
+}
+
+// 常量池：查找或添加常量，返回常量编号
+int pool_add(ConstantPool* pool, ConstantType type, double number, const char* chars, int length) {
+    if ((pool->count + 1) * 2 > pool->index_capacity) {
+        pool_grow_index(pool);
+    }
+    uint32_t slot = constant_hash(pool, type, number, chars, length) & (pool->index_capacity - 1);
+    while (pool->index[slot]) {
+        int existing = pool->index[slot] - 1;
+        if (constant_matches(pool, &pool->constants[existing], type, number, chars, length)) {
+            return pool_trace(pool, existing);
+        }
+        slot = (slot + 1) & (pool->index_capacity - 1);
+    }
+
+    if (pool->count > 0xFFFF) {
+        fprintf(stderr, "错误：常量数量超过 65536 个限制\n");
+        compile_fail();
+    }
+    if (pool->count == pool->capacity) {
+        pool->capacity = pool->capacity < 16 ? 16 : pool->capacity * 2;
+        pool->constants = realloc(pool->constants, pool->capacity * sizeof(Constant));
+    }
+    Constant* c = &pool->constants[pool->count];
+    c->type = type;
+    if (type == CONST_NUMBER) {
+        c->length = 0;
+        c->as.number = number;
+    } else {
+        if (pool->string_len + length > pool->string_capacity) {
+            while (pool->string_len + length > pool->string_capacity) {
+                pool->string_capacity = pool->string_capacity < 256 ? 256 : pool->string_capacity * 2;
+            }
+            pool->string_data = realloc(pool->string_data, pool->string_capacity);
+            if (!pool->string_data) {
+                fprintf(stderr, "内存分配失败！\n");
+                compile_fail();
+            }
+        }
+        if (length > 0) { // 空字符串不占数据区（此时数据区可能尚未分配）
+            memcpy(pool->string_data + pool->string_len, chars, length);
+        }
+        c->length = length;
+        c->as.offset = pool->string_len;
+        pool->string_len += length;
+    }
+    if (!pool->constants) {
+        fprintf(stderr, "内存分配失败！\n");
+        compile_fail();
+    }
+    pool->index[slot] = pool->count + 1;
+    return pool_trace(pool, pool->count++);
+}
+
+// 记录调试信息：接下来生成的指令属于当前标记所在的源码位置
+void debug_mark(Parser* parser) {
+    Token* token = &parser->lexer->current;
+    FunctionState* fn = parser->fn;
+    if (fn->line_count > 0 &&
+        fn->lines[fn->line_count - 1].offset == (uint32_t)fn->bc_pos) {
+        fn->line_count--; // 同一偏移上没有生成指令的语句，以后一条为准
+    }
+    if (fn->line_count == fn->line_capacity) {
+        fn->line_capacity = fn->line_capacity < 16 ? 16 : fn->line_capacity * 2;
+        fn->lines = realloc(fn->lines, fn->line_capacity * sizeof(DebugLine));
+        if (!fn->lines) {
+            fprintf(stderr, "内存分配失败！\n");
+            compile_fail();
+        }
+    }
+    DebugLine* entry = &fn->lines[fn->line_count++];
+    entry->offset = fn->bc_pos;
+    entry->line = token->line;
+    entry->col = token->col;
+}
+
+// 生成数值常量的编号
+void emit_number_constant(Parser* parser, double value) {
+    emit_u16(parser, (uint16_t)pool_add(&parser->pool, CONST_NUMBER, value, NULL, 0));
+}
+
+// 生成字符串常量（字面量或名字）的编号
+void emit_string_constant(Parser* parser, Span str) {
+    emit_u16(parser, (uint16_t)pool_add(&parser->pool, CONST_STRING, 0, str.chars, str.length));
+}
+
+// 生成属性访问指令：属性名常量编号 + 为该指令分配的内联缓存编号
+void emit_prop_op(Parser* parser, OpCode op, Span prop_name) {
+    if (parser->cache_count > 0xFFFF) {
+        fprintf(stderr, "错误：属性访问指令过多\n");
+        compile_fail();
+    }
+    emit_byte(parser, op);
+    emit_string_constant(parser, prop_name);
+    emit_u16(parser, (uint16_t)parser->cache_count);
+    parser->cache_count++;
+}
+
+// 标识符是否在当前函数的内层函数中出现过（出现过的局部变量视为被捕获）
+bool fn_is_captured(FunctionState* fn, Span name) {
+    for (int i = 0; i < fn->captured_count; i++) {
+        if (span_equal(fn->captured[i], name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 当前函数中的作用域是否需要堆环境：主程序的块总是需要（其中可能声明函数），
+// 函数中只有存在被捕获的变量时才需要
+bool fn_needs_env(FunctionState* fn) {
+    return fn->is_main || fn->captured_count > 0;
+}
+
+// 进入块作用域
+void scope_begin(Parser* parser) {
+    if (parser->scope_depth >= MAX_SCOPE_DEPTH) {
+        fprintf(stderr, "错误：作用域嵌套过深\n");
+        compile_fail();
+    }
+    Scope* scope = &parser->scopes[parser->scope_depth++];
+    scope->var_count = 0;
+    scope->env_slots = 0;
+    scope->has_env = fn_needs_env(parser->fn);
+    scope->saved_next_slot = parser->fn->next_slot;
+}
+
+// 退出块作用域，返回该作用域的堆环境槽位数（块内的栈帧槽位交还给后续语句复用）
+int scope_end(Parser* parser) {
+    Scope* scope = &parser->scopes[--parser->scope_depth];
+    parser->fn->next_slot = scope->saved_next_slot;
+    return scope->env_slots;
+}
+
+// 在作用域中查找变量，返回其在作用域中的序号，不存在返回 -1
+int scope_find(Scope* scope, Span name) {
+    for (int i = 0; i < scope->var_count; i++) {
+        if (span_equal(scope->vars[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 变量的存放位置
+typedef enum {
+    VAR_GLOBAL, // 全局变量：按名字访问
+    VAR_ENV,    // 堆环境：（深度，槽位），深度只计算有堆环境的作用域
+    VAR_FRAME   // 当前函数的栈帧槽位
+} VarKind;
+
+// 解析标识符的存放位置，找不到说明是全局变量
+VarKind resolve_var(Parser* parser, Span name, int* depth, int* slot) {
+    int env_depth = 0;
+    for (int i = parser->scope_depth - 1; i >= 0; i--) {
+        Scope* scope = &parser->scopes[i];
+        int found = scope_find(scope, name);
+        if (found != -1) {
+            *slot = scope->vars[found].slot;
+            if (!scope->vars[found].in_frame) {
+                *depth = env_depth;
+                return VAR_ENV;
+            }
+            // 逃逸分析保证内层函数引用的变量不会放在外层函数的栈帧中
+            if (i < parser->fn->scope_base) {
+                fprintf(stderr, "错误：无法访问外层函数的局部变量 '%.*s'\n", name.length, name.chars);
+                compile_fail();
+            }
+            return VAR_FRAME;
+        }
+        if (scope->has_env) {
+            env_depth++;
+        }
+    }
+    return VAR_GLOBAL;
+}
+
+// 生成访问变量的指令：读取或写入（写入时栈顶值为新值）
+void emit_var_op(Parser* parser, Span name, bool store) {
+    int depth, slot;
+    switch (resolve_var(parser, name, &depth, &slot)) {
+        case VAR_GLOBAL:
+            emit_byte(parser, store ? OP_STORE_VAR : OP_PUSH_VAR);
+            emit_string_constant(parser, name);
+            break;
+        case VAR_FRAME:
+            emit_byte(parser, store ? OP_STORE_SLOT : OP_LOAD_SLOT);
+            emit_byte(parser, (uint8_t)slot);
+            break;
+        case VAR_ENV:
+            if (depth == 0) {
+                emit_byte(parser, store ? OP_STORE_LOCAL : OP_LOAD_LOCAL);
+            } else {
+                emit_byte(parser, store ? OP_STORE_UPVAL : OP_LOAD_UPVAL);
+                emit_byte(parser, (uint8_t)depth);
+            }
+            emit_byte(parser, (uint8_t)slot);
+            break;
+    }
+}
+
+// 生成读取变量的指令：全局变量按名字访问，局部变量按槽位访问
+void emit_load_var(Parser* parser, Span name) {
+    emit_var_op(parser, name, false);
+}
+
+// 生成写入变量的指令（栈顶值为新值）
+void emit_store_var(Parser* parser, Span name) {
+    emit_var_op(parser, name, true);
+}
+
+// 在当前作用域中登记变量并分配位置：被捕获（或位于主程序块中）的变量放在堆环境，其余放在栈帧；
+// frame_slot >= 0 表示变量已有指定的栈帧槽位（形参）
+void scope_add_var(Parser* parser, Span name, int frame_slot) {
+    FunctionState* fn = parser->fn;
+    Scope* scope = &parser->scopes[parser->scope_depth - 1];
+    if (scope->var_count == scope->var_capacity) {
+        int capacity = scope->var_capacity < 8 ? 8 : scope->var_capacity * 2;
+        ScopeVar* vars = realloc(scope->vars, capacity * sizeof(ScopeVar));
+        if (!vars) {
+            fprintf(stderr, "内存分配失败！\n");
+            compile_fail();
+        }
+        scope->vars = vars;
+        scope->var_capacity = capacity;
+    }
+    ScopeVar* var = &scope->vars[scope->var_count++];
+    var->name = name;
+    if (scope->has_env && (fn->is_main || fn_is_captured(fn, name))) {
+        if (scope->env_slots >= MAX_ENV_SLOTS) {
+            fprintf(stderr, "错误：作用域内变量数量超限\n");
+            compile_fail();
+        }
+        var->in_frame = false;
+        var->slot = scope->env_slots++;
+        return;
+    }
+    if (frame_slot < 0) {
+        if (fn->next_slot >= MAX_FRAME_SLOTS) {
+            fprintf(stderr, "错误：函数内局部变量数量超限\n");
+            compile_fail();
+        }
+        frame_slot = fn->next_slot++;
+        if (fn->next_slot > fn->slot_count) {
+            fn->slot_count = fn->next_slot;
+        }
+    }
+    var->in_frame = true;
+    var->slot = frame_slot;
+}
+
+// 声明变量并生成初始化写入：块内变量分配新位置，顶层变量是全局变量
+void emit_declare_var(Parser* parser, Span name) {
+    if (parser->scope_depth == 0) {
+        emit_byte(parser, OP_STORE_VAR);
+        emit_string_constant(parser, name);
+        return;
     }
-    // 先添加字符串长度
-    emit_byte(parser, (uint8_t)len);
-    // 再添加字符串内容
-    memcpy(&parser->bytecode[parser->bc_pos], str, len);
-    parser->bc_pos += len;
+    Scope* scope = &parser->scopes[parser->scope_depth - 1];
+    if (scope_find(scope, name) == -1) {
+        scope_add_var(parser, name, -1);
+    }
+    emit_store_var(parser, name);
 }
 
 // 解析表达式（简单的加减表达式）
 void parse_expression(Parser* parser);
 
+// 解析调用的实参列表（当前标记为 '('），返回实参个数
+int parse_arguments(Parser* parser) {
+    parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '('
+    int arg_count = 0;
+    if (!parser_check(parser, TOKEN_PUNCTUATOR) || parser_char(parser) != ')') {
+        while (true) {
+            parse_expression(parser);
+            arg_count++;
+            if (parser_check(parser, TOKEN_PUNCTUATOR) &&
+                parser_char(parser) == ',') {
+                parser_match(parser, TOKEN_PUNCTUATOR); // 消费 ','
+            } else {
+                break;
+            }
+        }
+    }
+    if (!parser_check(parser, TOKEN_PUNCTUATOR) || parser_char(parser) != ')') {
+        fprintf(stderr, "错误：函数调用缺少右括号\n");
+        compile_fail();
+    }
+    parser_match(parser, TOKEN_PUNCTUATOR); // 消费 ')'
+    if (arg_count > 255) {
+        fprintf(stderr, "错误：实参个数超限\n");
+        compile_fail();
+    }
+    return arg_count;
+}
+
+// 解析后缀：属性访问 .name 和函数调用 (...)，栈顶为被访问的值。
+// allow_assign 为 true 时（语句开头）末尾的 obj.name = value 生成属性赋值
+void parse_postfix(Parser* parser, bool allow_assign) {
+    while (parser_check(parser, TOKEN_PUNCTUATOR)) {
+        char c = parser_char(parser);
+        if (c == '.') {
+            parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '.'
+            if (!parser_check(parser, TOKEN_IDENTIFIER)) {
+                fprintf(stderr, "错误：属性名必须是标识符\n");
+                compile_fail();
+            }
+            Span prop_name = parser->lexer->current.lexeme;
+            parser_match(parser, TOKEN_IDENTIFIER);
+            if (allow_assign && parser_check(parser, TOKEN_PUNCTUATOR) &&
+                parser_char(parser) == '=') {
+                parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '='
+                // 解析赋值表达式（值），生成 OP_SET_PROP 指令
+                parse_expression(parser);
+                emit_prop_op(parser, OP_SET_PROP, prop_name);
+                return;
+            }
+            // 生成 OP_GET_PROP 指令
+            emit_prop_op(parser, OP_GET_PROP, prop_name);
+        } else if (c == '(') {
+            // 栈上依次为函数、各实参
+            int arg_count = parse_arguments(parser);
+            emit_byte(parser, OP_CALL);
+            emit_byte(parser, (uint8_t)arg_count);
+        } else {
+            break;
+        }
+    }
+}
+
 // 解析主表达式（数字、字符串、标识符等）
 void parse_primary(Parser* parser) {
     if (parser_check(parser, TOKEN_NUMBER)) {
         // 生成 OP_PUSH_NUM 指令
         emit_byte(parser, OP_PUSH_NUM);
-        double num = atof(parser->lexer->current.lexeme);
-        emit_double(parser, num);
+        double num = token_number(&parser->lexer->current);
+        emit_number_constant(parser, num);
         parser_match(parser, TOKEN_NUMBER);
     } else if (parser_check(parser, TOKEN_STRING)) {
         // 生成 OP_PUSH_STR 指令
         emit_byte(parser, OP_PUSH_STR);
-        emit_string(parser, parser->lexer->current.lexeme);
+        emit_string_constant(parser, parser->lexer->current.lexeme);
         parser_match(parser, TOKEN_STRING);
     } else if (parser_check(parser, TOKEN_BOOLEAN)) {
         // 生成 OP_PUSH_BOOL 指令
         emit_byte(parser, OP_PUSH_BOOL);
-        bool value = strcmp(parser->lexer->current.lexeme, "true") == 0;
+        bool value = parser_char(parser) == 't';
         emit_byte(parser, value ? 1 : 0);
         parser_match(parser, TOKEN_BOOLEAN);
     } else if (parser_check(parser, TOKEN_UNDEFINED)) {
@@ -375,37 +1003,24 @@ void parse_primary(Parser* parser) {
         emit_byte(parser, OP_PUSH_NULL);
         parser_match(parser, TOKEN_NULL);
     } else if (parser_check(parser, TOKEN_IDENTIFIER)) {
-        // 生成 OP_PUSH_VAR 指令
-        emit_byte(parser, OP_PUSH_VAR);
-        emit_string(parser, parser->lexer->current.lexeme);
+        // 生成读取变量的指令
+        emit_load_var(parser, parser->lexer->current.lexeme);
         parser_match(parser, TOKEN_IDENTIFIER);
         
-        // 检查是否为属性访问（如 obj.prop）
-        while (parser_check(parser, TOKEN_PUNCTUATOR) && 
-               parser->lexer->current.lexeme[0] == '.') {
-            parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '.'
-            if (parser_check(parser, TOKEN_IDENTIFIER)) {
-                // 生成 OP_GET_PROP 指令
-                emit_byte(parser, OP_GET_PROP);
-                emit_string(parser, parser->lexer->current.lexeme);
-                parser_match(parser, TOKEN_IDENTIFIER);
-            } else {
-                fprintf(stderr, "错误：属性名必须是标识符\n");
-                exit(1);
-            }
-        }
+        // 属性访问（如 obj.prop）和函数调用（如 add(1, 2)）
+        parse_postfix(parser, false);
     } else if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-               parser->lexer->current.lexeme[0] == '(') {
+               parser_char(parser) == '(') {
         // 括号表达式
         parser_match(parser, TOKEN_PUNCTUATOR);
         parse_expression(parser);
         if (!parser_match(parser, TOKEN_PUNCTUATOR) || 
-            parser->lexer->current.lexeme[0] != ')') {
+            parser_char(parser) != ')') {
             fprintf(stderr, "错误：缺少右括号\n");
-            exit(1);
+            compile_fail();
         }
     } else if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-               parser->lexer->current.lexeme[0] == '{') {
+               parser_char(parser) == '{') {
         // 对象创建表达式 {}
         parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '{'
         
@@ -414,7 +1029,7 @@ void parse_primary(Parser* parser) {
         
         // 解析属性列表
         if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-            parser->lexer->current.lexeme[0] == '}') {
+            parser_char(parser) == '}') {
             // 空对象 {}
             parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '}'
         } else {
@@ -422,15 +1037,15 @@ void parse_primary(Parser* parser) {
             while (1) {
                 // 解析属性名
                 if (parser_check(parser, TOKEN_IDENTIFIER)) {
-                    char prop_name[MAX_TOKEN_LEN];
-                    strcpy(prop_name, parser->lexer->current.lexeme);
+                    Span prop_name = parser->lexer->current.lexeme;
                     parser_match(parser, TOKEN_IDENTIFIER);
                     
                     // 消费 ':'
                     if (!parser_check(parser, TOKEN_PUNCTUATOR) || 
-                        parser->lexer->current.lexeme[0] != ':') {
-                        fprintf(stderr, "错误：对象属性缺少冒号，当前标记: %s\n", parser->lexer->current.lexeme);
-                        exit(1);
+                        parser_char(parser) != ':') {
+                        fprintf(stderr, "错误：对象属性缺少冒号，当前标记: %.*s\n",
+                                parser->lexer->current.lexeme.length, parser->lexer->current.lexeme.chars);
+                        compile_fail();
                     }
                     parser_match(parser, TOKEN_PUNCTUATOR);
                     
@@ -438,119 +1053,200 @@ void parse_primary(Parser* parser) {
                     parse_expression(parser);
                     
                     // 生成 OP_SET_PROP 指令
-                    emit_byte(parser, OP_SET_PROP);
-                    emit_string(parser, prop_name);
+                    emit_prop_op(parser, OP_SET_PROP, prop_name);
                     
                     // 检查是否为对象结束
                     if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-                        parser->lexer->current.lexeme[0] == '}') {
+                        parser_char(parser) == '}') {
                         parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '}'
                         break;
                     }
                     
                     // 检查是否有逗号分隔符
                     if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-                        parser->lexer->current.lexeme[0] == ',') {
+                        parser_char(parser) == ',') {
                         parser_match(parser, TOKEN_PUNCTUATOR); // 消费 ','
                         // 继续下一个属性
                     } else {
-                        fprintf(stderr, "错误：对象属性列表格式错误，当前标记: %s\n", parser->lexer->current.lexeme);
-                        exit(1);
+                        fprintf(stderr, "错误：对象属性列表格式错误，当前标记: %.*s\n",
+                                parser->lexer->current.lexeme.length, parser->lexer->current.lexeme.chars);
+                        compile_fail();
                     }
                 } else {
-                    fprintf(stderr, "错误：对象属性名必须是标识符，当前标记: %s\n", parser->lexer->current.lexeme);
-                    exit(1);
+                    fprintf(stderr, "错误：对象属性名必须是标识符，当前标记: %.*s\n",
+                                parser->lexer->current.lexeme.length, parser->lexer->current.lexeme.chars);
+                    compile_fail();
                 }
             }
         }
     } else {
         fprintf(stderr, "错误：无法解析的表达式\n");
-        exit(1);
+        compile_fail();
     }
 }
 
-// 解析表达式（简单的加减表达式）
-void parse_expression(Parser* parser) {
+// 常量折叠：[start, end) 恰好是一条压入数值/字符串常量的指令时返回常量编号，否则返回 -1
+int emitted_constant(Parser* parser, int start, int end) {
+    const uint8_t* code = parser->fn->bytecode;
+    if (end - start != 3 || (code[start] != OP_PUSH_NUM && code[start] != OP_PUSH_STR)) {
+        return -1;
+    }
+    return code[start + 1] | (code[start + 2] << 8);
+}
+
+// 常量的字符串形式（与虚拟机 OP_ADD 的隐式转换一致，由 vm_format_number 格式化），写入 buf 或指向常量池
+const char* constant_text(Parser* parser, int index, char* buf, size_t buf_size, size_t* length) {
+    const Constant* c = &parser->pool.constants[index];
+    if (c->type == CONST_NUMBER) {
+        *length = (size_t)vm_format_number(buf, buf_size, c->as.number, true);
+        return buf;
+    }
+    *length = c->length;
+    return parser->pool.string_data + c->as.offset;
+}
+
+// 折叠两个字面量的加法：各自的压栈指令分别位于 [start, mid) 和 [mid, bc_pos)，
+// 都是常量时替换为一条压入结果常量的指令
+bool fold_add(Parser* parser, int start, int mid) {
+    FunctionState* fn = parser->fn;
+    int left = emitted_constant(parser, start, mid);
+    int right = emitted_constant(parser, mid, fn->bc_pos);
+    if (left < 0 || right < 0) {
+        return false;
+    }
+    const Constant* a = &parser->pool.constants[left];
+    const Constant* b = &parser->pool.constants[right];
+    fn->bc_pos = start;
+    if (a->type == CONST_NUMBER && b->type == CONST_NUMBER) {
+        emit_byte(parser, OP_PUSH_NUM);
+        emit_number_constant(parser, a->as.number + b->as.number);
+        return true;
+    }
+    char buf_a[VM_NUMBER_TEXT_SIZE], buf_b[VM_NUMBER_TEXT_SIZE];
+    size_t len_a, len_b;
+    const char* str_a = constant_text(parser, left, buf_a, sizeof(buf_a), &len_a);
+    const char* str_b = constant_text(parser, right, buf_b, sizeof(buf_b), &len_b);
+    // 先复制出结果：加入常量池可能使字符串数据区重新分配
+    char* chars = malloc(len_a + len_b + 1);
+    if (!chars) {
+        fprintf(stderr, "内存分配失败！\n");
+        compile_fail();
+    }
+    memcpy(chars, str_a, len_a);
+    memcpy(chars + len_a, str_b, len_b);
+    chars[len_a + len_b] = '\0';
+    emit_byte(parser, OP_PUSH_STR);
+    emit_u16(parser, (uint16_t)pool_add(&parser->pool, CONST_STRING, 0, chars, (int)(len_a + len_b)));
+    free(chars);
+    return true;
+}
+
+// 折叠两个数值字面量的减乘除（操作数位置同 fold_add），其余情况留给虚拟机
+bool fold_arith(Parser* parser, OpCode op, int start, int mid) {
+    FunctionState* fn = parser->fn;
+    int left = emitted_constant(parser, start, mid);
+    int right = emitted_constant(parser, mid, fn->bc_pos);
+    if (left < 0 || right < 0 || (op != OP_SUB && op != OP_MUL && op != OP_DIV) ||
+        parser->pool.constants[left].type != CONST_NUMBER ||
+        parser->pool.constants[right].type != CONST_NUMBER) {
+        return false;
+    }
+    double a = parser->pool.constants[left].as.number;
+    double b = parser->pool.constants[right].as.number;
+    fn->bc_pos = start;
+    emit_byte(parser, OP_PUSH_NUM);
+    emit_number_constant(parser, op == OP_SUB ? a - b : op == OP_MUL ? a * b : a / b);
+    return true;
+}
+
+// 二元运算符：优先级越大结合越紧，同级左结合
+typedef struct {
+    const char* text;
+    int precedence;
+    OpCode op;
+} BinaryOperator;
+
+static const BinaryOperator binary_operators[] = {
+    {"==",  1, OP_EQ},
+    {"!=",  1, OP_NE},
+    {"===", 1, OP_STRICT_EQ},
+    {"!==", 1, OP_STRICT_NE},
+    {"<",   2, OP_LT},
+    {"<=",  2, OP_LE},
+    {">",   2, OP_GT},
+    {">=",  2, OP_GE},
+    {"+",   3, OP_ADD},
+    {"-",   3, OP_SUB},
+    {"*",   4, OP_MUL},
+    {"/",   4, OP_DIV},
+};
+
+// 当前标记对应的二元运算符，不是运算符返回 NULL，是不支持的运算符则报错
+const BinaryOperator* parser_binary_operator(Parser* parser) {
+    if (!parser_check(parser, TOKEN_OPERATOR)) {
+        return NULL;
+    }
+    Span text = parser->lexer->current.lexeme;
+    for (size_t i = 0; i < sizeof(binary_operators) / sizeof(binary_operators[0]); i++) {
+        const BinaryOperator* binary = &binary_operators[i];
+        if ((int)strlen(binary->text) == text.length && memcmp(binary->text, text.chars, text.length) == 0) {
+            return binary;
+        }
+    }
+    fprintf(stderr, "错误：不支持的运算符 '%.*s'\n", text.length, text.chars);
+    compile_fail();
+}
+
+// 解析优先级不低于 min_precedence 的二元运算（优先级爬升），字面量之间的算术在编译期折叠
+void parse_binary(Parser* parser, int min_precedence) {
+    int start = parser->fn->bc_pos;
     parse_primary(parser);
     
-    while (parser_check(parser, TOKEN_OPERATOR)) {
-        // 确保运算符标记有有效内容
-        if (strlen(parser->lexer->current.lexeme) == 0) {
-            fprintf(stderr, "错误：无效的运算符标记\n");
-            exit(1);
-        }
-        
-        char op = parser->lexer->current.lexeme[0];
+    const BinaryOperator* binary;
+    while ((binary = parser_binary_operator(parser)) && binary->precedence >= min_precedence) {
         parser_match(parser, TOKEN_OPERATOR);
         
-        parse_primary(parser);
+        // 右操作数只吸收优先级更高的运算，保证同级运算左结合
+        int mid = parser->fn->bc_pos;
+        parse_binary(parser, binary->precedence + 1);
         
-        // 生成对应的运算符指令
-        if (op == '+') {
-            emit_byte(parser, OP_ADD);
-        } else {
-            fprintf(stderr, "错误：不支持的运算符 '%c'\n", op);
-            exit(1);
+        if (binary->op == OP_ADD) {
+            if (!fold_add(parser, start, mid)) {
+                emit_byte(parser, OP_ADD);
+            }
+        } else if (!fold_arith(parser, binary->op, start, mid)) {
+            emit_byte(parser, binary->op);
         }
     }
 }
 
-// 解析赋值语句
+// 解析表达式：比较（== != === !== < <= > >=）、加减、乘除，优先级依次升高
+void parse_expression(Parser* parser) {
+    parse_binary(parser, 1);
+}
+
+// 解析赋值语句和表达式语句（变量赋值、属性赋值、函数调用等），语句的结果值被丢弃
 void parse_assignment(Parser* parser) {
     if (parser_check(parser, TOKEN_IDENTIFIER)) {
         // 保存变量名
-        char var_name[MAX_TOKEN_LEN];
-        strcpy(var_name, parser->lexer->current.lexeme);
+        Span var_name = parser->lexer->current.lexeme;
         parser_match(parser, TOKEN_IDENTIFIER);
         
-        // 检查是否为属性赋值（如 obj.prop = value）
         if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-            parser->lexer->current.lexeme[0] == '.') {
-            parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '.'
-            if (parser_check(parser, TOKEN_IDENTIFIER)) {
-                char prop_name[MAX_TOKEN_LEN];
-                strcpy(prop_name, parser->lexer->current.lexeme);
-                parser_match(parser, TOKEN_IDENTIFIER);
-                
-                if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-                    parser->lexer->current.lexeme[0] == '=') {
-                    parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '='
-                    
-                    // 首先加载对象到栈上
-                    emit_byte(parser, OP_PUSH_VAR);
-                    emit_string(parser, var_name);
-                    
-                    // 然后解析赋值表达式（值）
-                    parse_expression(parser);
-                    
-                    // 生成 OP_SET_PROP 指令
-                    emit_byte(parser, OP_SET_PROP);
-                    emit_string(parser, prop_name);
-                } else {
-                    // 不是赋值，而是普通的属性访问
-                    emit_byte(parser, OP_PUSH_VAR);
-                    emit_string(parser, var_name);
-                    emit_byte(parser, OP_GET_PROP);
-                    emit_string(parser, prop_name);
-                }
-            } else {
-                fprintf(stderr, "错误：属性名必须是标识符\n");
-                exit(1);
-            }
-        } else if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-                   parser->lexer->current.lexeme[0] == '=') {
+            parser_char(parser) == '=') {
             parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '='
             
             // 解析赋值表达式
             parse_expression(parser);
             
-            // 生成 OP_STORE_VAR 指令
-            emit_byte(parser, OP_STORE_VAR);
-            emit_string(parser, var_name);
+            // 生成写入变量的指令
+            emit_store_var(parser, var_name);
         } else {
-            // 不是赋值，而是普通的标识符
-            emit_byte(parser, OP_PUSH_VAR);
-            emit_string(parser, var_name);
+            // 属性赋值（如 obj.prop = value）、属性访问或函数调用：
+            // 先加载变量，再解析后缀，最后丢弃留在栈上的结果
+            emit_load_var(parser, var_name);
+            parse_postfix(parser, true);
+            emit_byte(parser, OP_POP);
         }
     }
 }
@@ -558,43 +1254,40 @@ void parse_assignment(Parser* parser) {
 // 解析变量声明语句（var x = 10;）
 void parse_var_declaration(Parser* parser) {
     // 消费 var 关键字
-    parser_match_keyword(parser, "var");
+    parser_match_keyword(parser, KW_VAR);
     
     if (parser_check(parser, TOKEN_IDENTIFIER)) {
         // 保存变量名
-        char var_name[MAX_TOKEN_LEN];
-        strcpy(var_name, parser->lexer->current.lexeme);
+        Span var_name = parser->lexer->current.lexeme;
         parser_match(parser, TOKEN_IDENTIFIER);
         
         if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-            parser->lexer->current.lexeme[0] == '=') {
+            parser_char(parser) == '=') {
             parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '='
             
-            // 解析初始化表达式
+            // 解析初始化表达式（先于声明解析，初始化表达式中的同名变量指向外层）
             parse_expression(parser);
             
-            // 生成 OP_STORE_VAR 指令
-            emit_byte(parser, OP_STORE_VAR);
-            emit_string(parser, var_name);
+            // 声明变量并生成写入指令
+            emit_declare_var(parser, var_name);
         } else {
             // 没有初始化值，默认为 undefined
             emit_byte(parser, OP_PUSH_UNDEFINED);
-            emit_byte(parser, OP_STORE_VAR);
-            emit_string(parser, var_name);
+            emit_declare_var(parser, var_name);
         }
     } else {
         fprintf(stderr, "错误：变量声明缺少标识符\n");
-        exit(1);
+        compile_fail();
     }
 }
 
 // 解析打印语句（print(x); 或 print(x, y, ...);）
 void parse_print_statement(Parser* parser) {
     // 消费 print 关键字
-    parser_match_keyword(parser, "print");
+    parser_match_keyword(parser, KW_PRINT);
     
     if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-        parser->lexer->current.lexeme[0] == '(') {
+        parser_char(parser) == '(') {
         parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '('
         
         // 解析要打印的表达式列表（支持多个参数，用逗号分隔）
@@ -605,7 +1298,7 @@ void parse_print_statement(Parser* parser) {
             
             // 检查是否有逗号，如果有则继续解析下一个参数
             if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-                parser->lexer->current.lexeme[0] == ',') {
+                parser_char(parser) == ',') {
                 parser_match(parser, TOKEN_PUNCTUATOR); // 消费 ','
             } else {
                 break; // 没有逗号，结束参数解析
@@ -614,9 +1307,9 @@ void parse_print_statement(Parser* parser) {
         
         // 检查是否有右括号
         if (!parser_check(parser, TOKEN_PUNCTUATOR) || 
-            parser->lexer->current.lexeme[0] != ')') {
+            parser_char(parser) != ')') {
             fprintf(stderr, "错误：print 语句缺少右括号\n");
-            exit(1);
+            compile_fail();
         }
         parser_match(parser, TOKEN_PUNCTUATOR); // 消费 ')'
         
@@ -626,71 +1319,665 @@ void parse_print_statement(Parser* parser) {
         emit_byte(parser, (uint8_t)arg_count);
     } else {
         fprintf(stderr, "错误：print 语句缺少左括号\n");
-        exit(1);
+        compile_fail();
     }
 }
 
-// 解析语句块（{ ... }）
-void parse_block(Parser* parser) {
-    if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-        parser->lexer->current.lexeme[0] == '{') {
-        parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '{'
-        
-        // 生成 OP_PUSH_ENV 指令，创建新的作用域
-        emit_byte(parser, OP_PUSH_ENV);
+bool parse_statement(Parser* parser);
+
+// 解析语句序列，直到遇到 '}'（不消费）。返回序列是否以 return 结束（控制流不会走到序列之后）；
+// return 之后不可达的语句照常解析（检查语法、声明变量），但丢弃生成的指令和调试信息
+bool parse_statements(Parser* parser) {
+    bool returned = false;
+    while (!parser_check(parser, TOKEN_PUNCTUATOR) || 
+           parser_char(parser) != '}') {
+        if (parser_check(parser, TOKEN_EOF)) {
+            fprintf(stderr, "错误：语句块缺少右花括号\n");
+            compile_fail();
+        }
+        // 块内语句与顶层语句语法相同（包括嵌套块）
+        FunctionState* fn = parser->fn;
+        int bc_pos = fn->bc_pos;
+        bool statement_returned = parse_statement(parser);
+        if (returned) {
+            fn->bc_pos = bc_pos;
+            while (fn->line_count > 0 && fn->lines[fn->line_count - 1].offset >= (uint32_t)bc_pos) {
+                fn->line_count--;
+            }
+        }
+        returned = returned || statement_returned;
         
-        // 解析块内的语句
-        while (!parser_check(parser, TOKEN_PUNCTUATOR) || 
-               parser->lexer->current.lexeme[0] != '}') {
-            if (parser_check(parser, TOKEN_KEYWORD)) {
-                if (parser_check_keyword(parser, "var")) {
-                    parse_var_declaration(parser);
-                } else if (parser_check_keyword(parser, "print")) {
-                    parse_print_statement(parser);
-                } else {
-                    fprintf(stderr, "错误：未知的关键字 '%s'\n", parser->lexer->current.lexeme);
-                    exit(1);
+        // 只有当当前标记是分号时才消费它
+        if (parser_check(parser, TOKEN_PUNCTUATOR) && 
+            parser_char(parser) == ';') {
+            parser_match(parser, TOKEN_PUNCTUATOR);
+        }
+    }
+    return returned;
+}
+
+// 生成函数返回：退出函数内打开的所有堆环境，栈顶为返回值
+void emit_return(Parser* parser) {
+    for (int i = parser->scope_depth - 1; i >= parser->fn->scope_base; i--) {
+        if (parser->scopes[i].has_env) {
+            emit_byte(parser, OP_POP_ENV);
+        }
+    }
+    emit_byte(parser, OP_RET);
+}
+
+// 解析返回语句（return; 或 return expr;）
+void parse_return_statement(Parser* parser) {
+    parser_match_keyword(parser, KW_RETURN);
+    if (parser->fn->is_main) {
+        fprintf(stderr, "错误：return 只能出现在函数中\n");
+        compile_fail();
+    }
+    if (parser_check(parser, TOKEN_EOF) ||
+        (parser_check(parser, TOKEN_PUNCTUATOR) &&
+         (parser_char(parser) == ';' || parser_char(parser) == '}'))) {
+        emit_byte(parser, OP_PUSH_UNDEFINED);
+    } else {
+        parse_expression(parser);
+    }
+    emit_return(parser);
+}
+
+// 逃逸分析：预扫描函数体（当前标记为函数体的 '{'），收集在内层函数中出现的标识符。
+// 这些名字若是本函数的形参或局部变量就会被内层函数捕获，需要放在堆环境中；
+// 按名字保守判断，属性名（'.' 之后的标识符）不算
+void scan_captured_names(Parser* parser, FunctionState* fn) {
+    Lexer saved = *parser->lexer;
+    Token token = parser->lexer->current;
+    int depth = 0;           // 花括号嵌套深度
+    int inner_depth = -1;    // 进入内层函数体时的深度，-1 表示不在内层函数中
+    bool pending_inner = false; // 已遇到 function 关键字，尚未进入其函数体
+    bool after_dot = false;
+    int capacity = 0;
+    while (token.type != TOKEN_EOF) {
+        if (token.type == TOKEN_PUNCTUATOR && token_char(&token) == '{') {
+            if (pending_inner && inner_depth < 0) {
+                inner_depth = depth;
+            }
+            pending_inner = false;
+            depth++;
+        } else if (token.type == TOKEN_PUNCTUATOR && token_char(&token) == '}') {
+            depth--;
+            if (depth == inner_depth) {
+                inner_depth = -1;
+            }
+            if (depth == 0) {
+                break;
+            }
+        } else if (token.type == TOKEN_KEYWORD && token.keyword == KW_FUNCTION) {
+            pending_inner = true;
+        } else if (token.type == TOKEN_IDENTIFIER && !after_dot &&
+                   (inner_depth >= 0 || pending_inner) && !fn_is_captured(fn, token.lexeme)) {
+            if (fn->captured_count == capacity) {
+                capacity = capacity < 8 ? 8 : capacity * 2;
+                fn->captured = realloc(fn->captured, capacity * sizeof(*fn->captured));
+                if (!fn->captured) {
+                    fprintf(stderr, "内存分配失败！\n");
+                    compile_fail();
                 }
-            } else {
-                // 可能是赋值语句
-                parse_assignment(parser);
             }
-            
-            // 只有当当前标记是分号时才消费它
-            if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-                parser->lexer->current.lexeme[0] == ';') {
-                parser_match(parser, TOKEN_PUNCTUATOR);
+            fn->captured[fn->captured_count++] = token.lexeme;
+        }
+        after_dot = token.type == TOKEN_PUNCTUATOR && token_char(&token) == '.';
+        lexer_next_token(parser->lexer, &token);
+    }
+    *parser->lexer = saved;
+}
+
+// 初始化函数编译状态
+void function_state_init(FunctionState* fn, FunctionState* enclosing, int scope_base) {
+    fn->enclosing = enclosing;
+    fn->is_main = enclosing == NULL;
+    fn->bytecode = NULL;
+    fn->bc_pos = 0;
+    fn->bc_capacity = 0;
+    fn->lines = NULL;
+    fn->line_count = 0;
+    fn->line_capacity = 0;
+    fn->scope_base = scope_base;
+    fn->arity = 0;
+    fn->next_slot = 0;
+    fn->slot_count = 0;
+    fn->captured = NULL;
+    fn->captured_count = 0;
+}
+
+// 在函数表中预留一项，返回函数编号（函数体编译完成后填写）
+int reserve_function(Parser* parser) {
+    if (parser->function_count > 0xFFFF) {
+        fprintf(stderr, "错误：函数数量超限\n");
+        compile_fail();
+    }
+    if (parser->function_count == parser->function_capacity) {
+        parser->function_capacity = parser->function_capacity < 8 ? 8 : parser->function_capacity * 2;
+        parser->functions = realloc(parser->functions, parser->function_capacity * sizeof(CompiledFunction));
+        if (!parser->functions) {
+            fprintf(stderr, "内存分配失败！\n");
+            compile_fail();
+        }
+    }
+    parser->functions[parser->function_count].code = NULL;
+    parser->functions[parser->function_count].lines = NULL;
+    return parser->function_count++;
+}
+
+// --------------- 编译服务：函数级增量编译 ---------------
+// 编译服务在多次编译之间缓存顶层函数声明的编译结果：源码文本（连同起始列）没有变化的函数
+// 直接装入缓存的指令，只有改动过的函数重新编译。顶层函数中的自由变量都解析为全局变量，
+// 函数体的编译结果只取决于它自己的源码，与所在的位置和前后的代码无关
+
+uint64_t hash_bytes64(uint64_t hash, const void* data, size_t length);
+
+int read_u16(const uint8_t* at) {
+    return at[0] | (at[1] << 8);
+}
+
+void write_u16(uint8_t* at, int value) {
+    at[0] = (uint8_t)value;
+    at[1] = (uint8_t)(value >> 8);
+}
+
+// 重写一段窥孔优化之前的指令中引用的编号：常量编号经 constant_map 映射，
+// 函数编号和内联缓存编号分别加上偏移。有常量没有映射（-1）时返回 false
+bool relocate_code(uint8_t* code, int len, const int* constant_map, int function_delta, int cache_delta) {
+    for (int ip = 0; ip < len; ip += vm_op_length(code[ip])) {
+        uint8_t op = code[ip];
+        if (op == OP_PUSH_NUM || op == OP_PUSH_STR || op == OP_PUSH_VAR || op == OP_STORE_VAR ||
+            op == OP_GET_PROP || op == OP_SET_PROP) {
+            int constant = constant_map[read_u16(code + ip + 1)];
+            if (constant < 0) {
+                return false;
+            }
+            write_u16(code + ip + 1, constant);
+            if (op == OP_GET_PROP || op == OP_SET_PROP) {
+                write_u16(code + ip + 3, read_u16(code + ip + 3) + cache_delta);
+            }
+        } else if (op == OP_CLOSURE) {
+            write_u16(code + ip + 1, read_u16(code + ip + 1) + function_delta);
+        }
+    }
+    return true;
+}
+
+// 顶层函数声明的源码范围（当前标记是 function 关键字）：text 到函数体的右花括号为止，
+// scan 停在右花括号之后（current 为其后的标记）。函数结束前源码就到了末尾时返回 false
+bool function_source_span(Parser* parser, Lexer* scan, Span* text, Span* name) {
+    *scan = *parser->lexer;
+    Token token;
+    lexer_next_token(scan, &token);
+    *name = token.lexeme;
+    int depth = 0;
+    while (token.type != TOKEN_EOF) {
+        if (token.type == TOKEN_PUNCTUATOR && token_char(&token) == '{') {
+            depth++;
+        } else if (token.type == TOKEN_PUNCTUATOR && token_char(&token) == '}' && --depth <= 0) {
+            text->chars = parser->lexer->current.lexeme.chars;
+            text->length = (int)(token.lexeme.chars + token.lexeme.length - text->chars);
+            lexer_next_token(scan, &scan->current);
+            return true;
+        }
+        lexer_next_token(scan, &token);
+    }
+    return false;
+}
+
+uint64_t function_source_hash(Span text, int col) {
+    uint64_t hash = hash_bytes64(1469598103934665603ull, text.chars, (size_t)text.length);
+    return hash_bytes64(hash, &col, sizeof(col));
+}
+
+FunctionCacheEntry* session_find(CompilerSession* session, uint64_t hash, Span text, int col) {
+    FunctionCacheEntry* entry = session->buckets[hash & (SESSION_BUCKETS - 1)];
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->col == col && entry->text_length == text.length &&
+            memcmp(entry->text, text.chars, (size_t)text.length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void function_cache_entry_free(FunctionCacheEntry* entry) {
+    for (int i = 0; entry->functions && i < entry->function_count; i++) {
+        free(entry->functions[i].code);
+        free(entry->functions[i].lines);
+    }
+    free(entry->functions);
+    free(entry->constants);
+    free(entry->string_data);
+    free(entry->text);
+    free(entry);
+}
+
+// 把缓存的函数装入本次编译：按原来的顺序加入常量，预留函数编号和内联缓存编号，
+// 复制指令并重新编号，行号平移到函数声明现在所在的行
+void session_install(Parser* parser, FunctionCacheEntry* entry, int line) {
+    if (parser->cache_count + entry->cache_count > 0x10000) {
+        fprintf(stderr, "错误：属性访问指令过多\n");
+        compile_fail();
+    }
+    int* constant_map = malloc((entry->constant_count > 0 ? entry->constant_count : 1) * sizeof(int));
+    if (!constant_map) {
+        fprintf(stderr, "内存分配失败！\n");
+        compile_fail();
+    }
+    for (int i = 0; i < entry->constant_count; i++) {
+        const Constant* c = &entry->constants[i];
+        constant_map[i] = c->type == CONST_NUMBER
+            ? pool_add(&parser->pool, CONST_NUMBER, c->as.number, NULL, 0)
+            : pool_add(&parser->pool, CONST_STRING, 0, entry->string_data + c->as.offset, (int)c->length);
+    }
+    int base = parser->function_count;
+    for (int i = 0; i < entry->function_count; i++) {
+        reserve_function(parser);
+    }
+    for (int i = 0; i < entry->function_count; i++) {
+        const CompiledFunction* cached = &entry->functions[i];
+        CompiledFunction* fn = &parser->functions[base + i];
+        fn->code = malloc(cached->code_len);
+        fn->lines = malloc((cached->line_count > 0 ? cached->line_count : 1) * sizeof(DebugLine));
+        if (!fn->code || !fn->lines) {
+            fprintf(stderr, "内存分配失败！\n");
+            compile_fail();
+        }
+        memcpy(fn->code, cached->code, cached->code_len);
+        relocate_code(fn->code, cached->code_len, constant_map, base, parser->cache_count);
+        for (int j = 0; j < cached->line_count; j++) {
+            fn->lines[j] = cached->lines[j];
+            fn->lines[j].line += line;
+        }
+        fn->code_len = cached->code_len;
+        fn->line_count = cached->line_count;
+        fn->info = cached->info;
+        fn->info.name = (uint32_t)constant_map[cached->info.name];
+    }
+    parser->cache_count += entry->cache_count;
+    free(constant_map);
+}
+
+// 编译服务：当前标记是顶层函数声明的 function 关键字。缓存中有源码相同的函数时装入它，
+// 在声明处创建函数对象并跳过整个声明，返回 true；否则登记该函数、开始记录用到的常量，返回 false
+bool session_begin_function(Parser* parser) {
+    CompilerSession* session = parser->session;
+    Lexer scan;
+    Span text, name;
+    if (!function_source_span(parser, &scan, &text, &name)) {
+        return false;
+    }
+    const Token* start = &parser->lexer->current;
+    uint64_t hash = function_source_hash(text, start->col);
+    FunctionCacheEntry* entry = session_find(session, hash, text, start->col);
+    if (entry) {
+        int index = parser->function_count;
+        session_install(parser, entry, start->line);
+        entry->last_used = session->generation;
+        session->reused++;
+        *parser->lexer = scan;
+        emit_byte(parser, OP_CLOSURE);
+        emit_u16(parser, (uint16_t)index);
+        emit_declare_var(parser, name);
+        return true;
+    }
+
+    if (parser->pending_count == parser->pending_capacity) {
+        parser->pending_capacity = parser->pending_capacity < 16 ? 16 : parser->pending_capacity * 2;
+        parser->pending = realloc(parser->pending, parser->pending_capacity * sizeof(PendingFunction));
+        if (!parser->pending) {
+            fprintf(stderr, "内存分配失败！\n");
+            compile_fail();
+        }
+    }
+    PendingFunction* pending = &parser->pending[parser->pending_count++];
+    pending->text = text.chars;
+    pending->text_length = text.length;
+    pending->line = start->line;
+    pending->col = start->col;
+    pending->hash = hash;
+    pending->first_function = parser->function_count;
+    pending->first_cache = parser->cache_count;
+    pending->trace_begin = parser->pool.trace_count;
+    parser->pool.tracing = true;
+    session->compiled++;
+    return false;
+}
+
+// 编译服务：登记的顶层函数编译完毕，停止记录常量
+void session_end_function(Parser* parser) {
+    if (!parser->pool.tracing) {
+        return;
+    }
+    parser->pool.tracing = false;
+    PendingFunction* pending = &parser->pending[parser->pending_count - 1];
+    pending->function_end = parser->function_count;
+    pending->cache_end = parser->cache_count;
+    pending->trace_end = parser->pool.trace_count;
+}
+
+// 由登记信息生成缓存项：常量按第一次加入常量池的顺序重新编号。
+// constant_map 按常量池编号索引，进入和返回时全部为 -1。指令无法重新编号时返回 NULL
+FunctionCacheEntry* session_make_entry(Parser* parser, const PendingFunction* pending, int* constant_map) {
+    FunctionCacheEntry* entry = calloc(1, sizeof(FunctionCacheEntry));
+    if (!entry) {
+        return NULL;
+    }
+    const int* trace = parser->pool.trace;
+    int string_len = 0;
+    for (int i = pending->trace_begin; i < pending->trace_end; i++) {
+        if (constant_map[trace[i]] < 0) {
+            const Constant* c = &parser->pool.constants[trace[i]];
+            constant_map[trace[i]] = entry->constant_count++;
+            string_len += c->type == CONST_NUMBER ? 0 : (int)c->length;
+        }
+    }
+    entry->function_count = pending->function_end - pending->first_function;
+    entry->constants = malloc((entry->constant_count > 0 ? entry->constant_count : 1) * sizeof(Constant));
+    entry->string_data = malloc(string_len > 0 ? string_len : 1);
+    entry->functions = calloc(entry->function_count, sizeof(CompiledFunction));
+    entry->text = malloc(pending->text_length);
+    bool ok = entry->constants && entry->string_data && entry->functions && entry->text;
+
+    // 第一次出现的顺序与上面分配编号的顺序相同
+    int filled = 0;
+    string_len = 0;
+    for (int i = pending->trace_begin; ok && i < pending->trace_end; i++) {
+        if (constant_map[trace[i]] != filled) {
+            continue;
+        }
+        Constant* c = &entry->constants[filled++];
+        *c = parser->pool.constants[trace[i]];
+        if (c->type != CONST_NUMBER) {
+            memcpy(entry->string_data + string_len, parser->pool.string_data + c->as.offset, c->length);
+            c->as.offset = string_len;
+            string_len += (int)c->length;
+        }
+    }
+    for (int i = 0; ok && i < entry->function_count; i++) {
+        const CompiledFunction* fn = &parser->functions[pending->first_function + i];
+        CompiledFunction* cached = &entry->functions[i];
+        cached->code = malloc(fn->code_len);
+        cached->lines = malloc((fn->line_count > 0 ? fn->line_count : 1) * sizeof(DebugLine));
+        if (!cached->code || !cached->lines) {
+            ok = false;
+            break;
+        }
+        memcpy(cached->code, fn->code, fn->code_len);
+        cached->code_len = fn->code_len;
+        ok = relocate_code(cached->code, fn->code_len, constant_map,
+                           -pending->first_function, -pending->first_cache);
+        for (int j = 0; j < fn->line_count; j++) {
+            cached->lines[j] = fn->lines[j];
+            cached->lines[j].line -= pending->line;
+        }
+        cached->line_count = fn->line_count;
+        cached->info = fn->info;
+        cached->info.name = (uint32_t)constant_map[fn->info.name];
+        ok = ok && constant_map[fn->info.name] >= 0;
+    }
+    for (int i = pending->trace_begin; i < pending->trace_end; i++) {
+        constant_map[trace[i]] = -1;
+    }
+    if (!ok) {
+        function_cache_entry_free(entry);
+        return NULL;
+    }
+    memcpy(entry->text, pending->text, pending->text_length);
+    entry->text_length = pending->text_length;
+    entry->col = pending->col;
+    entry->hash = pending->hash;
+    entry->cache_count = pending->cache_end - pending->first_cache;
+    return entry;
+}
+
+// 编译服务：编译成功后（窥孔优化之前）把本次重新编译的顶层函数存入函数缓存，
+// 缓存项过多时淘汰本次编译没有用到的项
+void session_store(Parser* parser) {
+    CompilerSession* session = parser->session;
+    int* constant_map = malloc((parser->pool.count > 0 ? parser->pool.count : 1) * sizeof(int));
+    if (!constant_map) {
+        return; // 只是少存几项缓存
+    }
+    for (int i = 0; i < parser->pool.count; i++) {
+        constant_map[i] = -1;
+    }
+    for (int i = 0; i < parser->pending_count; i++) {
+        const PendingFunction* pending = &parser->pending[i];
+        Span text = {pending->text, pending->text_length};
+        // 同一份源码中可能有完全相同的函数
+        if (session_find(session, pending->hash, text, pending->col)) {
+            continue;
+        }
+        FunctionCacheEntry* entry = session_make_entry(parser, pending, constant_map);
+        if (entry) {
+            FunctionCacheEntry** bucket = &session->buckets[entry->hash & (SESSION_BUCKETS - 1)];
+            entry->last_used = session->generation;
+            entry->next = *bucket;
+            *bucket = entry;
+            session->entry_count++;
+        }
+    }
+    free(constant_map);
+
+    if (session->entry_count <= SESSION_MAX_ENTRIES) {
+        return;
+    }
+    for (int i = 0; i < SESSION_BUCKETS; i++) {
+        FunctionCacheEntry** link = &session->buckets[i];
+        while (*link) {
+            FunctionCacheEntry* entry = *link;
+            if (entry->last_used != session->generation) {
+                *link = entry->next;
+                function_cache_entry_free(entry);
+                session->entry_count--;
+            } else {
+                link = &entry->next;
             }
         }
+    }
+}
+
+// 解析函数声明（function name(a, b) { ... }）：函数体编译到独立的缓冲区，
+// 声明处生成 OP_CLOSURE 创建函数对象并绑定到函数名
+void parse_function_declaration(Parser* parser) {
+    if (parser->session && parser->scope_depth == 0 && session_begin_function(parser)) {
+        return;
+    }
+    parser_match_keyword(parser, KW_FUNCTION);
+    if (!parser_check(parser, TOKEN_IDENTIFIER)) {
+        fprintf(stderr, "错误：函数声明缺少函数名\n");
+        compile_fail();
+    }
+    Span name = parser->lexer->current.lexeme;
+    parser_match(parser, TOKEN_IDENTIFIER);
+
+    // 解析形参列表
+    Span params[MAX_FRAME_SLOTS]; // 形参占据栈帧的前 arity 个槽位
+    int arity = 0;
+    if (!parser_check(parser, TOKEN_PUNCTUATOR) || parser_char(parser) != '(') {
+        fprintf(stderr, "错误：函数声明缺少左括号\n");
+        compile_fail();
+    }
+    parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '('
+    while (parser_check(parser, TOKEN_IDENTIFIER)) {
+        if (arity >= MAX_FRAME_SLOTS) {
+            fprintf(stderr, "错误：形参个数超限\n");
+            compile_fail();
+        }
+        params[arity++] = parser->lexer->current.lexeme;
+        parser_match(parser, TOKEN_IDENTIFIER);
+        if (parser_check(parser, TOKEN_PUNCTUATOR) && parser_char(parser) == ',') {
+            parser_match(parser, TOKEN_PUNCTUATOR); // 消费 ','
+        }
+    }
+    if (!parser_check(parser, TOKEN_PUNCTUATOR) || parser_char(parser) != ')') {
+        fprintf(stderr, "错误：函数形参列表缺少右括号\n");
+        compile_fail();
+    }
+    parser_match(parser, TOKEN_PUNCTUATOR); // 消费 ')'
+    if (!parser_check(parser, TOKEN_PUNCTUATOR) || parser_char(parser) != '{') {
+        fprintf(stderr, "错误：函数体缺少左花括号\n");
+        compile_fail();
+    }
+
+    int index = reserve_function(parser);
+    FunctionState fn;
+    function_state_init(&fn, parser->fn, parser->scope_depth);
+    scan_captured_names(parser, &fn);
+    parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '{'
+    parser->fn = &fn;
+    debug_mark(parser);
+
+    // 函数体作用域：形参占据栈帧的前 arity 个槽位，被捕获的形参复制到堆环境中
+    fn.arity = arity;
+    fn.next_slot = fn.slot_count = arity;
+    scope_begin(parser);
+    Scope* body = &parser->scopes[parser->scope_depth - 1];
+    int slot_count_pos = -1;
+    if (body->has_env) {
+        emit_byte(parser, OP_PUSH_ENV);
+        slot_count_pos = fn.bc_pos;
+        emit_byte(parser, 0);
+    }
+    for (int i = 0; i < arity; i++) {
+        if (scope_find(body, params[i]) != -1) {
+            fprintf(stderr, "错误：重复的形参名 '%.*s'\n", params[i].length, params[i].chars);
+            compile_fail();
+        }
+        scope_add_var(parser, params[i], i);
+        if (!body->vars[body->var_count - 1].in_frame) {
+            emit_byte(parser, OP_LOAD_SLOT);
+            emit_byte(parser, (uint8_t)i);
+            emit_store_var(parser, params[i]);
+        }
+    }
+
+    bool returned = parse_statements(parser);
+    parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '}'
+
+    // 函数体末尾隐式返回 undefined（以 return 结束时不可达，省略）
+    if (!returned) {
+        emit_byte(parser, OP_PUSH_UNDEFINED);
+        emit_return(parser);
+    }
+    int env_slots = scope_end(parser);
+    if (slot_count_pos >= 0) {
+        fn.bytecode[slot_count_pos] = (uint8_t)env_slots;
+    }
+    parser->fn = fn.enclosing;
+
+    CompiledFunction* compiled = &parser->functions[index];
+    compiled->code = fn.bytecode;
+    compiled->code_len = fn.bc_pos;
+    compiled->lines = fn.lines;
+    compiled->line_count = fn.line_count;
+    compiled->info.entry = 0;
+    compiled->info.arity = (uint16_t)arity;
+    compiled->info.slot_count = (uint16_t)fn.slot_count;
+    compiled->info.name = (uint32_t)pool_add(&parser->pool, CONST_STRING, 0, name.chars, name.length);
+    free(fn.captured);
+    if (parser->session && parser->scope_depth == 0) {
+        session_end_function(parser);
+    }
+
+    // 在声明处创建函数对象并绑定到函数名
+    emit_byte(parser, OP_CLOSURE);
+    emit_u16(parser, (uint16_t)index);
+    emit_declare_var(parser, name);
+}
+
+// 预扫描语句块（当前标记为块的 '{'），判断块本身（不含嵌套的块和函数体）是否声明变量或函数
+bool block_declares_vars(Parser* parser) {
+    Lexer saved = *parser->lexer;
+    Token token = parser->lexer->current;
+    int depth = 0;
+    bool declares = false;
+    while (token.type != TOKEN_EOF) {
+        if (token.type == TOKEN_PUNCTUATOR && token_char(&token) == '{') {
+            depth++;
+        } else if (token.type == TOKEN_PUNCTUATOR && token_char(&token) == '}') {
+            if (--depth == 0) break;
+        } else if (depth == 1 && token.type == TOKEN_KEYWORD &&
+                   (token.keyword == KW_VAR || token.keyword == KW_FUNCTION)) {
+            declares = true;
+            break;
+        }
+        lexer_next_token(parser->lexer, &token);
+    }
+    *parser->lexer = saved;
+    return declares;
+}
+
+// 解析语句块（{ ... }），返回块是否以 return 结束
+bool parse_block(Parser* parser) {
+    bool returned = false;
+    if (parser_check(parser, TOKEN_PUNCTUATOR) && 
+        parser_char(parser) == '{') {
+        // 需要堆环境时生成 OP_PUSH_ENV 指令，创建新的作用域（槽位数待块解析完后回填）；
+        // 不声明任何变量的块不需要自己的环境
+        bool declares = block_declares_vars(parser);
+        parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '{'
+        scope_begin(parser);
+        Scope* scope = &parser->scopes[parser->scope_depth - 1];
+        scope->has_env = scope->has_env && declares;
+        bool has_env = scope->has_env;
+        int slot_count_pos = -1;
+        if (has_env) {
+            emit_byte(parser, OP_PUSH_ENV);
+            slot_count_pos = parser->fn->bc_pos;
+            emit_byte(parser, 0);
+        }
+        
+        // 解析块内的语句
+        returned = parse_statements(parser);
         
-        // 生成 OP_POP_ENV 指令，退出当前作用域
-        emit_byte(parser, OP_POP_ENV);
+        // 回填槽位数，生成 OP_POP_ENV 指令（以 return 结束时已在返回前退出），退出当前作用域
+        int env_slots = scope_end(parser);
+        if (has_env) {
+            parser->fn->bytecode[slot_count_pos] = (uint8_t)env_slots;
+            if (!returned) {
+                emit_byte(parser, OP_POP_ENV);
+            }
+        }
         
         parser_match(parser, TOKEN_PUNCTUATOR); // 消费 '}'
     }
+    return returned;
 }
 
-// 解析语句
-void parse_statement(Parser* parser) {
+// 解析语句，返回语句是否为 return（或以 return 结束的块）
+bool parse_statement(Parser* parser) {
+    debug_mark(parser);
     if (parser_check(parser, TOKEN_KEYWORD)) {
-        if (parser_check_keyword(parser, "var")) {
+        if (parser_check_keyword(parser, KW_VAR)) {
             parse_var_declaration(parser);
-        } else if (parser_check_keyword(parser, "print")) {
+        } else if (parser_check_keyword(parser, KW_PRINT)) {
             parse_print_statement(parser);
+        } else if (parser_check_keyword(parser, KW_FUNCTION)) {
+            parse_function_declaration(parser);
+        } else if (parser_check_keyword(parser, KW_RETURN)) {
+            parse_return_statement(parser);
+            return true;
         } else {
-            fprintf(stderr, "错误：未知的关键字 '%s'\n", parser->lexer->current.lexeme);
-            exit(1);
+            fprintf(stderr, "错误：未知的关键字 '%.*s'\n",
+                    parser->lexer->current.lexeme.length, parser->lexer->current.lexeme.chars);
+            compile_fail();
         }
     } else if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-               parser->lexer->current.lexeme[0] == '{') {
-        parse_block(parser);
+               parser_char(parser) == '{') {
+        return parse_block(parser);
     } else if (parser_check(parser, TOKEN_IDENTIFIER)) {
         // 可能是赋值语句或标识符表达式
         parse_assignment(parser);
     } else {
-        fprintf(stderr, "错误：无法解析的语句，当前标记是 '%s'\n", parser->lexer->current.lexeme);
-        exit(1);
+        fprintf(stderr, "错误：无法解析的语句，当前标记是 '%.*s'\n",
+                parser->lexer->current.lexeme.length, parser->lexer->current.lexeme.chars);
+        compile_fail();
     }
+    return false;
 }
 
 // 解析程序（多个语句）
@@ -699,7 +1986,7 @@ void parse_program(Parser* parser) {
         parse_statement(parser);
         // 只有当当前标记是分号时才消费它
         if (parser_check(parser, TOKEN_PUNCTUATOR) && 
-            parser->lexer->current.lexeme[0] == ';') {
+            parser_char(parser) == ';') {
             parser_match(parser, TOKEN_PUNCTUATOR);
         }
     }
@@ -708,30 +1995,279 @@ void parse_program(Parser* parser) {
     emit_byte(parser, OP_EXIT);
 }
 
-// 编译函数
-uint8_t* compile(const char* source, int* bytecode_len) {
-    Lexer lexer;
-    Parser parser;
+// 窥孔优化：把常见的相邻指令序列合并为一条超级指令，省去中间结果的入栈出栈和分派。
+// 融合表按顺序尝试（较长的序列在前），表项取自示例脚本中出现最多的相邻指令组合：
+// 变量读取后紧跟加法或属性读取。超级指令的操作数就是原各条指令操作数的拼接
+typedef struct {
+    uint8_t ops[3];
+    int length;
+    uint8_t fused;
+} Superinstruction;
+
+static const Superinstruction superinstructions[] = {
+    {{OP_PUSH_VAR, OP_PUSH_VAR, OP_ADD}, 3, OP_ADD_VAR_VAR},
+    {{OP_LOAD_SLOT, OP_LOAD_SLOT, OP_ADD}, 3, OP_ADD_SLOT_SLOT},
+    {{OP_PUSH_NUM, OP_ADD}, 2, OP_ADD_NUM},
+    {{OP_PUSH_VAR, OP_GET_PROP}, 2, OP_GET_VAR_PROP},
+    {{OP_LOAD_SLOT, OP_GET_PROP}, 2, OP_GET_SLOT_PROP},
+};
+
+// 匹配 ip 处的融合表项，返回匹配到的表项（没有则返回 NULL）。
+// barrier 是 ip 之后下一条语句的起点，合并的序列不能跨过它（调试信息要落在指令起点上）
+const Superinstruction* match_superinstruction(const uint8_t* code, int len, int ip, int barrier) {
+    for (size_t i = 0; i < sizeof(superinstructions) / sizeof(superinstructions[0]); i++) {
+        const Superinstruction* super = &superinstructions[i];
+        int pos = ip;
+        int k = 0;
+        for (; k < super->length; k++) {
+            if (pos >= len || code[pos] != super->ops[k]) break;
+            if (pos >= barrier && k > 0) break;
+            pos += vm_op_length(code[pos]);
+        }
+        if (k == super->length) {
+            return super;
+        }
+    }
+    return NULL;
+}
+
+// 对一段指令流就地做窥孔优化（合并后的指令只会更短），同步平移调试信息，返回新长度
+int peephole_optimize(uint8_t* code, int len, DebugLine* lines, int line_count) {
+    int ip = 0;
+    int out = 0;
+    int line = 0;
+    while (ip < len) {
+        while (line < line_count && lines[line].offset == (uint32_t)ip) {
+            lines[line++].offset = out;
+        }
+        int barrier = line < line_count ? (int)lines[line].offset : len;
+        const Superinstruction* super = match_superinstruction(code, len, ip, barrier);
+        if (super) {
+            // 先取完各条指令的长度，写入的超级指令可能覆盖原来的操作码
+            int lengths[3];
+            for (int k = 0, pos = ip; k < super->length; k++) {
+                lengths[k] = vm_op_length(code[pos]);
+                pos += lengths[k];
+            }
+            code[out++] = super->fused;
+            for (int k = 0; k < super->length; k++) {
+                memmove(code + out, code + ip + 1, lengths[k] - 1);
+                out += lengths[k] - 1;
+                ip += lengths[k];
+            }
+        } else {
+            int op_len = vm_op_length(code[ip]);
+            memmove(code + out, code + ip, op_len);
+            out += op_len;
+            ip += op_len;
+        }
+    }
+    return out;
+}
+
+// 编译服务：把会话保留的缓冲区交给本次编译（编译期间可能重新分配，由编译状态持有）
+void session_lend_buffers(CompilerSession* session, Parser* parser) {
+    for (int i = 0; i < MAX_SCOPE_DEPTH; i++) {
+        parser->scopes[i].vars = session->scope_vars[i];
+        parser->scopes[i].var_capacity = session->scope_capacity[i];
+        session->scope_vars[i] = NULL;
+    }
+    if (session->pool_index) {
+        memset(session->pool_index, 0, session->pool_index_capacity * sizeof(int));
+        parser->pool.index = session->pool_index;
+        parser->pool.index_capacity = session->pool_index_capacity;
+        session->pool_index = NULL;
+    }
+}
+
+// 编译服务：编译结束后收回作用域的变量缓冲区和常量池的去重索引
+void session_reclaim_buffers(CompilerSession* session, Parser* parser) {
+    for (int i = 0; i < MAX_SCOPE_DEPTH; i++) {
+        session->scope_vars[i] = parser->scopes[i].vars;
+        session->scope_capacity[i] = parser->scopes[i].var_capacity;
+    }
+    session->pool_index = parser->pool.index;
+    session->pool_index_capacity = parser->pool.index_capacity;
+}
+
+// 编译 state 中的源码（session 为 NULL 时是普通编译），返回模块
+Module* compile_module(CompileState* state, CompilerSession* session, const char* source, size_t length,
+                       bool optimize) {
+    Lexer* lexer = &state->lexer;
+    Parser* parser = &state->parser;
+    FunctionState* main_fn = &state->main_fn;
     
     // 初始化词法分析器
-    lexer_init(&lexer, source);
+    lexer_init(lexer, source, length);
     
-    // 初始化语法分析器
-    parser_init(&parser, &lexer);
+    // 初始化语法分析器，主程序是最外层的函数编译状态
+    function_state_init(main_fn, NULL, 0);
+    parser_init(parser, lexer);
+    parser->fn = main_fn;
+    parser->session = session;
+    if (session) {
+        session->generation++;
+        session->reused = session->compiled = 0;
+        session_lend_buffers(session, parser);
+    }
     
     // 解析并生成字节码
-    parse_program(&parser);
+    parse_program(parser);
+    if (session) {
+        session_store(parser);
+    }
+    if (optimize) {
+        main_fn->bc_pos = peephole_optimize(main_fn->bytecode, main_fn->bc_pos, main_fn->lines, main_fn->line_count);
+        for (int i = 0; i < parser->function_count; i++) {
+            CompiledFunction* fn = &parser->functions[i];
+            fn->code_len = peephole_optimize(fn->code, fn->code_len, fn->lines, fn->line_count);
+        }
+    }
     
-    // 返回生成的字节码
-    uint8_t* bytecode = malloc(parser.bc_pos);
-    if (!bytecode) {
+    // 拼接指令流：主程序在前，各函数体依次追加在主程序的缓冲区之后，调试信息随之平移；
+    // 拼接后的缓冲区直接成为模块的指令流
+    int code_len = main_fn->bc_pos;
+    int line_count = main_fn->line_count;
+    for (int i = 0; i < parser->function_count; i++) {
+        code_len += parser->functions[i].code_len;
+        line_count += parser->functions[i].line_count;
+    }
+    Module* module = malloc(sizeof(Module));
+    uint8_t* code = realloc(main_fn->bytecode, code_len);
+    DebugLine* lines = realloc(main_fn->lines, (line_count > 0 ? line_count : 1) * sizeof(DebugLine));
+    FunctionInfo* functions = malloc((parser->function_count > 0 ? parser->function_count : 1) * sizeof(FunctionInfo));
+    if (!module || !code || !lines || !functions) {
         fprintf(stderr, "内存分配失败！\n");
-        exit(1);
+        compile_fail();
+    }
+    int offset = main_fn->bc_pos;
+    int line_pos = main_fn->line_count;
+    for (int i = 0; i < parser->function_count; i++) {
+        CompiledFunction* fn = &parser->functions[i];
+        memcpy(code + offset, fn->code, fn->code_len);
+        for (int j = 0; j < fn->line_count; j++) {
+            lines[line_pos] = fn->lines[j];
+            lines[line_pos].offset += offset;
+            line_pos++;
+        }
+        functions[i] = fn->info;
+        functions[i].entry = offset;
+        offset += fn->code_len;
+        free(fn->code);
+        free(fn->lines);
+    }
+    free(parser->functions);
+
+    // 返回生成的模块，常量池的存储直接转交给模块
+    module->code = code;
+    module->code_len = code_len;
+    module->constants = parser->pool.constants;
+    module->constant_count = parser->pool.count;
+    module->string_data = parser->pool.string_data;
+    module->string_data_len = parser->pool.string_len;
+    module->functions = functions;
+    module->function_count = parser->function_count;
+    module->lines = lines;
+    module->line_count = line_count;
+    module->cache_count = parser->cache_count;
+    module->flags = 0;
+    module->snapshot = NULL;
+    module->snapshot_size = 0;
+    module->mapping = NULL;
+    module->mapping_size = 0;
+    free(parser->pool.trace);
+    free(parser->pending);
+    if (session) {
+        session_reclaim_buffers(session, parser);
+    } else {
+        free(parser->pool.index);
+        for (int i = 0; i < MAX_SCOPE_DEPTH; i++) {
+            free(parser->scopes[i].vars);
+        }
     }
-    memcpy(bytecode, parser.bytecode, parser.bc_pos);
-    *bytecode_len = parser.bc_pos;
     
-    return bytecode;
+    return module;
+}
+
+// 编译函数：返回模块（指令流 + 常量池），由调用者用 module_free 释放。
+// 源码不必以 '\0' 结尾，编译期间必须保持有效；optimize 为 false 时跳过窥孔优化
+Module* compile(const char* source, size_t length, bool optimize) {
+    CompileState state;
+    return compile_module(&state, NULL, source, length, optimize);
+}
+
+CompilerSession* compiler_session_create(void) {
+    return calloc(1, sizeof(CompilerSession));
+}
+
+void compiler_session_free(CompilerSession* session) {
+    for (int i = 0; i < SESSION_BUCKETS; i++) {
+        FunctionCacheEntry* entry = session->buckets[i];
+        while (entry) {
+            FunctionCacheEntry* next = entry->next;
+            function_cache_entry_free(entry);
+            entry = next;
+        }
+    }
+    for (int i = 0; i < MAX_SCOPE_DEPTH; i++) {
+        free(session->scope_vars[i]);
+    }
+    free(session->pool_index);
+    free(session);
+}
+
+// 编译出错时释放编译状态中已分配的缓冲区，作用域的变量缓冲区和去重索引还给会话。
+// 在跳回之前调用：仍在编译的各层函数的编译状态还在各自的栈帧中
+void session_discard_state(CompilerSession* session) {
+    Parser* parser = &session->state.parser;
+    for (FunctionState* fn = parser->fn; fn && !fn->is_main; fn = fn->enclosing) {
+        free(fn->bytecode);
+        free(fn->lines);
+        free(fn->captured);
+    }
+    for (int i = 0; i < parser->function_count; i++) {
+        free(parser->functions[i].code);
+        free(parser->functions[i].lines);
+    }
+    free(parser->functions);
+    free(parser->pool.constants);
+    free(parser->pool.string_data);
+    free(parser->pool.trace);
+    free(parser->pending);
+    free(session->state.main_fn.bytecode);
+    free(session->state.main_fn.lines);
+    session_reclaim_buffers(session, parser);
+}
+
+// 在会话中增量编译一份源码：与 compile 的结果相同，源码没有变化的顶层函数直接复用上次的编译结果。
+// 编译错误不退出进程：提示写到标准错误，返回 NULL，会话可以继续使用
+Module* compiler_session_compile(CompilerSession* session, const char* source, size_t length, bool optimize) {
+    if (setjmp(session->error_jump) != 0) {
+        return NULL;
+    }
+    compile_error_session = session;
+    Module* module = compile_module(&session->state, session, source, length, optimize);
+    compile_error_session = NULL;
+    return module;
+}
+
+VM_NORETURN void compile_fail(void) {
+    CompilerSession* session = compile_error_session;
+    if (session) {
+        compile_error_session = NULL;
+        session_discard_state(session);
+        longjmp(session->error_jump, 1);
+    }
+    exit(1);
+}
+
+// 序列化模块为容器格式（见 module_serialize）
+uint8_t* serialize_module(const Module* module, size_t* size) {
+    uint8_t* data = module_serialize(module, size);
+    if (!data) {
+        exit(1);
+    }
+    return data;
 }
 
 // 打印帮助信息
@@ -739,53 +2275,76 @@ void print_help() {
     printf("stack-vm-compiler - 将 Stack VM 源代码编译为字节码\n");
     printf("\n");
     printf("用法: stack-vm-compiler [选项] 输入文件 [输出文件]\n");
+    printf("      stack-vm-compiler -e -j <线程数> 输入文件...\n");
+    printf("      stack-vm-compiler --server < 请求\n");
     printf("\n");
     printf("选项:\n");
     printf("  -h, --help      显示此帮助信息\n");
     printf("  -o <文件>       指定输出文件路径\n");
     printf("  -c              将字节码输出到标准输出\n");
     printf("  -e              直接执行编译后的字节码（不输出文件）\n");
+    printf("  -O0             关闭窥孔优化（不合并超级指令）\n");
+    printf("  --no-cache      不读写编译缓存\n");
+    printf("  -j <线程数>     与 -e 一起使用：用线程池并发执行多个输入文件（0 表示按 CPU 个数）\n");
+    printf("  --no-jit        执行时不把热点函数编译为本地代码，只用解释器\n");
+    printf("  --registers     把模块标记为寄存器字节码执行（-e 时直接生效，输出的 .bin 文件中保留该标记）\n");
+    printf("  --profile       与 -e 一起使用：剖析执行过程，报告输出到标准错误，\n");
+    printf("                  折叠调用栈写入去掉扩展名的输入文件名加 .folded（foo.txt -> foo.folded，\n");
+    printf("                  可交给 flamegraph.pl）\n");
+    printf("  --snapshot <文件> 与 -e 一起使用：执行完毕后把全局变量及其可达的堆连同模块写成快照文件\n");
+    printf("  --restore <文件>  与 -e 一起使用：先恢复快照文件中的堆，再从快照的位置继续执行；\n");
+    printf("                  输入文件的开头必须就是生成快照的脚本（例如同一份前导脚本加上后续代码）\n");
+    printf("  --server        编译服务：从标准输入逐行读取源文件路径并依次编译，只重新编译改动过的\n");
+    printf("                  顶层函数；每个请求回一行 \"ok <字节数> <复用数>/<函数数>\" 后接 .bin 内容，\n");
+    printf("                  或回一行 \"error <原因>\"\n");
     printf("\n");
     printf("示例:\n");
     printf("  stack-vm-compiler source.txt output.bin\n");
     printf("  stack-vm-compiler -o output.bin source.txt\n");
     printf("  stack-vm-compiler -c source.txt | hexdump -C\n");
     printf("  stack-vm-compiler -e source.txt\n");
+    printf("  stack-vm-compiler -e -j 8 a.txt b.txt c.txt\n");
+    printf("  stack-vm-compiler -e --profile source.txt\n");
+    printf("  stack-vm-compiler -e --snapshot prelude.snap prelude.txt\n");
+    printf("  stack-vm-compiler -e --restore prelude.snap app.txt\n");
+    printf("\n");
+    printf("编译出的 .bin 文件可由虚拟机直接映射执行: stack-vm run output.bin\n");
+    printf("编译结果按源码内容缓存在 $STACK_VM_CACHE_DIR（默认 ~/.cache/stack-vm），\n");
+    printf("重复编译同一份源码时直接使用缓存\n");
 }
 
-// 读取文件内容
-char* read_file(const char* filename, size_t* size) {
-    FILE* file = fopen(filename, "r");
-    if (!file) {
+// 只读映射源文件，由 unmap_file 释放（空文件不映射）。
+// 词法分析直接在映射上进行，源码不经过额外的读取和复制
+const char* map_file(const char* filename, size_t* size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "错误：无法打开文件 '%s'\n", filename);
         return NULL;
     }
-    
-    // 获取文件大小
-    fseek(file, 0, SEEK_END);
-    *size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    // 分配内存并读取文件内容
-    char* buffer = (char*)malloc(*size + 1);
-    if (!buffer) {
-        fprintf(stderr, "错误：内存分配失败\n");
-        fclose(file);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "错误：读取文件失败\n");
+        close(fd);
         return NULL;
     }
-    
-    size_t read = fread(buffer, 1, *size, file);
-    if (read != *size) {
+    *size = (size_t)st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return "";
+    }
+    void* data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
         fprintf(stderr, "错误：读取文件失败\n");
-        free(buffer);
-        fclose(file);
         return NULL;
     }
-    
-    buffer[*size] = '\0'; // 确保字符串以空字符结尾
-    fclose(file);
-    
-    return buffer;
+    return data;
+}
+
+void unmap_file(const char* data, size_t size) {
+    if (size > 0) {
+        munmap((void*)data, size);
+    }
 }
 
 // 写入文件内容
@@ -807,6 +2366,354 @@ bool write_file(const char* filename, const uint8_t* data, size_t size) {
     return true;
 }
 
+// --------------- 编译缓存 ---------------
+// 以“源码内容 + 编译器版本 + 优化选项”的哈希为键，把编译结果以 .bin 容器格式
+// 存放在缓存目录中；命中时直接映射缓存文件，跳过词法/语法分析。
+// 写入先落到同目录下的临时文件再 rename，多个进程并发共享缓存时不会读到半个文件
+#define COMPILER_VERSION "stack-vm-compiler 1"
+
+// 编译器版本串：重新构建编译器会使旧缓存全部失效，避免指令编码变化后误用旧字节码
+static const char compiler_build_id[] = COMPILER_VERSION " " __DATE__ " " __TIME__;
+
+// 64 位 FNV-1a
+uint64_t hash_bytes64(uint64_t hash, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// 缓存目录：STACK_VM_CACHE_DIR，其次 $XDG_CACHE_HOME/stack-vm，再次 $HOME/.cache/stack-vm。
+// 返回 false 表示没有可用的缓存目录
+bool cache_dir(char* buffer, size_t size) {
+    const char* dir = getenv("STACK_VM_CACHE_DIR");
+    int n;
+    if (dir && *dir) {
+        n = snprintf(buffer, size, "%s", dir);
+    } else if ((dir = getenv("XDG_CACHE_HOME")) && *dir) {
+        n = snprintf(buffer, size, "%s/stack-vm", dir);
+    } else if ((dir = getenv("HOME")) && *dir) {
+        n = snprintf(buffer, size, "%s/.cache/stack-vm", dir);
+    } else {
+        return false;
+    }
+    return n > 0 && (size_t)n < size;
+}
+
+// 逐级创建目录（已存在不算错误）
+bool make_dirs(char* path) {
+    for (char* p = path + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char saved = *p;
+            *p = '\0';
+            bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+            *p = saved;
+            if (!ok) {
+                return false;
+            }
+            if (saved == '\0') {
+                return true;
+            }
+        }
+    }
+}
+
+// 构造缓存文件路径：<目录>/<哈希>-<源码长度>.bin
+bool cache_path(char* buffer, size_t size, const char* source, size_t length, bool optimize) {
+    char dir[4096];
+    if (!cache_dir(dir, sizeof(dir))) {
+        return false;
+    }
+    uint64_t hash = 14695981039346656037ull;
+    hash = hash_bytes64(hash, compiler_build_id, sizeof(compiler_build_id));
+    hash = hash_bytes64(hash, &optimize, sizeof(optimize));
+    hash = hash_bytes64(hash, source, length);
+    int n = snprintf(buffer, size, "%s/%016llx-%llu.bin", dir,
+                     (unsigned long long)hash, (unsigned long long)length);
+    return n > 0 && (size_t)n < size;
+}
+
+// 查找缓存：文件不存在时静默返回 NULL；文件损坏时报告并返回 NULL，
+// 调用方随后重新编译并覆盖它
+Module* cache_lookup(const char* path) {
+    if (access(path, R_OK) != 0) {
+        return NULL;
+    }
+    char error[256];
+    Module* module = module_load_file(path, error, sizeof(error));
+    if (!module) {
+        fprintf(stderr, "%s\n", error);
+    }
+    return module;
+}
+
+// 写入缓存：先写同目录下以进程号区分的临时文件，再原子地 rename 到最终路径。
+// 缓存只是加速手段，任何失败都只放弃写入，不影响本次编译
+void cache_store(const char* path, const uint8_t* data, size_t size) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char* slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        if (!make_dirs(dir)) {
+            return;
+        }
+    }
+
+    char temp[4096 + 32];
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n <= 0) {
+            break;
+        }
+        written += (size_t)n;
+    }
+    if (close(fd) != 0 || written != size || rename(temp, path) != 0) {
+        unlink(temp);
+    }
+}
+
+// 得到源文件对应的模块：先查编译缓存，未命中则编译并写入缓存，再加上 flags 中的模块标记
+// （缓存中的模块不带标记，与执行方式无关）。失败时返回 NULL。
+// session 非空时在会话中编译，编译错误只让这一个文件失败，不会退出进程
+Module* load_module(const char* input_file, bool optimize, bool use_cache, uint32_t flags,
+                    CompilerSession* session) {
+    // 映射输入文件
+    size_t file_size;
+    const char* source_code = map_file(input_file, &file_size);
+    if (!source_code) {
+        return NULL;
+    }
+    
+    // 命中缓存则直接映射缓存的 .bin，不再编译
+    char cache_file[4096 + 64];
+    bool cacheable = use_cache && cache_path(cache_file, sizeof(cache_file),
+                                             source_code, file_size, optimize);
+    Module* module = cacheable ? cache_lookup(cache_file) : NULL;
+    bool cache_hit = module != NULL;
+    
+    // 编译源代码（模块不引用源码）
+    if (!module) {
+        module = session ? compiler_session_compile(session, source_code, file_size, optimize)
+                         : compile(source_code, file_size, optimize);
+    }
+    
+    // 解除源码映射
+    unmap_file(source_code, file_size);
+    
+    if (!module) {
+        fprintf(stderr, "错误：编译失败\n");
+        return NULL;
+    }
+    if (cacheable && !cache_hit) {
+        size_t bytecode_len;
+        uint8_t* bytecode = serialize_module(module, &bytecode_len);
+        cache_store(cache_file, bytecode, bytecode_len);
+        free(bytecode);
+    }
+    module->flags |= flags;
+    return module;
+}
+
+// 用调度器并发执行多个脚本（jobs 为线程数，0 表示按 CPU 个数）：
+// 先在主线程中依次得到全部模块（在同一个编译会话中编译，编译失败的文件单独报告，
+// 其余照常执行），再提交给工作线程，任一脚本失败时返回 1
+int run_parallel(const char** files, int count, int jobs, bool optimize, bool use_cache, uint32_t flags,
+                 const VMConfig* config) {
+    Module** modules = calloc((size_t)count, sizeof(Module*));
+    CompilerSession* session = compiler_session_create();
+    if (!modules || !session) {
+        fprintf(stderr, "内存分配失败！\n");
+        free(modules);
+        free(session);
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        modules[i] = load_module(files[i], optimize, use_cache, flags, session);
+        if (!modules[i]) {
+            fprintf(stderr, "错误：无法加载 '%s'\n", files[i]);
+            failed++;
+        }
+    }
+    compiler_session_free(session);
+    
+    Scheduler* sched = sched_create(jobs, config);
+    if (!sched) {
+        fprintf(stderr, "错误：无法创建调度器\n");
+        failed = count;
+    } else {
+        for (int i = 0; i < count; i++) {
+            if (modules[i] && !sched_submit(sched, modules[i], (void*)files[i])) {
+                fprintf(stderr, "错误：无法提交 '%s'\n", files[i]);
+                failed++;
+            }
+        }
+        // 按完成顺序报告失败的脚本
+        SchedResult result;
+        while (sched_next_result(sched, &result)) {
+            if (result.status != VM_OK) {
+                fprintf(stderr, "%s: %s\n", (const char*)result.user_data, result.error);
+                failed++;
+            }
+        }
+        sched_destroy(sched);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (modules[i]) {
+            module_free(modules[i]);
+        }
+    }
+    free(modules);
+    return failed > 0 ? 1 : 0;
+}
+
+// 编译服务（--server）：从标准输入逐行读取源文件路径，在同一个会话中依次编译，
+// 只重新编译改动过的顶层函数。每个请求先回一行状态：成功为
+// "ok <字节数> <复用的顶层函数数>/<顶层函数总数>"，其后紧跟该字节数的 .bin 容器；
+// 失败为 "error <原因>"（编译错误的详细提示在标准错误中）。标准输入结束时退出
+int run_server(bool optimize, uint32_t flags) {
+    CompilerSession* session = compiler_session_create();
+    if (!session) {
+        fprintf(stderr, "内存分配失败！\n");
+        return 1;
+    }
+    char* request = NULL;
+    size_t request_capacity = 0;
+    ssize_t request_len;
+    int result = 0;
+    while ((request_len = getline(&request, &request_capacity, stdin)) >= 0) {
+        while (request_len > 0 && (request[request_len - 1] == '\n' || request[request_len - 1] == '\r')) {
+            request[--request_len] = '\0';
+        }
+        if (request_len == 0) {
+            continue;
+        }
+        size_t file_size;
+        const char* source_code = map_file(request, &file_size);
+        Module* module = NULL;
+        if (source_code) {
+            module = compiler_session_compile(session, source_code, file_size, optimize);
+            unmap_file(source_code, file_size);
+        }
+        if (!module) {
+            printf("error %s\n", source_code ? "编译失败" : "无法读取文件");
+            fflush(stdout);
+            continue;
+        }
+        module->flags |= flags;
+        size_t bytecode_len;
+        uint8_t* bytecode = serialize_module(module, &bytecode_len);
+        module_free(module);
+        printf("ok %zu %d/%d\n", bytecode_len, session->reused, session->reused + session->compiled);
+        bool written = fwrite(bytecode, 1, bytecode_len, stdout) == bytecode_len && fflush(stdout) == 0;
+        free(bytecode);
+        if (!written) {
+            fprintf(stderr, "错误：写入标准输出失败\n");
+            result = 1;
+            break;
+        }
+    }
+    free(request);
+    compiler_session_free(session);
+    return result;
+}
+
+// 剖析执行（-e --profile）：报告输出到标准错误，折叠调用栈写入输入文件名去掉扩展名加 .folded。
+// 出错的脚本同样输出已经记录的剖析结果
+int run_profiled(const char* input_file, const Module* module) {
+    StackVM* vm = vm_create(NULL);
+    VMProfile* profile = vm_profile_create(module);
+    VMStatus status = vm && profile ? vm_load(vm, module) : VM_ERROR_MEMORY;
+    if (status == VM_OK) {
+        vm_set_profile(vm, profile);
+        status = vm_run(vm);
+    }
+    if (status != VM_OK) {
+        fprintf(stderr, "%s\n", vm && profile ? vm_error_message(vm) : "内存分配失败！");
+    }
+    vm_destroy(vm);
+    if (!profile) {
+        return 1;
+    }
+    
+    vm_profile_report(profile, stderr);
+    char* folded_file = malloc(strlen(input_file) + sizeof(".folded"));
+    if (!folded_file) {
+        fprintf(stderr, "内存分配失败！\n");
+        vm_profile_free(profile);
+        return 1;
+    }
+    strcpy(folded_file, input_file);
+    char* dot = strrchr(folded_file, '.');
+    char* slash = strrchr(folded_file, '/');
+    if (dot && (!slash || dot > slash)) {
+        *dot = '\0';
+    }
+    strcat(folded_file, ".folded");
+    FILE* out = fopen(folded_file, "w");
+    bool written = out && vm_profile_write_folded(profile, out);
+    if (out && fclose(out) != 0) {
+        written = false;
+    }
+    if (written) {
+        fprintf(stderr, "\n折叠调用栈已写入：%s\n", folded_file);
+    } else {
+        fprintf(stderr, "错误：无法写入文件 '%s'\n", folded_file);
+    }
+    free(folded_file);
+    vm_profile_free(profile);
+    return status == VM_OK && written ? 0 : 1;
+}
+
+// 执行模块（-e）：restore_file 非空时先恢复快照文件中的堆，从快照的位置继续执行；
+// snapshot_file 非空时执行完毕后把虚拟机的堆连同模块写成快照文件
+int run_module(const Module* module, const VMConfig* config, const char* restore_file,
+               const char* snapshot_file) {
+    Module* snapshot = NULL;
+    char error[256];
+    if (restore_file && !(snapshot = module_load_file(restore_file, error, sizeof(error)))) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    StackVM* vm = vm_create(config);
+    VMStatus status = VM_ERROR_MEMORY;
+    if (vm) {
+        status = snapshot ? vm_restore(vm, snapshot, module) : vm_load(vm, module);
+    }
+    if (snapshot) {
+        module_free(snapshot); // 堆已经重建，快照文件不再需要
+    }
+    if (status == VM_OK) {
+        status = vm_run(vm);
+    }
+    bool written = true;
+    if (status == VM_OK && snapshot_file) {
+        size_t size;
+        uint8_t* data = vm_snapshot(vm, &size);
+        if (data) {
+            written = write_file(snapshot_file, data, size);
+            free(data);
+        } else {
+            status = VM_ERROR_RUNTIME;
+        }
+    }
+    if (status != VM_OK) {
+        fprintf(stderr, "%s\n", vm ? vm_error_message(vm) : "内存分配失败！");
+    }
+    vm_destroy(vm);
+    return status == VM_OK && written ? 0 : 1;
+}
+
 // 主函数：命令行工具入口
 #ifdef COMPILER_TEST
 int main(int argc, char* argv[]) {
@@ -814,6 +2721,17 @@ int main(int argc, char* argv[]) {
     const char* output_file = NULL;
     bool output_to_stdout = false;
     bool execute_only = false;
+    bool optimize = true;
+    bool use_cache = true;
+    bool profile = false;
+    bool server = false;
+    const char* snapshot_file = NULL; // --snapshot：执行后写入的快照文件
+    const char* restore_file = NULL;  // --restore：执行前恢复的快照文件
+    uint32_t module_flags = 0; // 加在编译结果上的模块标记
+    VMConfig config = {0}; // 执行时的虚拟机配置
+    int jobs = -1; // 并发执行的线程数，-1 表示未指定 -j
+    const char* inputs[argc];
+    int input_count = 0;
     
     // 解析命令行参数
     for (int i = 1; i < argc; i++) {
@@ -828,23 +2746,70 @@ int main(int argc, char* argv[]) {
                 print_help();
                 return 1;
             }
+        } else if (strcmp(argv[i], "--snapshot") == 0 || strcmp(argv[i], "--restore") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "错误：选项 '%s' 需要一个参数\n", argv[i]);
+                print_help();
+                return 1;
+            }
+            if (argv[i][2] == 's') {
+                snapshot_file = argv[++i];
+            } else {
+                restore_file = argv[++i];
+            }
         } else if (strcmp(argv[i], "-c") == 0) {
             output_to_stdout = true;
         } else if (strcmp(argv[i], "-e") == 0) {
             execute_only = true;
+        } else if (strcmp(argv[i], "-O0") == 0) {
+            optimize = false;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = false;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        } else if (strcmp(argv[i], "--server") == 0) {
+            server = true;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            config.jit_threshold = -1;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            module_flags |= MODULE_REGISTER_TIER;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            char* end;
+            if (i + 1 >= argc || (jobs = (int)strtol(argv[++i], &end, 10), *end != '\0') || jobs < 0) {
+                fprintf(stderr, "错误：选项 '-j' 需要一个非负整数参数\n");
+                print_help();
+                return 1;
+            }
         } else if (argv[i][0] == '-') {
             fprintf(stderr, "错误：未知选项 '%s'\n", argv[i]);
             print_help();
             return 1;
-        } else if (!input_file) {
-            input_file = argv[i];
-        } else if (!output_file) {
-            output_file = argv[i];
         } else {
+            // 位置参数：并发执行（-j）时全部是输入文件，否则为输入文件和输出文件
+            inputs[input_count++] = argv[i];
+        }
+    }
+    if (jobs < 0 && input_count > 0) {
+        input_file = inputs[0];
+        if (input_count > (output_file ? 1 : 2)) {
             fprintf(stderr, "错误：太多的参数\n");
             print_help();
             return 1;
         }
+        if (input_count == 2) {
+            output_file = inputs[1];
+        }
+    } else if (input_count > 0) {
+        input_file = inputs[0];
+    }
+    
+    if (server) {
+        if (input_count > 0 || output_file || output_to_stdout || execute_only || jobs >= 0 || profile ||
+            snapshot_file || restore_file) {
+            fprintf(stderr, "错误：选项 '--server' 从标准输入读取请求，只能与 '-O0'、'--registers' 一起使用\n");
+            return 1;
+        }
+        return run_server(optimize, module_flags);
     }
     
     // 检查是否提供了输入文件
@@ -853,74 +2818,90 @@ int main(int argc, char* argv[]) {
         print_help();
         return 1;
     }
-    
-    // 读取输入文件
-    size_t file_size;
-    char* source_code = read_file(input_file, &file_size);
-    if (!source_code) {
+    if (jobs >= 0 && !execute_only) {
+        fprintf(stderr, "错误：选项 '-j' 只能与 '-e' 一起使用\n");
+        return 1;
+    }
+    if (profile && (!execute_only || jobs >= 0)) {
+        fprintf(stderr, "错误：选项 '--profile' 只能与 '-e' 一起使用（不支持 '-j'）\n");
+        return 1;
+    }
+    if ((snapshot_file || restore_file) && (!execute_only || jobs >= 0 || profile)) {
+        fprintf(stderr, "错误：选项 '--snapshot' 和 '--restore' 只能与 '-e' 一起使用（不支持 '-j' 和 '--profile'）\n");
+        return 1;
+    }
+    if (profile && (module_flags & MODULE_REGISTER_TIER)) {
+        fprintf(stderr, "错误：选项 '--profile' 不能与 '--registers' 一起使用\n");
         return 1;
     }
     
-    // 编译源代码
-    int bytecode_len;
-    uint8_t* bytecode = compile(source_code, &bytecode_len);
-    
-    // 释放源代码内存
-    free(source_code);
+    if (jobs >= 0) {
+        return run_parallel(inputs, input_count, jobs, optimize, use_cache, module_flags, &config);
+    }
     
-    if (!bytecode) {
-        fprintf(stderr, "错误：编译失败\n");
+    Module* module = load_module(input_file, optimize, use_cache, module_flags, NULL);
+    if (!module) {
         return 1;
     }
     
     // 根据选项处理编译结果
     if (execute_only) {
+        if (profile) {
+            int result = run_profiled(input_file, module);
+            module_free(module);
+            return result;
+        }
         // 执行编译后的字节码
-        StackVM vm;
-        vm_init(&vm);
-        vm_execute(&vm, bytecode, bytecode_len);
+        int result = run_module(module, &config, restore_file, snapshot_file);
+        module_free(module);
+        return result;
+    }
+    
+    size_t bytecode_len;
+    uint8_t* bytecode = serialize_module(module, &bytecode_len);
+    module_free(module);
+    
+    // 根据选项输出序列化后的模块
+    if (output_to_stdout) {
+        // 输出到标准输出
+        if (fwrite(bytecode, 1, bytecode_len, stdout) != bytecode_len) {
+            fprintf(stderr, "错误：写入标准输出失败\n");
+            free(bytecode);
+            return 1;
+        }
     } else {
-        if (output_to_stdout) {
-            // 输出到标准输出
-            if ((int)fwrite(bytecode, 1, bytecode_len, stdout) != bytecode_len) {
-                fprintf(stderr, "错误：写入标准输出失败\n");
+        // 写入输出文件
+        if (!output_file) {
+            // 如果没有指定输出文件，使用输入文件的基础名加上 .bin 扩展名
+            char* base_name = strdup(input_file);
+            char* dot = strrchr(base_name, '.');
+            if (dot) {
+                *dot = '\0';
+            }
+            output_file = base_name;
+            
+            // 构造完整的输出文件名
+            char* full_output_file = (char*)malloc(strlen(output_file) + 5);
+            sprintf(full_output_file, "%s.bin", output_file);
+            
+            if (!write_file(full_output_file, bytecode, bytecode_len)) {
+                free(full_output_file);
+                free(base_name);
                 free(bytecode);
                 return 1;
             }
+            
+            printf("成功编译：%s -> %s\n", input_file, full_output_file);
+            free(full_output_file);
+            free(base_name);
         } else {
-            // 写入输出文件
-            if (!output_file) {
-                // 如果没有指定输出文件，使用输入文件的基础名加上 .bin 扩展名
-                char* base_name = strdup(input_file);
-                char* dot = strrchr(base_name, '.');
-                if (dot) {
-                    *dot = '\0';
-                }
-                output_file = base_name;
-                
-                // 构造完整的输出文件名
-                char* full_output_file = (char*)malloc(strlen(output_file) + 5);
-                sprintf(full_output_file, "%s.bin", output_file);
-                
-                if (!write_file(full_output_file, bytecode, bytecode_len)) {
-                    free(full_output_file);
-                    free(base_name);
-                    free(bytecode);
-                    return 1;
-                }
-                
-                printf("成功编译：%s -> %s\n", input_file, full_output_file);
-                free(full_output_file);
-                free(base_name);
-            } else {
-                // 使用指定的输出文件
-                if (!write_file(output_file, bytecode, bytecode_len)) {
-                    free(bytecode);
-                    return 1;
-                }
-                
-                printf("成功编译：%s -> %s\n", input_file, output_file);
+            // 使用指定的输出文件
+            if (!write_file(output_file, bytecode, bytecode_len)) {
+                free(bytecode);
+                return 1;
             }
+            
+            printf("成功编译：%s -> %s\n", input_file, output_file);
         }
     }
     
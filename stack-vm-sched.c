@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "stack-vm-sched.h"
+
+// --------------- 双端队列 ---------------
+// 只有所有者会压入（从注入队列搬来的一批任务），所有者和偷取者各从一端取出。
+// 每个队列一把锁：任务粒度是整个脚本，锁的开销远小于一次执行
+
+static void deque_init(SchedDeque* deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->top = deque->bottom = 0;
+}
+
+// 所有者从底部弹出最近压入的任务
+static bool deque_pop(SchedDeque* deque, SchedJob* job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom != deque->top;
+    if (found) {
+        deque->bottom--;
+        *job = deque->jobs[deque->bottom & (SCHED_DEQUE_CAPACITY - 1)];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// 偷取者从顶部取走最早压入的任务
+static bool deque_steal(SchedDeque* deque, SchedJob* job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom != deque->top;
+    if (found) {
+        *job = deque->jobs[deque->top & (SCHED_DEQUE_CAPACITY - 1)];
+        deque->top++;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// --------------- 任务获取 ---------------
+
+// 从注入队列取一批任务：第一个直接返回，其余放进自己的队列供自己和其他线程取用
+static bool take_injected(SchedWorker* worker, SchedJob* job) {
+    Scheduler* sched = worker->sched;
+    SchedDeque* deque = &worker->deque;
+    pthread_mutex_lock(&sched->lock);
+    if (sched->inject_count == 0) {
+        pthread_mutex_unlock(&sched->lock);
+        return false;
+    }
+    *job = sched->inject[sched->inject_head];
+    sched->inject_head = (sched->inject_head + 1) % sched->inject_capacity;
+    sched->inject_count--;
+
+    pthread_mutex_lock(&deque->lock);
+    unsigned room = SCHED_DEQUE_CAPACITY - (deque->bottom - deque->top);
+    size_t batch = sched->inject_count / (size_t)sched->worker_count;
+    if (batch > SCHED_BATCH_SIZE) batch = SCHED_BATCH_SIZE;
+    if (batch > room) batch = room;
+    for (size_t i = 0; i < batch; i++) {
+        deque->jobs[deque->bottom & (SCHED_DEQUE_CAPACITY - 1)] = sched->inject[sched->inject_head];
+        deque->bottom++;
+        sched->inject_head = (sched->inject_head + 1) % sched->inject_capacity;
+        sched->inject_count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    if (batch > 0) {
+        // 搬进队列的任务可以被偷取，唤醒空闲的线程
+        sched->epoch++;
+        pthread_cond_broadcast(&sched->work_ready);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return true;
+}
+
+// 从随机选定的线程开始依次尝试偷取一个任务
+static bool steal_job(SchedWorker* worker, SchedJob* job) {
+    Scheduler* sched = worker->sched;
+    worker->steal_seed = worker->steal_seed * 1103515245u + 12345u;
+    int start = (int)((worker->steal_seed >> 16) % (unsigned)sched->worker_count);
+    for (int i = 0; i < sched->worker_count; i++) {
+        SchedWorker* victim = &sched->workers[(start + i) % sched->worker_count];
+        if (victim != worker && deque_steal(&victim->deque, job)) {
+            worker->stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool find_job(SchedWorker* worker, SchedJob* job) {
+    return deque_pop(&worker->deque, job) || take_injected(worker, job) || steal_job(worker, job);
+}
+
+// --------------- 工作线程 ---------------
+
+// 默认的输出回调：各线程的虚拟机按块（通常是若干整行）依次写到标准输出
+static void sched_write_stdout(void* user_data, const char* data, size_t length) {
+    Scheduler* sched = (Scheduler*)user_data;
+    pthread_mutex_lock(&sched->output_lock);
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    pthread_mutex_unlock(&sched->output_lock);
+}
+
+// 结果节点在提交时已经分配好，发布结果不会失败
+static void post_result(Scheduler* sched, SchedResultNode* node, const SchedResult* result) {
+    node->result = *result;
+    node->next = NULL;
+    pthread_mutex_lock(&sched->done_lock);
+    if (sched->done_tail) {
+        sched->done_tail->next = node;
+    } else {
+        sched->done_head = node;
+    }
+    sched->done_tail = node;
+    pthread_cond_signal(&sched->done_ready);
+    pthread_mutex_unlock(&sched->done_lock);
+}
+
+// 在本线程的虚拟机上执行一个任务，之后把虚拟机恢复到初始状态供下一个任务使用
+static void run_job(SchedWorker* worker, const SchedJob* job) {
+    SchedResult result;
+    result.user_data = job->user_data;
+    result.worker = worker->index;
+    result.error[0] = '\0';
+    if (!worker->vm) {
+        worker->vm = vm_create(&worker->sched->config);
+    }
+    StackVM* vm = worker->vm;
+    if (!vm) {
+        result.status = VM_ERROR_MEMORY;
+        snprintf(result.error, sizeof(result.error), "内存分配失败！");
+    } else {
+        result.status = vm_load(vm, job->module);
+        if (result.status == VM_OK) {
+            result.status = vm_run(vm);
+        }
+        if (result.status != VM_OK) {
+            snprintf(result.error, sizeof(result.error), "%s", vm_error_message(vm));
+        }
+        if (vm_reset(vm) != VM_OK) {
+            // 复用失败时丢弃这个虚拟机，下一个任务重新创建
+            vm_destroy(vm);
+            worker->vm = NULL;
+        }
+    }
+    worker->executed++;
+    post_result(worker->sched, job->node, &result);
+}
+
+static void* worker_main(void* arg) {
+    SchedWorker* worker = (SchedWorker*)arg;
+    Scheduler* sched = worker->sched;
+    for (;;) {
+        pthread_mutex_lock(&sched->lock);
+        unsigned long epoch = sched->epoch;
+        pthread_mutex_unlock(&sched->lock);
+
+        SchedJob job;
+        if (find_job(worker, &job)) {
+            run_job(worker, &job);
+            continue;
+        }
+
+        // 没有可做的任务：等到有新任务（epoch 变化）或者要求停止。
+        // 停止时所有任务都已提交完毕，找不到任务即可退出
+        pthread_mutex_lock(&sched->lock);
+        while (sched->epoch == epoch && !sched->stopping) {
+            pthread_cond_wait(&sched->work_ready, &sched->lock);
+        }
+        bool stop = sched->stopping && sched->epoch == epoch;
+        pthread_mutex_unlock(&sched->lock);
+        if (stop) {
+            break;
+        }
+    }
+    vm_destroy(worker->vm);
+    worker->vm = NULL;
+    return NULL;
+}
+
+// --------------- 对外接口 ---------------
+
+Scheduler* sched_create(int workers, const VMConfig* config) {
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (int)cpus : 1;
+    }
+    if (workers > SCHED_MAX_WORKERS) {
+        workers = SCHED_MAX_WORKERS;
+    }
+    Scheduler* sched = calloc(1, sizeof(Scheduler));
+    if (!sched) {
+        return NULL;
+    }
+    if (config) {
+        sched->config = *config;
+    }
+    pthread_mutex_init(&sched->output_lock, NULL);
+    if (!sched->config.output) {
+        sched->config.output = sched_write_stdout;
+        sched->config.output_user_data = sched;
+    }
+    sched->worker_count = workers;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work_ready, NULL);
+    pthread_mutex_init(&sched->done_lock, NULL);
+    pthread_cond_init(&sched->done_ready, NULL);
+    for (int i = 0; i < workers; i++) {
+        SchedWorker* worker = &sched->workers[i];
+        worker->sched = sched;
+        worker->index = i;
+        worker->steal_seed = (unsigned)i * 2654435761u + 1;
+        deque_init(&worker->deque);
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&sched->workers[i].thread, NULL, worker_main, &sched->workers[i]) != 0) {
+            fprintf(stderr, "错误：无法创建工作线程\n");
+            // 已启动的线程照常停止
+            sched->worker_count = i;
+            sched_destroy(sched);
+            return NULL;
+        }
+    }
+    return sched;
+}
+
+// 先计入未完成数再入队，保证任务的结果出现时 outstanding 一定已经包含它
+static void adjust_outstanding(Scheduler* sched, int delta) {
+    pthread_mutex_lock(&sched->done_lock);
+    sched->outstanding += (size_t)(long)delta;
+    pthread_mutex_unlock(&sched->done_lock);
+}
+
+bool sched_submit(Scheduler* sched, const Module* module, void* user_data) {
+    SchedResultNode* node = malloc(sizeof(SchedResultNode));
+    if (!node) {
+        return false;
+    }
+    adjust_outstanding(sched, 1);
+    pthread_mutex_lock(&sched->lock);
+    if (sched->inject_count == sched->inject_capacity) {
+        size_t capacity = sched->inject_capacity < 64 ? 64 : sched->inject_capacity * 2;
+        SchedJob* jobs = malloc(capacity * sizeof(SchedJob));
+        if (!jobs) {
+            pthread_mutex_unlock(&sched->lock);
+            adjust_outstanding(sched, -1);
+            free(node);
+            return false;
+        }
+        // 按队列顺序搬到新缓冲区的开头
+        for (size_t i = 0; i < sched->inject_count; i++) {
+            jobs[i] = sched->inject[(sched->inject_head + i) % sched->inject_capacity];
+        }
+        free(sched->inject);
+        sched->inject = jobs;
+        sched->inject_head = 0;
+        sched->inject_capacity = capacity;
+    }
+    SchedJob* job = &sched->inject[(sched->inject_head + sched->inject_count) % sched->inject_capacity];
+    job->module = module;
+    job->user_data = user_data;
+    job->node = node;
+    sched->inject_count++;
+    sched->epoch++;
+    pthread_cond_signal(&sched->work_ready);
+    pthread_mutex_unlock(&sched->lock);
+    return true;
+}
+
+bool sched_next_result(Scheduler* sched, SchedResult* result) {
+    pthread_mutex_lock(&sched->done_lock);
+    if (sched->outstanding == 0) {
+        pthread_mutex_unlock(&sched->done_lock);
+        return false;
+    }
+    while (!sched->done_head) {
+        pthread_cond_wait(&sched->done_ready, &sched->done_lock);
+    }
+    SchedResultNode* node = sched->done_head;
+    sched->done_head = node->next;
+    if (!sched->done_head) {
+        sched->done_tail = NULL;
+    }
+    sched->outstanding--;
+    pthread_mutex_unlock(&sched->done_lock);
+    *result = node->result;
+    free(node);
+    return true;
+}
+
+void sched_destroy(Scheduler* sched) {
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = true;
+    pthread_cond_broadcast(&sched->work_ready);
+    pthread_mutex_unlock(&sched->lock);
+    for (int i = 0; i < sched->worker_count; i++) {
+        pthread_join(sched->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < SCHED_MAX_WORKERS; i++) {
+        if (sched->workers[i].sched) {
+            pthread_mutex_destroy(&sched->workers[i].deque.lock);
+        }
+    }
+    SchedResultNode* node = sched->done_head;
+    while (node) {
+        SchedResultNode* next = node->next;
+        free(node);
+        node = next;
+    }
+    free(sched->inject);
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->work_ready);
+    pthread_mutex_destroy(&sched->done_lock);
+    pthread_cond_destroy(&sched->done_ready);
+    pthread_mutex_destroy(&sched->output_lock);
+    free(sched);
+}
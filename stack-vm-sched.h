@@ -0,0 +1,91 @@
+#ifndef STACK_VM_SCHED_H
+#define STACK_VM_SCHED_H
+
+#include <pthread.h>
+#include "stack-vm.h"
+
+// --------------- 并发调度器 ---------------
+// 一组工作线程，每个线程持有一个可复用的虚拟机（连同它的栈和内存池），
+// 批量执行互相独立的脚本。任务先进入共享的注入队列，空闲的工作线程一次取走一批
+// 放进自己的双端队列；自己的队列从底部取（后进先出，缓存局部性好），
+// 队列空了就从其他线程队列的顶部偷（先进先出，偷走最早的任务）。
+// 执行结果按完成顺序放入完成队列，由提交方取走。
+// 模块由调用方持有，在对应的结果取回之前不能释放；同一模块可以提交多次
+
+#define SCHED_MAX_WORKERS 64
+#define SCHED_DEQUE_CAPACITY 256 // 每个工作线程队列的容量（2 的幂）
+#define SCHED_BATCH_SIZE 16      // 从注入队列一次取走的任务数
+
+typedef struct {
+    const Module* module;
+    void* user_data;              // 原样带回结果中
+    struct SchedResultNode* node; // 提交时预先分配的结果节点，工作线程发布结果时不再分配内存
+} SchedJob;
+
+typedef struct {
+    void* user_data;
+    VMStatus status;
+    char error[256];              // status 不为 VM_OK 时的错误描述
+    int worker;                   // 执行该任务的工作线程编号
+} SchedResult;
+
+// 工作线程的双端队列（环形缓冲区，由自己的锁保护）
+typedef struct {
+    pthread_mutex_t lock;
+    SchedJob jobs[SCHED_DEQUE_CAPACITY];
+    unsigned top;                 // 被偷取的一端
+    unsigned bottom;              // 所有者压入和弹出的一端
+} SchedDeque;
+
+typedef struct Scheduler Scheduler;
+
+typedef struct {
+    Scheduler* sched;
+    int index;
+    pthread_t thread;
+    StackVM* vm;                  // 在工作线程中创建，任务之间用 vm_reset 复用
+    SchedDeque deque;
+    unsigned steal_seed;          // 选择偷取对象的伪随机状态
+    size_t executed;              // 已执行的任务数
+    size_t stolen;                // 其中偷来的任务数
+} SchedWorker;
+
+typedef struct SchedResultNode {
+    SchedResult result;
+    struct SchedResultNode* next;
+} SchedResultNode;
+
+struct Scheduler {
+    SchedWorker workers[SCHED_MAX_WORKERS];
+    int worker_count;
+    VMConfig config;
+
+    pthread_mutex_t lock;         // 保护注入队列、唤醒计数和停止标记
+    pthread_cond_t work_ready;    // 有新任务可取（或要求停止）
+    SchedJob* inject;             // 注入队列（环形缓冲区，按需扩容）
+    size_t inject_head;
+    size_t inject_count;
+    size_t inject_capacity;
+    unsigned long epoch;          // 每次有新任务可取时递增，避免丢失唤醒
+    bool stopping;
+
+    pthread_mutex_t done_lock;    // 保护完成队列
+    pthread_cond_t done_ready;
+    SchedResultNode* done_head;
+    SchedResultNode* done_tail;
+    size_t outstanding;           // 已提交但结果尚未取走的任务数
+
+    pthread_mutex_t output_lock;  // 未指定输出回调时，各虚拟机经此锁写标准输出
+};
+
+// 创建调度器并启动 workers 个工作线程（0 表示按 CPU 个数），config 用于各线程的虚拟机。
+// config 没有指定输出回调时，各虚拟机的输出块在锁内写到标准输出，不会相互穿插
+Scheduler* sched_create(int workers, const VMConfig* config);
+// 提交一个任务（线程安全），内存不足时返回 false
+bool sched_submit(Scheduler* sched, const Module* module, void* user_data);
+// 取一个已完成的结果，必要时等待；没有未取走的任务时返回 false
+bool sched_next_result(Scheduler* sched, SchedResult* result);
+// 等待已提交的任务全部执行完毕后停止工作线程并释放调度器（未取走的结果被丢弃）
+void sched_destroy(Scheduler* sched);
+
+#endif // STACK_VM_SCHED_H
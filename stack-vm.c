@@ -3,634 +3,5673 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "stack-vm.h"
 
 // --------------- 常量定义 ---------------
-#define MAX_PROPS 64 // 每个对象的最大属性数
-#define MAX_VARS 32  // 每个环境的最大变量数
+#define OBJECT_DICT_THRESHOLD 32 // 属性数达到此值的对象再新增属性时转为字典模式
+#define SHAPE_MAX_TRANSITIONS 16 // 形状的子形状数达到此值后，再新增不同的属性就转为字典模式
 
 // --------------- 函数原型声明 ---------------
+#ifndef VM_TRACING_GC
 void val_free(Value v);
+#endif
+static void jit_load(StackVM* vm, const Module* module);
+static void jit_unload(StackVM* vm);
+static void reg_load(StackVM* vm, const Module* module, int main_size);
+static void reg_unload(StackVM* vm);
+
+// --------------- 输出 ---------------
+// OP_PRINT 的输出先追加到虚拟机的缓冲区，达到阈值时一次性写出；
+// 放不下的长字符串不复制，和缓冲区内容一起用 writev 写出
+
+// 写出 iov 描述的全部数据（处理部分写入和信号中断），出错时放弃
+static void write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        size_t n = (size_t)written;
+        while (count > 0 && n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// 写出缓冲区的内容，随后紧接着写出 extra（可以为空）
+static void output_flush_with(StackVM* vm, const char* extra, size_t extra_length) {
+    OutputSink* out = &vm->output;
+    if (out->write) {
+        if (out->length > 0) {
+            out->write(out->user_data, out->data, out->length);
+        }
+        if (extra_length > 0) {
+            out->write(out->user_data, extra, extra_length);
+        }
+    } else {
+        struct iovec iov[2] = {
+            {out->data, out->length},
+            {(void*)extra, extra_length}
+        };
+        fflush(stdout); // 宿主程序经 stdio 写出的内容排在前面
+        write_all(STDOUT_FILENO, iov, 2);
+    }
+    out->length = 0;
+}
+
+void vm_flush_output(StackVM* vm) {
+    if (vm->output.length > 0) {
+        output_flush_with(vm, NULL, 0);
+    }
+}
+
+// 更换输出回调（NULL 表示标准输出），已缓冲的内容先按原来的方式写出
+void vm_set_output(StackVM* vm, VMOutputFn output, void* user_data) {
+    vm_flush_output(vm);
+    vm->output.write = output;
+    vm->output.user_data = user_data;
+}
+
+static inline void output_bytes(StackVM* vm, const char* data, size_t length) {
+    OutputSink* out = &vm->output;
+    if (out->length + length > out->capacity) {
+        if (length > out->capacity / 2) {
+            output_flush_with(vm, data, length);
+            return;
+        }
+        output_flush_with(vm, NULL, 0);
+    }
+    memcpy(out->data + out->length, data, length);
+    out->length += length;
+}
+
+#define OUTPUT_LITERAL(vm, text) output_bytes((vm), (text), sizeof(text) - 1)
+
+// 数值的字符串形式，print（"%g"）与字符串拼接和编译器的常量折叠（fixed，"%.2f"）共用，
+// 三者对特殊值的写法一致：NaN 和无穷大按 JS 的写法，-0 和 printf 一样保留符号。
+// buffer 至少 VM_NUMBER_TEXT_SIZE 字节时不会截断，返回长度
+int vm_format_number(char* buffer, size_t size, double number, bool fixed) {
+    if (isnan(number)) {
+        return snprintf(buffer, size, "NaN");
+    }
+    if (isinf(number)) {
+        return snprintf(buffer, size, "%s", number < 0 ? "-Infinity" : "Infinity");
+    }
+    return fixed ? snprintf(buffer, size, "%.2f", number) : snprintf(buffer, size, "%g", number);
+}
+
+// 按 "%g" 格式输出数值：绝对值小于 1e6 的整数（"%g" 不会改用指数形式）直接转换，
+// 其余（包括 NaN 和无穷大）交给 vm_format_number
+static void output_number(StackVM* vm, double number) {
+    char buffer[VM_NUMBER_TEXT_SIZE];
+    if (number > -1e6 && number < 1e6 && number == (double)(int32_t)number &&
+        (number != 0 || !signbit(number))) {
+        int32_t value = (int32_t)number;
+        uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+        char* end = buffer + sizeof(buffer);
+        char* p = end;
+        do {
+            *--p = (char)('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+        if (value < 0) {
+            *--p = '-';
+        }
+        output_bytes(vm, p, (size_t)(end - p));
+    } else {
+        int length = vm_format_number(buffer, sizeof(buffer), number, false);
+        output_bytes(vm, buffer, (size_t)length);
+    }
+}
+
+// 按配置分配输出缓冲区
+static void output_init(StackVM* vm, const VMConfig* config);
+
+// --------------- 错误处理 ---------------
+// 记录错误码和描述：经 vm_load/vm_run 进入时跳回调用方并返回错误码；
+// 直接调用 vm_execute 等旧接口时保持原来的行为，打印到 stderr 并退出进程
+VM_NORETURN static void vm_error(StackVM* vm, VMStatus status, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(vm->error, sizeof(vm->error), format, args);
+    va_end(args);
+    vm->status = status;
+    if (vm->error_jump) {
+        longjmp(*vm->error_jump, 1);
+    }
+    vm_flush_output(vm);
+    fprintf(stderr, "%s\n", vm->error);
+    exit(1);
+}
+
+// --------------- 内存池 ---------------
+// 内存块：头部之后按本级块大小切分，块起始地址按 POOL_CHUNK_SIZE 对齐，
+// 因此任何一个小块的地址向下对齐即可得到所属内存块
+struct PoolChunk {
+    Pool* pool;
+    PoolChunk* next;
+    int size_class;
+    size_t used;          // 已切分的字节数（含头部）
+};
+
+#define POOL_CHUNK_HEADER ((sizeof(PoolChunk) + 15) & ~(size_t)15)
+
+// 各级块大小（16 字节对齐，最后一级为 POOL_MAX_BLOCK）
+static const size_t pool_class_sizes[POOL_CLASS_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256, (POOL_MAX_BLOCK + 15) & ~(size_t)15
+};
+
+static int pool_class_of(Pool* pool, size_t size) {
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        if (size <= pool_class_sizes[i]) {
+            return i;
+        }
+    }
+    vm_error(pool->owner, VM_ERROR_MEMORY, "内存池不支持 %zu 字节的分配！", size);
+}
+
+static PoolChunk* pool_new_chunk(Pool* pool, int size_class) {
+    PoolChunk* chunk = pool->spare;
+    if (chunk) {
+        // 优先复用 pool_recycle 回收的内存块
+        pool->spare = chunk->next;
+    } else {
+        void* memory = NULL;
+        if (posix_memalign(&memory, POOL_CHUNK_SIZE, POOL_CHUNK_SIZE) != 0) {
+            vm_error(pool->owner, VM_ERROR_MEMORY, "内存分配失败！");
+        }
+        chunk = (PoolChunk*)memory;
+        pool->stats.chunk_count++;
+        pool->stats.bytes_reserved += POOL_CHUNK_SIZE;
+    }
+    chunk->pool = pool;
+    chunk->next = pool->chunks;
+    chunk->size_class = size_class;
+    chunk->used = POOL_CHUNK_HEADER;
+    pool->chunks = chunk;
+    pool->current[size_class] = chunk;
+    return chunk;
+}
+
+static void pool_init(Pool* pool, StackVM* owner) {
+    memset(pool, 0, sizeof(Pool));
+    pool->owner = owner;
+    pool->external.prev = pool->external.next = &pool->external;
+}
+
+// 在池外分配 size 字节并登记到池的链表中（失败返回 NULL）
+static void* pool_external_alloc(Pool* pool, size_t size) {
+    PoolExternal* block = malloc(sizeof(PoolExternal) + size);
+    if (!block) {
+        return NULL;
+    }
+    block->prev = &pool->external;
+    block->next = pool->external.next;
+    pool->external.next->prev = block;
+    pool->external.next = block;
+    return block + 1;
+}
+
+// 调整池外存储的大小（ptr 为 NULL 时等同于分配），失败时原存储不变并返回 NULL
+static void* pool_external_realloc(Pool* pool, void* ptr, size_t size) {
+    if (!ptr) {
+        return pool_external_alloc(pool, size);
+    }
+    PoolExternal* grown = realloc((PoolExternal*)ptr - 1, sizeof(PoolExternal) + size);
+    if (!grown) {
+        return NULL;
+    }
+    grown->prev->next = grown;
+    grown->next->prev = grown;
+    return grown + 1;
+}
+
+// 释放池外存储（不需要知道所属的池）
+static void pool_external_free(void* ptr) {
+    if (!ptr) return;
+    PoolExternal* block = (PoolExternal*)ptr - 1;
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    free(block);
+}
+
+// 释放链表中剩下的全部池外存储
+static void pool_external_release(Pool* pool) {
+    PoolExternal* block = pool->external.next;
+    while (block != &pool->external) {
+        PoolExternal* next = block->next;
+        free(block);
+        block = next;
+    }
+    pool->external.prev = pool->external.next = &pool->external;
+}
+
+static void pool_free_chunks(PoolChunk* chunk) {
+    while (chunk) {
+        PoolChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+// 整体释放池中的全部内存块和池外存储（其中仍在使用的块随之失效）
+static void pool_destroy(Pool* pool) {
+    pool_external_release(pool);
+    pool_free_chunks(pool->chunks);
+    pool_free_chunks(pool->spare);
+    pool_init(pool, pool->owner);
+}
+
+// 整体回收池中的全部块（池外存储直接释放）但保留内存块，之后的分配重新从这些内存块切分（可改为任意一级）
+static void pool_recycle(Pool* pool) {
+    pool_external_release(pool);
+    while (pool->chunks) {
+        PoolChunk* chunk = pool->chunks;
+        pool->chunks = chunk->next;
+        chunk->next = pool->spare;
+        pool->spare = chunk;
+    }
+    memset(pool->free_lists, 0, sizeof(pool->free_lists));
+    memset(pool->current, 0, sizeof(pool->current));
+    pool->stats.live_blocks = 0;
+}
+
+// 分配不超过 POOL_MAX_BLOCK 字节的内存：优先复用空闲链表，其次从本级内存块切分
+void* pool_alloc(Pool* pool, size_t size) {
+    int size_class = pool_class_of(pool, size);
+    pool->stats.alloc_count++;
+    pool->stats.live_blocks++;
+    PoolBlock* block = pool->free_lists[size_class];
+    if (block) {
+        pool->free_lists[size_class] = block->next;
+        return block;
+    }
+    size_t block_size = pool_class_sizes[size_class];
+    PoolChunk* chunk = pool->current[size_class];
+    if (!chunk || chunk->used + block_size > POOL_CHUNK_SIZE) {
+        chunk = pool_new_chunk(pool, size_class);
+    }
+    void* ptr = (char*)chunk + chunk->used;
+    chunk->used += block_size;
+    return ptr;
+}
+
+// 归还 pool_alloc 分配的内存
+void pool_free(void* ptr) {
+    if (!ptr) return;
+    PoolChunk* chunk = (PoolChunk*)((uintptr_t)ptr & ~(uintptr_t)(POOL_CHUNK_SIZE - 1));
+    Pool* pool = chunk->pool;
+    PoolBlock* block = (PoolBlock*)ptr;
+    block->next = pool->free_lists[chunk->size_class];
+    pool->free_lists[chunk->size_class] = block;
+    pool->stats.free_count++;
+    pool->stats.live_blocks--;
+}
+
+// 池中的块所属的虚拟机（用于只拿到对象、没有虚拟机指针的地方报告错误）
+static StackVM* pool_owner(const void* ptr) {
+    const PoolChunk* chunk = (const PoolChunk*)((uintptr_t)ptr & ~(uintptr_t)(POOL_CHUNK_SIZE - 1));
+    return chunk->pool->owner;
+}
+
+#ifdef VM_TRACING_GC
+// pool_alloc 分配的块的实际大小
+static size_t pool_block_size(const void* ptr) {
+    const PoolChunk* chunk = (const PoolChunk*)((uintptr_t)ptr & ~(uintptr_t)(POOL_CHUNK_SIZE - 1));
+    return pool_class_sizes[chunk->size_class];
+}
+#endif
+
+// 读取虚拟机内存池的统计信息
+void vm_pool_stats(const StackVM* vm, PoolStats* stats) {
+    *stats = vm->pool.stats;
+}
 
 // --------------- 内存管理工具函数 ---------------
-// 创建对象头
-ObjectHeader* create_object(ValueType type, size_t size) {
-    ObjectHeader* obj = malloc(size);
-    if (!obj) {
-        fprintf(stderr, "内存分配失败！\n");
-        exit(1);
+#ifdef VM_TRACING_GC
+// 追踪模式下对象和环境分配后登记到回收器，分配量达到阈值时请求一次回收
+static void gc_track(StackVM* vm, size_t size) {
+    vm->gc_stats.bytes_allocated += size;
+    if (vm->gc_stats.bytes_allocated >= vm->next_gc) {
+        vm->gc_pending = true;
     }
+}
+#endif
+
+// 创建对象头（从虚拟机的内存池分配）
+ObjectHeader* create_object(StackVM* vm, ValueType type, size_t size) {
+    ObjectHeader* obj = pool_alloc(&vm->pool, size);
+#ifdef VM_TRACING_GC
+    obj->marked = false;
+    obj->gc_next = vm->objects;
+    vm->objects = obj;
+    gc_track(vm, pool_block_size(obj));
+#else
     obj->ref_count = 1;
+#endif
     obj->type = type;
     return obj;
 }
 
+// 对象的属性数（槽位数组中有效值的个数）
+static inline int object_prop_count(const Object* obj) {
+    return obj->dict ? obj->dict->count : obj->shape->slot_count;
+}
+
+// 释放对象在内存池之外的存储（长字符串的内容、对象的槽位数组）和对象本身
+static void object_destroy(ObjectHeader* obj) {
+    if (obj->type == VAL_STRING) {
+        StringObject* str_obj = (StringObject*)obj;
+        // 短字符串的内容紧跟在对象头之后，与对象一起分配
+        if (str_obj->chars != (char*)(str_obj + 1)) {
+            pool_external_free(str_obj->chars);
+        }
+    } else if (obj->type == VAL_OBJECT) {
+        pool_external_free(((Object*)obj)->slots);
+        pool_external_free(((Object*)obj)->dict);
+    }
+    pool_free(obj);
+}
+
+#ifdef VM_TRACING_GC
+// 追踪模式下不维护引用计数
+#define gc_inc_ref(obj) ((void)(obj))
+#define gc_dec_ref(obj) ((void)(obj))
+#else
 // 增加引用计数
 void gc_inc_ref(ObjectHeader* obj) {
     if (obj) obj->ref_count++;
 }
 
 // 减少引用计数，如果引用为0则释放
+// （绳索的左子串沿循环释放，反复追加得到的很深的左链不会耗尽 C 栈）
 void gc_dec_ref(ObjectHeader* obj) {
-    if (!obj) return;
-    if (--obj->ref_count == 0) {
+    while (obj && --obj->ref_count == 0) {
+        ObjectHeader* next = NULL;
         switch (obj->type) {
             case VAL_STRING: {
                 StringObject* str_obj = (StringObject*)obj;
-                free(str_obj->chars);
+                if (STRING_IS_ROPE(str_obj)) {
+                    gc_dec_ref((ObjectHeader*)str_obj->right);
+                    next = (ObjectHeader*)str_obj->left;
+                }
                 break;
             }
             case VAL_OBJECT: {
                 Object* obj_obj = (Object*)obj;
-                for (int i = 0; i < obj_obj->property_count; i++) {
-                    free(obj_obj->prop_names[i]);
-                    val_free(obj_obj->prop_values[i]);
+                // 属性名保存在形状（或属性表）中，都是驻留字符串
+                for (int i = 0; i < object_prop_count(obj_obj); i++) {
+                    val_free(obj_obj->slots[i]);
                 }
-                free(obj_obj->prop_names);
-                free(obj_obj->prop_values);
+                break;
+            }
+            case VAL_FUNCTION: {
+                FunctionObject* fn_obj = (FunctionObject*)obj;
+                free_env(fn_obj->env);
                 break;
             }
             default:
                 break;
         }
-        free(obj);
+        object_destroy(obj);
+        obj = next;
     }
 }
+#endif
 
 // --------------- 工具函数（类型创建/销毁、变量查找）---------------
-Value val_number(double num) {
-    Value v = {.type = VAL_NUMBER};
-    v.data.number = num;
-    return v;
+// 分配长度为 length 的字符串对象，内容由调用者填写（末尾的 '\0' 已写好）。
+// 放得进内存池的短字符串把内容和对象头分配在同一块中
+static StringObject* alloc_string(StackVM* vm, size_t length) {
+    size_t inline_size = sizeof(StringObject) + length + 1;
+    bool inline_chars = inline_size <= POOL_MAX_BLOCK;
+    StringObject* str_obj = (StringObject*)create_object(vm, VAL_STRING,
+                                                         inline_chars ? inline_size : sizeof(StringObject));
+    str_obj->chars = inline_chars ? (char*)(str_obj + 1) : pool_external_alloc(&vm->pool, length + 1);
+    if (!str_obj->chars) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    str_obj->chars[length] = '\0';
+    str_obj->length = length;
+    str_obj->hash = 0;
+    str_obj->left = str_obj->right = NULL;
+    return str_obj;
+}
+
+// 拼接两个字符串（结果是新的引用，或者在一方为空时直接是另一方）：
+// 短结果直接复制；长结果只创建引用两个子串的绳索节点，O(1) 完成，
+// 反复 s = s + x 时不再每次复制整个前缀
+static StringObject* string_concat(StackVM* vm, StringObject* a, StringObject* b) {
+    if (a->length == 0) return b;
+    if (b->length == 0) return a;
+    size_t length = a->length + b->length;
+    if (length < STRING_ROPE_MIN_LENGTH) {
+        // 两个子串都比阈值短，一定是平坦字符串
+        StringObject* str_obj = alloc_string(vm, length);
+        memcpy(str_obj->chars, a->chars, a->length);
+        memcpy(str_obj->chars + a->length, b->chars, b->length);
+        str_obj->hash = hash_string(str_obj->chars, length);
+        return str_obj;
+    }
+    StringObject* rope = (StringObject*)create_object(vm, VAL_STRING, sizeof(StringObject));
+    rope->hash = 0;
+    rope->length = length;
+    rope->chars = NULL;
+    rope->left = a;
+    rope->right = b;
+    gc_inc_ref((ObjectHeader*)a);
+    gc_inc_ref((ObjectHeader*)b);
+    return rope;
+}
+
+// 展平绳索节点：用显式栈从右向左把叶子复制进新缓冲区，然后释放对子串的引用
+static void string_flatten(StringObject* str) {
+    char* chars = pool_external_alloc(&pool_owner(str)->pool, str->length + 1);
+    int capacity = 16;
+    int count = 0;
+    StringObject** pending = malloc(sizeof(StringObject*) * capacity);
+    if (!chars || !pending) {
+        pool_external_free(chars);
+        free(pending);
+        vm_error(pool_owner(str), VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    size_t pos = str->length;
+    chars[pos] = '\0';
+    pending[count++] = str;
+    while (count > 0) {
+        StringObject* node = pending[--count];
+        if (!STRING_IS_ROPE(node)) {
+            pos -= node->length;
+            memcpy(chars + pos, node->chars, node->length);
+            continue;
+        }
+        if (count + 2 > capacity) {
+            capacity *= 2;
+            StringObject** grown = realloc(pending, sizeof(StringObject*) * capacity);
+            if (!grown) {
+                pool_external_free(chars);
+                free(pending);
+                vm_error(pool_owner(str), VM_ERROR_MEMORY, "内存分配失败！");
+            }
+            pending = grown;
+        }
+        // 先压左子串，右子串先出栈、先写入末尾
+        pending[count++] = node->left;
+        pending[count++] = node->right;
+    }
+    free(pending);
+    StringObject* left = str->left;
+    StringObject* right = str->right;
+    str->chars = chars;
+    str->hash = hash_string(chars, str->length);
+    str->left = str->right = NULL;
+    gc_dec_ref((ObjectHeader*)left);
+    gc_dec_ref((ObjectHeader*)right);
+}
+
+const char* string_chars(StringObject* str) {
+    if (STRING_IS_ROPE(str)) {
+        string_flatten(str);
+    }
+    return str->chars;
+}
+
+// 按内容创建字符串对象
+static StringObject* alloc_string_copy(StackVM* vm, const char* chars, size_t length, uint32_t hash) {
+    StringObject* str_obj = alloc_string(vm, length);
+    memcpy(str_obj->chars, chars, length);
+    str_obj->hash = hash;
+    return str_obj;
+}
+
+Value val_string(StackVM* vm, const char* str) {
+    size_t len = strlen(str);
+    return val_obj((ObjectHeader*)alloc_string_copy(vm, str, len, hash_string(str, len)));
+}
+
+// 创建一个新对象（初始为空形状）
+Value val_object(StackVM* vm) {
+    Object* obj = (Object*)create_object(vm, VAL_OBJECT, sizeof(Object));
+    obj->shape = vm->root_shape;
+    obj->slots = NULL;
+    obj->slot_capacity = 0;
+    obj->dict = NULL;
+    return val_obj((ObjectHeader*)obj);
+}
+
+#ifndef VM_TRACING_GC
+// 释放值
+void val_free(Value v) {
+    if (IS_HEAP_VALUE(v)) {
+        gc_dec_ref(AS_OBJ(v));
+    }
+}
+#endif
+
+// --------------- 字符串驻留表 ---------------
+// FNV-1a 哈希
+uint32_t hash_string(const char* chars, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)chars[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void table_init(StringTable* table) {
+    table->entries = NULL;
+    table->count = 0;
+    table->capacity = 0;
+}
+
+// 查找内容相同的字符串，返回其所在槽（空槽表示不存在）
+static StringObject** table_find(StringObject** entries, int capacity,
+                                 const char* chars, size_t length, uint32_t hash) {
+    uint32_t index = hash & (capacity - 1);
+    while (true) {
+        StringObject* entry = entries[index];
+        if (entry == NULL ||
+            (entry->hash == hash && entry->length == length &&
+             memcmp(entry->chars, chars, length) == 0)) {
+            return &entries[index];
+        }
+        index = (index + 1) & (capacity - 1);
+    }
 }
 
-Value val_boolean(bool b) {
-    Value v = {.type = VAL_BOOLEAN};
-    v.data.boolean = b;
-    return v;
+// 扩容并重新散列
+static void table_grow(StackVM* vm, StringTable* table) {
+    int capacity = table->capacity < 16 ? 16 : table->capacity * 2;
+    StringObject** entries = calloc(capacity, sizeof(StringObject*));
+    if (!entries) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    for (int i = 0; i < table->capacity; i++) {
+        StringObject* entry = table->entries[i];
+        if (entry) {
+            *table_find(entries, capacity, entry->chars, entry->length, entry->hash) = entry;
+        }
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+// 释放驻留表及其中的全部字符串
+static void table_free(StringTable* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        StringObject* entry = table->entries[i];
+#ifndef VM_TRACING_GC
+        // 追踪模式下驻留字符串与其他对象一起登记在回收器中，由回收器释放
+        if (entry) {
+            if (entry->chars != (char*)(entry + 1)) {
+                pool_external_free(entry->chars);
+            }
+            pool_free(entry);
+        }
+#else
+        (void)entry;
+#endif
+    }
+    free(table->entries);
+    table_init(table);
+}
+
+// 驻留字符串：内容相同的字符串返回同一个对象
+StringObject* vm_intern(StackVM* vm, const char* chars, size_t length) {
+    StringTable* table = &vm->strings;
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        table_grow(vm, table);
+    }
+    uint32_t hash = hash_string(chars, length);
+    StringObject** slot = table_find(table->entries, table->capacity, chars, length, hash);
+    if (*slot == NULL) {
+        *slot = alloc_string_copy(vm, chars, length, hash);
+        table->count++;
+    }
+    return *slot;
+}
+
+// 数值转字符串（按 "%.2f" 格式，见 vm_format_number），结果缓存在虚拟机中；缓存持有字符串的一个引用
+static StringObject* number_to_string(StackVM* vm, double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    uint32_t index = hash_string((const char*)&bits, sizeof(bits)) % NUMBER_STRING_CACHE_SIZE;
+    NumberString* entry = &vm->number_strings[index];
+    if (entry->string && entry->bits == bits) {
+        return entry->string;
+    }
+    char num_str[VM_NUMBER_TEXT_SIZE];
+    int len = vm_format_number(num_str, sizeof(num_str), number, true);
+    gc_dec_ref((ObjectHeader*)entry->string);
+    entry->bits = bits;
+    entry->string = alloc_string_copy(vm, num_str, (size_t)len, hash_string(num_str, (size_t)len));
+    return entry->string;
+}
+
+// 把加法的操作数转换为字符串（类似 JS 隐式转换；返回的字符串不转移引用）
+static StringObject* value_to_string(StackVM* vm, Value v) {
+    const char* text;
+    switch (VAL_TYPE(v)) {
+        case VAL_STRING:    return (StringObject*)AS_OBJ(v);
+        case VAL_NUMBER:    return number_to_string(vm, AS_NUMBER(v));
+        case VAL_BOOLEAN:   text = AS_BOOL(v) ? "true" : "false"; break;
+        case VAL_UNDEFINED: text = "undefined"; break;
+        case VAL_NULL:      text = "null"; break;
+        default:            text = "[object Object]"; break;
+    }
+    return vm_intern(vm, text, strlen(text));
+}
+
+// --------------- 算术与比较 ---------------
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// 转换为数值（类似 JS 的 Number()）：布尔值为 0/1，null 为 0，undefined、对象和函数为 NaN；
+// 字符串去掉首尾空白后整体是一个数（strtod 的十进制或 0x 十六进制形式）时取其值，空串为 0，否则为 NaN
+static double value_to_number(Value v) {
+    switch (VAL_TYPE(v)) {
+        case VAL_NUMBER:  return AS_NUMBER(v);
+        case VAL_BOOLEAN: return AS_BOOL(v) ? 1 : 0;
+        case VAL_NULL:    return 0;
+        case VAL_STRING: {
+            const char* chars = string_chars((StringObject*)AS_OBJ(v));
+            while (is_space(*chars)) chars++;
+            if (*chars == '\0') {
+                return 0;
+            }
+            // strtod 还接受 inf/nan 等写法，要求符号之后是数字或小数点
+            char first = *chars == '+' || *chars == '-' ? chars[1] : chars[0];
+            if ((first < '0' || first > '9') && first != '.') {
+                return NAN;
+            }
+            char* end;
+            double number = strtod(chars, &end);
+            while (is_space(*end)) end++;
+            return *end == '\0' ? number : NAN;
+        }
+        default:
+            return NAN;
+    }
+}
+
+// 两个字符串按字节序比较，返回负数、0 或正数
+static int string_compare(StringObject* a, StringObject* b) {
+    if (a == b) {
+        return 0;
+    }
+    const char* chars_a = string_chars(a);
+    const char* chars_b = string_chars(b);
+    int order = memcmp(chars_a, chars_b, a->length < b->length ? a->length : b->length);
+    if (order != 0) {
+        return order;
+    }
+    return a->length < b->length ? -1 : a->length > b->length;
+}
+
+// 严格相等：类型相同且值相同（字符串比较内容，对象和函数比较身份，NaN 不等于自身）
+static bool values_strict_equal(Value a, Value b) {
+    ValueType type = VAL_TYPE(a);
+    if (type != VAL_TYPE(b)) {
+        return false;
+    }
+    switch (type) {
+        case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_BOOLEAN:   return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_UNDEFINED:
+        case VAL_NULL:      return true;
+        case VAL_STRING: {
+            StringObject* str_a = (StringObject*)AS_OBJ(a);
+            StringObject* str_b = (StringObject*)AS_OBJ(b);
+            return str_a->length == str_b->length && string_compare(str_a, str_b) == 0;
+        }
+        default:            return AS_OBJ(a) == AS_OBJ(b);
+    }
+}
+
+// 宽松相等：类型相同时同严格相等；null 与 undefined 只彼此相等；
+// 数值、字符串和布尔值之间转换为数值比较；对象和函数只与自身相等
+static bool values_loose_equal(Value a, Value b) {
+    ValueType type_a = VAL_TYPE(a);
+    ValueType type_b = VAL_TYPE(b);
+    if (type_a == type_b) {
+        return values_strict_equal(a, b);
+    }
+    bool nullish_a = type_a == VAL_NULL || type_a == VAL_UNDEFINED;
+    bool nullish_b = type_b == VAL_NULL || type_b == VAL_UNDEFINED;
+    if (nullish_a || nullish_b) {
+        return nullish_a && nullish_b;
+    }
+    if (type_a == VAL_OBJECT || type_a == VAL_FUNCTION || type_b == VAL_OBJECT || type_b == VAL_FUNCTION) {
+        return false;
+    }
+    return value_to_number(a) == value_to_number(b);
+}
+
+// 减乘除与比较的通用实现（op 为模块中的通用指令），结果不含堆对象
+static Value binary_op(uint8_t op, Value a, Value b) {
+    switch (op) {
+        case OP_SUB:       return val_number(value_to_number(a) - value_to_number(b));
+        case OP_MUL:       return val_number(value_to_number(a) * value_to_number(b));
+        case OP_DIV:       return val_number(value_to_number(a) / value_to_number(b));
+        case OP_EQ:        return val_boolean(values_loose_equal(a, b));
+        case OP_NE:        return val_boolean(!values_loose_equal(a, b));
+        case OP_STRICT_EQ: return val_boolean(values_strict_equal(a, b));
+        case OP_STRICT_NE: return val_boolean(!values_strict_equal(a, b));
+        default:
+            break;
+    }
+    // 大小比较：两个字符串按字节序，其余转换为数值（有 NaN 时结果为 false）
+    if (IS_STRING(a) && IS_STRING(b)) {
+        int order = string_compare((StringObject*)AS_OBJ(a), (StringObject*)AS_OBJ(b));
+        switch (op) {
+            case OP_LT: return val_boolean(order < 0);
+            case OP_LE: return val_boolean(order <= 0);
+            case OP_GT: return val_boolean(order > 0);
+            default:    return val_boolean(order >= 0);
+        }
+    }
+    double x = value_to_number(a);
+    double y = value_to_number(b);
+    switch (op) {
+        case OP_LT: return val_boolean(x < y);
+        case OP_LE: return val_boolean(x <= y);
+        case OP_GT: return val_boolean(x > y);
+        default:    return val_boolean(x >= y);
+    }
+}
+
+// --------------- 隐藏类（Shape）---------------
+// 创建形状节点并挂到父节点的转换链表上
+static Shape* shape_new(StackVM* vm, Shape* parent, StringObject* key) {
+    Shape* shape = malloc(sizeof(Shape));
+    if (!shape) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    shape->id = vm->next_shape_id++;
+    shape->parent = parent;
+    shape->key = key;
+    shape->slot_count = parent ? parent->slot_count + 1 : 0;
+    shape->children = NULL;
+    shape->next_sibling = NULL;
+    shape->child_count = 0;
+    if (parent) {
+        shape->next_sibling = parent->children;
+        parent->children = shape;
+        parent->child_count++;
+    }
+    return shape;
+}
+
+// 在形状上新增属性，得到（或复用）对应的子形状。属性太多或者形状树在这里分叉太多时
+// 返回 NULL：这样的对象多半被当作查找表使用，继续增加形状只会让内联缓存失效，改用字典模式
+static Shape* shape_add_property(StackVM* vm, Shape* shape, StringObject* key) {
+    if (shape->slot_count >= OBJECT_DICT_THRESHOLD) {
+        return NULL;
+    }
+    for (Shape* child = shape->children; child != NULL; child = child->next_sibling) {
+        if (child->key == key) {
+            return child;
+        }
+    }
+    if (shape->child_count >= SHAPE_MAX_TRANSITIONS) {
+        return NULL;
+    }
+    return shape_new(vm, shape, key);
+}
+
+// 查找属性所在槽位，不存在返回 -1
+static int shape_lookup(Shape* shape, StringObject* key) {
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->key == key) {
+            return shape->slot_count - 1;
+        }
+    }
+    return -1;
+}
+
+// 释放整棵转换子树
+static void shape_free(Shape* shape) {
+    Shape* child = shape->children;
+    while (child != NULL) {
+        Shape* next = child->next_sibling;
+        shape_free(child);
+        child = next;
+    }
+    free(shape);
+}
+
+// --------------- 字典模式的对象 ---------------
+// 控制字节按组读成一个 64 位整数，用位运算同时比较一组中的每个字节（不依赖特定指令集）
+#define DICT_LO 0x0101010101010101ull
+#define DICT_HI 0x8080808080808080ull
+
+static inline uint64_t dict_group(const PropertyDict* dict, uint32_t pos) {
+    uint64_t group;
+    memcpy(&group, &dict->control[pos], sizeof(group));
+    return group;
+}
+
+// 组中等于 tag 的字节的最高位置 1（可能误报紧跟在真正匹配之后的字节，调用方会比较属性名）
+static inline uint64_t dict_match(uint64_t group, uint8_t tag) {
+    uint64_t x = group ^ (DICT_LO * tag);
+    return (x - DICT_LO) & ~x & DICT_HI;
+}
+
+// 最高位置 1 的字节即为空位（已占用的位置只存 7 位标记）
+static inline uint64_t dict_match_empty(uint64_t group) {
+    return group & DICT_HI;
+}
+
+// 组内第一个置位的字节序号（控制字节按地址顺序读入，小端和大端分别从低位和高位开始）
+static inline int dict_first(uint64_t match) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_clzll(match) / 8;
+#else
+    return __builtin_ctzll(match) / 8;
+#endif
+}
+
+static inline uint64_t dict_next(uint64_t match) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return match & ~(1ull << (63 - __builtin_clzll(match)));
+#else
+    return match & (match - 1);
+#endif
+}
+
+// 属性的槽位下标，不存在返回 -1
+static int dict_find(const PropertyDict* dict, const StringObject* key) {
+    uint8_t tag = key->hash & 0x7F;
+    for (uint32_t pos = (key->hash >> 7) & dict->mask;; pos = (pos + DICT_GROUP) & dict->mask) {
+        uint64_t group = dict_group(dict, pos);
+        for (uint64_t match = dict_match(group, tag); match; match = dict_next(match)) {
+            uint32_t i = (pos + dict_first(match)) & dict->mask;
+            if (dict->keys[i] == key) {
+                return dict->slots[i];
+            }
+        }
+        if (dict_match_empty(group)) {
+            return -1;
+        }
+    }
+}
+
+// 把一个不在表中的属性放到第一个空位（表中一定有空位）
+static void dict_insert(PropertyDict* dict, StringObject* key, int slot) {
+    uint32_t pos = (key->hash >> 7) & dict->mask;
+    uint64_t empty;
+    while (!(empty = dict_match_empty(dict_group(dict, pos)))) {
+        pos = (pos + DICT_GROUP) & dict->mask;
+    }
+    uint32_t i = (pos + dict_first(empty)) & dict->mask;
+    uint8_t tag = key->hash & 0x7F;
+    dict->control[i] = tag;
+    if (i < DICT_GROUP) {
+        dict->control[dict->mask + 1 + i] = tag;
+    }
+    dict->keys[i] = key;
+    dict->slots[i] = slot;
+    dict->count++;
+}
+
+// 分配容量为 capacity（2 的幂，不小于 DICT_GROUP）的空表，控制字节、属性名、下标放在同一块中
+static PropertyDict* dict_new(StackVM* vm, uint32_t capacity) {
+    size_t control_size = (capacity + DICT_GROUP + 7) & ~(size_t)7;
+    PropertyDict* dict = pool_external_alloc(&vm->pool, sizeof(PropertyDict) + capacity * (sizeof(StringObject*) + sizeof(int32_t)) +
+                                control_size);
+    if (!dict) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    dict->keys = (StringObject**)(dict + 1);
+    dict->slots = (int32_t*)(dict->keys + capacity);
+    dict->control = (uint8_t*)(dict->slots + capacity);
+    memset(dict->control, DICT_EMPTY, capacity + DICT_GROUP);
+    dict->mask = capacity - 1;
+    dict->count = 0;
+    return dict;
+}
+
+// 对象转为字典模式：沿形状链取出各槽位的属性名建表，属性值留在原来的槽位中
+static void object_to_dict(StackVM* vm, Object* obj) {
+    uint32_t capacity = 2 * DICT_GROUP;
+    while (capacity < 2 * (uint32_t)obj->shape->slot_count) {
+        capacity *= 2;
+    }
+    PropertyDict* dict = dict_new(vm, capacity);
+    for (Shape* shape = obj->shape; shape->parent != NULL; shape = shape->parent) {
+        dict_insert(dict, shape->key, shape->slot_count - 1);
+    }
+    obj->dict = dict;
+    obj->shape = vm->dict_shape;
+}
+
+// 字典模式下设置属性（对象持有值的一个新引用）。表的装载率超过 7/8 时容量翻倍并重新插入
+static void dict_set(StackVM* vm, Object* obj, StringObject* key, Value value) {
+    PropertyDict* dict = obj->dict;
+    int slot = dict_find(dict, key);
+    if (IS_HEAP_VALUE(value)) {
+        gc_inc_ref(AS_OBJ(value));
+    }
+    if (slot >= 0) {
+        val_free(obj->slots[slot]);
+        obj->slots[slot] = value;
+        return;
+    }
+    if ((uint32_t)(dict->count + 1) * 8 > (dict->mask + 1) * 7) {
+        PropertyDict* grown = dict_new(vm, (dict->mask + 1) * 2);
+        for (uint32_t i = 0; i <= dict->mask; i++) {
+            if (dict->control[i] != DICT_EMPTY) {
+                dict_insert(grown, dict->keys[i], dict->slots[i]);
+            }
+        }
+        pool_external_free(dict);
+        obj->dict = dict = grown;
+    }
+    slot = dict->count;
+    if (slot >= obj->slot_capacity) {
+        int capacity = obj->slot_capacity < 4 ? 4 : obj->slot_capacity * 2;
+        Value* slots = pool_external_realloc(&vm->pool, obj->slots, capacity * sizeof(Value));
+        if (!slots) {
+            vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+        }
+        obj->slots = slots;
+        obj->slot_capacity = capacity;
+    }
+    dict_insert(dict, key, slot);
+    obj->slots[slot] = value;
+}
+
+// --------------- 属性内联缓存 ---------------
+// 按形状 id 查找缓存项
+static InlineCacheEntry* ic_find(InlineCache* ic, int shape_id) {
+    for (int i = 0; i < ic->count; i++) {
+        if (ic->entries[i].shape_id == shape_id) {
+            return &ic->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// 记录一个新形状，缓存已满时转为超多态，之后不再缓存
+static void ic_record(InlineCache* ic, int shape_id, int slot, Shape* next_shape) {
+    if (ic->count < 0) return;
+    if (ic->count == IC_WAYS) {
+        ic->count = -1;
+        return;
+    }
+    InlineCacheEntry* entry = &ic->entries[ic->count++];
+    entry->shape_id = shape_id;
+    entry->slot = slot;
+    entry->next_shape = next_shape;
+}
+
+// 读取 2 字节小端整数
+static uint16_t read_u16(const uint8_t* bytecode, int ip) {
+    return (uint16_t)(bytecode[ip] | (bytecode[ip + 1] << 8));
+}
+
+// 变量在环境中的下标，不存在返回 -1（变量名都是驻留字符串，比较指针即可）
+static inline int env_find(const Env* env, const StringObject* name) {
+    if (env->index) {
+        for (uint32_t i = name->hash & env->index_mask;; i = (i + 1) & env->index_mask) {
+            int32_t entry = env->index[i];
+            if (entry == 0) {
+                return -1;
+            }
+            if (env->names[entry - 1] == name) {
+                return entry - 1;
+            }
+        }
+    }
+    if (env->names) {
+        for (int i = 0; i < env->var_count; i++) {
+            if (env->names[i] == name) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// 查找变量（沿作用域链查找，不存在返回undefined）
+Value env_get(Env* env, StringObject* name) {
+    for (Env* current = env; current != NULL; current = current->parent) {
+        int i = env_find(current, name);
+        if (i >= 0) {
+            Value val = current->values[i];
+            // 增加引用计数，因为返回的是新的引用
+            if (IS_HEAP_VALUE(val)) {
+                gc_inc_ref(AS_OBJ(val));
+            }
+            return val;
+        }
+    }
+    return val_undefined();
+}
+
+static void env_index_insert(Env* env, int slot) {
+    uint32_t i = env->names[slot]->hash & env->index_mask;
+    while (env->index[i] != 0) {
+        i = (i + 1) & env->index_mask;
+    }
+    env->index[i] = slot + 1;
+}
+
+// 变量存放在池外时释放（内联的变量随环境一起归还内存池）
+static void env_free_storage(Env* env) {
+    if (env->values != (Value*)(env + 1)) {
+        pool_external_free(env->values);
+    }
+}
+
+// 按名字访问的环境已满：变量搬到池外两倍大的存储（值、名字、索引依次相连）并重建索引，
+// 索引容量为变量容量的两倍，装载率不超过 1/2
+static void env_grow(Env* env) {
+    int capacity = env->capacity * 2;
+    size_t index_size = (size_t)capacity * 2;
+    Value* values = pool_external_alloc(&pool_owner(env)->pool,
+                                        (size_t)capacity * (sizeof(Value) + sizeof(StringObject*)) +
+                                        index_size * sizeof(int32_t));
+    if (!values) {
+        vm_error(pool_owner(env), VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    StringObject** names = (StringObject**)(values + capacity);
+    int32_t* index = (int32_t*)(names + capacity);
+    memcpy(values, env->values, env->var_count * sizeof(Value));
+    memcpy(names, env->names, env->var_count * sizeof(StringObject*));
+    memset(index, 0, index_size * sizeof(int32_t));
+    env_free_storage(env);
+    env->values = values;
+    env->names = names;
+    env->index = index;
+    env->index_mask = (uint32_t)index_size - 1;
+    env->capacity = capacity;
+    for (int i = 0; i < env->var_count; i++) {
+        env_index_insert(env, i);
+    }
+}
+
+// 存储变量（只在当前环境中设置，已存在则覆盖，不存在则新增；env 须按名字访问）
+void env_set(Env* env, StringObject* name, Value val) {
+    int i = env_find(env, name);
+    if (i >= 0) {
+        val_free(env->values[i]); // 释放旧值
+        // 增加新值的引用计数，因为它被环境持有
+        if (IS_HEAP_VALUE(val)) {
+            gc_inc_ref(AS_OBJ(val));
+        }
+        env->values[i] = val;
+        return;
+    }
+    if (env->var_count == env->capacity) {
+        env_grow(env);
+    }
+    i = env->var_count++;
+    env->names[i] = name;
+    // 增加引用计数，因为它被环境持有
+    if (IS_HEAP_VALUE(val)) {
+        gc_inc_ref(AS_OBJ(val));
+    }
+    env->values[i] = val;
+    if (env->index) {
+        env_index_insert(env, i);
+    }
+}
+
+// --------------- 虚拟机核心操作 ---------------
+// 分配环境（持有父环境的一个引用）：容纳得下时 capacity 个变量与结构体放在同一块中，
+// named 为 false 时只有值数组
+static Env* env_alloc(StackVM* vm, Env* parent, int capacity, bool named) {
+    size_t storage = (size_t)capacity * (sizeof(Value) + (named ? sizeof(StringObject*) : 0));
+    bool inline_vars = sizeof(Env) + storage <= POOL_MAX_BLOCK;
+    Value* values = inline_vars ? NULL : pool_external_alloc(&vm->pool, storage);
+    if (!inline_vars && !values) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    Env* env = pool_alloc(&vm->pool, inline_vars ? sizeof(Env) + storage : sizeof(Env));
+    env->values = inline_vars ? (Value*)(env + 1) : values;
+    env->names = named ? (StringObject**)(env->values + capacity) : NULL;
+    env->index = NULL;
+    env->index_mask = 0;
+    env->var_count = 0;
+    env->capacity = capacity;
+#ifdef VM_TRACING_GC
+    env->marked = false;
+    env->gc_next = vm->envs;
+    vm->envs = env;
+    gc_track(vm, pool_block_size(env));
+#else
+    env->ref_count = 1;
+    if (parent) {
+        parent->ref_count++;
+    }
+#endif
+    env->parent = parent;
+    return env;
+}
+
+// 创建按名字访问的新环境（持有父环境的一个引用）
+Env* create_env(StackVM* vm, Env* parent) {
+    return env_alloc(vm, parent, ENV_INLINE_VARS, true);
+}
+
+// 创建按槽位访问的块作用域环境（槽位由编译器静态分配，初始为 undefined）
+Env* create_slot_env(StackVM* vm, Env* parent, int slot_count) {
+    Env* env = env_alloc(vm, parent, slot_count, false);
+    for (int i = 0; i < slot_count; i++) {
+        env->values[i] = val_undefined();
+    }
+    env->var_count = slot_count;
+    return env;
+}
+
+// 沿作用域链向外走 depth 层
+static Env* env_at_depth(Env* env, int depth) {
+    while (depth-- > 0) {
+        env = env->parent;
+    }
+    return env;
+}
+
+// 按槽位读取变量（返回新的引用）
+static Value env_get_slot(Env* env, int slot) {
+    Value val = env->values[slot];
+    if (IS_HEAP_VALUE(val)) {
+        gc_inc_ref(AS_OBJ(val));
+    }
+    return val;
+}
+
+// 按槽位写入变量
+static void env_set_slot(Env* env, int slot, Value val) {
+    val_free(env->values[slot]); // 释放旧值
+    // 增加新值的引用计数，因为它被环境持有
+    if (IS_HEAP_VALUE(val)) {
+        gc_inc_ref(AS_OBJ(val));
+    }
+    env->values[slot] = val;
+}
+
+#ifndef VM_TRACING_GC
+// 释放环境的一个引用，最后一个引用释放时连同变量值一起释放，并释放对父环境的引用
+// （变量名由驻留表持有，不在这里释放）
+void free_env(Env* env) {
+    while (env && --env->ref_count == 0) {
+        Env* parent = env->parent;
+        for (int i = 0; i < env->var_count; i++) {
+            val_free(env->values[i]);
+        }
+        env_free_storage(env);
+        pool_free(env);
+        env = parent;
+    }
+}
+#endif
+
+#ifdef VM_TRACING_GC
+// --------------- 追踪式垃圾回收 ---------------
+// 非移动的标记-清除：根为值栈、当前作用域链、各调用帧保存的环境、常量池和驻留表。
+// 解释器在寄存器和局部变量中持有对象的裸指针，因此对象从不移动，只在安全点
+// （分配前、弹出操作数之前）才会回收
+
+// 标记对象并压入灰色栈，稍后扫描其引用
+static void gc_mark_object(StackVM* vm, ObjectHeader* obj) {
+    if (!obj || obj->marked) return;
+    obj->marked = true;
+    // 平坦字符串不引用其他对象，无需扫描
+    if (obj->type == VAL_STRING && !STRING_IS_ROPE((StringObject*)obj)) return;
+    if (vm->gray_count >= vm->gray_capacity) {
+        int capacity = vm->gray_capacity ? vm->gray_capacity * 2 : 64;
+        ObjectHeader** gray = realloc(vm->gray, (size_t)capacity * sizeof(ObjectHeader*));
+        if (!gray) {
+            vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+        }
+        vm->gray = gray;
+        vm->gray_capacity = capacity;
+    }
+    vm->gray[vm->gray_count++] = obj;
+}
+
+static void gc_mark_value(StackVM* vm, Value v) {
+    if (IS_HEAP_VALUE(v)) {
+        gc_mark_object(vm, AS_OBJ(v));
+    }
+}
+
+// 沿父链标记环境及其中的变量值（遇到已标记的环境即停止，其祖先必已标记）
+static void gc_mark_env(StackVM* vm, Env* env) {
+    while (env && !env->marked) {
+        env->marked = true;
+        for (int i = 0; i < env->var_count; i++) {
+            if (env->names) {
+                gc_mark_object(vm, (ObjectHeader*)env->names[i]);
+            }
+            gc_mark_value(vm, env->values[i]);
+        }
+        env = env->parent;
+    }
+}
+
+static void gc_mark_roots(StackVM* vm) {
+    for (int i = 0; i < vm->sp; i++) {
+        gc_mark_value(vm, vm->stack[i]);
+    }
+    gc_mark_env(vm, vm->global_env);
+    gc_mark_env(vm, vm->current_env);
+    for (int i = 0; i < vm->call_sp; i++) {
+        gc_mark_env(vm, vm->call_stack[i].saved_env);
+    }
+    if (vm->module) {
+        for (uint32_t i = 0; i < vm->module->constant_count; i++) {
+            gc_mark_value(vm, vm->constants[i]);
+        }
+    }
+    for (int i = 0; i < NUMBER_STRING_CACHE_SIZE; i++) {
+        gc_mark_object(vm, (ObjectHeader*)vm->number_strings[i].string);
+    }
+    // 驻留字符串还被形状和内联缓存引用，始终存活
+    for (int i = 0; i < vm->strings.capacity; i++) {
+        gc_mark_object(vm, (ObjectHeader*)vm->strings.entries[i]);
+    }
+}
+
+// 扫描灰色对象引用的对象，直到灰色栈为空
+static void gc_trace(StackVM* vm) {
+    while (vm->gray_count > 0) {
+        ObjectHeader* obj = vm->gray[--vm->gray_count];
+        if (obj->type == VAL_OBJECT) {
+            Object* object = (Object*)obj;
+            for (int i = 0; i < object_prop_count(object); i++) {
+                gc_mark_value(vm, object->slots[i]);
+            }
+        } else if (obj->type == VAL_FUNCTION) {
+            gc_mark_env(vm, ((FunctionObject*)obj)->env);
+        } else if (obj->type == VAL_STRING) {
+            StringObject* rope = (StringObject*)obj;
+            gc_mark_object(vm, (ObjectHeader*)rope->left);
+            gc_mark_object(vm, (ObjectHeader*)rope->right);
+        }
+    }
+}
+
+// 释放未标记的对象和环境，清除存活者的标记，返回存活的字节数
+static size_t gc_sweep(StackVM* vm) {
+    size_t live = 0;
+    ObjectHeader** link = &vm->objects;
+    while (*link) {
+        ObjectHeader* obj = *link;
+        size_t size = pool_block_size(obj);
+        if (obj->marked) {
+            obj->marked = false;
+            live += size;
+            link = &obj->gc_next;
+        } else {
+            *link = obj->gc_next;
+            vm->gc_stats.freed_bytes += size;
+            object_destroy(obj);
+        }
+    }
+    Env** env_link = &vm->envs;
+    while (*env_link) {
+        Env* env = *env_link;
+        size_t size = pool_block_size(env);
+        if (env->marked) {
+            env->marked = false;
+            live += size;
+            env_link = &env->gc_next;
+        } else {
+            *env_link = env->gc_next;
+            vm->gc_stats.freed_bytes += size;
+            env_free_storage(env);
+            pool_free(env);
+        }
+    }
+    return live;
+}
+
+// 执行一次完整回收：新分配量达到存活量（至少 GC_INITIAL_THRESHOLD）时触发下一次，即堆约翻倍时回收
+void vm_gc_collect(StackVM* vm) {
+    gc_mark_roots(vm);
+    gc_trace(vm);
+    size_t live = gc_sweep(vm);
+    vm->gc_stats.collections++;
+    vm->gc_stats.live_bytes = live;
+    vm->gc_stats.bytes_allocated = 0;
+    vm->next_gc = live > GC_INITIAL_THRESHOLD ? live : GC_INITIAL_THRESHOLD;
+    vm->gc_pending = false;
+}
+
+// 读取回收器的统计信息
+void vm_gc_stats(const StackVM* vm, GCStats* stats) {
+    *stats = vm->gc_stats;
+}
+#endif
+
+// --------------- 栈内存区 ---------------
+// 值栈和调用栈各自预留一段连续的虚拟地址空间（按配置的上限），末尾再跟一页不可访问的
+// 保护页。创建时只提交初始容量对应的页面，增长时就地提交更多页面：栈地址始终不变，
+// 浅的工作负载只占用初始的几页物理内存，越界访问会落在保护页上立即出错，而不是踩坏堆
+
+// 不缓存在静态变量中：多个线程同时创建虚拟机时不共享任何可写状态
+static size_t page_size(void) {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static size_t round_to_pages(size_t bytes) {
+    size_t page = page_size();
+    return (bytes + page - 1) / page * page;
+}
+
+// 预留 bytes 字节（向上取整到页）加一页保护页，全部不可访问
+static void* region_reserve(StackVM* vm, size_t bytes) {
+    void* base = mmap(NULL, round_to_pages(bytes) + page_size(), PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        vm_error(vm, VM_ERROR_MEMORY, "无法预留栈空间！");
+    }
+    return base;
+}
+
+// 把区域开头的 bytes 字节（向上取整到页）设为可读写，返回实际提交的字节数
+static size_t region_commit(StackVM* vm, void* base, size_t bytes) {
+    size_t committed = round_to_pages(bytes);
+    if (mprotect(base, committed, PROT_READ | PROT_WRITE) != 0) {
+        vm_error(vm, VM_ERROR_MEMORY, "无法提交栈空间！");
+    }
+    return committed;
+}
+
+static void region_release(void* base, size_t bytes) {
+    if (base) {
+        munmap(base, round_to_pages(bytes) + page_size());
+    }
+}
+
+// 按倍增策略把容量扩展到至少 needed（不超过 limit），返回新的容量
+static int region_grow(StackVM* vm, void* base, int capacity, int needed, int limit, size_t elem_size) {
+    int target = capacity * 2 > needed ? capacity * 2 : needed;
+    if (target > limit) {
+        target = limit;
+    }
+    size_t committed = region_commit(vm, base, (size_t)target * elem_size);
+    int grown = (int)(committed / elem_size);
+    return grown < limit ? grown : limit;
+}
+
+// 确保值栈至少能容纳 needed 个值
+static void vm_reserve_stack(StackVM* vm, int needed) {
+    if (needed <= vm->stack_capacity) {
+        return;
+    }
+    if (needed > vm->stack_limit) {
+        vm_error(vm, VM_ERROR_STACK_OVERFLOW, "栈溢出！（需要 %d，上限 %d）", needed, vm->stack_limit);
+    }
+    vm->stack_capacity = region_grow(vm, vm->stack, vm->stack_capacity, needed, vm->stack_limit, sizeof(Value));
+}
+
+// 确保调用栈至少能容纳 needed 帧
+static void vm_reserve_calls(StackVM* vm, int needed) {
+    if (needed <= vm->call_capacity) {
+        return;
+    }
+    if (needed > vm->call_limit) {
+        vm_error(vm, VM_ERROR_STACK_OVERFLOW, "调用栈溢出！（需要 %d，上限 %d）", needed, vm->call_limit);
+    }
+    vm->call_capacity = region_grow(vm, vm->call_stack, vm->call_capacity, needed, vm->call_limit, sizeof(CallFrame));
+}
+
+// --------------- 虚拟机生命周期 ---------------
+void vm_init(StackVM* vm) {
+    vm_init_ex(vm, NULL);
+}
+
+// 初始化除错误状态之外的全部字段，失败时经 vm_error 报告
+static void vm_setup_heap(StackVM* vm);
+
+static void vm_setup(StackVM* vm, const VMConfig* config) {
+    VMConfig defaults = {0};
+    if (!config) {
+        config = &defaults;
+    }
+    int stack_size = config->stack_size > 0 ? config->stack_size : VM_DEFAULT_STACK_SIZE;
+    int max_stack_size = config->max_stack_size > 0 ? config->max_stack_size : VM_DEFAULT_MAX_STACK_SIZE;
+    int call_depth = config->call_depth > 0 ? config->call_depth : VM_DEFAULT_CALL_DEPTH;
+    int max_call_depth = config->max_call_depth > 0 ? config->max_call_depth : VM_DEFAULT_MAX_CALL_DEPTH;
+    if (stack_size > max_stack_size) {
+        max_stack_size = stack_size;
+    }
+    if (call_depth > max_call_depth) {
+        max_call_depth = call_depth;
+    }
+
+    vm->stack_limit = max_stack_size;
+    vm->stack = region_reserve(vm, (size_t)max_stack_size * sizeof(Value));
+    vm->stack_capacity = 0;
+    vm_reserve_stack(vm, stack_size);
+    vm->sp = 0;
+    vm->call_limit = max_call_depth;
+    vm->call_stack = region_reserve(vm, (size_t)max_call_depth * sizeof(CallFrame));
+    vm->call_capacity = 0;
+    vm_reserve_calls(vm, call_depth);
+    vm->call_sp = 0;
+    vm->jit_threshold = config->jit_threshold != 0 ? config->jit_threshold : VM_DEFAULT_JIT_THRESHOLD;
+    output_init(vm, config);
+    pool_init(&vm->pool, vm);
+    vm_setup_heap(vm);
+}
+
+static void output_init(StackVM* vm, const VMConfig* config) {
+    OutputSink* out = &vm->output;
+    size_t capacity = config->output_buffer_size > 0 ? config->output_buffer_size : VM_DEFAULT_OUTPUT_BUFFER;
+    out->capacity = capacity < 256 ? 256 : capacity;
+    out->data = malloc(out->capacity);
+    out->length = 0;
+    out->write = config->output;
+    out->user_data = config->output_user_data;
+    if (!out->data) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    if (config->output_flush_threshold > 0) {
+        out->flush_threshold = config->output_flush_threshold < out->capacity ?
+                               config->output_flush_threshold : out->capacity;
+    } else if (!out->write && isatty(STDOUT_FILENO)) {
+        out->flush_threshold = 1; // 交互使用时每行立即可见
+    } else {
+        out->flush_threshold = out->capacity / 2;
+    }
+}
+
+// 初始化堆上的状态：全局环境、驻留表、形状树和模块相关的字段
+static void vm_setup_heap(StackVM* vm) {
+    memset(vm->number_strings, 0, sizeof(vm->number_strings));
+#ifdef VM_TRACING_GC
+    vm->objects = NULL;
+    vm->envs = NULL;
+    vm->next_gc = GC_INITIAL_THRESHOLD;
+    vm->gc_pending = false;
+    vm->gray = NULL;
+    vm->gray_count = vm->gray_capacity = 0;
+    memset(&vm->gc_stats, 0, sizeof(GCStats));
+#endif
+    vm->global_env = create_env(vm, NULL); // 创建全局环境
+    vm->current_env = vm->global_env;
+    table_init(&vm->strings);
+    vm->module = NULL;
+    vm->entry = 0;
+    vm->constants = NULL;
+    vm->frame_sizes = NULL;
+    vm->function_scopes = NULL;
+    vm->function_scope_count = 0;
+    vm->next_shape_id = 0;
+    vm->root_shape = shape_new(vm, NULL, NULL);
+    vm->dict_shape = shape_new(vm, NULL, NULL);
+    vm->caches = NULL;
+    vm->cache_count = 0;
+    vm->code = NULL;
+    vm->quicken_budget = NULL;
+    vm->registers = NULL;
+    vm->jit = NULL;
+}
+
+// 按配置创建虚拟机（config 为 NULL 或字段为 0 时使用默认值）
+void vm_init_ex(StackVM* vm, const VMConfig* config) {
+    vm->error_jump = NULL;
+    vm->status = VM_OK;
+    vm->error[0] = '\0';
+    memset(&vm->output, 0, sizeof(vm->output));
+    vm->profile = NULL;
+    vm_setup(vm, config);
+}
+
+// 退出当前作用域链上直到 until 为止的所有块作用域
+static void vm_unwind_envs(StackVM* vm, Env* until) {
+    while (vm->current_env != until) {
+        Env* env = vm->current_env;
+        vm->current_env = env->parent;
+        free_env(env);
+    }
+}
+
+// 退出全部调用帧和块作用域并清空值栈，回到全局作用域（全局变量保留）
+static void vm_unwind(StackVM* vm) {
+    // 在函数中途结束（OP_EXIT 或出错）时逐帧退出函数内的块作用域，恢复到调用前的环境
+    while (vm->call_sp > 0) {
+        CallFrame frame = vm_ret(vm);
+        FunctionObject* callee = (FunctionObject*)AS_OBJ(vm->stack[frame.base - 1]);
+        vm_unwind_envs(vm, callee->env ? callee->env : vm->global_env);
+        vm->current_env = frame.saved_env;
+    }
+    while (vm->sp > 0) {
+        vm_pop_free(vm);
+    }
+    vm_unwind_envs(vm, vm->global_env);
+}
+
+// 释放 scopes 的前 count 项复制出的作用域链（数组本身由调用方释放）
+static void function_scopes_clear(FunctionScope* scopes, int count) {
+    for (int i = 0; scopes && i < count; i++) {
+        free(scopes[i].slot_counts);
+        scopes[i].slot_counts = NULL;
+    }
+}
+
+// 释放全部对象、环境和模块相关的数据（栈和内存池的内存块由调用方处理）
+static void vm_release_heap(StackVM* vm) {
+    vm_flush_output(vm);
+    vm_unwind(vm);
+    free_env(vm->global_env);
+    vm->global_env = vm->current_env = NULL;
+    free(vm->constants);
+    vm->constants = NULL;
+    free(vm->frame_sizes);
+    vm->frame_sizes = NULL;
+    function_scopes_clear(vm->function_scopes, vm->function_scope_count);
+    free(vm->function_scopes);
+    vm->function_scopes = NULL;
+    vm->function_scope_count = 0;
+    jit_unload(vm);
+    vm->module = NULL;
+    free(vm->caches);
+    vm->caches = NULL;
+    vm->cache_count = 0;
+    free(vm->code);
+    vm->code = NULL;
+    vm->quicken_budget = NULL;
+    reg_unload(vm);
+    shape_free(vm->root_shape);
+    vm->root_shape = NULL;
+    shape_free(vm->dict_shape);
+    vm->dict_shape = NULL;
+    for (int i = 0; i < NUMBER_STRING_CACHE_SIZE; i++) {
+        gc_dec_ref((ObjectHeader*)vm->number_strings[i].string);
+        vm->number_strings[i].string = NULL;
+    }
+#ifdef VM_TRACING_GC
+    // 没有任何根时清除一遍即释放全部对象和环境（长字符串内容和槽位数组在池外）
+    gc_sweep(vm);
+    vm->objects = NULL;
+    vm->envs = NULL;
+    free(vm->gray);
+    vm->gray = NULL;
+    vm->gray_count = vm->gray_capacity = 0;
+#endif
+    // 驻留字符串归虚拟机所有，最后统一释放
+    table_free(&vm->strings);
+}
+
+// 释放虚拟机持有的全部资源
+void vm_free(StackVM* vm) {
+    vm_release_heap(vm);
+    region_release(vm->stack, (size_t)vm->stack_limit * sizeof(Value));
+    vm->stack = NULL;
+    vm->stack_capacity = vm->stack_limit = 0;
+    region_release(vm->call_stack, (size_t)vm->call_limit * sizeof(CallFrame));
+    vm->call_stack = NULL;
+    vm->call_capacity = vm->call_limit = 0;
+    free(vm->output.data);
+    vm->output.data = NULL;
+    vm->output.capacity = vm->output.length = 0;
+    // 所有对象头、字符串和环境都在内存池中，整体释放（包括引用计数无法回收的循环引用）
+    pool_destroy(&vm->pool);
+}
+
+// 把虚拟机恢复到刚创建时的状态（卸载模块、清空全局变量），但保留已提交的栈和
+// 内存池的内存块，供执行大量短脚本时复用，省去每次创建虚拟机的系统调用
+VMStatus vm_reset(StackVM* vm) {
+    jmp_buf jump;
+    jmp_buf* saved_jump = vm->error_jump;
+    vm->error_jump = &jump;
+    if (setjmp(jump)) {
+        vm->error_jump = saved_jump;
+        return vm->status;
+    }
+    vm_release_heap(vm);
+    pool_recycle(&vm->pool);
+    vm_setup_heap(vm);
+    vm->error_jump = saved_jump;
+    vm->status = VM_OK;
+    vm->error[0] = '\0';
+    return VM_OK;
+}
+
+void vm_push(StackVM* vm, Value val) {
+    if (vm->sp >= vm->stack_capacity) {
+        vm_reserve_stack(vm, vm->sp + 1);
+    }
+    // 增加引用计数，因为值现在被栈持有
+    if (IS_HEAP_VALUE(val)) {
+        gc_inc_ref(AS_OBJ(val));
+    }
+    vm->stack[vm->sp++] = val;
+}
+
+Value vm_pop(StackVM* vm) {
+    if (vm->sp <= 0) vm_error(vm, VM_ERROR_RUNTIME, "栈下溢！");
+    return vm->stack[--vm->sp];
+}
+
+// 直接从栈中弹出并释放值（用于不需要返回值的情况）
+void vm_pop_free(StackVM* vm) {
+    Value val = vm_pop(vm);
+    val_free(val);
+}
+
+// 函数调用：压入调用帧（调用栈按需增长）
+void vm_call(StackVM* vm, const CallFrame* frame) {
+    if (vm->call_sp >= vm->call_capacity) {
+        vm_reserve_calls(vm, vm->call_sp + 1);
+    }
+    vm->call_stack[vm->call_sp++] = *frame;
+}
+
+// 函数返回：弹出调用帧
+CallFrame vm_ret(StackVM* vm) {
+    if (vm->call_sp <= 0) vm_error(vm, VM_ERROR_RUNTIME, "无函数可返回！");
+    return vm->call_stack[--vm->call_sp];
+}
+
+// --------------- 字节码校验 ---------------
+// 加载时对指令流做一遍抽象解释：检查操作码和操作数长度、常量/缓存/槽位/函数编号，
+// 并计算主程序的最大栈深度和每个函数的栈帧深度。通过校验的模块在执行时不会越界读取
+// 指令、访问不存在的槽位或使值栈下溢，主程序之外的栈空间在调用时按栈帧深度预留。
+
+// 指令元信息：操作数字节数、出栈数、入栈数、名字（剖析报告使用）
+typedef struct {
+    int8_t operand_len;
+    int8_t pops;
+    int8_t pushes;
+    const char* name;
+} OpInfo;
+
+static const OpInfo op_info[256] = {
+    [OP_PUSH_NUM]       = {2, 0, 1, "PUSH_NUM"},
+    [OP_PUSH_STR]       = {2, 0, 1, "PUSH_STR"},
+    [OP_PUSH_BOOL]      = {1, 0, 1, "PUSH_BOOL"},
+    [OP_PUSH_UNDEFINED] = {0, 0, 1, "PUSH_UNDEFINED"},
+    [OP_PUSH_NULL]      = {0, 0, 1, "PUSH_NULL"},
+    [OP_PUSH_VAR]       = {2, 0, 1, "PUSH_VAR"},
+    [OP_STORE_VAR]      = {2, 1, 0, "STORE_VAR"},
+    [OP_ADD]            = {0, 2, 1, "ADD"},
+    [OP_CALL]           = {1, 1, 1, "CALL"},  // 另外弹出的实参个数由操作数给出
+    [OP_RET]            = {0, 0, 0, "RET"},
+    [OP_PRINT]          = {1, 0, 0, "PRINT"}, // 出栈数由操作数给出
+    [OP_EXIT]           = {0, 0, 0, "EXIT"},
+    [OP_NEW_OBJECT]     = {0, 0, 1, "NEW_OBJECT"},
+    [OP_SET_PROP]       = {4, 2, 1, "SET_PROP"},
+    [OP_GET_PROP]       = {4, 1, 1, "GET_PROP"},
+    [OP_PUSH_ENV]       = {1, 0, 0, "PUSH_ENV"},
+    [OP_POP_ENV]        = {0, 0, 0, "POP_ENV"},
+    [OP_LOAD_LOCAL]     = {1, 0, 1, "LOAD_LOCAL"},
+    [OP_STORE_LOCAL]    = {1, 1, 0, "STORE_LOCAL"},
+    [OP_LOAD_UPVAL]     = {2, 0, 1, "LOAD_UPVAL"},
+    [OP_STORE_UPVAL]    = {2, 1, 0, "STORE_UPVAL"},
+    [OP_POP]            = {0, 1, 0, "POP"},
+    [OP_CLOSURE]        = {2, 0, 1, "CLOSURE"},
+    [OP_LOAD_SLOT]      = {1, 0, 1, "LOAD_SLOT"},
+    [OP_STORE_SLOT]     = {1, 1, 0, "STORE_SLOT"},
+    [OP_ADD_VAR_VAR]    = {4, 0, 1, "ADD_VAR_VAR"},
+    [OP_ADD_SLOT_SLOT]  = {2, 0, 1, "ADD_SLOT_SLOT"},
+    [OP_ADD_NUM]        = {2, 1, 1, "ADD_NUM"},
+    [OP_GET_VAR_PROP]   = {6, 0, 1, "GET_VAR_PROP"},
+    [OP_GET_SLOT_PROP]  = {5, 0, 1, "GET_SLOT_PROP"},
+    [OP_SUB]            = {0, 2, 1, "SUB"},
+    [OP_MUL]            = {0, 2, 1, "MUL"},
+    [OP_DIV]            = {0, 2, 1, "DIV"},
+    [OP_LT]             = {0, 2, 1, "LT"},
+    [OP_LE]             = {0, 2, 1, "LE"},
+    [OP_GT]             = {0, 2, 1, "GT"},
+    [OP_GE]             = {0, 2, 1, "GE"},
+    [OP_EQ]             = {0, 2, 1, "EQ"},
+    [OP_NE]             = {0, 2, 1, "NE"},
+    [OP_STRICT_EQ]      = {0, 2, 1, "STRICT_EQ"},
+    [OP_STRICT_NE]      = {0, 2, 1, "STRICT_NE"},
+    [OP_ADD_NUM_NUM]    = {0, 2, 1, "ADD_NUM_NUM"},
+    [OP_ADD_STR_STR]    = {0, 2, 1, "ADD_STR_STR"},
+    [OP_SUB_NUM_NUM]    = {0, 2, 1, "SUB_NUM_NUM"},
+    [OP_MUL_NUM_NUM]    = {0, 2, 1, "MUL_NUM_NUM"},
+    [OP_DIV_NUM_NUM]    = {0, 2, 1, "DIV_NUM_NUM"},
+    [OP_LT_NUM_NUM]     = {0, 2, 1, "LT_NUM_NUM"},
+    [OP_LE_NUM_NUM]     = {0, 2, 1, "LE_NUM_NUM"},
+    [OP_GT_NUM_NUM]     = {0, 2, 1, "GT_NUM_NUM"},
+    [OP_GE_NUM_NUM]     = {0, 2, 1, "GE_NUM_NUM"},
+    [OP_EQ_NUM_NUM]     = {0, 2, 1, "EQ_NUM_NUM"},
+    [OP_NE_NUM_NUM]     = {0, 2, 1, "NE_NUM_NUM"},
+};
+
+// 判断字节是否为有效操作码（op_info 只对有效操作码有意义）
+static bool op_is_valid(uint8_t op) {
+    return op < OP_COUNT;
+}
+
+int vm_op_length(uint8_t op) {
+    return op_is_valid(op) ? 1 + op_info[op].operand_len : 0;
+}
+
+const char* vm_op_name(uint8_t op) {
+    return op_is_valid(op) ? op_info[op].name : "?";
+}
+
+// 校验时的静态作用域链：每次 OP_PUSH_ENV 产生一个节点（NULL 表示全局作用域）
+typedef struct VerifyEnv {
+    int slot_count;
+    struct VerifyEnv* parent;
+} VerifyEnv;
+
+typedef struct {
+    const Module* module;
+    int* depth_at;          // 每个偏移处的栈深度（相对栈帧基址，-1 表示尚未到达）
+    VerifyEnv** env_at;     // 每个偏移处的静态作用域链
+    int* owner;             // 每个偏移所属的函数（-1 为主程序）
+    uint8_t* in_operand;    // 非 0 表示该字节是某条已校验指令的操作数
+    VerifyEnv** func_env;   // 每个函数创建时（OP_CLOSURE 处）的作用域链
+    bool* func_seen;        // 函数是否已加入待校验队列
+    int* func_queue;
+    int func_pending;
+    VerifyEnv** envs;       // 所有分配的作用域节点，校验结束后统一释放
+    int env_count;
+    int env_capacity;
+    char* error;            // 失败时写入错误描述
+    size_t error_size;
+} Verifier;
+
+static bool verify_fail(Verifier* v, int offset, const char* message) {
+    snprintf(v->error, v->error_size, "字节码校验失败（偏移 %d）：%s", offset, message);
+    return false;
+}
+
+static bool verify_out_of_memory(Verifier* v) {
+    snprintf(v->error, v->error_size, "内存分配失败！");
+    return false;
+}
+
+// 内存不足时返回 NULL（校验按失败处理）
+static VerifyEnv* verify_new_env(Verifier* v, int slot_count, VerifyEnv* parent) {
+    if (v->env_count == v->env_capacity) {
+        int capacity = v->env_capacity < 16 ? 16 : v->env_capacity * 2;
+        VerifyEnv** envs = realloc(v->envs, capacity * sizeof(VerifyEnv*));
+        if (!envs) {
+            verify_out_of_memory(v);
+            return NULL;
+        }
+        v->envs = envs;
+        v->env_capacity = capacity;
+    }
+    VerifyEnv* env = malloc(sizeof(VerifyEnv));
+    if (!env) {
+        verify_out_of_memory(v);
+        return NULL;
+    }
+    env->slot_count = slot_count;
+    env->parent = parent;
+    v->envs[v->env_count++] = env;
+    return env;
+}
+
+// 检查常量编号及其类型
+static bool verify_constant(Verifier* v, int offset, int index, ConstantType type) {
+    if (index >= (int)v->module->constant_count) {
+        return verify_fail(v, offset, "常量编号越界");
+    }
+    if (v->module->constants[index].type != (uint32_t)type) {
+        return verify_fail(v, offset, "常量类型不符");
+    }
+    return true;
+}
+
+// 检查（深度，槽位）是否指向静态作用域链上存在的块作用域槽位
+static bool verify_slot(Verifier* v, int offset, VerifyEnv* env, int depth, int slot) {
+    while (env != NULL && depth-- > 0) {
+        env = env->parent;
+    }
+    if (env == NULL) {
+        return verify_fail(v, offset, "访问的作用域不存在");
+    }
+    if (slot >= env->slot_count) {
+        return verify_fail(v, offset, "作用域槽位越界");
+    }
+    return true;
+}
+
+// 校验主程序（function 为 -1）或一个函数，返回其栈帧的最大深度（失败返回 -1）
+static int verify_function(Verifier* v, int function) {
+    const Module* module = v->module;
+    const uint8_t* code = module->code;
+    int len = (int)module->code_len;
+    bool is_main = function < 0;
+    const FunctionInfo* info = is_main ? NULL : &module->functions[function];
+    if (!is_main && info->entry >= module->code_len) {
+        verify_fail(v, len, "函数入口越界");
+        return -1;
+    }
+    int entry = is_main ? 0 : (int)info->entry;
+    // 函数的形参和局部变量占据栈帧底部，栈深度不能低于它们
+    int frame_floor = is_main ? 0 : info->slot_count;
+    VerifyEnv* entry_env = is_main ? NULL : v->func_env[function];
+    int max_stack = frame_floor;
+
+    if (v->depth_at[entry] != -1 || v->in_operand[entry]) {
+        verify_fail(v, entry, "函数入口与其他代码重叠");
+        return -1;
+    }
+
+    // 待处理的偏移（深度和作用域记录在 depth_at/env_at 中）
+    int* worklist = malloc(sizeof(int) * (len + 1));
+    if (!worklist) {
+        verify_out_of_memory(v);
+        return -1;
+    }
+    int pending = 0;
+    v->depth_at[entry] = frame_floor;
+    v->env_at[entry] = entry_env;
+    v->owner[entry] = function;
+    worklist[pending++] = entry;
+
+    bool ok = true;
+    while (ok && pending > 0) {
+        int ip = worklist[--pending];
+        int depth = v->depth_at[ip];
+        VerifyEnv* env = v->env_at[ip];
+        uint8_t op = code[ip];
+        int next;
+
+        if (!op_is_valid(op)) {
+            ok = verify_fail(v, ip, "未知指令");
+            break;
+        }
+        if (op >= OP_FIRST_QUICKENED) {
+            ok = verify_fail(v, ip, "特化指令只能由虚拟机在执行时生成");
+            break;
+        }
+        const OpInfo* op_desc = &op_info[op];
+        const uint8_t* operands = &code[ip + 1];
+        next = ip + 1 + op_desc->operand_len;
+        if (next > len) {
+            ok = verify_fail(v, ip, "操作数越过指令流末尾");
+            break;
+        }
+        // 指令之间不能重叠：操作数字节不能同时是另一条指令的起点
+        for (int b = ip + 1; b < next; b++) {
+            if (v->depth_at[b] != -1) {
+                ok = verify_fail(v, b, "跳转目标或函数入口落在指令中间");
+                break;
+            }
+            v->in_operand[b] = 1;
+        }
+        if (!ok) break;
+
+        int pops = op_desc->pops;
+        int pushes = op_desc->pushes;
+        bool falls_through = true;
+        switch ((OpCode)op) {
+            case OP_PUSH_NUM:
+            case OP_ADD_NUM:
+                ok = verify_constant(v, ip, read_u16(operands, 0), CONST_NUMBER);
+                break;
+            case OP_ADD_VAR_VAR:
+                ok = verify_constant(v, ip, read_u16(operands, 0), CONST_STRING) &&
+                     verify_constant(v, ip, read_u16(operands, 2), CONST_STRING);
+                break;
+            case OP_ADD_SLOT_SLOT:
+                if (operands[0] >= frame_floor || operands[1] >= frame_floor) {
+                    ok = verify_fail(v, ip, "栈帧槽位越界");
+                }
+                break;
+            case OP_GET_VAR_PROP:
+                ok = verify_constant(v, ip, read_u16(operands, 0), CONST_STRING) &&
+                     verify_constant(v, ip, read_u16(operands, 2), CONST_STRING);
+                if (ok && read_u16(operands, 4) >= module->cache_count) {
+                    ok = verify_fail(v, ip, "内联缓存编号越界");
+                }
+                break;
+            case OP_GET_SLOT_PROP:
+                if (operands[0] >= frame_floor) {
+                    ok = verify_fail(v, ip, "栈帧槽位越界");
+                    break;
+                }
+                ok = verify_constant(v, ip, read_u16(operands, 1), CONST_STRING);
+                if (ok && read_u16(operands, 3) >= module->cache_count) {
+                    ok = verify_fail(v, ip, "内联缓存编号越界");
+                }
+                break;
+            case OP_PUSH_STR:
+            case OP_PUSH_VAR:
+            case OP_STORE_VAR:
+                ok = verify_constant(v, ip, read_u16(operands, 0), CONST_STRING);
+                break;
+            case OP_SET_PROP:
+            case OP_GET_PROP:
+                ok = verify_constant(v, ip, read_u16(operands, 0), CONST_STRING);
+                if (ok && read_u16(operands, 2) >= module->cache_count) {
+                    ok = verify_fail(v, ip, "内联缓存编号越界");
+                }
+                break;
+            case OP_PRINT:
+                pops = operands[0];
+                break;
+            case OP_CALL:
+                pops += operands[0];
+                break;
+            case OP_PUSH_ENV:
+                env = verify_new_env(v, operands[0], env);
+                ok = env != NULL;
+                break;
+            case OP_POP_ENV:
+                if (env == entry_env) {
+                    ok = verify_fail(v, ip, "OP_POP_ENV 没有对应的 OP_PUSH_ENV");
+                    break;
+                }
+                env = env->parent;
+                break;
+            case OP_LOAD_LOCAL:
+            case OP_STORE_LOCAL:
+                ok = verify_slot(v, ip, env, 0, operands[0]);
+                break;
+            case OP_LOAD_UPVAL:
+            case OP_STORE_UPVAL:
+                ok = verify_slot(v, ip, env, operands[0], operands[1]);
+                break;
+            case OP_LOAD_SLOT:
+            case OP_STORE_SLOT:
+                if (operands[0] >= frame_floor) {
+                    ok = verify_fail(v, ip, "栈帧槽位越界");
+                }
+                break;
+            case OP_CLOSURE: {
+                int index = read_u16(operands, 0);
+                if (index >= (int)module->function_count) {
+                    ok = verify_fail(v, ip, "函数编号越界");
+                    break;
+                }
+                // 函数体按创建处的作用域链校验，每个函数只能在一种作用域链下创建
+                if (!v->func_seen[index]) {
+                    v->func_seen[index] = true;
+                    v->func_env[index] = env;
+                    v->func_queue[v->func_pending++] = index;
+                } else if (v->func_env[index] != env) {
+                    ok = verify_fail(v, ip, "同一函数在不同的作用域中创建");
+                }
+                break;
+            }
+            case OP_RET:
+                if (is_main) {
+                    ok = verify_fail(v, ip, "主程序中不能使用 OP_RET");
+                } else if (depth != frame_floor + 1 || env != entry_env) {
+                    ok = verify_fail(v, ip, "函数返回时必须恰好留下一个返回值且作用域已全部退出");
+                }
+                falls_through = false;
+                break;
+            case OP_EXIT:
+                falls_through = false;
+                break;
+            default:
+                break;
+        }
+        if (!ok) break;
+
+        if (depth - pops < frame_floor) {
+            ok = verify_fail(v, ip, "值栈下溢");
+            break;
+        }
+        depth = depth - pops + pushes;
+        if (depth > max_stack) {
+            max_stack = depth;
+        }
+
+        if (falls_through) {
+            if (next >= len) {
+                ok = verify_fail(v, ip, "执行越过指令流末尾");
+                break;
+            }
+            if (v->in_operand[next]) {
+                ok = verify_fail(v, next, "跳转目标或函数入口落在指令中间");
+            } else if (v->depth_at[next] == -1) {
+                v->depth_at[next] = depth;
+                v->env_at[next] = env;
+                v->owner[next] = function;
+                worklist[pending++] = next;
+            } else if (v->owner[next] != function) {
+                ok = verify_fail(v, next, "不同函数的指令相互重叠");
+            } else if (v->depth_at[next] != depth || v->env_at[next] != env) {
+                ok = verify_fail(v, next, "汇合点的栈深度或作用域不一致");
+            }
+        }
+    }
+
+    free(worklist);
+    return ok ? max_stack : -1;
+}
+
+// 校验模块，成功时给出主程序所需的最大值栈深度和每个函数的栈帧深度
+// （frame_sizes 至少有 function_count 项，从未被创建的函数记为 0）；
+// scopes 非空时（至少 function_count 项）还给出每个函数创建处的作用域链，
+// 成功时各项的 slot_counts 由调用方释放。失败时把错误描述写入 error，不打印
+bool vm_verify(const Module* module, int* max_stack, int* frame_sizes, FunctionScope* scopes,
+               char* error, size_t error_size) {
+    Verifier v;
+    v.module = module;
+    v.error = error;
+    v.error_size = error_size;
+    if (module->code_len == 0) {
+        return verify_fail(&v, 0, "指令流为空");
+    }
+    // 偏移在校验和执行中都用 int 表示
+    if (module->code_len > INT32_MAX) {
+        return verify_fail(&v, 0, "指令流过长");
+    }
+    int len = (int)module->code_len;
+    // 缓存数来自文件头，加载时按它分配缓存：每个缓存属于一条多字节的属性访问指令，
+    // 不会多于指令流的字节数（编号是 2 字节的，也不会超过 65536 个）
+    if (module->cache_count > module->code_len || module->cache_count > 0x10000) {
+        return verify_fail(&v, 0, "内联缓存数超过属性访问指令可能的个数");
+    }
+    // 函数表来自文件：入口和栈帧大小先按无符号数检查，之后才能当作下标
+    for (uint32_t i = 0; i < module->function_count; i++) {
+        const FunctionInfo* info = &module->functions[i];
+        if (info->entry >= module->code_len) {
+            return verify_fail(&v, len, "函数入口越界");
+        }
+        if (info->slot_count < info->arity) {
+            return verify_fail(&v, info->entry, "函数的栈帧槽位少于形参个数");
+        }
+        if (info->name >= module->constant_count ||
+            module->constants[info->name].type != CONST_STRING) {
+            return verify_fail(&v, info->entry, "函数名不是字符串常量");
+        }
+    }
+    int function_count = module->function_count > 0 ? module->function_count : 1;
+    v.depth_at = malloc(sizeof(int) * len);
+    v.env_at = malloc(sizeof(VerifyEnv*) * len);
+    v.owner = malloc(sizeof(int) * len);
+    v.in_operand = calloc(len, sizeof(uint8_t));
+    v.func_env = calloc(function_count, sizeof(VerifyEnv*));
+    v.func_seen = calloc(function_count, sizeof(bool));
+    v.func_queue = malloc(sizeof(int) * function_count);
+    v.func_pending = 0;
+    v.envs = NULL;
+    v.env_count = 0;
+    v.env_capacity = 0;
+    bool ok = true;
+    if (!v.depth_at || !v.env_at || !v.owner || !v.in_operand ||
+        !v.func_env || !v.func_seen || !v.func_queue) {
+        ok = verify_out_of_memory(&v);
+    } else {
+        for (int i = 0; i < len; i++) {
+            v.depth_at[i] = -1;
+        }
+        for (uint32_t i = 0; i < module->function_count; i++) {
+            frame_sizes[i] = 0;
+        }
+        // 先校验主程序，再依次校验其中（以及已校验函数中）创建的函数
+        *max_stack = verify_function(&v, -1);
+        ok = *max_stack >= 0;
+    }
+    int done = 0;
+    while (ok && done < v.func_pending) {
+        int function = v.func_queue[done++];
+        frame_sizes[function] = verify_function(&v, function);
+        ok = frame_sizes[function] >= 0;
+    }
+    // 作用域节点在返回前释放，需要时把每个函数的作用域链按层复制出来
+    for (uint32_t i = 0; ok && scopes && i < module->function_count; i++) {
+        FunctionScope* scope = &scopes[i];
+        scope->created = v.func_seen[i];
+        scope->depth = 0;
+        scope->slot_counts = NULL;
+        for (VerifyEnv* env = v.func_env[i]; env; env = env->parent) {
+            scope->depth++;
+        }
+        if (scope->depth > 0) {
+            scope->slot_counts = malloc(scope->depth * sizeof(int));
+            if (!scope->slot_counts) {
+                function_scopes_clear(scopes, (int)i);
+                ok = verify_out_of_memory(&v);
+                break;
+            }
+            int level = 0;
+            for (VerifyEnv* env = v.func_env[i]; env; env = env->parent) {
+                scope->slot_counts[level++] = env->slot_count;
+            }
+        }
+    }
+
+    for (int i = 0; i < v.env_count; i++) {
+        free(v.envs[i]);
+    }
+    free(v.envs);
+    free(v.depth_at);
+    free(v.env_at);
+    free(v.owner);
+    free(v.in_operand);
+    free(v.func_env);
+    free(v.func_seen);
+    free(v.func_queue);
+    return ok;
+}
+
+// --------------- 模块加载 ---------------
+// 加载模块：常量池一次性物化（字符串驻留），并为属性访问指令分配内联缓存，
+// 执行时按编号直接取用，不再逐次分配和比较字符串。
+// 模块本身只读，物化的常量、缓存和栈帧深度都存放在虚拟机中，因此同一个模块
+// 可以同时加载到多个虚拟机（线程）中。失败时虚拟机处于未加载模块的状态
+VMStatus vm_load(StackVM* vm, const Module* module) {
+    jmp_buf jump;
+    jmp_buf* saved_jump = vm->error_jump;
+    vm->error_jump = &jump;
+    if (setjmp(jump)) {
+        vm->error_jump = saved_jump;
+        return vm->status;
+    }
+    jit_unload(vm);
+    reg_unload(vm);
+    vm->module = NULL;
+
+    // 解释器不做逐条指令的边界检查，只执行通过校验的字节码，并预先把栈提交到校验得到的深度
+    // （函数调用的栈帧在调用时按该函数的栈帧深度预留）
+    int max_stack;
+    free(vm->frame_sizes);
+    vm->frame_sizes = malloc((module->function_count > 0 ? module->function_count : 1) * sizeof(int));
+    function_scopes_clear(vm->function_scopes, vm->function_scope_count);
+    free(vm->function_scopes);
+    vm->function_scope_count = 0;
+    vm->function_scopes = malloc((module->function_count > 0 ? module->function_count : 1) * sizeof(FunctionScope));
+    if (!vm->frame_sizes || !vm->function_scopes) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    char message[sizeof(vm->error)];
+    if (!vm_verify(module, &max_stack, vm->frame_sizes, vm->function_scopes, message, sizeof(message))) {
+        vm_error(vm, VM_ERROR_VERIFY, "%s", message);
+    }
+    vm->function_scope_count = (int)module->function_count;
+    vm_reserve_stack(vm, vm->sp + max_stack);
+    free(vm->constants);
+    vm->constants = malloc((module->constant_count > 0 ? module->constant_count : 1) * sizeof(Value));
+    free(vm->caches);
+    vm->caches = calloc(module->cache_count > 0 ? module->cache_count : 1, sizeof(InlineCache));
+    if (!vm->constants || !vm->caches) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    for (uint32_t i = 0; i < module->constant_count; i++) {
+        const Constant* constant = &module->constants[i];
+        if (constant->type == CONST_NUMBER) {
+            vm->constants[i] = val_number(constant->as.number);
+        } else {
+            StringObject* str = vm_intern(vm, module->string_data + constant->as.offset, constant->length);
+            vm->constants[i] = val_obj((ObjectHeader*)str);
+        }
+    }
+    vm->cache_count = module->cache_count;
+    // 执行用的指令流副本：特化只改写本虚拟机的副本，模块保持只读
+    free(vm->code);
+    vm->code = malloc(module->code_len * 2);
+    if (!vm->code) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    memcpy(vm->code, module->code, module->code_len);
+    vm->quicken_budget = vm->code + module->code_len;
+    memset(vm->quicken_budget, VM_QUICKEN_LIMIT, module->code_len);
+    reg_load(vm, module, max_stack);
+    jit_load(vm, module);
+    vm->module = module;
+    vm->entry = 0;
+    vm->error_jump = saved_jump;
+    return VM_OK;
+}
+
+// 从映射到内存的容器文件构造模块：各部分直接指向映射，不做拷贝
+static Module* module_from_image(void* base, size_t size, char* error, size_t error_size) {
+    const uint8_t* bytes = (const uint8_t*)base;
+    const ContainerHeader* header = (const ContainerHeader*)base;
+    if (size < sizeof(ContainerHeader) || header->magic != CONTAINER_MAGIC) {
+        snprintf(error, error_size, "错误：不是有效的字节码文件");
+        return NULL;
+    }
+    if (header->version != CONTAINER_VERSION) {
+        snprintf(error, error_size, "错误：不支持的字节码版本 %d（当前为 %d）", header->version, CONTAINER_VERSION);
+        return NULL;
+    }
+    size_t table_end = sizeof(ContainerHeader) + (size_t)header->section_count * sizeof(SectionEntry);
+    if (table_end > size) {
+        snprintf(error, error_size, "错误：字节码文件段表不完整");
+        return NULL;
+    }
+
+    Module* module = calloc(1, sizeof(Module));
+    if (!module) {
+        snprintf(error, error_size, "内存分配失败！");
+        return NULL;
+    }
+    module->flags = header->flags;
+    const SectionEntry* sections = (const SectionEntry*)(bytes + sizeof(ContainerHeader));
+    for (int i = 0; i < header->section_count; i++) {
+        const SectionEntry* section = &sections[i];
+        if (section->offset > size || section->size > size - section->offset ||
+            section->offset % CONTAINER_ALIGN != 0) {
+            snprintf(error, error_size, "错误：字节码文件的段越界或未对齐");
+            free(module);
+            return NULL;
+        }
+        const void* data = bytes + section->offset;
+        switch (section->kind) {
+            case SECTION_CODE:
+                module->code = (const uint8_t*)data;
+                module->code_len = section->size;
+                break;
+            case SECTION_CONSTANTS:
+                module->constants = (const Constant*)data;
+                module->constant_count = section->size / sizeof(Constant);
+                break;
+            case SECTION_STRINGS:
+                module->string_data = (const char*)data;
+                module->string_data_len = section->size;
+                break;
+            case SECTION_FUNCTIONS:
+                module->functions = (const FunctionInfo*)data;
+                module->function_count = section->size / sizeof(FunctionInfo);
+                break;
+            case SECTION_DEBUG:
+                module->lines = (const DebugLine*)data;
+                module->line_count = section->size / sizeof(DebugLine);
+                break;
+            case SECTION_SNAPSHOT:
+                // 内容由 vm_restore 校验
+                module->snapshot = (const uint8_t*)data;
+                module->snapshot_size = section->size;
+                break;
+            default:
+                break; // 忽略不认识的段，便于向前兼容
+        }
+    }
+    if (!module->code) {
+        snprintf(error, error_size, "错误：字节码文件缺少代码段");
+        free(module);
+        return NULL;
+    }
+    // 字符串常量必须落在字符串数据区内（偏移是 64 位的，先比较偏移再比较剩余长度，避免相加溢出）
+    for (uint32_t i = 0; i < module->constant_count; i++) {
+        const Constant* constant = &module->constants[i];
+        if (constant->type != CONST_NUMBER &&
+            (constant->type != CONST_STRING ||
+             constant->as.offset > module->string_data_len ||
+             constant->length > module->string_data_len - constant->as.offset)) {
+            snprintf(error, error_size, "错误：字节码文件的常量池已损坏");
+            free(module);
+            return NULL;
+        }
+    }
+    module->cache_count = header->cache_count;
+    module->mapping = base;
+    module->mapping_size = size;
+    return module;
+}
+
+// 以只读方式映射 .bin 文件并就地加载，多个进程共享同一份页缓存。
+// 失败返回 NULL，并把错误描述写入 error（error_size 字节），不打印
+Module* module_load_file(const char* path, char* error, size_t error_size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(error, error_size, "错误：无法打开文件 '%s'", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        snprintf(error, error_size, "错误：无法读取文件 '%s'", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    void* base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // 映射建立后即可关闭文件描述符
+    if (base == MAP_FAILED) {
+        snprintf(error, error_size, "错误：无法映射文件 '%s'", path);
+        return NULL;
+    }
+    Module* module = module_from_image(base, size, error, error_size);
+    if (!module) {
+        munmap(base, size);
+    }
+    return module;
+}
+
+// 释放模块：映射来的模块解除映射，编译器生成的模块各部分均为单独分配
+void module_free(Module* module) {
+    if (module->mapping) {
+        munmap(module->mapping, module->mapping_size);
+    } else {
+        free((void*)module->code);
+        free((void*)module->constants);
+        free((void*)module->string_data);
+        free((void*)module->functions);
+        free((void*)module->lines);
+        free((void*)module->snapshot);
+    }
+    free(module);
+}
+
+// 追加一个段到容器：记录段表项，段起始偏移按 CONTAINER_ALIGN 对齐
+static size_t container_add_section(SectionEntry* entry, SectionKind kind, size_t offset, size_t size) {
+    offset = (offset + CONTAINER_ALIGN - 1) & ~(size_t)(CONTAINER_ALIGN - 1);
+    entry->kind = kind;
+    entry->offset = (uint32_t)offset;
+    entry->size = (uint32_t)size;
+    entry->reserved = 0;
+    return offset + size;
+}
+
+// 序列化模块为容器格式：文件头 + 段表 + 代码/常量池/字符串/函数表/调试信息各段，
+// 有快照时最后加上快照段
+uint8_t* module_serialize(const Module* module, size_t* size) {
+    enum { MAX_SECTIONS = 6 };
+    SectionEntry sections[MAX_SECTIONS];
+    const void* payloads[MAX_SECTIONS] = {
+        module->code, module->constants, module->string_data, module->functions, module->lines,
+        module->snapshot
+    };
+    int section_count = module->snapshot ? MAX_SECTIONS : MAX_SECTIONS - 1;
+    size_t end = sizeof(ContainerHeader) + section_count * sizeof(SectionEntry);
+    end = container_add_section(&sections[0], SECTION_CODE, end, module->code_len);
+    end = container_add_section(&sections[1], SECTION_CONSTANTS, end,
+                                module->constant_count * sizeof(Constant));
+    end = container_add_section(&sections[2], SECTION_STRINGS, end, module->string_data_len);
+    end = container_add_section(&sections[3], SECTION_FUNCTIONS, end,
+                                module->function_count * sizeof(FunctionInfo));
+    end = container_add_section(&sections[4], SECTION_DEBUG, end,
+                                module->line_count * sizeof(DebugLine));
+    if (module->snapshot) {
+        end = container_add_section(&sections[5], SECTION_SNAPSHOT, end, module->snapshot_size);
+    }
+    if (end > UINT32_MAX) {
+        fprintf(stderr, "错误：字节码文件过大\n");
+        return NULL;
+    }
+
+    uint8_t* data = calloc(1, end);
+    if (!data) {
+        fprintf(stderr, "内存分配失败！\n");
+        return NULL;
+    }
+    ContainerHeader header = {
+        .magic = CONTAINER_MAGIC,
+        .version = CONTAINER_VERSION,
+        .section_count = (uint16_t)section_count,
+        .cache_count = module->cache_count,
+        .flags = module->flags
+    };
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), sections, section_count * sizeof(SectionEntry));
+    for (int i = 0; i < section_count; i++) {
+        if (sections[i].size > 0) {
+            memcpy(data + sections[i].offset, payloads[i], sections[i].size);
+        }
+    }
+    *size = end;
+    return data;
+}
+
+// --------------- 堆快照 ---------------
+// 写快照时从全局变量出发按引用关系遍历：新遇到的字符串、对象、函数和环境依次编号，
+// 对象和环境的变量在处理到它时才在 SnapshotVar 数组中占一段连续区间，
+// 同一个节点只写一次，因此共享的子对象和循环引用都能原样恢复
+
+typedef struct {
+    StackVM* vm;
+    const void** keys;       // 指针 -> 编号的开放寻址表
+    uint32_t* ids;
+    uint32_t map_count;
+    uint32_t map_capacity;   // 2 的幂
+    SnapshotVar* vars;
+    uint32_t var_count, var_capacity;
+    SnapshotString* strings;
+    uint32_t string_count, string_capacity;
+    SnapshotObject* objects;
+    Object** object_refs;    // 对象编号 -> 对象，按编号依次填写属性
+    uint32_t object_count, object_capacity;
+    SnapshotFunction* functions;
+    uint32_t function_count, function_capacity;
+    SnapshotEnv* envs;
+    Env** env_refs;
+    uint32_t env_count, env_capacity;
+    char* chars;
+    size_t chars_size, chars_capacity;
+} SnapshotWriter;
+
+static void snapshot_writer_free(SnapshotWriter* w) {
+    free(w->keys);
+    free(w->ids);
+    free(w->vars);
+    free(w->strings);
+    free(w->objects);
+    free(w->object_refs);
+    free(w->functions);
+    free(w->envs);
+    free(w->env_refs);
+    free(w->chars);
+}
+
+// 保证数组至少能容纳 needed 项（各表的项数不超过 UINT32_MAX / 2）
+static void* snapshot_grow(SnapshotWriter* w, void* data, uint32_t* capacity, uint32_t needed, size_t size) {
+    if (needed <= *capacity) {
+        return data;
+    }
+    if (needed > UINT32_MAX / 2) {
+        vm_error(w->vm, VM_ERROR_RUNTIME, "堆太大，无法写入快照");
+    }
+    uint32_t grown_capacity = *capacity < 16 ? 16 : *capacity;
+    while (grown_capacity < needed) {
+        grown_capacity *= 2;
+    }
+    void* grown = realloc(data, (size_t)grown_capacity * size);
+    if (!grown) {
+        vm_error(w->vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    *capacity = grown_capacity;
+    return grown;
+}
+
+static inline uint32_t snapshot_hash(const void* key) {
+    return (uint32_t)(((uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// 已编号的节点返回编号，否则返回 SNAPSHOT_NONE
+static uint32_t snapshot_map_find(const SnapshotWriter* w, const void* key) {
+    if (w->map_capacity == 0) {
+        return SNAPSHOT_NONE;
+    }
+    for (uint32_t i = snapshot_hash(key) & (w->map_capacity - 1);; i = (i + 1) & (w->map_capacity - 1)) {
+        if (w->keys[i] == key) {
+            return w->ids[i];
+        }
+        if (w->keys[i] == NULL) {
+            return SNAPSHOT_NONE;
+        }
+    }
+}
+
+// 登记新节点的编号，装载率超过一半时容量翻倍并重新插入
+static void snapshot_map_put(SnapshotWriter* w, const void* key, uint32_t id) {
+    if ((w->map_count + 1) * 2 > w->map_capacity) {
+        uint32_t capacity = w->map_capacity < 64 ? 64 : w->map_capacity * 2;
+        const void** keys = calloc(capacity, sizeof(void*));
+        uint32_t* ids = malloc(capacity * sizeof(uint32_t));
+        if (!keys || !ids || capacity < w->map_capacity) {
+            free(keys);
+            free(ids);
+            vm_error(w->vm, VM_ERROR_MEMORY, "内存分配失败！");
+        }
+        for (uint32_t i = 0; i < w->map_capacity; i++) {
+            if (w->keys[i]) {
+                uint32_t j = snapshot_hash(w->keys[i]) & (capacity - 1);
+                while (keys[j]) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                keys[j] = w->keys[i];
+                ids[j] = w->ids[i];
+            }
+        }
+        free(w->keys);
+        free(w->ids);
+        w->keys = keys;
+        w->ids = ids;
+        w->map_capacity = capacity;
+    }
+    uint32_t i = snapshot_hash(key) & (w->map_capacity - 1);
+    while (w->keys[i]) {
+        i = (i + 1) & (w->map_capacity - 1);
+    }
+    w->keys[i] = key;
+    w->ids[i] = id;
+    w->map_count++;
+}
+
+// 字符串：绳索节点展平后写入内容，并记下它是否就是驻留表中的那一份
+static uint32_t snapshot_string(SnapshotWriter* w, StringObject* str) {
+    uint32_t id = snapshot_map_find(w, str);
+    if (id != SNAPSHOT_NONE) {
+        return id;
+    }
+    const char* chars = string_chars(str);
+    StringTable* table = &w->vm->strings;
+    bool interned = table->capacity > 0 &&
+                    *table_find(table->entries, table->capacity, chars, str->length, str->hash) == str;
+    if (str->length > UINT32_MAX - w->chars_size) {
+        vm_error(w->vm, VM_ERROR_RUNTIME, "堆太大，无法写入快照");
+    }
+    if (w->chars_size + str->length > w->chars_capacity) {
+        size_t capacity = w->chars_capacity < 256 ? 256 : w->chars_capacity;
+        while (capacity < w->chars_size + str->length) {
+            capacity *= 2;
+        }
+        char* grown = realloc(w->chars, capacity);
+        if (!grown) {
+            vm_error(w->vm, VM_ERROR_MEMORY, "内存分配失败！");
+        }
+        w->chars = grown;
+        w->chars_capacity = capacity;
+    }
+    memcpy(w->chars + w->chars_size, chars, str->length);
+    id = w->string_count;
+    w->strings = snapshot_grow(w, w->strings, &w->string_capacity, id + 1, sizeof(SnapshotString));
+    w->strings[id].offset = w->chars_size;
+    w->strings[id].length = (uint32_t)str->length;
+    w->strings[id].interned = interned;
+    w->string_count++;
+    w->chars_size += str->length;
+    snapshot_map_put(w, str, id);
+    return id;
+}
+
+// 对象先编号，属性留到按编号处理时再写（属性值可能引用回这个对象）
+static uint32_t snapshot_object(SnapshotWriter* w, Object* obj) {
+    uint32_t id = snapshot_map_find(w, obj);
+    if (id != SNAPSHOT_NONE) {
+        return id;
+    }
+    id = w->object_count;
+    uint32_t capacity = w->object_capacity;
+    w->objects = snapshot_grow(w, w->objects, &capacity, id + 1, sizeof(SnapshotObject));
+    w->object_refs = snapshot_grow(w, w->object_refs, &w->object_capacity, id + 1, sizeof(Object*));
+    w->object_refs[id] = obj;
+    w->object_count++;
+    snapshot_map_put(w, obj, id);
+    return id;
+}
+
+// 块作用域环境：父环境先编号，全局环境为 SNAPSHOT_GLOBAL
+static uint32_t snapshot_env(SnapshotWriter* w, Env* env) {
+    if (env == w->vm->global_env) {
+        return SNAPSHOT_GLOBAL;
+    }
+    uint32_t id = snapshot_map_find(w, env);
+    if (id != SNAPSHOT_NONE) {
+        return id;
+    }
+    if (env->names) {
+        vm_error(w->vm, VM_ERROR_RUNTIME, "快照不支持按名字访问的局部环境");
+    }
+    uint32_t parent = snapshot_env(w, env->parent);
+    id = w->env_count;
+    uint32_t capacity = w->env_capacity;
+    w->envs = snapshot_grow(w, w->envs, &capacity, id + 1, sizeof(SnapshotEnv));
+    w->env_refs = snapshot_grow(w, w->env_refs, &w->env_capacity, id + 1, sizeof(Env*));
+    w->envs[id].parent = parent;
+    w->envs[id].reserved = 0;
+    w->env_refs[id] = env;
+    w->env_count++;
+    snapshot_map_put(w, env, id);
+    return id;
+}
+
+static uint32_t snapshot_function(SnapshotWriter* w, FunctionObject* fn) {
+    uint32_t id = snapshot_map_find(w, fn);
+    if (id != SNAPSHOT_NONE) {
+        return id;
+    }
+    id = w->function_count;
+    w->functions = snapshot_grow(w, w->functions, &w->function_capacity, id + 1, sizeof(SnapshotFunction));
+    w->function_count++;
+    snapshot_map_put(w, fn, id);
+    // 全局作用域中创建的函数不持有环境
+    uint32_t env = fn->env ? snapshot_env(w, fn->env) : SNAPSHOT_GLOBAL;
+    w->functions[id].index = (uint32_t)fn->index;
+    w->functions[id].env = env;
+    return id;
+}
+
+static SnapshotVar snapshot_value(SnapshotWriter* w, Value value) {
+    SnapshotVar var;
+    memset(&var, 0, sizeof(var));
+    var.name = SNAPSHOT_NONE;
+    var.type = VAL_TYPE(value);
+    switch (var.type) {
+        case VAL_NUMBER:
+            var.number = AS_NUMBER(value);
+            break;
+        case VAL_BOOLEAN:
+            var.number = AS_BOOL(value) ? 1 : 0;
+            break;
+        case VAL_STRING:
+            var.ref = snapshot_string(w, (StringObject*)AS_OBJ(value));
+            break;
+        case VAL_OBJECT:
+            var.ref = snapshot_object(w, (Object*)AS_OBJ(value));
+            break;
+        case VAL_FUNCTION:
+            var.ref = snapshot_function(w, (FunctionObject*)AS_OBJ(value));
+            break;
+        default:
+            break;
+    }
+    return var;
+}
+
+// 占用一段连续的变量区间，返回起始下标
+static uint32_t snapshot_reserve_vars(SnapshotWriter* w, uint32_t count) {
+    if (count > UINT32_MAX / 2 - w->var_count) {
+        vm_error(w->vm, VM_ERROR_RUNTIME, "堆太大，无法写入快照");
+    }
+    uint32_t first = w->var_count;
+    w->vars = snapshot_grow(w, w->vars, &w->var_capacity, first + count, sizeof(SnapshotVar));
+    w->var_count += count;
+    return first;
+}
+
+// 按槽位顺序写出对象的属性：先沿形状链（或字典）取出各槽位的属性名，再写属性值
+static void snapshot_fill_object(SnapshotWriter* w, uint32_t id) {
+    Object* obj = w->object_refs[id];
+    uint32_t count = (uint32_t)object_prop_count(obj);
+    uint32_t first = snapshot_reserve_vars(w, count);
+    w->objects[id].first = first;
+    w->objects[id].count = count;
+    if (obj->dict) {
+        PropertyDict* dict = obj->dict;
+        for (uint32_t i = 0; i <= dict->mask; i++) {
+            if (dict->control[i] != DICT_EMPTY) {
+                uint32_t name = snapshot_string(w, dict->keys[i]);
+                w->vars[first + dict->slots[i]].name = name;
+            }
+        }
+    } else {
+        for (Shape* shape = obj->shape; shape->parent != NULL; shape = shape->parent) {
+            uint32_t name = snapshot_string(w, shape->key);
+            w->vars[first + shape->slot_count - 1].name = name;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        SnapshotVar var = snapshot_value(w, obj->slots[i]);
+        var.name = w->vars[first + i].name;
+        w->vars[first + i] = var;
+    }
+}
+
+static void snapshot_fill_env(SnapshotWriter* w, uint32_t id) {
+    Env* env = w->env_refs[id];
+    uint32_t count = (uint32_t)env->var_count;
+    uint32_t first = snapshot_reserve_vars(w, count);
+    w->envs[id].first = first;
+    w->envs[id].count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        SnapshotVar var = snapshot_value(w, env->values[i]);
+        w->vars[first + i] = var;
+    }
+}
+
+// 主程序的长度：函数体都排在主程序之后
+static uint32_t module_main_length(const Module* module) {
+    uint32_t end = module->code_len;
+    for (uint32_t i = 0; i < module->function_count; i++) {
+        if (module->functions[i].entry < end) {
+            end = module->functions[i].entry;
+        }
+    }
+    return end;
+}
+
+// 把各表拼成快照段，连同模块本身序列化为容器
+static uint8_t* snapshot_finish(SnapshotWriter* w, uint32_t resume, uint32_t global_count, size_t* size) {
+    StackVM* vm = w->vm;
+    SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .resume = resume,
+        .global_count = global_count,
+        .var_count = w->var_count,
+        .string_count = w->string_count,
+        .object_count = w->object_count,
+        .function_count = w->function_count,
+        .env_count = w->env_count,
+        .chars_size = (uint32_t)w->chars_size,
+        .reserved = 0
+    };
+    const void* parts[] = {&header, w->vars, w->strings, w->objects, w->functions, w->envs, w->chars};
+    size_t part_sizes[] = {
+        sizeof(header),
+        (size_t)w->var_count * sizeof(SnapshotVar),
+        (size_t)w->string_count * sizeof(SnapshotString),
+        (size_t)w->object_count * sizeof(SnapshotObject),
+        (size_t)w->function_count * sizeof(SnapshotFunction),
+        (size_t)w->env_count * sizeof(SnapshotEnv),
+        w->chars_size
+    };
+    size_t section_size = 0;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        section_size += part_sizes[i];
+    }
+    if (section_size > UINT32_MAX) {
+        vm_error(vm, VM_ERROR_RUNTIME, "堆太大，无法写入快照");
+    }
+    uint8_t* section = malloc(section_size);
+    if (!section) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (part_sizes[i] > 0) {
+            memcpy(section + offset, parts[i], part_sizes[i]);
+        }
+        offset += part_sizes[i];
+    }
+    Module image = *vm->module;
+    image.snapshot = section;
+    image.snapshot_size = (uint32_t)section_size;
+    uint8_t* data = module_serialize(&image, size);
+    free(section);
+    if (!data) {
+        vm_error(vm, VM_ERROR_MEMORY, "无法生成快照文件");
+    }
+    return data;
+}
+
+uint8_t* vm_snapshot(StackVM* vm, size_t* size) {
+    if (!vm->module) {
+        snprintf(vm->error, sizeof(vm->error), "没有加载模块");
+        vm->status = VM_ERROR_RUNTIME;
+        return NULL;
+    }
+    SnapshotWriter w;
+    memset(&w, 0, sizeof(w));
+    w.vm = vm;
+    jmp_buf jump;
+    jmp_buf* saved_jump = vm->error_jump;
+    vm->error_jump = &jump;
+    if (setjmp(jump)) {
+        vm->error_jump = saved_jump;
+        snapshot_writer_free(&w);
+        return NULL;
+    }
+    // 恢复后从主程序末尾的 OP_EXIT 继续：后面接着的代码（更长的模块）从这里开始执行
+    uint32_t main_length = module_main_length(vm->module);
+    if (main_length == 0 || vm->module->code[main_length - 1] != OP_EXIT) {
+        vm_error(vm, VM_ERROR_RUNTIME, "主程序没有以 OP_EXIT 结束，无法写入快照");
+    }
+    Env* globals = vm->global_env;
+    uint32_t global_count = (uint32_t)globals->var_count;
+    snapshot_reserve_vars(&w, global_count);
+    for (uint32_t i = 0; i < global_count; i++) {
+        SnapshotVar var = snapshot_value(&w, globals->values[i]);
+        var.name = snapshot_string(&w, globals->names[i]);
+        w.vars[i] = var;
+    }
+    // 处理对象和环境时可能遇到新的节点，直到两张表都处理完
+    uint32_t objects_done = 0;
+    uint32_t envs_done = 0;
+    while (objects_done < w.object_count || envs_done < w.env_count) {
+        while (objects_done < w.object_count) {
+            snapshot_fill_object(&w, objects_done++);
+        }
+        while (envs_done < w.env_count) {
+            snapshot_fill_env(&w, envs_done++);
+        }
+    }
+    uint8_t* data = snapshot_finish(&w, main_length - 1, global_count, size);
+    vm->error_jump = saved_jump;
+    snapshot_writer_free(&w);
+    return data;
+}
+
+// 快照段中各数组的位置
+typedef struct {
+    const SnapshotHeader* header;
+    const SnapshotVar* vars;
+    const SnapshotString* strings;
+    const SnapshotObject* objects;
+    const SnapshotFunction* functions;
+    const SnapshotEnv* envs;
+    const char* chars;
+} SnapshotImage;
+
+// 变量的值和名字都要指向表内；need_name 为真时必须有名字（全局变量、对象属性）
+static bool snapshot_var_valid(const SnapshotImage* image, const SnapshotVar* var, bool need_name) {
+    const SnapshotHeader* header = image->header;
+    if (var->name != SNAPSHOT_NONE) {
+        if (var->name >= header->string_count || !image->strings[var->name].interned) {
+            return false;
+        }
+    } else if (need_name) {
+        return false;
+    }
+    switch (var->type) {
+        case VAL_NUMBER:
+        case VAL_BOOLEAN:
+        case VAL_UNDEFINED:
+        case VAL_NULL:
+            return true;
+        case VAL_STRING:
+            return var->ref < header->string_count;
+        case VAL_OBJECT:
+            return var->ref < header->object_count;
+        case VAL_FUNCTION:
+            return var->ref < header->function_count;
+        default:
+            return false;
+    }
+}
+
+static inline bool range_valid(uint32_t first, uint32_t count, uint32_t limit) {
+    return (uint64_t)first + count <= limit;
+}
+
+// 定位快照段中的各数组并检查全部下标，重建时不再检查
+static bool snapshot_parse(const Module* snapshot, SnapshotImage* image) {
+    if (!snapshot->snapshot || snapshot->snapshot_size < sizeof(SnapshotHeader)) {
+        return false;
+    }
+    const SnapshotHeader* header = (const SnapshotHeader*)snapshot->snapshot;
+    if (header->magic != SNAPSHOT_MAGIC || header->global_count > header->var_count ||
+        header->var_count > INT32_MAX || header->resume >= snapshot->code_len ||
+        snapshot->code[header->resume] != OP_EXIT) {
+        return false;
+    }
+    uint64_t offsets[6];
+    offsets[0] = sizeof(SnapshotHeader);
+    offsets[1] = offsets[0] + (uint64_t)header->var_count * sizeof(SnapshotVar);
+    offsets[2] = offsets[1] + (uint64_t)header->string_count * sizeof(SnapshotString);
+    offsets[3] = offsets[2] + (uint64_t)header->object_count * sizeof(SnapshotObject);
+    offsets[4] = offsets[3] + (uint64_t)header->function_count * sizeof(SnapshotFunction);
+    offsets[5] = offsets[4] + (uint64_t)header->env_count * sizeof(SnapshotEnv);
+    if (offsets[5] + header->chars_size > snapshot->snapshot_size) {
+        return false;
+    }
+    image->header = header;
+    image->vars = (const SnapshotVar*)(snapshot->snapshot + offsets[0]);
+    image->strings = (const SnapshotString*)(snapshot->snapshot + offsets[1]);
+    image->objects = (const SnapshotObject*)(snapshot->snapshot + offsets[2]);
+    image->functions = (const SnapshotFunction*)(snapshot->snapshot + offsets[3]);
+    image->envs = (const SnapshotEnv*)(snapshot->snapshot + offsets[4]);
+    image->chars = (const char*)(snapshot->snapshot + offsets[5]);
+
+    for (uint32_t i = 0; i < header->string_count; i++) {
+        const SnapshotString* str = &image->strings[i];
+        if (str->offset > header->chars_size || str->length > header->chars_size - str->offset) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->var_count; i++) {
+        if (!snapshot_var_valid(image, &image->vars[i], i < header->global_count)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->object_count; i++) {
+        const SnapshotObject* obj = &image->objects[i];
+        if (!range_valid(obj->first, obj->count, header->var_count)) {
+            return false;
+        }
+        for (uint32_t j = 0; j < obj->count; j++) {
+            if (image->vars[obj->first + j].name == SNAPSHOT_NONE) {
+                return false;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < header->function_count; i++) {
+        const SnapshotFunction* fn = &image->functions[i];
+        if (fn->index >= snapshot->function_count ||
+            (fn->env != SNAPSHOT_GLOBAL && fn->env >= header->env_count)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->env_count; i++) {
+        const SnapshotEnv* env = &image->envs[i];
+        if (!range_valid(env->first, env->count, header->var_count) ||
+            (env->parent != SNAPSHOT_GLOBAL && env->parent >= i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// module 的开头是否就是快照所在的模块：主程序在继续位置之前的指令、全部常量和
+// 全部函数都相同（函数体按编号依次排在主程序之后，跳转都是相对偏移），内联缓存也够用
+static bool snapshot_module_matches(const Module* snapshot, const Module* module, uint32_t resume) {
+    if (module == snapshot) {
+        return true;
+    }
+    if (module->code_len < resume || memcmp(module->code, snapshot->code, resume) != 0 ||
+        module->constant_count < snapshot->constant_count ||
+        module->function_count < snapshot->function_count ||
+        module->cache_count < snapshot->cache_count) {
+        return false;
+    }
+    for (uint32_t i = 0; i < snapshot->constant_count; i++) {
+        const Constant* a = &snapshot->constants[i];
+        const Constant* b = &module->constants[i];
+        if (a->type != b->type || a->length != b->length) {
+            return false;
+        }
+        if (a->type == CONST_NUMBER ? memcmp(&a->as.number, &b->as.number, sizeof(double)) != 0
+                                    : memcmp(snapshot->string_data + a->as.offset,
+                                             module->string_data + b->as.offset, a->length) != 0) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < snapshot->function_count; i++) {
+        const FunctionInfo* a = &snapshot->functions[i];
+        const FunctionInfo* b = &module->functions[i];
+        uint32_t end = i + 1 < snapshot->function_count ? snapshot->functions[i + 1].entry : snapshot->code_len;
+        if (a->arity != b->arity || a->slot_count != b->slot_count || a->name != b->name ||
+            end < a->entry || end > snapshot->code_len || b->entry > module->code_len ||
+            end - a->entry > module->code_len - b->entry ||
+            memcmp(snapshot->code + a->entry, module->code + b->entry, end - a->entry) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 给对象追加一个新属性（按槽位顺序重建对象，属性多时和执行时一样转为字典模式），
+// 已有同名属性时返回 false
+static bool object_add_property(StackVM* vm, Object* obj, StringObject* key, Value value) {
+    if (!obj->dict) {
+        if (shape_lookup(obj->shape, key) >= 0) {
+            return false;
+        }
+        Shape* next_shape = shape_add_property(vm, obj->shape, key);
+        if (next_shape) {
+            int slot = next_shape->slot_count - 1;
+            if (slot >= obj->slot_capacity) {
+                int capacity = obj->slot_capacity < 4 ? 4 : obj->slot_capacity * 2;
+                Value* slots = pool_external_realloc(&vm->pool, obj->slots, capacity * sizeof(Value));
+                if (!slots) {
+                    vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+                }
+                obj->slots = slots;
+                obj->slot_capacity = capacity;
+            }
+            if (IS_HEAP_VALUE(value)) {
+                gc_inc_ref(AS_OBJ(value));
+            }
+            obj->shape = next_shape;
+            obj->slots[slot] = value;
+            return true;
+        }
+        object_to_dict(vm, obj);
+    } else if (dict_find(obj->dict, key) >= 0) {
+        return false;
+    }
+    dict_set(vm, obj, key, value);
+    return true;
+}
+
+// 重建中的堆：各表编号 -> 新建的节点。每个节点在这里持有一个引用，重建完成后释放
+typedef struct {
+    StringObject** strings;
+    Object** objects;
+    FunctionObject** functions;
+    Env** envs;
+    uint32_t string_count;   // 各表已创建的个数
+    uint32_t object_count;
+    uint32_t function_count;
+    uint32_t env_count;
+} SnapshotHeap;
+
+static void snapshot_heap_release(SnapshotHeap* heap) {
+#ifndef VM_TRACING_GC
+    for (uint32_t i = 0; i < heap->string_count; i++) {
+        gc_dec_ref((ObjectHeader*)heap->strings[i]);
+    }
+    for (uint32_t i = 0; i < heap->object_count; i++) {
+        gc_dec_ref((ObjectHeader*)heap->objects[i]);
+    }
+    for (uint32_t i = 0; i < heap->function_count; i++) {
+        gc_dec_ref((ObjectHeader*)heap->functions[i]);
+    }
+    for (uint32_t i = 0; i < heap->env_count; i++) {
+        free_env(heap->envs[i]);
+    }
+#endif
+    free(heap->strings);
+    free(heap->objects);
+    free(heap->functions);
+    free(heap->envs);
+    memset(heap, 0, sizeof(*heap));
+}
+
+static Value snapshot_heap_value(const SnapshotHeap* heap, const SnapshotVar* var) {
+    switch (var->type) {
+        case VAL_NUMBER:
+            return val_number(var->number);
+        case VAL_BOOLEAN:
+            return val_boolean(var->number != 0);
+        case VAL_NULL:
+            return val_null();
+        case VAL_STRING:
+            return val_obj((ObjectHeader*)heap->strings[var->ref]);
+        case VAL_OBJECT:
+            return val_obj((ObjectHeader*)heap->objects[var->ref]);
+        case VAL_FUNCTION:
+            return val_obj((ObjectHeader*)heap->functions[var->ref]);
+        default:
+            return val_undefined();
+    }
+}
+
+// 函数体只按创建处的作用域链校验过：闭包环境必须逐层和它一致（层数相同、每层槽位数相同），
+// 从未被创建过的函数没有校验过函数体，不能出现在快照中
+static bool snapshot_scope_matches(const StackVM* vm, const FunctionObject* fn) {
+    const FunctionScope* scope = &vm->function_scopes[fn->index];
+    if (!scope->created) {
+        return false;
+    }
+    const Env* env = fn->env ? fn->env : vm->global_env;
+    for (int level = 0; level < scope->depth; level++) {
+        if (env == vm->global_env || env->names || env->var_count != scope->slot_counts[level]) {
+            return false;
+        }
+        env = env->parent;
+    }
+    return env == vm->global_env;
+}
+
+// 先创建全部节点（环境按编号创建，父环境总是已经存在），再填写属性、闭包环境和变量
+static void snapshot_heap_build(StackVM* vm, const SnapshotImage* image, SnapshotHeap* heap) {
+    const SnapshotHeader* header = image->header;
+    heap->strings = malloc((header->string_count + 1) * sizeof(StringObject*));
+    heap->objects = malloc((header->object_count + 1) * sizeof(Object*));
+    heap->functions = malloc((header->function_count + 1) * sizeof(FunctionObject*));
+    heap->envs = malloc((header->env_count + 1) * sizeof(Env*));
+    if (!heap->strings || !heap->objects || !heap->functions || !heap->envs) {
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+    for (uint32_t i = 0; i < header->string_count; i++) {
+        const SnapshotString* record = &image->strings[i];
+        const char* chars = image->chars + record->offset;
+        StringObject* str;
+        if (record->interned) {
+            str = vm_intern(vm, chars, record->length);
+            gc_inc_ref((ObjectHeader*)str);
+        } else {
+            str = alloc_string_copy(vm, chars, record->length, hash_string(chars, record->length));
+        }
+        heap->strings[heap->string_count++] = str;
+    }
+    for (uint32_t i = 0; i < header->object_count; i++) {
+        heap->objects[heap->object_count++] = (Object*)AS_OBJ(val_object(vm));
+    }
+    for (uint32_t i = 0; i < header->function_count; i++) {
+        FunctionObject* fn = (FunctionObject*)create_object(vm, VAL_FUNCTION, sizeof(FunctionObject));
+        fn->index = (int)image->functions[i].index;
+        fn->env = NULL;
+        heap->functions[heap->function_count++] = fn;
+    }
+    for (uint32_t i = 0; i < header->env_count; i++) {
+        const SnapshotEnv* record = &image->envs[i];
+        Env* parent = record->parent != SNAPSHOT_GLOBAL ? heap->envs[record->parent] : vm->global_env;
+        heap->envs[heap->env_count++] = create_slot_env(vm, parent, (int)record->count);
+    }
+
+    for (uint32_t i = 0; i < header->object_count; i++) {
+        const SnapshotObject* record = &image->objects[i];
+        for (uint32_t j = 0; j < record->count; j++) {
+            const SnapshotVar* var = &image->vars[record->first + j];
+            if (!object_add_property(vm, heap->objects[i], heap->strings[var->name],
+                                     snapshot_heap_value(heap, var))) {
+                vm_error(vm, VM_ERROR_VERIFY, "快照已损坏：对象有重复的属性");
+            }
+        }
+    }
+    for (uint32_t i = 0; i < header->function_count; i++) {
+        uint32_t env = image->functions[i].env;
+        if (env != SNAPSHOT_GLOBAL) {
+            Env* closure_env = heap->envs[env];
+#ifndef VM_TRACING_GC
+            closure_env->ref_count++;
+#endif
+            heap->functions[i]->env = closure_env;
+        }
+        if (!snapshot_scope_matches(vm, heap->functions[i])) {
+            vm_error(vm, VM_ERROR_VERIFY, "快照已损坏：函数 %d 的闭包环境与校验得到的作用域不符",
+                     heap->functions[i]->index);
+        }
+    }
+    for (uint32_t i = 0; i < header->env_count; i++) {
+        const SnapshotEnv* record = &image->envs[i];
+        for (uint32_t j = 0; j < record->count; j++) {
+            env_set_slot(heap->envs[i], (int)j, snapshot_heap_value(heap, &image->vars[record->first + j]));
+        }
+    }
+    for (uint32_t i = 0; i < header->global_count; i++) {
+        const SnapshotVar* var = &image->vars[i];
+        env_set(vm->global_env, heap->strings[var->name], snapshot_heap_value(heap, var));
+    }
+}
+
+VMStatus vm_restore(StackVM* vm, const Module* snapshot, const Module* module) {
+    if (!module) {
+        module = snapshot;
+    }
+    VMStatus status = vm_reset(vm);
+    if (status != VM_OK) {
+        return status;
+    }
+    SnapshotImage image;
+    if (!snapshot_parse(snapshot, &image)) {
+        snprintf(vm->error, sizeof(vm->error), "快照文件无效或已损坏");
+        vm->status = VM_ERROR_VERIFY;
+        return vm->status;
+    }
+    if (!snapshot_module_matches(snapshot, module, image.header->resume)) {
+        snprintf(vm->error, sizeof(vm->error), "模块的开头与快照所在的模块不一致");
+        vm->status = VM_ERROR_VERIFY;
+        return vm->status;
+    }
+    status = vm_load(vm, module);
+    if (status != VM_OK) {
+        return status;
+    }
+    SnapshotHeap heap;
+    memset(&heap, 0, sizeof(heap));
+    jmp_buf jump;
+    jmp_buf* saved_jump = vm->error_jump;
+    vm->error_jump = &jump;
+    if (setjmp(jump)) {
+        // 退回到刚创建时的状态，错误描述保留给调用方
+        vm->error_jump = saved_jump;
+        snapshot_heap_release(&heap);
+        status = vm->status;
+        char message[sizeof(vm->error)];
+        memcpy(message, vm->error, sizeof(message));
+        vm_reset(vm);
+        memcpy(vm->error, message, sizeof(message));
+        vm->status = status;
+        return status;
+    }
+    snapshot_heap_build(vm, &image, &heap);
+    snapshot_heap_release(&heap);
+    vm->error_jump = saved_jump;
+    // 寄存器字节码只能从主程序开头执行，从快照的位置继续时改用栈式解释器
+    reg_unload(vm);
+    vm->entry = (int)image.header->resume;
+    return VM_OK;
+}
+
+// --------------- 性能剖析 ---------------
+
+// 剖析用时钟：x86 上读时间戳计数器，其他平台用单调时钟（纳秒）
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROFILE_CLOCK_UNIT "周期"
+static inline uint64_t profile_clock(void) {
+    return __builtin_ia32_rdtsc();
+}
+#else
+#define PROFILE_CLOCK_UNIT "纳秒"
+static inline uint64_t profile_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+// 内存不足时返回 -1
+static int profile_add_node(VMProfile* profile, int parent, int function) {
+    if (profile->node_count == profile->node_capacity) {
+        int capacity = profile->node_capacity < 64 ? 64 : profile->node_capacity * 2;
+        ProfileNode* nodes = realloc(profile->nodes, capacity * sizeof(ProfileNode));
+        if (!nodes) {
+            return -1;
+        }
+        profile->nodes = nodes;
+        profile->node_capacity = capacity;
+    }
+    int index = profile->node_count++;
+    ProfileNode* node = &profile->nodes[index];
+    memset(node, 0, sizeof(ProfileNode));
+    node->parent = parent;
+    node->function = function;
+    node->first_child = -1;
+    node->next_sibling = -1;
+    if (parent >= 0) {
+        node->next_sibling = profile->nodes[parent].first_child;
+        profile->nodes[parent].first_child = index;
+    }
+    return index;
+}
+
+VMProfile* vm_profile_create(const Module* module) {
+    VMProfile* profile = calloc(1, sizeof(VMProfile));
+    if (!profile) {
+        return NULL;
+    }
+    size_t code_len = module->code_len > 0 ? module->code_len : 1;
+    profile->module = module;
+    profile->pair_counts = calloc((size_t)VM_PROFILE_OPCODES * VM_PROFILE_OPCODES, sizeof(uint64_t));
+    profile->offset_counts = calloc(code_len, sizeof(uint64_t));
+    profile->offset_cycles = calloc(code_len, sizeof(uint64_t));
+    if (!profile->pair_counts || !profile->offset_counts || !profile->offset_cycles ||
+        profile_add_node(profile, -1, -1) < 0) {
+        vm_profile_free(profile);
+        return NULL;
+    }
+    profile->last_offset = -1;
+    return profile;
+}
+
+void vm_profile_free(VMProfile* profile) {
+    if (profile) {
+        free(profile->pair_counts);
+        free(profile->offset_counts);
+        free(profile->offset_cycles);
+        free(profile->nodes);
+        free(profile);
+    }
+}
+
+void vm_set_profile(StackVM* vm, VMProfile* profile) {
+    vm->profile = profile;
+}
+
+// 把从上一条指令开始到现在的耗时和分配记到它名下
+static void profile_charge(StackVM* vm, VMProfile* profile, uint64_t now) {
+    if (profile->last_offset < 0) {
+        return;
+    }
+    uint8_t op = profile->module->code[profile->last_offset];
+    uint64_t elapsed = now - profile->last_time;
+    profile->cycles += elapsed;
+    profile->op_cycles[op] += elapsed;
+    profile->op_allocs[op] += vm->pool.stats.alloc_count - profile->last_allocs;
+    profile->offset_cycles[profile->last_offset] += elapsed;
+    profile->nodes[profile->current].cycles += elapsed;
+}
+
+// 每条指令开始时调用（offset 为操作码的偏移）
+static void profile_step(StackVM* vm, int offset) {
+    VMProfile* profile = vm->profile;
+    profile_charge(vm, profile, profile_clock());
+
+    // 调用深度的变化只可能来自上一条 OP_CALL / OP_RET：进入被调函数或回到调用者
+    while (profile->depth > vm->call_sp) {
+        profile->current = profile->nodes[profile->current].parent;
+        profile->depth--;
+    }
+    while (profile->depth < vm->call_sp) {
+        int function = vm->call_stack[profile->depth].function;
+        int child = profile->nodes[profile->current].first_child;
+        while (child >= 0 && profile->nodes[child].function != function) {
+            child = profile->nodes[child].next_sibling;
+        }
+        if (child < 0 && (child = profile_add_node(profile, profile->current, function)) < 0) {
+            vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+        }
+        profile->current = child;
+        profile->depth++;
+    }
+
+    uint8_t op = profile->module->code[offset];
+    if (profile->last_offset >= 0) {
+        uint8_t prev = profile->module->code[profile->last_offset];
+        profile->pair_counts[prev * VM_PROFILE_OPCODES + op]++;
+    }
+    profile->instructions++;
+    profile->op_counts[op]++;
+    profile->offset_counts[offset]++;
+    profile->nodes[profile->current].instructions++;
+    profile->last_offset = offset;
+    profile->last_allocs = vm->pool.stats.alloc_count;
+    profile->last_time = profile_clock(); // 重新读时钟，记录本身的开销不计入下一条指令
+}
+
+// 一次执行开始 / 结束（正常结束或出错）时调用
+static void profile_begin(StackVM* vm) {
+    VMProfile* profile = vm->profile;
+    profile->current = 0;
+    profile->depth = 0;
+    profile->last_offset = -1;
+}
+
+static void profile_end(StackVM* vm) {
+    profile_charge(vm, vm->profile, profile_clock());
+    vm->profile->last_offset = -1;
+}
+
+// 报告的排序项：按 key 从大到小
+typedef struct {
+    uint64_t key;
+    uint32_t index;
+} ProfileEntry;
+
+static int profile_entry_compare(const void* a, const void* b) {
+    const ProfileEntry* x = (const ProfileEntry*)a;
+    const ProfileEntry* y = (const ProfileEntry*)b;
+    if (x->key != y->key) {
+        return x->key < y->key ? 1 : -1;
+    }
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+// 取出 values 中非 0 的项并排序，返回项数（内存不足时返回 -1）
+static int profile_sorted(const uint64_t* values, size_t count, ProfileEntry** entries) {
+    int found = 0;
+    for (size_t i = 0; i < count; i++) {
+        found += values[i] != 0;
+    }
+    *entries = malloc((found > 0 ? found : 1) * sizeof(ProfileEntry));
+    if (!*entries) {
+        return -1;
+    }
+    int n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (values[i] != 0) {
+            (*entries)[n].key = values[i];
+            (*entries)[n].index = (uint32_t)i;
+            n++;
+        }
+    }
+    qsort(*entries, n, sizeof(ProfileEntry), profile_entry_compare);
+    return n;
+}
+
+static double profile_percent(uint64_t part, uint64_t total) {
+    return total > 0 ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+// 偏移所在语句的源码位置（调试信息按偏移递增排列），没有调试信息时返回 NULL
+static const DebugLine* profile_line(const Module* module, uint32_t offset) {
+    const DebugLine* found = NULL;
+    uint32_t low = 0, high = module->line_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (module->lines[mid].offset <= offset) {
+            found = &module->lines[mid];
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return found;
+}
+
+#define PROFILE_TOP 20 // 操作码对和热点指令各列出的项数
+
+// 输出表头的一个单元格：printf 的宽度按字节计，中文按显示宽度（2 列）补齐。
+// width 为负时左对齐（宽度含与下一列之间的空格）
+static void profile_header(FILE* out, const char* text, int width) {
+    int columns = 0;
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        if ((*c & 0xC0) != 0x80) {
+            columns += *c < 0x80 ? 1 : 2;
+        }
+    }
+    int pad = (width < 0 ? -width : width) - columns;
+    if (width < 0) {
+        fputs(text, out);
+    }
+    for (int i = 0; i < pad; i++) {
+        fputc(' ', out);
+    }
+    if (width > 0) {
+        fputs(text, out);
+    }
+}
+
+void vm_profile_report(const VMProfile* profile, FILE* out) {
+    const Module* module = profile->module;
+    ProfileEntry* entries;
+    int n;
+
+    fprintf(out, "==== 性能剖析 ====\n");
+    fprintf(out, "执行指令 %llu 条，耗时 %llu %s\n",
+            (unsigned long long)profile->instructions, (unsigned long long)profile->cycles, PROFILE_CLOCK_UNIT);
+
+    fprintf(out, "\n-- 操作码（按耗时排序）--\n");
+    profile_header(out, "操作码", -17);
+    profile_header(out, "次数", 12);
+    profile_header(out, "占比", 8);
+    profile_header(out, "耗时", 15);
+    profile_header(out, "占比", 8);
+    profile_header(out, "每条", 11);
+    profile_header(out, "分配", 11);
+    fputc('\n', out);
+    if ((n = profile_sorted(profile->op_cycles, VM_PROFILE_OPCODES, &entries)) < 0) {
+        fprintf(out, "内存分配失败！\n");
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        uint32_t op = entries[i].index;
+        uint64_t count = profile->op_counts[op];
+        fprintf(out, "%-16s %12llu %6.2f%% %14llu %6.2f%% %10.1f %10llu\n", vm_op_name((uint8_t)op),
+                (unsigned long long)count, profile_percent(count, profile->instructions),
+                (unsigned long long)profile->op_cycles[op], profile_percent(profile->op_cycles[op], profile->cycles),
+                count > 0 ? (double)profile->op_cycles[op] / (double)count : 0.0,
+                (unsigned long long)profile->op_allocs[op]);
+    }
+    free(entries);
+
+    fprintf(out, "\n-- 相邻操作码对（前 %d）--\n", PROFILE_TOP);
+    profile_header(out, "前一条 -> 后一条", -35);
+    profile_header(out, "次数", 12);
+    profile_header(out, "占比", 8);
+    fputc('\n', out);
+    if ((n = profile_sorted(profile->pair_counts, (size_t)VM_PROFILE_OPCODES * VM_PROFILE_OPCODES, &entries)) < 0) {
+        fprintf(out, "内存分配失败！\n");
+        return;
+    }
+    for (int i = 0; i < n && i < PROFILE_TOP; i++) {
+        char pair[64];
+        snprintf(pair, sizeof(pair), "%s -> %s", vm_op_name((uint8_t)(entries[i].index / VM_PROFILE_OPCODES)),
+                 vm_op_name((uint8_t)(entries[i].index % VM_PROFILE_OPCODES)));
+        fprintf(out, "%-34s %12llu %6.2f%%\n", pair, (unsigned long long)entries[i].key,
+                profile_percent(entries[i].key, profile->instructions));
+    }
+    free(entries);
+
+    fprintf(out, "\n-- 热点指令（前 %d）--\n", PROFILE_TOP);
+    profile_header(out, "偏移", 8);
+    profile_header(out, "  操作码", -19);
+    profile_header(out, "次数", 12);
+    profile_header(out, "耗时", 15);
+    profile_header(out, "占比", 8);
+    fputs("  源码位置\n", out);
+    if ((n = profile_sorted(profile->offset_cycles, module->code_len, &entries)) < 0) {
+        fprintf(out, "内存分配失败！\n");
+        return;
+    }
+    for (int i = 0; i < n && i < PROFILE_TOP; i++) {
+        uint32_t offset = entries[i].index;
+        const DebugLine* line = profile_line(module, offset);
+        char where[32] = "?";
+        if (line) {
+            snprintf(where, sizeof(where), "%u:%u", line->line, line->col);
+        }
+        fprintf(out, "%8u  %-16s %12llu %14llu %6.2f%%  %s\n", offset, vm_op_name(module->code[offset]),
+                (unsigned long long)profile->offset_counts[offset], (unsigned long long)entries[i].key,
+                profile_percent(entries[i].key, profile->cycles), where);
+    }
+    free(entries);
+}
+
+// 调用上下文树上的函数名（根节点为主程序）
+static void profile_write_frame(const Module* module, int function, FILE* out) {
+    if (function < 0) {
+        fputs("<main>", out);
+        return;
+    }
+    const Constant* name = &module->constants[module->functions[function].name];
+    fwrite(module->string_data + name->as.offset, 1, name->length, out);
+}
+
+// 每个有自身耗时的节点输出一行「主程序;调用者;...;函数 耗时」，可直接交给 flamegraph.pl
+bool vm_profile_write_folded(const VMProfile* profile, FILE* out) {
+    int* path = malloc((profile->node_count > 0 ? profile->node_count : 1) * sizeof(int));
+    if (!path) {
+        return false;
+    }
+    for (int i = 0; i < profile->node_count; i++) {
+        const ProfileNode* node = &profile->nodes[i];
+        if (node->cycles == 0) {
+            continue;
+        }
+        int depth = 0;
+        for (int n = i; n >= 0; n = profile->nodes[n].parent) {
+            path[depth++] = n;
+        }
+        while (depth > 0) {
+            profile_write_frame(profile->module, profile->nodes[path[--depth]].function, out);
+            fputc(depth > 0 ? ';' : ' ', out);
+        }
+        fprintf(out, "%llu\n", (unsigned long long)node->cycles);
+    }
+    free(path);
+    return !ferror(out);
+}
+
+// --------------- 基线 JIT（x86-64）---------------
+// 函数的调用次数达到阈值时，从入口开始逐条翻译，直到第一条没有模板的指令（函数总以
+// OP_RET 结束，调用、全局变量、作用域等指令都留给解释器）。本地代码的寄存器约定：
+// r12 指向值栈顶（下一个空位），r13 指向栈帧槽位，r14 为虚拟机；rax/rcx/rdx/rsi/rdi
+// 和 xmm0/xmm1 为临时寄存器。退出时把栈顶写回 vm->sp，在 eax 中返回继续执行的偏移。
+// 每个模板先做完全部检查再修改状态，检查失败时跳到退出桩：此时虚拟机的状态与解释器
+// 即将执行该指令时完全相同，解释器从这条指令接着执行即可（同时记一次去优化）。
+// 常量、驻留字符串的地址和内联缓存记录的形状都直接编进代码，本地代码属于加载了
+// 该模块的这个虚拟机，模块卸载时一起释放
+#ifdef VM_JIT
+
+#define JIT_MIN_OPS 2        // 入口处可翻译的指令少于此数时不值得编译
+#define JIT_DEOPT_LIMIT 16   // 去优化超过此次数且占进入次数的比例过高时丢弃本地代码
+#define JIT_DEOPT_RATIO 4    // 即去优化超过进入次数的 1/4
+
+// 模板依赖的值布局：类型标签在前 4 字节，数据在偏移 8；引用计数在对象头开头
+typedef char jit_value_layout_check[(sizeof(Value) == 16 && offsetof(Value, data) == 8) ? 1 : -1];
+#ifndef VM_TRACING_GC
+typedef char jit_header_layout_check[offsetof(ObjectHeader, ref_count) == 0 ? 1 : -1];
+#endif
+
+#define JIT_VALUE_SIZE ((int32_t)sizeof(Value))
+#define JIT_DATA ((int32_t)offsetof(Value, data))
+#define JIT_HEAP_TYPES ((1u << VAL_STRING) | (1u << VAL_OBJECT) | (1u << VAL_FUNCTION))
+
+enum {
+    JIT_RAX = 0, JIT_RCX = 1, JIT_RDX = 2, JIT_RSI = 6, JIT_RDI = 7,
+    JIT_R12 = 12, JIT_R13 = 13, JIT_R14 = 14
+};
+
+// 条件跳转的条件码
+#define JIT_CC_NE 0x5
+#define JIT_CC_NC 0x3
+
+// 待回填的跳转：跳到 ip 处的退出桩
+typedef struct {
+    size_t at;  // rel32 的位置
+    int ip;
+} JitFixup;
+
+typedef struct {
+    uint8_t* code;
+    size_t length;
+    size_t capacity;
+    JitFixup* fixups;
+    int fixup_count;
+    int fixup_capacity;
+    bool failed;   // 内存不足
+} JitBuffer;
+
+static void jit_byte(JitBuffer* b, uint8_t byte) {
+    if (b->length == b->capacity) {
+        size_t capacity = b->capacity < 256 ? 256 : b->capacity * 2;
+        uint8_t* code = realloc(b->code, capacity);
+        if (!code) {
+            b->failed = true;
+            b->length = 0; // 继续写入也不会越界，结果被丢弃
+            return;
+        }
+        b->code = code;
+        b->capacity = capacity;
+    }
+    b->code[b->length++] = byte;
+}
+
+static void jit_u32(JitBuffer* b, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        jit_byte(b, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void jit_u64(JitBuffer* b, uint64_t value) {
+    jit_u32(b, (uint32_t)value);
+    jit_u32(b, (uint32_t)(value >> 32));
+}
+
+static void jit_patch32(JitBuffer* b, size_t at, uint32_t value) {
+    if (!b->failed) {
+        for (int i = 0; i < 4; i++) {
+            b->code[at + i] = (uint8_t)(value >> (8 * i));
+        }
+    }
+}
+
+// 访问 [base + disp32] 的指令：[强制前缀] REX [0F] 操作码 ModRM(mod=10) [SIB] disp32
+static void jit_mem(JitBuffer* b, uint8_t prefix, bool wide, bool escape, uint8_t opcode,
+                    int reg, int base, int32_t disp) {
+    if (prefix) {
+        jit_byte(b, prefix);
+    }
+    jit_byte(b, (uint8_t)(0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3)));
+    if (escape) {
+        jit_byte(b, 0x0F);
+    }
+    jit_byte(b, opcode);
+    jit_byte(b, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+    if ((base & 7) == 4) {
+        jit_byte(b, 0x24); // rsp/r12 作基址时需要 SIB
+    }
+    jit_u32(b, (uint32_t)disp);
+}
+
+static void jit_load64(JitBuffer* b, int reg, int base, int32_t disp) {
+    jit_mem(b, 0, true, false, 0x8B, reg, base, disp);
+}
+
+static void jit_store64(JitBuffer* b, int reg, int base, int32_t disp) {
+    jit_mem(b, 0, true, false, 0x89, reg, base, disp);
+}
+
+static void jit_load32(JitBuffer* b, int reg, int base, int32_t disp) {
+    jit_mem(b, 0, false, false, 0x8B, reg, base, disp);
+}
+
+static void jit_store32(JitBuffer* b, int reg, int base, int32_t disp) {
+    jit_mem(b, 0, false, false, 0x89, reg, base, disp);
+}
+
+// mov dword [base + disp], imm32
+static void jit_store_imm32(JitBuffer* b, int base, int32_t disp, uint32_t imm) {
+    jit_mem(b, 0, false, false, 0xC7, 0, base, disp);
+    jit_u32(b, imm);
+}
+
+// cmp dword [base + disp], imm32
+static void jit_cmp_imm32(JitBuffer* b, int base, int32_t disp, uint32_t imm) {
+    jit_mem(b, 0, false, false, 0x81, 7, base, disp);
+    jit_u32(b, imm);
+}
+
+// movsd/addsd/subsd/mulsd/divsd xmm, [base + disp] 与 movsd [base + disp], xmm
+#define JIT_MOVSD_LOAD 0x10
+#define JIT_MOVSD_STORE 0x11
+#define JIT_ADDSD 0x58
+#define JIT_MULSD 0x59
+#define JIT_SUBSD 0x5C
+#define JIT_DIVSD 0x5E
+static void jit_sse(JitBuffer* b, uint8_t opcode, int xmm, int base, int32_t disp) {
+    jit_mem(b, 0xF2, false, true, opcode, xmm, base, disp);
+}
+
+// ucomisd xmm, [base + disp]
+static void jit_ucomisd(JitBuffer* b, int xmm, int base, int32_t disp) {
+    jit_mem(b, 0x66, false, true, 0x2E, xmm, base, disp);
+}
+
+// mov rax, imm64
+static void jit_mov_rax_imm64(JitBuffer* b, uint64_t imm) {
+    jit_byte(b, 0x48);
+    jit_byte(b, 0xB8);
+    jit_u64(b, imm);
+}
+
+// add/sub r12, imm8：移动栈顶
+static void jit_move_top(JitBuffer* b, int values) {
+    int bytes = values * JIT_VALUE_SIZE;
+    jit_byte(b, 0x49);
+    jit_byte(b, 0x83);
+    jit_byte(b, bytes >= 0 ? 0xC4 : 0xEC);
+    jit_byte(b, (uint8_t)(bytes >= 0 ? bytes : -bytes));
+}
+
+// 条件跳转到 ip 处的退出桩（去优化）
+static void jit_guard(JitBuffer* b, uint8_t cc, int ip) {
+    jit_byte(b, 0x0F);
+    jit_byte(b, (uint8_t)(0x80 | cc));
+    if (b->fixup_count == b->fixup_capacity) {
+        int capacity = b->fixup_capacity < 16 ? 16 : b->fixup_capacity * 2;
+        JitFixup* fixups = realloc(b->fixups, capacity * sizeof(JitFixup));
+        if (!fixups) {
+            b->failed = true;
+            return;
+        }
+        b->fixups = fixups;
+        b->fixup_capacity = capacity;
+    }
+    b->fixups[b->fixup_count].at = b->length;
+    b->fixups[b->fixup_count].ip = ip;
+    b->fixup_count++;
+    jit_u32(b, 0);
+}
+
+// 检查 [base + disp] 处的值是数值
+static void jit_guard_number(JitBuffer* b, int base, int32_t disp, int ip) {
+    jit_cmp_imm32(b, base, disp, VAL_NUMBER);
+    jit_guard(b, JIT_CC_NE, ip);
+}
+
+#ifndef VM_TRACING_GC
+// 以 eax 中的类型判断值是否为堆对象：mov ecx, 掩码; bt ecx, eax，随后的 jnc 跳过 skip 字节
+static void jit_skip_unless_heap(JitBuffer* b, uint8_t skip) {
+    jit_byte(b, 0xB9);
+    jit_u32(b, JIT_HEAP_TYPES);
+    jit_byte(b, 0x0F);
+    jit_byte(b, 0xA3);
+    jit_byte(b, 0xC1);
+    jit_byte(b, 0x70 | JIT_CC_NC);
+    jit_byte(b, skip);
+}
+
+// 调用 gc_dec_ref(rdi)（10 + 2 字节）
+static void jit_call_release(JitBuffer* b) {
+    jit_mov_rax_imm64(b, (uint64_t)(uintptr_t)&gc_dec_ref);
+    jit_byte(b, 0xFF);
+    jit_byte(b, 0xD0);
+}
+#endif
+
+// 类型在 eax、数据在 rdx 的值被新的位置持有：堆对象的引用计数加一（inc dword [rdx]）
+static void jit_retain(JitBuffer* b) {
+#ifdef VM_TRACING_GC
+    (void)b;
+#else
+    jit_skip_unless_heap(b, 2);
+    jit_byte(b, 0xFF);
+    jit_byte(b, 0x02);
+#endif
+}
+
+// 释放类型在 eax、数据在 rdx 的值（对应解释器的 val_free），会调用 C 代码
+static void jit_release(JitBuffer* b) {
+#ifdef VM_TRACING_GC
+    (void)b;
+#else
+    jit_skip_unless_heap(b, 15);
+    jit_byte(b, 0x48); // mov rdi, rdx
+    jit_byte(b, 0x89);
+    jit_byte(b, 0xD7);
+    jit_call_release(b);
+#endif
+}
+
+// 按单态内联缓存读取 [base + disp] 处对象的属性，结果的类型放在 eax、数据放在 rdx，
+// 对象指针留在 rsi。不是对象或形状不符时去优化
+static void jit_emit_prop_load(JitBuffer* b, const InlineCacheEntry* entry, int base, int32_t disp, int ip) {
+    jit_cmp_imm32(b, base, disp, VAL_OBJECT);
+    jit_guard(b, JIT_CC_NE, ip);
+    jit_load64(b, JIT_RSI, base, disp + JIT_DATA);
+    jit_load64(b, JIT_RCX, JIT_RSI, (int32_t)offsetof(Object, shape));
+    jit_cmp_imm32(b, JIT_RCX, (int32_t)offsetof(Shape, id), (uint32_t)entry->shape_id);
+    jit_guard(b, JIT_CC_NE, ip);
+    if (entry->slot >= 0) {
+        jit_load64(b, JIT_RCX, JIT_RSI, (int32_t)offsetof(Object, slots));
+        jit_load32(b, JIT_RAX, JIT_RCX, entry->slot * JIT_VALUE_SIZE);
+        jit_load64(b, JIT_RDX, JIT_RCX, entry->slot * JIT_VALUE_SIZE + JIT_DATA);
+    } else {
+        jit_byte(b, 0xB8); // mov eax, VAL_UNDEFINED（不存在的属性）
+        jit_u32(b, VAL_UNDEFINED);
+    }
+}
+
+// 单态的内联缓存项（其他状态不翻译）
+static const InlineCacheEntry* jit_monomorphic(StackVM* vm, uint16_t cache) {
+    const InlineCache* ic = &vm->caches[cache];
+    return ic->count == 1 && !ic->entries[0].next_shape ? &ic->entries[0] : NULL;
+}
+
+// 翻译 ip 处的一条指令，没有对应模板时返回 false（不生成任何代码）
+static bool jit_emit_op(StackVM* vm, JitBuffer* b, const uint8_t* code, int ip) {
+    const uint8_t* operands = code + ip + 1;
+    switch (code[ip]) {
+        case OP_PUSH_NUM: {
+            Value constant = vm->constants[read_u16(operands, 0)];
+            uint64_t bits;
+            memcpy(&bits, &constant.data.number, sizeof(bits));
+            jit_store_imm32(b, JIT_R12, 0, VAL_NUMBER);
+            jit_mov_rax_imm64(b, bits);
+            jit_store64(b, JIT_RAX, JIT_R12, JIT_DATA);
+            jit_move_top(b, 1);
+            return true;
+        }
+        case OP_PUSH_STR: {
+            // 驻留字符串在模块卸载前一直存在，地址直接编进代码
+            jit_store_imm32(b, JIT_R12, 0, VAL_STRING);
+            jit_mov_rax_imm64(b, (uint64_t)(uintptr_t)AS_OBJ(vm->constants[read_u16(operands, 0)]));
+            jit_store64(b, JIT_RAX, JIT_R12, JIT_DATA);
+#ifndef VM_TRACING_GC
+            jit_byte(b, 0xFF); // inc dword [rax]
+            jit_byte(b, 0x00);
+#endif
+            jit_move_top(b, 1);
+            return true;
+        }
+        case OP_PUSH_BOOL:
+            jit_store_imm32(b, JIT_R12, 0, VAL_BOOLEAN);
+            jit_mem(b, 0, true, false, 0xC7, 0, JIT_R12, JIT_DATA); // mov qword [r12 + 8], imm32
+            jit_u32(b, operands[0] ? 1 : 0);
+            jit_move_top(b, 1);
+            return true;
+        case OP_PUSH_UNDEFINED:
+        case OP_PUSH_NULL:
+            jit_store_imm32(b, JIT_R12, 0, code[ip] == OP_PUSH_NULL ? VAL_NULL : VAL_UNDEFINED);
+            jit_move_top(b, 1);
+            return true;
+        case OP_LOAD_SLOT: {
+            int32_t slot = operands[0] * JIT_VALUE_SIZE;
+            jit_load32(b, JIT_RAX, JIT_R13, slot);
+            jit_load64(b, JIT_RDX, JIT_R13, slot + JIT_DATA);
+            jit_store32(b, JIT_RAX, JIT_R12, 0);
+            jit_store64(b, JIT_RDX, JIT_R12, JIT_DATA);
+            jit_retain(b);
+            jit_move_top(b, 1);
+            return true;
+        }
+        case OP_STORE_SLOT: {
+            // 先释放槽位中的旧值，再把栈顶的值（连同引用）移进槽位
+            int32_t slot = operands[0] * JIT_VALUE_SIZE;
+            jit_load32(b, JIT_RAX, JIT_R13, slot);
+            jit_load64(b, JIT_RDX, JIT_R13, slot + JIT_DATA);
+            jit_release(b);
+            jit_move_top(b, -1);
+            jit_load64(b, JIT_RAX, JIT_R12, 0);
+            jit_load64(b, JIT_RDX, JIT_R12, JIT_DATA);
+            jit_store64(b, JIT_RAX, JIT_R13, slot);
+            jit_store64(b, JIT_RDX, JIT_R13, slot + JIT_DATA);
+            return true;
+        }
+        case OP_POP:
+            jit_move_top(b, -1);
+            jit_load32(b, JIT_RAX, JIT_R12, 0);
+            jit_load64(b, JIT_RDX, JIT_R12, JIT_DATA);
+            jit_release(b);
+            return true;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV: {
+            // 只翻译数值运算，字符串拼接和类型转换去优化到解释器
+            uint8_t opcode = code[ip] == OP_ADD ? JIT_ADDSD : code[ip] == OP_SUB ? JIT_SUBSD :
+                             code[ip] == OP_MUL ? JIT_MULSD : JIT_DIVSD;
+            jit_guard_number(b, JIT_R12, -2 * JIT_VALUE_SIZE, ip);
+            jit_guard_number(b, JIT_R12, -JIT_VALUE_SIZE, ip);
+            jit_sse(b, JIT_MOVSD_LOAD, 0, JIT_R12, -2 * JIT_VALUE_SIZE + JIT_DATA);
+            jit_sse(b, opcode, 0, JIT_R12, -JIT_VALUE_SIZE + JIT_DATA);
+            jit_sse(b, JIT_MOVSD_STORE, 0, JIT_R12, -2 * JIT_VALUE_SIZE + JIT_DATA);
+            jit_move_top(b, -1);
+            return true;
+        }
+        case OP_LT:
+        case OP_LE:
+        case OP_GT:
+        case OP_GE: {
+            // 数值大小比较：x < y 按 y > x 比较，使 NaN（无序）时 seta/setae 都得到 false
+            bool less = code[ip] == OP_LT || code[ip] == OP_LE;
+            bool or_equal = code[ip] == OP_LE || code[ip] == OP_GE;
+            int32_t x = -2 * JIT_VALUE_SIZE;
+            int32_t y = -JIT_VALUE_SIZE;
+            jit_guard_number(b, JIT_R12, x, ip);
+            jit_guard_number(b, JIT_R12, y, ip);
+            jit_sse(b, JIT_MOVSD_LOAD, 0, JIT_R12, (less ? y : x) + JIT_DATA);
+            jit_ucomisd(b, 0, JIT_R12, (less ? x : y) + JIT_DATA);
+            jit_byte(b, 0x0F); // seta/setae al
+            jit_byte(b, or_equal ? 0x93 : 0x97);
+            jit_byte(b, 0xC0);
+            jit_byte(b, 0x0F); // movzx eax, al
+            jit_byte(b, 0xB6);
+            jit_byte(b, 0xC0);
+            jit_store_imm32(b, JIT_R12, x, VAL_BOOLEAN);
+            jit_store64(b, JIT_RAX, JIT_R12, x + JIT_DATA);
+            jit_move_top(b, -1);
+            return true;
+        }
+        case OP_ADD_SLOT_SLOT: {
+            int32_t a = operands[0] * JIT_VALUE_SIZE;
+            int32_t c = operands[1] * JIT_VALUE_SIZE;
+            jit_guard_number(b, JIT_R13, a, ip);
+            jit_guard_number(b, JIT_R13, c, ip);
+            jit_sse(b, JIT_MOVSD_LOAD, 0, JIT_R13, a + JIT_DATA);
+            jit_sse(b, JIT_ADDSD, 0, JIT_R13, c + JIT_DATA);
+            jit_store_imm32(b, JIT_R12, 0, VAL_NUMBER);
+            jit_sse(b, JIT_MOVSD_STORE, 0, JIT_R12, JIT_DATA);
+            jit_move_top(b, 1);
+            return true;
+        }
+        case OP_ADD_NUM: {
+            Value constant = vm->constants[read_u16(operands, 0)];
+            if (!IS_NUMBER(constant)) {
+                return false;
+            }
+            uint64_t bits;
+            memcpy(&bits, &constant.data.number, sizeof(bits));
+            jit_guard_number(b, JIT_R12, -JIT_VALUE_SIZE, ip);
+            jit_mov_rax_imm64(b, bits);
+            jit_byte(b, 0x66); // movq xmm1, rax
+            jit_byte(b, 0x48);
+            jit_byte(b, 0x0F);
+            jit_byte(b, 0x6E);
+            jit_byte(b, 0xC8);
+            jit_sse(b, JIT_MOVSD_LOAD, 0, JIT_R12, -JIT_VALUE_SIZE + JIT_DATA);
+            jit_byte(b, 0xF2); // addsd xmm0, xmm1
+            jit_byte(b, 0x0F);
+            jit_byte(b, 0x58);
+            jit_byte(b, 0xC1);
+            jit_sse(b, JIT_MOVSD_STORE, 0, JIT_R12, -JIT_VALUE_SIZE + JIT_DATA);
+            return true;
+        }
+        case OP_GET_SLOT_PROP: {
+            const InlineCacheEntry* entry = jit_monomorphic(vm, read_u16(operands, 3));
+            if (!entry) {
+                return false;
+            }
+            jit_emit_prop_load(b, entry, JIT_R13, operands[0] * JIT_VALUE_SIZE, ip);
+            jit_store32(b, JIT_RAX, JIT_R12, 0);
+            jit_store64(b, JIT_RDX, JIT_R12, JIT_DATA);
+            jit_retain(b);
+            jit_move_top(b, 1);
+            return true;
+        }
+        case OP_GET_PROP: {
+            // 属性值替换栈顶的对象，先持有属性值再释放对象（同解释器的顺序）
+            const InlineCacheEntry* entry = jit_monomorphic(vm, read_u16(operands, 2));
+            if (!entry) {
+                return false;
+            }
+            jit_emit_prop_load(b, entry, JIT_R12, -JIT_VALUE_SIZE, ip);
+            jit_store32(b, JIT_RAX, JIT_R12, -JIT_VALUE_SIZE);
+            jit_store64(b, JIT_RDX, JIT_R12, -JIT_VALUE_SIZE + JIT_DATA);
+            jit_retain(b);
+#ifndef VM_TRACING_GC
+            jit_byte(b, 0x48); // mov rdi, rsi
+            jit_byte(b, 0x89);
+            jit_byte(b, 0xF7);
+            jit_call_release(b);
+#endif
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static void jit_free_code(JitFunction* compiled) {
+    if (compiled->memory) {
+        munmap(compiled->memory, compiled->memory_size);
+    }
+    compiled->memory = NULL;
+    compiled->memory_size = 0;
+    compiled->code = NULL;
+}
+
+// 编译函数 index，成功时 compiled->code 可用；失败则不再尝试
+static bool jit_compile(StackVM* vm, JitFunction* compiled, int index) {
+    const Module* module = vm->module;
+    const uint8_t* code = module->code;
+    int ip = (int)module->functions[index].entry;
+    JitBuffer b = {0};
+    compiled->state = JIT_UNSUPPORTED;
+
+    // 序言：保存 r12 - r14（连同返回地址共 32 字节，调用 C 函数时栈保持 16 字节对齐），
+    // r14 = vm，r13 = frame，r12 = vm->stack + vm->sp
+    static const uint8_t prologue[] = {
+        0x41, 0x54, 0x41, 0x55, 0x41, 0x56, // push r12; push r13; push r14
+        0x49, 0x89, 0xFE,                   // mov r14, rdi
+        0x49, 0x89, 0xF5,                   // mov r13, rsi
+    };
+    for (size_t i = 0; i < sizeof(prologue); i++) {
+        jit_byte(&b, prologue[i]);
+    }
+    jit_load64(&b, JIT_RAX, JIT_R14, (int32_t)offsetof(StackVM, stack));
+    jit_mem(&b, 0, true, false, 0x63, JIT_RCX, JIT_R14, (int32_t)offsetof(StackVM, sp)); // movsxd rcx, [r14 + sp]
+    static const uint8_t top[] = {
+        0x48, 0xC1, 0xE1, 0x04, // shl rcx, 4
+        0x4C, 0x8D, 0x24, 0x08, // lea r12, [rax + rcx]
+    };
+    for (size_t i = 0; i < sizeof(top); i++) {
+        jit_byte(&b, top[i]);
+    }
+
+    int ops = 0;
+    while ((uint32_t)ip < module->code_len && jit_emit_op(vm, &b, code, ip)) {
+        ops++;
+        ip += vm_op_length(code[ip]);
+    }
+    if (ops < JIT_MIN_OPS || b.failed) {
+        free(b.code);
+        free(b.fixups);
+        return false;
+    }
+
+    // 正常退出：从第一条未翻译的指令继续解释执行
+    jit_byte(&b, 0xB8); // mov eax, ip
+    jit_u32(&b, (uint32_t)ip);
+    size_t epilogue = b.length;
+    jit_byte(&b, 0x4C); // mov rcx, r12
+    jit_byte(&b, 0x89);
+    jit_byte(&b, 0xE1);
+    jit_mem(&b, 0, true, false, 0x2B, JIT_RCX, JIT_R14, (int32_t)offsetof(StackVM, stack)); // sub rcx, [r14 + stack]
+    static const uint8_t leave[] = {
+        0x48, 0xC1, 0xF9, 0x04, // sar rcx, 4
+    };
+    for (size_t i = 0; i < sizeof(leave); i++) {
+        jit_byte(&b, leave[i]);
+    }
+    jit_store32(&b, JIT_RCX, JIT_R14, (int32_t)offsetof(StackVM, sp));
+    static const uint8_t restore[] = {
+        0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, // pop r14; pop r13; pop r12
+        0xC3,                               // ret
+    };
+    for (size_t i = 0; i < sizeof(restore); i++) {
+        jit_byte(&b, restore[i]);
+    }
+
+    // 去优化的退出桩：记一次去优化，从检查失败的指令继续解释执行
+    for (int i = 0; i < b.fixup_count; i++) {
+        jit_patch32(&b, b.fixups[i].at, (uint32_t)(b.length - (b.fixups[i].at + 4)));
+        jit_byte(&b, 0xB8); // mov eax, ip
+        jit_u32(&b, (uint32_t)b.fixups[i].ip);
+        jit_byte(&b, 0x48); // mov rcx, &compiled->deopts
+        jit_byte(&b, 0xB9);
+        jit_u64(&b, (uint64_t)(uintptr_t)&compiled->deopts);
+        jit_byte(&b, 0xFF); // inc dword [rcx]
+        jit_byte(&b, 0x01);
+        jit_byte(&b, 0xE9); // jmp epilogue
+        jit_u32(&b, (uint32_t)(epilogue - (b.length + 4)));
+    }
+    free(b.fixups);
+    if (b.failed) {
+        free(b.code);
+        return false;
+    }
+
+    // 先以可写方式映射并写入，再改为只读可执行
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (b.length + page - 1) / page * page;
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        free(b.code);
+        return false;
+    }
+    memcpy(memory, b.code, b.length);
+    free(b.code);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return false;
+    }
+    compiled->memory = memory;
+    compiled->memory_size = size;
+    compiled->code = (JitCode)memory;
+    compiled->state = JIT_COMPILED;
+    return true;
+}
+
+// 从函数入口执行本地代码，返回继续解释执行的偏移；去优化过于频繁时丢弃本地代码
+static inline int jit_enter(StackVM* vm, JitFunction* compiled, Value* frame) {
+    compiled->entries++;
+    int ip = compiled->code(vm, frame);
+    if (compiled->deopts > JIT_DEOPT_LIMIT && compiled->deopts * JIT_DEOPT_RATIO > compiled->entries) {
+        jit_free_code(compiled);
+        compiled->state = JIT_DISCARDED;
+    }
+    return ip;
+}
+
+#endif // VM_JIT
+
+// 加载模块时分配各函数的 JIT 状态（阈值为负或平台不支持时不分配）
+static void jit_load(StackVM* vm, const Module* module) {
+#ifdef VM_JIT
+    if (vm->jit_threshold >= 0 && module->function_count > 0) {
+        vm->jit = calloc(module->function_count, sizeof(JitFunction));
+        if (!vm->jit) {
+            vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+        }
+    }
+#else
+    (void)vm;
+    (void)module;
+#endif
+}
+
+// 释放全部本地代码（模块卸载时）
+static void jit_unload(StackVM* vm) {
+#ifdef VM_JIT
+    if (vm->jit && vm->module) {
+        for (uint32_t i = 0; i < vm->module->function_count; i++) {
+            jit_free_code(&vm->jit[i]);
+        }
+    }
+#endif
+    free(vm->jit);
+    vm->jit = NULL;
+}
+
+void vm_jit_stats(const StackVM* vm, JitStats* stats) {
+    memset(stats, 0, sizeof(JitStats));
+    if (!vm->jit || !vm->module) {
+        return;
+    }
+    for (uint32_t i = 0; i < vm->module->function_count; i++) {
+        const JitFunction* compiled = &vm->jit[i];
+        stats->compiled += compiled->state == JIT_COMPILED;
+        stats->discarded += compiled->state == JIT_DISCARDED;
+        stats->code_bytes += compiled->memory_size;
+        stats->entries += compiled->entries;
+        stats->deopts += compiled->deopts;
+    }
+}
+
+// --------------- 解释器分派 ---------------
+// GCC/Clang 下默认使用标签地址（computed goto）做线索化分派：每条指令的处理代码末尾
+// 直接跳转到下一条指令，各操作码各自拥有一个间接跳转点，分支预测比单一 switch 跳转准确。
+// 定义 VM_SWITCH_DISPATCH（make DISPATCH=switch）则使用可移植的 switch 循环。
+// 两种方式都依赖 vm_load 的校验：执行路径一定在 OP_EXIT 处结束，不会越过指令流末尾。
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH
+#endif
+
+// 剖析时线索化分派改用全部指向记录代码的分派表，switch 分派则在循环开头判断一次，
+// 不剖析时的执行路径与原来相同
+#ifdef VM_THREADED_DISPATCH
+#define VM_SWITCH()   VM_NEXT();
+#define VM_CASE(op)   L_##op:
+#define VM_DEFAULT    L_invalid:
+#define VM_NEXT()     goto *dispatch[bytecode[ip++]]
+#else
+#define VM_SWITCH()   vm_loop: if (profiling) profile_step(vm, ip); switch (bytecode[ip++])
+#define VM_CASE(op)   case op:
+#define VM_DEFAULT    default:
+#define VM_NEXT()     goto vm_loop
+#endif
+
+#if defined(__clang__)
+#define VM_DIAG_PUSH_OVERRIDE_INIT \
+    _Pragma("clang diagnostic push") _Pragma("clang diagnostic ignored \"-Winitializer-overrides\"")
+#define VM_DIAG_POP _Pragma("clang diagnostic pop")
+#elif defined(__GNUC__)
+#define VM_DIAG_PUSH_OVERRIDE_INIT \
+    _Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Woverride-init\"")
+#define VM_DIAG_POP _Pragma("GCC diagnostic pop")
+#endif
+
+// 解释器内联的入栈/出栈，语义同 vm_push / vm_pop，省去每个操作数一次的函数调用；
+// 校验器已证明栈深度不超过 stack_capacity 且不会下溢，因此这里不做边界检查
+static inline void push_fast(StackVM* vm, Value val) {
+    // 增加引用计数，因为值现在被栈持有
+    if (IS_HEAP_VALUE(val)) {
+        gc_inc_ref(AS_OBJ(val));
+    }
+    vm->stack[vm->sp++] = val;
+}
+
+static inline Value pop_fast(StackVM* vm) {
+    return vm->stack[--vm->sp];
+}
+
+// 回收安全点：放在会分配的指令开头、弹出操作数之前，此时所有存活的值都能从根到达
+#ifdef VM_TRACING_GC
+#define GC_SAFEPOINT(vm) do { if ((vm)->gc_pending) vm_gc_collect(vm); } while (0)
+#else
+#define GC_SAFEPOINT(vm) ((void)0)
+#endif
+
+// 读取全局变量（返回新的引用），ip 处为 2 字节变量名常量编号
+static inline Value global_get(StackVM* vm, const uint8_t* bytecode, int ip) {
+    StringObject* name = (StringObject*)AS_OBJ(vm->constants[read_u16(bytecode, ip)]);
+    Value val = env_get(vm->global_env, name);
+    if (IS_UNDEFINED(val)) {
+        vm_error(vm, VM_ERROR_RUNTIME, "未定义变量：%s", name->chars);
+    }
+    return val;
+}
+
+// 加法：支持数值+数值、字符串+字符串、字符串+数值（类似 JS 隐式转换）。
+// 拼接的结果可能就是某个操作数，调用方需要自己持有一个引用
+static inline Value add_values(StackVM* vm, Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return val_number(AS_NUMBER(a) + AS_NUMBER(b));
+    }
+    if (!IS_STRING(a) && !IS_STRING(b)) {
+        vm_error(vm, VM_ERROR_RUNTIME, "不支持的加法类型！");
+    }
+    // 任何一方为字符串，都将另一方转换为字符串后拼接
+    StringObject* str_a = value_to_string(vm, a);
+    StringObject* str_b = value_to_string(vm, b);
+    return val_obj((ObjectHeader*)string_concat(vm, str_a, str_b));
+}
+
+// 加法，结果入栈
+static inline void add_push(StackVM* vm, Value a, Value b) {
+    push_fast(vm, add_values(vm, a, b));
+}
+
+// 特化（quickening）：通用指令执行一次后，按这次遇到的操作数类型把自己改写为特化指令，
+// 之后由特化指令直接检查类型并计算；检查不通过时改回通用指令重新执行这一条。
+// 两个操作数都是数值时各通用指令对应的特化指令
+static const uint8_t quicken_numeric[OP_COUNT] = {
+    [OP_ADD] = OP_ADD_NUM_NUM,
+    [OP_SUB] = OP_SUB_NUM_NUM,
+    [OP_MUL] = OP_MUL_NUM_NUM,
+    [OP_DIV] = OP_DIV_NUM_NUM,
+    [OP_LT] = OP_LT_NUM_NUM,
+    [OP_LE] = OP_LE_NUM_NUM,
+    [OP_GT] = OP_GT_NUM_NUM,
+    [OP_GE] = OP_GE_NUM_NUM,
+    [OP_EQ] = OP_EQ_NUM_NUM,
+    [OP_NE] = OP_NE_NUM_NUM,
+    [OP_STRICT_EQ] = OP_EQ_NUM_NUM,
+    [OP_STRICT_NE] = OP_NE_NUM_NUM,
+};
+
+// 把 at 处的通用指令改写为特化指令 op（这条指令特化失败的次数已达上限时保持不变）
+static inline void quicken(StackVM* vm, int at, uint8_t op) {
+    if (vm->quicken_budget[at] > 0) {
+        vm->code[at] = op;
+    }
+}
+
+// 特化指令的检查失败：改回模块中原来的通用指令并记一次失败，返回重新执行的偏移
+static inline int dequicken(StackVM* vm, int at) {
+    vm->quicken_budget[at]--;
+    vm->code[at] = vm->module->code[at];
+    return at;
+}
+
+// 打印一行：各参数之间以空格分隔（参数仍由调用方持有）
+static void print_values(StackVM* vm, const Value* args, int count) {
+    OUTPUT_LITERAL(vm, "输出：");
+    for (int i = 0; i < count; i++) {
+        Value val = args[i];
+        switch (VAL_TYPE(val)) {
+            case VAL_NUMBER:
+                output_number(vm, AS_NUMBER(val));
+                break;
+            case VAL_STRING: {
+                StringObject* str_obj = (StringObject*)AS_OBJ(val);
+                output_bytes(vm, string_chars(str_obj), str_obj->length);
+                break;
+            }
+            case VAL_BOOLEAN:
+                if (AS_BOOL(val)) {
+                    OUTPUT_LITERAL(vm, "true");
+                } else {
+                    OUTPUT_LITERAL(vm, "false");
+                }
+                break;
+            case VAL_UNDEFINED:
+                OUTPUT_LITERAL(vm, "undefined");
+                break;
+            case VAL_NULL:
+                OUTPUT_LITERAL(vm, "null");
+                break;
+            case VAL_OBJECT:
+                OUTPUT_LITERAL(vm, "[object Object]");
+                break;
+            case VAL_FUNCTION: {
+                FunctionObject* fn = (FunctionObject*)AS_OBJ(val);
+                StringObject* name = (StringObject*)AS_OBJ(vm->constants[vm->module->functions[fn->index].name]);
+                OUTPUT_LITERAL(vm, "[Function: ");
+                output_bytes(vm, name->chars, name->length);
+                OUTPUT_LITERAL(vm, "]");
+                break;
+            }
+            default:
+                OUTPUT_LITERAL(vm, "未知类型");
+                break;
+        }
+        
+        // 在参数之间添加空格（如果不是最后一个参数）
+        if (i < count - 1) {
+            OUTPUT_LITERAL(vm, " ");
+        }
+    }
+    OUTPUT_LITERAL(vm, "\n");
 }
 
-Value val_undefined() {
-    Value v = {.type = VAL_UNDEFINED};
-    return v;
-}
+// 读取对象属性：name 为属性名常量编号，cache 为内联缓存编号（返回的值不增加引用计数）
+static inline Value get_prop(StackVM* vm, Value obj_val, uint16_t name, uint16_t cache) {
+    StringObject* prop_name = (StringObject*)AS_OBJ(vm->constants[name]);
+    InlineCache* ic = &vm->caches[cache];
+    if (!IS_OBJECT(obj_val)) {
+        vm_error(vm, VM_ERROR_RUNTIME, "获取属性的目标不是对象！");
+    }
+    Object* obj = (Object*)AS_OBJ(obj_val);
 
-Value val_null() {
-    Value v = {.type = VAL_NULL};
-    return v;
+    // 形状命中缓存时直接按槽位读取，否则查找并记录（不存在的属性也会记录）
+    int slot;
+    InlineCacheEntry* entry = ic_find(ic, obj->shape->id);
+    if (entry) {
+        slot = entry->slot;
+    } else if (obj->dict) {
+        // 字典模式的对象不记入缓存（它们共用一个形状，槽位因对象而异）
+        slot = dict_find(obj->dict, prop_name);
+    } else {
+        slot = shape_lookup(obj->shape, prop_name);
+        ic_record(ic, obj->shape->id, slot, NULL);
+    }
+    return slot >= 0 ? obj->slots[slot] : val_undefined();
 }
 
-Value val_string(const char* str) {
-    Value v = {.type = VAL_STRING};
-    size_t len = strlen(str);
-    StringObject* str_obj = (StringObject*)create_object(VAL_STRING, sizeof(StringObject));
-    str_obj->length = len;
-    str_obj->chars = malloc(len + 1);
-    strcpy(str_obj->chars, str);
-    v.data.obj = (ObjectHeader*)str_obj;
-    return v;
-}
+// 设置对象属性（对象持有值的一个新引用），name / cache 同 get_prop
+static void set_prop(StackVM* vm, Value obj_val, Value value, uint16_t name, uint16_t cache) {
+    StringObject* prop_name = (StringObject*)AS_OBJ(vm->constants[name]);
+    InlineCache* ic = &vm->caches[cache];
+    if (!IS_OBJECT(obj_val)) {
+        vm_error(vm, VM_ERROR_RUNTIME, "设置属性的目标不是对象！");
+    }
+    Object* obj = (Object*)AS_OBJ(obj_val);
 
-// 创建一个新对象
-Value val_object() {
-    Value v = {.type = VAL_OBJECT};
-    Object* obj = (Object*)create_object(VAL_OBJECT, sizeof(Object));
-    obj->property_count = 0;
-    obj->prop_names = NULL;
-    obj->prop_values = NULL;
-    v.data.obj = (ObjectHeader*)obj;
-    return v;
-}
+    // 形状命中缓存时直接得到槽位（以及新增属性后的形状），否则查找并记录
+    int slot;
+    Shape* next_shape;
+    InlineCacheEntry* entry = ic_find(ic, obj->shape->id);
+    if (entry) {
+        slot = entry->slot;
+        next_shape = entry->next_shape;
+    } else if (obj->dict) {
+        dict_set(vm, obj, prop_name, value);
+        return;
+    } else {
+        slot = shape_lookup(obj->shape, prop_name);
+        next_shape = NULL;
+        if (slot == -1) {
+            next_shape = shape_add_property(vm, obj->shape, prop_name);
+            if (!next_shape) {
+                object_to_dict(vm, obj);
+                dict_set(vm, obj, prop_name, value);
+                return;
+            }
+            slot = next_shape->slot_count - 1;
+        }
+        ic_record(ic, obj->shape->id, slot, next_shape);
+    }
 
-// 释放值
-void val_free(Value v) {
-    switch (v.type) {
-        case VAL_STRING:
-        case VAL_OBJECT:
-            gc_dec_ref(v.data.obj);
-            break;
-        default:
-            break;
+    // 增加引用计数，因为对象现在持有这个值
+    if (IS_HEAP_VALUE(value)) {
+        gc_inc_ref(AS_OBJ(value));
     }
-}
 
-// 查找变量（沿作用域链查找，不存在返回undefined）
-Value env_get(Env* env, const char* name) {
-    Env* current = env;
-    while (current != NULL) {
-        for (int i = 0; i < current->var_count; i++) {
-            if (strcmp(current->names[i], name) == 0) {
-                Value val = current->values[i];
-                // 增加引用计数，因为返回的是新的引用
-                if (val.type == VAL_STRING || val.type == VAL_OBJECT) {
-                    gc_inc_ref(val.data.obj);
-                }
-                return val;
+    if (next_shape) {
+        // 添加新属性：槽位数组按倍数扩容
+        if (slot >= obj->slot_capacity) {
+            int capacity = obj->slot_capacity < 4 ? 4 : obj->slot_capacity * 2;
+            Value* slots = pool_external_realloc(&vm->pool, obj->slots, capacity * sizeof(Value));
+            if (!slots) {
+                vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
             }
+            obj->slots = slots;
+            obj->slot_capacity = capacity;
         }
-        current = current->parent; // 继续查找父环境
+        obj->shape = next_shape;
+    } else {
+        // 更新现有属性，先释放旧值
+        val_free(obj->slots[slot]);
     }
-    return val_undefined();
+    obj->slots[slot] = value;
 }
 
-// 存储变量（只在当前环境中设置，已存在则覆盖，不存在则新增）
-void env_set(Env* env, const char* name, Value val) {
-    for (int i = 0; i < env->var_count; i++) {
-        if (strcmp(env->names[i], name) == 0) {
-            val_free(env->values[i]); // 释放旧值
-            // 增加新值的引用计数，因为它被环境持有
-            if (val.type == VAL_STRING || val.type == VAL_OBJECT) {
-                gc_inc_ref(val.data.obj);
+// --------------- 解释器（支持多类型运算、变量、函数）---------------
+void vm_execute(StackVM* vm) {
+    uint8_t* bytecode = vm->code; // 可写副本，特化指令就地改写
+    int ip = vm->entry;           // 主程序开头，或者恢复快照后的继续位置
+    Value* frame = vm->stack; // 当前栈帧的槽位（值栈地址固定，可以直接缓存指针）
+#ifdef VM_THREADED_DISPATCH
+    // 分派表：未列出的操作码都指向 L_invalid（后面的指定初始化覆盖前面的默认值）
+    VM_DIAG_PUSH_OVERRIDE_INIT
+    static void* const dispatch_table[256] = {
+        [0 ... 255] = &&L_invalid,
+        [OP_PUSH_NUM] = &&L_OP_PUSH_NUM,
+        [OP_PUSH_STR] = &&L_OP_PUSH_STR,
+        [OP_PUSH_BOOL] = &&L_OP_PUSH_BOOL,
+        [OP_PUSH_UNDEFINED] = &&L_OP_PUSH_UNDEFINED,
+        [OP_PUSH_NULL] = &&L_OP_PUSH_NULL,
+        [OP_PUSH_VAR] = &&L_OP_PUSH_VAR,
+        [OP_STORE_VAR] = &&L_OP_STORE_VAR,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_RET] = &&L_OP_RET,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_EXIT] = &&L_OP_EXIT,
+        [OP_NEW_OBJECT] = &&L_OP_NEW_OBJECT,
+        [OP_SET_PROP] = &&L_OP_SET_PROP,
+        [OP_GET_PROP] = &&L_OP_GET_PROP,
+        [OP_PUSH_ENV] = &&L_OP_PUSH_ENV,
+        [OP_POP_ENV] = &&L_OP_POP_ENV,
+        [OP_LOAD_LOCAL] = &&L_OP_LOAD_LOCAL,
+        [OP_STORE_LOCAL] = &&L_OP_STORE_LOCAL,
+        [OP_LOAD_UPVAL] = &&L_OP_LOAD_UPVAL,
+        [OP_STORE_UPVAL] = &&L_OP_STORE_UPVAL,
+        [OP_POP] = &&L_OP_POP,
+        [OP_CLOSURE] = &&L_OP_CLOSURE,
+        [OP_LOAD_SLOT] = &&L_OP_LOAD_SLOT,
+        [OP_STORE_SLOT] = &&L_OP_STORE_SLOT,
+        [OP_ADD_VAR_VAR] = &&L_OP_ADD_VAR_VAR,
+        [OP_ADD_SLOT_SLOT] = &&L_OP_ADD_SLOT_SLOT,
+        [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+        [OP_GET_VAR_PROP] = &&L_OP_GET_VAR_PROP,
+        [OP_GET_SLOT_PROP] = &&L_OP_GET_SLOT_PROP,
+        [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL,
+        [OP_DIV] = &&L_OP_DIV,
+        [OP_LT] = &&L_OP_LT,
+        [OP_LE] = &&L_OP_LE,
+        [OP_GT] = &&L_OP_GT,
+        [OP_GE] = &&L_OP_GE,
+        [OP_EQ] = &&L_OP_EQ,
+        [OP_NE] = &&L_OP_NE,
+        [OP_STRICT_EQ] = &&L_OP_STRICT_EQ,
+        [OP_STRICT_NE] = &&L_OP_STRICT_NE,
+        [OP_ADD_NUM_NUM] = &&L_OP_ADD_NUM_NUM,
+        [OP_ADD_STR_STR] = &&L_OP_ADD_STR_STR,
+        [OP_SUB_NUM_NUM] = &&L_OP_SUB_NUM_NUM,
+        [OP_MUL_NUM_NUM] = &&L_OP_MUL_NUM_NUM,
+        [OP_DIV_NUM_NUM] = &&L_OP_DIV_NUM_NUM,
+        [OP_LT_NUM_NUM] = &&L_OP_LT_NUM_NUM,
+        [OP_LE_NUM_NUM] = &&L_OP_LE_NUM_NUM,
+        [OP_GT_NUM_NUM] = &&L_OP_GT_NUM_NUM,
+        [OP_GE_NUM_NUM] = &&L_OP_GE_NUM_NUM,
+        [OP_EQ_NUM_NUM] = &&L_OP_EQ_NUM_NUM,
+        [OP_NE_NUM_NUM] = &&L_OP_NE_NUM_NUM,
+    };
+    VM_DIAG_POP
+    static void* const profile_table[256] = {
+        [0 ... 255] = &&L_profile,
+    };
+#endif
+    bool profiling = vm->profile && vm->profile->module == vm->module;
+    if (profiling) {
+        profile_begin(vm);
+    }
+#ifdef VM_JIT
+    bool jit = vm->jit && !profiling; // 剖析时逐条解释执行，不进入本地代码
+#endif
+#ifdef VM_THREADED_DISPATCH
+    void* const* dispatch = profiling ? profile_table : dispatch_table;
+#endif
+    
+    VM_SWITCH() {
+        // 压入数值：后续 2 字节为常量编号
+        VM_CASE(OP_PUSH_NUM) {
+            push_fast(vm, vm->constants[read_u16(bytecode, ip)]);
+            ip += 2;
+            VM_NEXT();
+        }
+        // 压入字符串：后续 2 字节为常量编号（加载时已驻留，只需增加引用计数）
+        VM_CASE(OP_PUSH_STR) {
+            push_fast(vm, vm->constants[read_u16(bytecode, ip)]);
+            ip += 2;
+            VM_NEXT();
+        }
+        // 压入布尔值：后续1字节表示布尔值
+        VM_CASE(OP_PUSH_BOOL) {
+            bool b = bytecode[ip++];
+            push_fast(vm, val_boolean(b));
+            VM_NEXT();
+        }
+        // 压入undefined
+        VM_CASE(OP_PUSH_UNDEFINED) {
+            push_fast(vm, val_undefined());
+            VM_NEXT();
+        }
+        // 压入null
+        VM_CASE(OP_PUSH_NULL) {
+            push_fast(vm, val_null());
+            VM_NEXT();
+        }
+        // 创建新对象
+        VM_CASE(OP_NEW_OBJECT) {
+            GC_SAFEPOINT(vm);
+            push_fast(vm, val_object(vm));
+            VM_NEXT();
+        }
+        // 设置对象属性：栈顶是值，栈次顶是对象，后续是属性名常量编号和内联缓存编号
+        VM_CASE(OP_SET_PROP) {
+            // 弹出栈顶值（属性值）和对象
+            Value value = pop_fast(vm);
+            Value obj_val = pop_fast(vm);
+            set_prop(vm, obj_val, value, read_u16(bytecode, ip), read_u16(bytecode, ip + 2));
+            ip += 4;
+            
+            // 将对象重新压回栈顶
+            push_fast(vm, obj_val);
+            VM_NEXT();
+        }
+        // 获取对象属性：栈顶是对象，后续是属性名常量编号和内联缓存编号
+        VM_CASE(OP_GET_PROP) {
+            // 弹出栈顶对象，用属性值替换
+            Value obj_val = pop_fast(vm);
+            push_fast(vm, get_prop(vm, obj_val, read_u16(bytecode, ip), read_u16(bytecode, ip + 2)));
+            val_free(obj_val);
+            ip += 4;
+            VM_NEXT();
+        }
+        // 超级指令：读取全局变量的属性，后续 2 字节变量名 + 2 字节属性名 + 2 字节缓存编号
+        VM_CASE(OP_GET_VAR_PROP) {
+            Value obj_val = global_get(vm, bytecode, ip);
+            push_fast(vm, get_prop(vm, obj_val, read_u16(bytecode, ip + 2), read_u16(bytecode, ip + 4)));
+            val_free(obj_val);
+            ip += 6;
+            VM_NEXT();
+        }
+        // 超级指令：读取栈帧槽位的属性，后续 1 字节槽位 + 2 字节属性名 + 2 字节缓存编号
+        VM_CASE(OP_GET_SLOT_PROP) {
+            push_fast(vm, get_prop(vm, frame[bytecode[ip]], read_u16(bytecode, ip + 1), read_u16(bytecode, ip + 3)));
+            ip += 5;
+            VM_NEXT();
+        }
+        // 压入全局变量：后续 2 字节为变量名常量编号
+        VM_CASE(OP_PUSH_VAR) {
+            push_fast(vm, global_get(vm, bytecode, ip));
+            ip += 2;
+            VM_NEXT();
+        }
+        // 存储全局变量：栈顶值 → 变量（后续 2 字节为变量名常量编号）
+        VM_CASE(OP_STORE_VAR) {
+            StringObject* name = (StringObject*)AS_OBJ(vm->constants[read_u16(bytecode, ip)]);
+            Value val = pop_fast(vm);
+            env_set(vm->global_env, name, val);
+            ip += 2;
+            VM_NEXT();
+        }
+        // 读取当前作用域变量：1字节槽位
+        VM_CASE(OP_LOAD_LOCAL) {
+            uint8_t slot = bytecode[ip++];
+            push_fast(vm, env_get_slot(vm->current_env, slot));
+            VM_NEXT();
+        }
+        // 写入当前作用域变量：1字节槽位
+        VM_CASE(OP_STORE_LOCAL) {
+            uint8_t slot = bytecode[ip++];
+            Value val = pop_fast(vm);
+            env_set_slot(vm->current_env, slot, val);
+            VM_NEXT();
+        }
+        // 读取外层作用域变量：1字节深度 + 1字节槽位
+        VM_CASE(OP_LOAD_UPVAL) {
+            uint8_t depth = bytecode[ip++];
+            uint8_t slot = bytecode[ip++];
+            push_fast(vm, env_get_slot(env_at_depth(vm->current_env, depth), slot));
+            VM_NEXT();
+        }
+        // 写入外层作用域变量：1字节深度 + 1字节槽位
+        VM_CASE(OP_STORE_UPVAL) {
+            uint8_t depth = bytecode[ip++];
+            uint8_t slot = bytecode[ip++];
+            Value val = pop_fast(vm);
+            env_set_slot(env_at_depth(vm->current_env, depth), slot, val);
+            VM_NEXT();
+        }
+        // 创建新作用域：1字节槽位数
+        VM_CASE(OP_PUSH_ENV) {
+            GC_SAFEPOINT(vm);
+            uint8_t slot_count = bytecode[ip++];
+            // 创建新环境，将当前环境作为父环境
+            vm->current_env = create_slot_env(vm, vm->current_env, slot_count);
+            VM_NEXT();
+        }
+        // 退出当前作用域
+        VM_CASE(OP_POP_ENV) {
+            Env *old_env = vm->current_env;
+            vm->current_env = vm->current_env->parent;
+            // 释放当前环境
+            free_env(old_env);
+            VM_NEXT();
+        }
+        // 加法：支持数值+数值、字符串+字符串、字符串+数值（类似 JS 隐式转换）
+        VM_CASE(OP_ADD) {
+            GC_SAFEPOINT(vm);
+            Value b = pop_fast(vm);
+            Value a = pop_fast(vm);
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                quicken(vm, ip - 1, OP_ADD_NUM_NUM);
+            } else if (IS_STRING(a) && IS_STRING(b)) {
+                quicken(vm, ip - 1, OP_ADD_STR_STR);
+            }
+            add_push(vm, a, b);
+            val_free(a);
+            val_free(b);
+            VM_NEXT();
+        }
+        // 减乘除与比较（通用指令）：两个操作数都是数值时特化
+        VM_CASE(OP_SUB)
+        VM_CASE(OP_MUL)
+        VM_CASE(OP_DIV)
+        VM_CASE(OP_LT)
+        VM_CASE(OP_LE)
+        VM_CASE(OP_GT)
+        VM_CASE(OP_GE)
+        VM_CASE(OP_EQ)
+        VM_CASE(OP_NE)
+        VM_CASE(OP_STRICT_EQ)
+        VM_CASE(OP_STRICT_NE) {
+            uint8_t op = bytecode[ip - 1];
+            Value b = pop_fast(vm);
+            Value a = pop_fast(vm);
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                quicken(vm, ip - 1, quicken_numeric[op]);
+            }
+            push_fast(vm, binary_op(op, a, b));
+            val_free(a);
+            val_free(b);
+            VM_NEXT();
+        }
+        // 特化指令：两个数值操作数（x、y 为左右操作数），结果原地替换左操作数
+#define VM_NUMERIC_CASE(op, result)                               \
+        VM_CASE(op) {                                             \
+            Value* top = &vm->stack[vm->sp - 2];                  \
+            if (!IS_NUMBER(top[0]) || !IS_NUMBER(top[1])) {       \
+                ip = dequicken(vm, ip - 1);                       \
+                VM_NEXT();                                        \
+            }                                                     \
+            double x = AS_NUMBER(top[0]);                         \
+            double y = AS_NUMBER(top[1]);                         \
+            top[0] = (result);                                    \
+            vm->sp--;                                             \
+            VM_NEXT();                                            \
+        }
+        VM_NUMERIC_CASE(OP_ADD_NUM_NUM, val_number(x + y))
+        VM_NUMERIC_CASE(OP_SUB_NUM_NUM, val_number(x - y))
+        VM_NUMERIC_CASE(OP_MUL_NUM_NUM, val_number(x * y))
+        VM_NUMERIC_CASE(OP_DIV_NUM_NUM, val_number(x / y))
+        VM_NUMERIC_CASE(OP_LT_NUM_NUM, val_boolean(x < y))
+        VM_NUMERIC_CASE(OP_LE_NUM_NUM, val_boolean(x <= y))
+        VM_NUMERIC_CASE(OP_GT_NUM_NUM, val_boolean(x > y))
+        VM_NUMERIC_CASE(OP_GE_NUM_NUM, val_boolean(x >= y))
+        VM_NUMERIC_CASE(OP_EQ_NUM_NUM, val_boolean(x == y))
+        VM_NUMERIC_CASE(OP_NE_NUM_NUM, val_boolean(x != y))
+#undef VM_NUMERIC_CASE
+        // 特化指令：两个字符串拼接
+        VM_CASE(OP_ADD_STR_STR) {
+            GC_SAFEPOINT(vm);
+            Value* top = &vm->stack[vm->sp - 2];
+            if (!IS_STRING(top[0]) || !IS_STRING(top[1])) {
+                ip = dequicken(vm, ip - 1);
+                VM_NEXT();
+            }
+            Value a = top[0];
+            Value b = top[1];
+            vm->sp -= 2;
+            push_fast(vm, val_obj((ObjectHeader*)string_concat(vm, (StringObject*)AS_OBJ(a), (StringObject*)AS_OBJ(b))));
+            val_free(a);
+            val_free(b);
+            VM_NEXT();
+        }
+        // 超级指令：两个全局变量相加，后续 2 + 2 字节为变量名常量编号
+        VM_CASE(OP_ADD_VAR_VAR) {
+            GC_SAFEPOINT(vm);
+            Value a = global_get(vm, bytecode, ip);
+            Value b = global_get(vm, bytecode, ip + 2);
+            ip += 4;
+            add_push(vm, a, b);
+            val_free(a);
+            val_free(b);
+            VM_NEXT();
+        }
+        // 超级指令：两个栈帧槽位相加，后续 1 + 1 字节槽位
+        VM_CASE(OP_ADD_SLOT_SLOT) {
+            GC_SAFEPOINT(vm);
+            Value a = frame[bytecode[ip]];
+            Value b = frame[bytecode[ip + 1]];
+            ip += 2;
+            add_push(vm, a, b);
+            VM_NEXT();
+        }
+        // 超级指令：栈顶加数值常量，后续 2 字节为常量编号
+        VM_CASE(OP_ADD_NUM) {
+            GC_SAFEPOINT(vm);
+            Value b = vm->constants[read_u16(bytecode, ip)];
+            ip += 2;
+            Value a = pop_fast(vm);
+            add_push(vm, a, b);
+            val_free(a);
+            VM_NEXT();
+        }
+        // 函数调用：后续 1 字节为实参个数，栈上依次为函数、各实参。
+        // 实参原地成为被调用函数的前 arity 个栈帧槽位（多余的丢弃，缺少的补 undefined），
+        // 其余槽位是局部变量，同样初始化为 undefined
+        VM_CASE(OP_CALL) {
+            int arg_count = bytecode[ip++];
+            Value callee = vm->stack[vm->sp - arg_count - 1];
+            if (!IS_FUNCTION(callee)) {
+                vm_error(vm, VM_ERROR_RUNTIME, "调用的不是函数！");
+            }
+            FunctionObject* fn = (FunctionObject*)AS_OBJ(callee);
+            const FunctionInfo* info = &vm->module->functions[fn->index];
+            int base = vm->sp - arg_count;
+            if (base + vm->frame_sizes[fn->index] > vm->stack_capacity) {
+                vm_reserve_stack(vm, base + vm->frame_sizes[fn->index]);
+            }
+            for (; arg_count > info->arity; arg_count--) {
+                val_free(pop_fast(vm));
+            }
+            for (; arg_count < info->slot_count; arg_count++) {
+                push_fast(vm, val_undefined());
+            }
+            CallFrame call_frame = {ip, base, fn->index, vm->current_env};
+            vm_call(vm, &call_frame);
+            vm->current_env = fn->env ? fn->env : vm->global_env;
+            frame = &vm->stack[base];
+            ip = info->entry;
+#ifdef VM_JIT
+            // 热点函数：进入本地代码，它返回时从退出点接着解释执行（调用帧不变）
+            if (jit) {
+                JitFunction* compiled = &vm->jit[fn->index];
+                if (compiled->code || (compiled->state == JIT_COLD &&
+                                       ++compiled->calls >= (uint32_t)vm->jit_threshold &&
+                                       jit_compile(vm, compiled, fn->index))) {
+                    ip = jit_enter(vm, compiled, frame);
+                }
+            }
+#endif
+            VM_NEXT();
+        }
+        // 函数返回：释放栈帧（连同函数本身），返回值留在原来函数所在的位置
+        VM_CASE(OP_RET) {
+            Value result = pop_fast(vm);
+            CallFrame call_frame = vm_ret(vm);
+            while (vm->sp > call_frame.base - 1) {
+                val_free(pop_fast(vm));
+            }
+            vm->stack[vm->sp++] = result; // 转移所有权，不增加引用计数
+            vm->current_env = call_frame.saved_env;
+            frame = vm->call_sp > 0 ? &vm->stack[vm->call_stack[vm->call_sp - 1].base] : vm->stack;
+            ip = call_frame.return_ip;
+            VM_NEXT();
+        }
+        // 创建函数对象：后续 2 字节为函数编号，捕获当前环境（全局环境归虚拟机所有，不捕获）
+        VM_CASE(OP_CLOSURE) {
+            GC_SAFEPOINT(vm);
+            FunctionObject* fn = (FunctionObject*)create_object(vm, VAL_FUNCTION, sizeof(FunctionObject));
+            fn->index = read_u16(bytecode, ip);
+            fn->env = vm->current_env != vm->global_env ? vm->current_env : NULL;
+            if (fn->env) {
+#ifndef VM_TRACING_GC
+                fn->env->ref_count++;
+#endif
+            }
+            ip += 2;
+            // 栈持有新对象的唯一引用
+            Value val = val_obj((ObjectHeader*)fn);
+            vm->stack[vm->sp++] = val;
+            VM_NEXT();
+        }
+        // 读取栈帧槽位（形参或未被捕获的局部变量）：1字节槽位
+        VM_CASE(OP_LOAD_SLOT) {
+            push_fast(vm, frame[bytecode[ip++]]);
+            VM_NEXT();
+        }
+        // 写入栈帧槽位：1字节槽位
+        VM_CASE(OP_STORE_SLOT) {
+            uint8_t slot = bytecode[ip++];
+            Value val = pop_fast(vm);
+            val_free(frame[slot]);
+            frame[slot] = val;
+            VM_NEXT();
+        }
+        // 打印：支持多类型输出和多个参数
+        VM_CASE(OP_PRINT) {
+            // 后续 1 字节为参数个数；参数按顺序位于栈顶，直接在栈上读取，打印完再整体弹出
+            uint8_t arg_count = bytecode[ip++];
+            Value* args = &vm->stack[vm->sp - arg_count];
+            print_values(vm, args, arg_count);
+            
+            // 释放参数
+            for (int i = 0; i < arg_count; i++) {
+                val_free(args[i]);
+            }
+            vm->sp -= arg_count;
+            // 攒够一批（整行）再写出
+            if (vm->output.length >= vm->output.flush_threshold) {
+                vm_flush_output(vm);
+            }
+            VM_NEXT();
+        }
+        // 丢弃栈顶值
+        VM_CASE(OP_POP) {
+            val_free(pop_fast(vm));
+            VM_NEXT();
+        }
+        VM_CASE(OP_EXIT) {
+            if (profiling) {
+                profile_end(vm);
             }
-            env->values[i] = val;
             return;
         }
+        VM_DEFAULT {
+            vm_error(vm, VM_ERROR_RUNTIME, "未知指令：%d", bytecode[ip - 1]);
+        }
+#ifdef VM_THREADED_DISPATCH
+        // 剖析：先记录这条指令，再跳到它真正的处理代码
+        L_profile: {
+            profile_step(vm, ip - 1);
+            goto *dispatch_table[bytecode[ip - 1]];
+        }
+#endif
     }
-    if (env->var_count >= MAX_VARS) {
-        fprintf(stderr, "变量数量超限！\n");
-        exit(1);
-    }
-    env->names[env->var_count] = strdup(name);
-    // 增加引用计数，因为它被环境持有
-    if (val.type == VAL_STRING || val.type == VAL_OBJECT) {
-        gc_inc_ref(val.data.obj);
-    }
-    env->values[env->var_count] = val;
-    env->var_count++;
 }
 
-// --------------- 虚拟机核心操作 ---------------
-// 创建新环境
-Env* create_env(Env* parent) {
-    Env* env = malloc(sizeof(Env));
-    if (!env) {
-        fprintf(stderr, "内存分配失败！\n");
-        exit(1);
-    }
-    env->var_count = 0;
-    env->parent = parent;
-    return env;
+// --------------- 寄存器字节码：翻译 ---------------
+// 栈式指令的每个操作数都要经过值栈：函数中的 c = a + b 是 LOAD_SLOT、LOAD_SLOT、ADD、
+// STORE_SLOT 四条指令（合并成超级指令后仍有两条）。模块带 MODULE_REGISTER_TIER 标记时，
+// 加载后把主程序和每个函数的直线代码翻译成三地址指令（上例只剩一条 ADD c, a, b）。
+// 翻译时维护一个符号栈，记录每个栈深度上的值此刻在哪里：该深度自己的寄存器、某个栈帧
+// 槽位（LOAD_SLOT 不产生指令）、常量，或尚未读取的全局变量；使用这些值的指令直接以它们
+// 的位置为操作数，只有调用和打印需要把操作数依次放进寄存器。
+// 全局变量可能被任何调用改写，读取时还可能报错，因此未读取的全局变量只留给紧接着的那条
+// 指令：发出其他指令前先读进各自的寄存器，读取的顺序和报错的位置都与栈式执行相同。
+// 写栈帧槽位之前，符号栈中还引用该槽位旧值的位置先复制出来
+
+// 栈式指令到寄存器指令的对应（二元运算）
+static const uint8_t reg_binary_ops[OP_COUNT] = {
+    [OP_ADD] = REG_ADD,
+    [OP_SUB] = REG_SUB,
+    [OP_MUL] = REG_MUL,
+    [OP_DIV] = REG_DIV,
+    [OP_LT] = REG_LT,
+    [OP_LE] = REG_LE,
+    [OP_GT] = REG_GT,
+    [OP_GE] = REG_GE,
+    [OP_EQ] = REG_EQ,
+    [OP_NE] = REG_NE,
+    [OP_STRICT_EQ] = REG_STRICT_EQ,
+    [OP_STRICT_NE] = REG_STRICT_NE,
+};
+
+typedef struct {
+    RegInstr* code;
+    int count;
+    uint16_t* stack;     // 符号栈：每个深度上的值的位置（操作数编码）
+    bool* checked;       // 该深度上的全局变量已经读取过一次（丢弃时不必为报错再读）
+    int floor;           // 栈帧槽位数：符号栈从这里开始
+    int depth;
+    int globals;         // 符号栈中尚未放进寄存器的全局变量数
+    int producer;        // 最后一条指令的结果就是栈顶的临时值时为它的下标，否则为 -1
+    uint16_t specials;   // 附加常量 undefined/null/false/true 中第一个的编号
+} RegTranslator;
+
+static inline bool reg_is_global(uint16_t operand) {
+    return (operand & (REG_CONSTANT | REG_GLOBAL)) == REG_GLOBAL;
 }
 
-// 释放环境
-void free_env(Env* env) {
-    for (int i = 0; i < env->var_count; i++) {
-        free(env->names[i]);
-        val_free(env->values[i]);
-    }
-    free(env);
+static RegInstr* reg_emit(RegTranslator* t, uint8_t op, int a, uint16_t b) {
+    RegInstr* in = &t->code[t->count++];
+    in->op = op;
+    in->n = 0;
+    in->a = (uint16_t)a;
+    in->b = b;
+    in->c = in->d = 0;
+    t->producer = -1;
+    return in;
 }
 
-void vm_init(StackVM* vm) {
-    vm->sp = 0;
-    vm->call_sp = 0;
-    vm->current_env = create_env(NULL); // 创建全局环境
+static void reg_push(RegTranslator* t, uint16_t operand) {
+    t->stack[t->depth] = operand;
+    t->checked[t->depth] = false;
+    t->globals += reg_is_global(operand);
+    t->depth++;
 }
 
-void vm_push(StackVM* vm, Value val) {
-    if (vm->sp >= 64) {fprintf(stderr, "栈溢出！\n"); exit(1);}
-    // 增加引用计数，因为值现在被栈持有
-    if (val.type == VAL_STRING || val.type == VAL_OBJECT) {
-        gc_inc_ref(val.data.obj);
-    }
-    vm->stack[vm->sp++] = val;
+static uint16_t reg_pop(RegTranslator* t) {
+    uint16_t operand = t->stack[--t->depth];
+    t->globals -= reg_is_global(operand);
+    return operand;
 }
 
-Value vm_pop(StackVM* vm) {
-    if (vm->sp <= 0) {fprintf(stderr, "栈下溢！\n"); exit(1);}
-    return vm->stack[--vm->sp];
+// 指令的结果写入当前栈顶深度的寄存器
+static void reg_push_result(RegTranslator* t, RegInstr* in) {
+    reg_push(t, in->a);
+    t->producer = (int)(in - t->code);
 }
 
-// 直接从栈中弹出并释放值（用于不需要返回值的情况）
-void vm_pop_free(StackVM* vm) {
-    Value val = vm_pop(vm);
-    val_free(val);
+// 把深度 p 上的值放进它自己的寄存器
+static void reg_materialize(RegTranslator* t, int p) {
+    uint16_t operand = t->stack[p];
+    if (operand != p) {
+        t->globals -= reg_is_global(operand);
+        reg_emit(t, REG_MOVE, p, operand);
+        t->stack[p] = (uint16_t)p;
+    }
 }
 
-// 函数调用：保存当前 ip 到调用栈，跳转到函数起始位置
-void vm_call(StackVM* vm, int func_ip) {
-    if (vm->call_sp >= 16) {fprintf(stderr, "调用栈溢出！\n"); exit(1);}
-    vm->call_stack[vm->call_sp++] = func_ip;
+// 发出一条指令之前调用：from 以下尚未读取的全局变量读进各自的寄存器，
+// from 及以上的值全部放进寄存器（from 为当前深度时只处理全局变量）
+static void reg_settle(RegTranslator* t, int from) {
+    for (int p = t->globals > 0 ? t->floor : from; p < t->depth; p++) {
+        if (p >= from || reg_is_global(t->stack[p])) {
+            reg_materialize(t, p);
+        }
+    }
 }
 
-// 函数返回：从调用栈恢复 ip
-int vm_ret(StackVM* vm) {
-    if (vm->call_sp <= 0) {fprintf(stderr, "无函数可返回！\n"); exit(1);}
-    return vm->call_stack[--vm->call_sp];
+static void reg_binary(RegTranslator* t, uint8_t op, uint16_t x, uint16_t y) {
+    reg_settle(t, t->depth);
+    RegInstr* in = reg_emit(t, op, t->depth, x);
+    in->c = y;
+    reg_push_result(t, in);
 }
 
-// --------------- 解释器（支持多类型运算、变量、函数）---------------
-void vm_execute(StackVM* vm, const uint8_t* bytecode, int len) {
-    int ip = 0;
-    while (ip < len) {
-        OpCode op = (OpCode)bytecode[ip++];
-        switch (op) {
-            // 压入数值：后续 8 字节为 double
-            case OP_PUSH_NUM: {
-                double num;
-                memcpy(&num, &bytecode[ip], sizeof(double));
-                vm_push(vm, val_number(num));
-                ip += sizeof(double);
+// 翻译从 entry 开始的一段直线代码，直到 OP_RET / OP_EXIT（floor 为栈帧槽位数）
+static void reg_translate_code(RegTranslator* t, const uint8_t* code, int entry, int floor) {
+    t->floor = t->depth = floor;
+    t->globals = 0;
+    t->producer = -1;
+    for (int ip = entry;; ip += vm_op_length(code[ip])) {
+        const uint8_t* operands = &code[ip + 1];
+        RegInstr* in;
+        switch ((OpCode)code[ip]) {
+            case OP_PUSH_NUM:
+            case OP_PUSH_STR:
+                reg_push(t, REG_CONSTANT | read_u16(operands, 0));
                 break;
-            }
-            // 压入字符串：1字节长度 + N字节字符串
-            case OP_PUSH_STR: {
-                uint8_t str_len = bytecode[ip++];
-                char str[str_len + 1];
-                memcpy(str, &bytecode[ip], str_len);
-                str[str_len] = '\0';
-                vm_push(vm, val_string(str));
-                ip += str_len;
+            case OP_PUSH_UNDEFINED:
+                reg_push(t, REG_CONSTANT | t->specials);
                 break;
-            }
-            // 压入布尔值：后续1字节表示布尔值
-            case OP_PUSH_BOOL: {
-                bool b = bytecode[ip++];
-                vm_push(vm, val_boolean(b));
+            case OP_PUSH_NULL:
+                reg_push(t, REG_CONSTANT | (t->specials + 1));
                 break;
-            }
-            // 压入undefined
-            case OP_PUSH_UNDEFINED: {
-                vm_push(vm, val_undefined());
+            case OP_PUSH_BOOL:
+                reg_push(t, REG_CONSTANT | (t->specials + (operands[0] ? 3 : 2)));
                 break;
-            }
-            // 压入null
-            case OP_PUSH_NULL: {
-                vm_push(vm, val_null());
+            case OP_PUSH_VAR:
+                reg_push(t, REG_GLOBAL | read_u16(operands, 0));
                 break;
-            }
-            // 创建新对象
-            case OP_NEW_OBJECT: {
-                vm_push(vm, val_object());
+            case OP_LOAD_SLOT:
+                reg_push(t, operands[0]);
+                break;
+            case OP_STORE_VAR: {
+                uint16_t value = reg_pop(t);
+                reg_settle(t, t->depth);
+                reg_emit(t, REG_SET_GLOBAL, read_u16(operands, 0), value);
                 break;
             }
-            // 设置对象属性：栈顶是值，栈次顶是对象，后续是属性名
-            case OP_SET_PROP: {
-                // 读取属性名
-                uint8_t prop_len = bytecode[ip++];
-                char prop_name[prop_len + 1];
-                memcpy(prop_name, &bytecode[ip], prop_len);
-                prop_name[prop_len] = '\0';
-                ip += prop_len;
-                
-                // 弹出栈顶值（属性值）和对象
-                Value value = vm_pop(vm);
-                Value obj_val = vm_pop(vm);
-                
-                if (obj_val.type != VAL_OBJECT) {
-                    fprintf(stderr, "设置属性的目标不是对象！\n");
-                    exit(1);
-                }
-                
-                Object* obj = (Object*)obj_val.data.obj;
-                
-                // 查找属性是否已存在
-                int index = -1;
-                for (int i = 0; i < obj->property_count; i++) {
-                    if (strcmp(obj->prop_names[i], prop_name) == 0) {
-                        index = i;
-                        break;
-                    }
-                }
-                
-                if (index == -1) {
-                    // 添加新属性
-                    if (obj->property_count >= MAX_PROPS) {
-                        fprintf(stderr, "对象属性数量超限！\n");
-                        exit(1);
-                    }
-                    
-                    obj->prop_names = realloc(obj->prop_names, (obj->property_count + 1) * sizeof(uint8_t*));
-                    obj->prop_values = realloc(obj->prop_values, (obj->property_count + 1) * sizeof(Value));
-                    
-                    obj->prop_names[obj->property_count] = strdup(prop_name);
-                    
-                    // 增加引用计数，因为对象现在持有这个值
-                    if (value.type == VAL_STRING || value.type == VAL_OBJECT) {
-                        gc_inc_ref(value.data.obj);
-                    }
-                    
-                    obj->prop_values[obj->property_count] = value;
-                    obj->property_count++;
-                } else {
-                    // 更新现有属性
-                    // 先释放旧值
-                    val_free(obj->prop_values[index]);
-                    
-                    // 增加新值的引用计数
-                    if (value.type == VAL_STRING || value.type == VAL_OBJECT) {
-                        gc_inc_ref(value.data.obj);
-                    }
-                    
-                    obj->prop_values[index] = value;
+            case OP_STORE_SLOT: {
+                uint8_t slot = operands[0];
+                int producer = t->producer;
+                uint16_t value = reg_pop(t);
+                bool aliased = false;
+                for (int p = t->floor; p < t->depth; p++) {
+                    aliased |= t->stack[p] == slot;
                 }
-                
-                // 将对象重新压回栈顶
-                vm_push(vm, obj_val);
-                break;
-            }
-            // 获取对象属性：栈顶是对象，后续是属性名
-            case OP_GET_PROP: {
-                // 读取属性名
-                uint8_t prop_len = bytecode[ip++];
-                char prop_name[prop_len + 1];
-                memcpy(prop_name, &bytecode[ip], prop_len);
-                prop_name[prop_len] = '\0';
-                ip += prop_len;
-                
-                // 弹出栈顶对象
-                Value obj_val = vm_pop(vm);
-                
-                if (obj_val.type != VAL_OBJECT) {
-                    fprintf(stderr, "获取属性的目标不是对象！\n");
-                    exit(1);
+                if (producer >= 0 && value == t->depth && !aliased) {
+                    // 上一条指令的结果直接写入槽位
+                    t->code[producer].a = slot;
+                    t->producer = -1;
+                    break;
                 }
-                
-                Object* obj = (Object*)obj_val.data.obj;
-                
-                // 查找属性
-                Value result = val_undefined();
-                for (int i = 0; i < obj->property_count; i++) {
-                    if (strcmp(obj->prop_names[i], prop_name) == 0) {
-                        result = obj->prop_values[i];
-                        // 增加引用计数，因为我们将返回这个值的引用
-                        if (result.type == VAL_STRING || result.type == VAL_OBJECT) {
-                            gc_inc_ref(result.data.obj);
-                        }
-                        break;
+                for (int p = t->floor; p < t->depth; p++) {
+                    if (t->stack[p] == slot) {
+                        reg_materialize(t, p);
                     }
                 }
-                
-                // 将对象重新压回栈顶，保持引用计数平衡
-                vm_push(vm, obj_val);
-                
-                // 将属性值压入栈顶
-                vm_push(vm, result);
-                break;
-            }
-            // 压入变量：1字节长度 + N字节变量名
-            case OP_PUSH_VAR: {
-                uint8_t name_len = bytecode[ip++];
-                char name[name_len + 1];
-                memcpy(name, &bytecode[ip], name_len);
-                name[name_len] = '\0';
-                Value val = env_get(vm->current_env, name);
-                if (val.type == VAL_UNDEFINED) {
-                    fprintf(stderr, "未定义变量：%s\n", name);
-                    exit(1);
+                reg_settle(t, t->depth);
+                if (value != slot) {
+                    reg_emit(t, REG_MOVE, slot, value);
                 }
-                vm_push(vm, val);
-                ip += name_len;
                 break;
             }
-            // 存储变量：栈顶值 → 变量（变量名在栈顶值之后）
-            case OP_STORE_VAR: {
-                uint8_t name_len = bytecode[ip++];
-                char name[name_len + 1];
-                memcpy(name, &bytecode[ip], name_len);
-                name[name_len] = '\0';
-                Value val = vm_pop(vm);
-                env_set(vm->current_env, name, val);
-                ip += name_len;
-                break;
-            }
-            // 创建新作用域
-            case OP_PUSH_ENV: {
-                // 创建新环境，将当前环境作为父环境
-                vm->current_env = create_env(vm->current_env);
-                break;
-            }
-            // 退出当前作用域
-            case OP_POP_ENV: {
-                Env *old_env = vm->current_env;
-                vm->current_env = vm->current_env->parent;
-                // 释放当前环境
-                free_env(old_env);
-                break;
-            }
-            // 加法：支持数值+数值、字符串+字符串、字符串+数值（类似 JS 隐式转换）
-            case OP_ADD: {
-                Value b = vm_pop(vm);
-                Value a = vm_pop(vm);
-                if (a.type == VAL_NUMBER && b.type == VAL_NUMBER) {
-                    vm_push(vm, val_number(a.data.number + b.data.number));
-                } else if (a.type == VAL_STRING || b.type == VAL_STRING) {
-                    // 任何一方为字符串，都将另一方转换为字符串后拼接
-                    char* str_a;
-                    size_t len_a;
-                    char* str_b;
-                    size_t len_b;
-                    
-                    // 转换a为字符串
-                    if (a.type == VAL_STRING) {
-                        StringObject* sobj_a = (StringObject*)a.data.obj;
-                        len_a = sobj_a->length;
-                        str_a = sobj_a->chars;
-                    } else if (a.type == VAL_NUMBER) {
-                        char num_str[32];
-                        sprintf(num_str, "%.2f", a.data.number);
-                        len_a = strlen(num_str);
-                        str_a = num_str;
-                    } else if (a.type == VAL_BOOLEAN) {
-                        str_a = a.data.boolean ? "true" : "false";
-                        len_a = strlen(str_a);
-                    } else if (a.type == VAL_UNDEFINED) {
-                        str_a = "undefined";
-                        len_a = strlen(str_a);
-                    } else if (a.type == VAL_NULL) {
-                        str_a = "null";
-                        len_a = strlen(str_a);
-                    } else {
-                        str_a = "[object Object]";
-                        len_a = strlen(str_a);
-                    }
-                    
-                    // 转换b为字符串
-                    if (b.type == VAL_STRING) {
-                        StringObject* sobj_b = (StringObject*)b.data.obj;
-                        len_b = sobj_b->length;
-                        str_b = sobj_b->chars;
-                    } else if (b.type == VAL_NUMBER) {
-                        char num_str[32];
-                        sprintf(num_str, "%.2f", b.data.number);
-                        len_b = strlen(num_str);
-                        str_b = num_str;
-                    } else if (b.type == VAL_BOOLEAN) {
-                        str_b = b.data.boolean ? "true" : "false";
-                        len_b = strlen(str_b);
-                    } else if (b.type == VAL_UNDEFINED) {
-                        str_b = "undefined";
-                        len_b = strlen(str_b);
-                    } else if (b.type == VAL_NULL) {
-                        str_b = "null";
-                        len_b = strlen(str_b);
-                    } else {
-                        str_b = "[object Object]";
-                        len_b = strlen(str_b);
-                    }
-                    
-                    // 拼接字符串
-                    size_t total_len = len_a + len_b;
-                    char* new_chars = malloc(total_len + 1);
-                    strcpy(new_chars, str_a);
-                    strcat(new_chars, str_b);
-                    
-                    // 创建新字符串对象
-                    StringObject* new_str = (StringObject*)create_object(VAL_STRING, sizeof(StringObject));
-                    new_str->length = total_len;
-                    new_str->chars = new_chars;
-                    
-                    Value res = {.type = VAL_STRING, .data.obj = (ObjectHeader*)new_str};
-                    vm_push(vm, res);
+            case OP_LOAD_LOCAL:
+                reg_settle(t, t->depth);
+                reg_push_result(t, reg_emit(t, REG_GET_LOCAL, t->depth, operands[0]));
+                break;
+            case OP_STORE_LOCAL: {
+                uint16_t value = reg_pop(t);
+                reg_settle(t, t->depth);
+                reg_emit(t, REG_SET_LOCAL, operands[0], value);
+                break;
+            }
+            case OP_LOAD_UPVAL:
+                reg_settle(t, t->depth);
+                in = reg_emit(t, REG_GET_UPVAL, t->depth, operands[1]);
+                in->n = operands[0];
+                reg_push_result(t, in);
+                break;
+            case OP_STORE_UPVAL: {
+                uint16_t value = reg_pop(t);
+                reg_settle(t, t->depth);
+                in = reg_emit(t, REG_SET_UPVAL, operands[1], value);
+                in->n = operands[0];
+                break;
+            }
+            case OP_PUSH_ENV:
+                reg_settle(t, t->depth);
+                reg_emit(t, REG_PUSH_ENV, 0, 0)->n = operands[0];
+                break;
+            case OP_POP_ENV:
+                reg_settle(t, t->depth);
+                reg_emit(t, REG_POP_ENV, 0, 0);
+                break;
+            case OP_NEW_OBJECT:
+                reg_settle(t, t->depth);
+                reg_push_result(t, reg_emit(t, REG_NEW_OBJECT, t->depth, 0));
+                break;
+            case OP_SET_PROP: {
+                uint16_t value = reg_pop(t);
+                uint16_t obj = reg_pop(t);
+                reg_settle(t, t->depth);
+                in = reg_emit(t, REG_SET_PROP, obj, value);
+                in->c = read_u16(operands, 0);
+                in->d = read_u16(operands, 2);
+                // 对象留在栈上
+                reg_push(t, obj);
+                t->checked[t->depth - 1] = true;
+                break;
+            }
+            case OP_GET_PROP:
+            case OP_GET_VAR_PROP:
+            case OP_GET_SLOT_PROP: {
+                uint16_t obj;
+                if (code[ip] == OP_GET_PROP) {
+                    obj = reg_pop(t);
+                } else if (code[ip] == OP_GET_VAR_PROP) {
+                    obj = REG_GLOBAL | read_u16(operands, 0);
+                    operands += 2;
                 } else {
-                    fprintf(stderr, "不支持的加法类型！\n");
-                    exit(1);
+                    obj = operands[0];
+                    operands += 1;
                 }
-                val_free(a);
-                val_free(b);
+                reg_settle(t, t->depth);
+                in = reg_emit(t, REG_GET_PROP, t->depth, obj);
+                in->c = read_u16(operands, 0);
+                in->d = read_u16(operands, 2);
+                reg_push_result(t, in);
                 break;
             }
-            // 函数调用：后续 4 字节为函数起始指令偏移（小端）
-            case OP_CALL: {
-                int func_offset;
-                memcpy(&func_offset, &bytecode[ip + 1], sizeof(int));
-                ip += sizeof(int) + 1; // +1 是跳过 OP_CALL 指令本身
-                vm_call(vm, ip); // 保存当前 ip（函数执行完后返回此处）
-                ip = func_offset; // 跳转到函数起始位置
+            case OP_ADD_VAR_VAR:
+                reg_binary(t, REG_ADD, REG_GLOBAL | read_u16(operands, 0), REG_GLOBAL | read_u16(operands, 2));
+                break;
+            case OP_ADD_SLOT_SLOT:
+                reg_binary(t, REG_ADD, operands[0], operands[1]);
+                break;
+            case OP_ADD_NUM: {
+                uint16_t x = reg_pop(t);
+                reg_binary(t, REG_ADD, x, REG_CONSTANT | read_u16(operands, 0));
+                break;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_LT:
+            case OP_LE:
+            case OP_GT:
+            case OP_GE:
+            case OP_EQ:
+            case OP_NE:
+            case OP_STRICT_EQ:
+            case OP_STRICT_NE: {
+                uint16_t y = reg_pop(t);
+                uint16_t x = reg_pop(t);
+                reg_binary(t, reg_binary_ops[code[ip]], x, y);
                 break;
             }
-            // 函数返回：恢复 ip 到调用前位置，保持返回值在栈上
-            case OP_RET: {
-                ip = vm_ret(vm);
+            case OP_CLOSURE:
+                reg_settle(t, t->depth);
+                reg_push_result(t, reg_emit(t, REG_CLOSURE, t->depth, read_u16(operands, 0)));
+                break;
+            case OP_CALL: {
+                int callee = t->depth - operands[0] - 1;
+                reg_settle(t, callee);
+                reg_emit(t, REG_CALL, callee, 0)->n = operands[0];
+                t->depth = callee;
+                reg_push(t, (uint16_t)callee);
                 break;
             }
-            // 打印：支持多类型输出和多个参数
             case OP_PRINT: {
-                // 读取参数数量
-                uint8_t arg_count = bytecode[ip++];
-                // ip++ 是因为参数数量占用一个字节
-                
-                // 从栈中弹出所有参数（注意顺序是倒序）
-                Value* args = malloc(sizeof(Value) * arg_count);
-                for (int i = arg_count - 1; i >= 0; i--) {
-                    args[i] = vm_pop(vm);
-                }
-                
-                // 打印所有参数
-                printf("输出：");
-                for (int i = 0; i < arg_count; i++) {
-                    Value val = args[i];
-                    switch (val.type) {
-                        case VAL_NUMBER: 
-                            printf("%g", val.data.number); 
-                            break;
-                        case VAL_STRING: {
-                            StringObject* str_obj = (StringObject*)val.data.obj;
-                            printf("%s", str_obj->chars); 
-                            break;
-                        }
-                        case VAL_BOOLEAN: 
-                            printf("%s", val.data.boolean ? "true" : "false"); 
-                            break;
-                        case VAL_UNDEFINED: 
-                            printf("undefined"); 
-                            break;
-                        case VAL_NULL: 
-                            printf("null"); 
-                            break;
-                        case VAL_OBJECT: 
-                            printf("[object Object]"); 
-                            break;
-                        default:
-                            printf("未知类型"); 
-                            break;
-                    }
-                    
-                    // 在参数之间添加空格（如果不是最后一个参数）
-                    if (i < arg_count - 1) {
-                        printf(" ");
-                    }
-                }
-                
-                // 打印换行符
-                printf("\n");
-                
-                // 释放参数占用的内存
-                for (int i = 0; i < arg_count; i++) {
-                    val_free(args[i]);
-                }
-                free(args);
+                int first = t->depth - operands[0];
+                reg_settle(t, first);
+                reg_emit(t, REG_PRINT, first, 0)->n = operands[0];
+                t->depth = first;
                 break;
             }
+            case OP_POP:
+                // 丢弃尚未读取的全局变量时仍要读一次：变量未定义时应当报错
+                if (reg_is_global(t->stack[t->depth - 1]) && !t->checked[t->depth - 1]) {
+                    reg_settle(t, t->depth - 1);
+                }
+                reg_pop(t);
+                break;
+            case OP_RET:
+                reg_emit(t, REG_RET, reg_pop(t), 0);
+                return;
             case OP_EXIT:
+                reg_settle(t, t->depth);
+                reg_emit(t, REG_EXIT, 0, 0);
                 return;
             default:
-                fprintf(stderr, "未知指令：%d\n", op);
-                exit(1);
+                // 特化指令不会出现在模块中（校验器已拒绝）
+                return;
         }
     }
 }
 
-// 测试：执行「变量赋值 + 函数调用 + 字符串拼接 + 数值运算 + 新类型测试」
+// 释放寄存器字节码（卸载模块时）
+static void reg_unload(StackVM* vm) {
+    RegProgram* prog = vm->registers;
+    if (prog) {
+        free(prog->code);
+        free(prog->entries);
+        free(prog->constants);
+        free(prog);
+        vm->registers = NULL;
+    }
+}
+
+// 加载模块时翻译（模块要求时），frame_sizes 已由校验得到，main_size 为主程序的最大栈深度。
+// 操作数编码容纳不下（寄存器或常量太多）时整个模块仍按栈式指令执行
+static void reg_load(StackVM* vm, const Module* module, int main_size) {
+    reg_unload(vm);
+    if (!(module->flags & MODULE_REGISTER_TIER) ||
+        module->constant_count + 4 > REG_GLOBAL || main_size >= REG_MAX_REGISTERS) {
+        return;
+    }
+    int max_frame = main_size;
+    for (uint32_t i = 0; i < module->function_count; i++) {
+        if (vm->frame_sizes[i] >= REG_MAX_REGISTERS) {
+            return;
+        }
+        if (vm->frame_sizes[i] > max_frame) {
+            max_frame = vm->frame_sizes[i];
+        }
+    }
+
+    // 每条栈式指令至多产生一条指令，另外每个入栈的值至多被复制进寄存器一次
+    RegProgram* prog = calloc(1, sizeof(RegProgram));
+    RegTranslator t;
+    t.code = malloc((2 * (size_t)module->code_len + 1) * sizeof(RegInstr));
+    t.stack = malloc((max_frame + 1) * sizeof(uint16_t));
+    t.checked = malloc((max_frame + 1) * sizeof(bool));
+    t.count = 0;
+    t.specials = (uint16_t)module->constant_count;
+    if (prog) {
+        prog->entries = malloc((module->function_count > 0 ? module->function_count : 1) * sizeof(int));
+        prog->constants = malloc((module->constant_count + 4) * sizeof(Value));
+    }
+    if (!prog || !t.code || !t.stack || !t.checked || !prog->entries || !prog->constants) {
+        if (prog) {
+            free(prog->entries);
+            free(prog->constants);
+            free(prog);
+        }
+        free(t.code);
+        free(t.stack);
+        free(t.checked);
+        vm_error(vm, VM_ERROR_MEMORY, "内存分配失败！");
+    }
+
+    reg_translate_code(&t, module->code, 0, 0);
+    for (uint32_t i = 0; i < module->function_count; i++) {
+        // 从未被创建的函数没有经过校验，也不会被调用
+        prog->entries[i] = -1;
+        if (vm->frame_sizes[i] > 0) {
+            prog->entries[i] = t.count;
+            reg_translate_code(&t, module->code, module->functions[i].entry, module->functions[i].slot_count);
+        }
+    }
+    free(t.stack);
+    free(t.checked);
+    RegInstr* code = realloc(t.code, t.count * sizeof(RegInstr));
+    prog->code = code ? code : t.code;
+    prog->code_len = t.count;
+    memcpy(prog->constants, vm->constants, module->constant_count * sizeof(Value));
+    prog->constants[t.specials] = val_undefined();
+    prog->constants[t.specials + 1] = val_null();
+    prog->constants[t.specials + 2] = val_boolean(false);
+    prog->constants[t.specials + 3] = val_boolean(true);
+    prog->main_size = main_size;
+    vm->registers = prog;
+}
+
+// --------------- 寄存器字节码：解释器 ---------------
+// 每个寄存器始终持有一个有效值（及其引用）：写寄存器时先持有新值、再释放旧值，
+// 读操作数只是借用。执行中 vm->sp 是当前栈帧的寄存器末尾，调用帧的布局与栈式执行相同
+// （被调函数位于第一个实参之前），因此回收器的根、出错时的 vm_unwind 都不需要区分两种执行方式
+#ifdef VM_THREADED_DISPATCH
+#define REG_SWITCH()  REG_NEXT();
+#define REG_CASE(op)  R_##op:
+#define REG_DEFAULT   R_invalid:
+#define REG_NEXT()    do { in = pc++; goto *dispatch[in->op]; } while (0)
+#else
+#define REG_SWITCH()  reg_loop: in = pc++; if (counting) vm->profile->instructions++; switch (in->op)
+#define REG_CASE(op)  case op:
+#define REG_DEFAULT   default:
+#define REG_NEXT()    goto reg_loop
+#endif
+
+// 读操作数：寄存器、常量，或者按名字读取的全局变量（未定义时报错，返回的值不增加引用计数）
+#define REG_OPERAND(x) ((x) < REG_GLOBAL ? frame[x] : \
+                        (x) & REG_CONSTANT ? constants[(x) & ~REG_CONSTANT] : reg_global(vm, (x)))
+
+static Value reg_global(StackVM* vm, uint16_t operand) {
+    StringObject* name = (StringObject*)AS_OBJ(vm->constants[operand & ~REG_GLOBAL]);
+    int i = env_find(vm->global_env, name);
+    if (i >= 0 && !IS_UNDEFINED(vm->global_env->values[i])) {
+        return vm->global_env->values[i];
+    }
+    vm_error(vm, VM_ERROR_RUNTIME, "未定义变量：%s", name->chars);
+}
+
+// 写寄存器：新值可能只被旧值引用（例如从对象中读出的属性），所以先持有再释放
+static inline void reg_store(Value* reg, Value val) {
+    if (IS_HEAP_VALUE(val)) {
+        gc_inc_ref(AS_OBJ(val));
+    }
+    Value old = *reg;
+    *reg = val;
+    val_free(old);
+}
+
+// 写入调用方已经持有一个引用的值（新建的对象、从环境读出的值、数值和布尔值）
+static inline void reg_store_owned(Value* reg, Value val) {
+    Value old = *reg;
+    *reg = val;
+    val_free(old);
+}
+
+// 写入环境等其他位置：env_set 之类先释放旧值，借用的值可能正是旧值，因此暂时多持有一个引用
+#define REG_RETAINED(val, statement) do {                 \
+        if (IS_HEAP_VALUE(val)) gc_inc_ref(AS_OBJ(val));  \
+        statement;                                        \
+        val_free(val);                                    \
+    } while (0)
+
+void vm_execute_registers(StackVM* vm) {
+    const RegProgram* prog = vm->registers;
+    const RegInstr* code = prog->code;
+    const Value* constants = prog->constants;
+    const RegInstr* pc = code;
+    const RegInstr* in;
+    Value* frame = vm->stack;
+#ifdef VM_THREADED_DISPATCH
+    VM_DIAG_PUSH_OVERRIDE_INIT
+    static void* const dispatch_table[256] = {
+        [0 ... 255] = &&R_invalid,
+        [REG_MOVE] = &&R_REG_MOVE,
+        [REG_ADD] = &&R_REG_ADD,
+        [REG_SUB] = &&R_REG_SUB,
+        [REG_MUL] = &&R_REG_MUL,
+        [REG_DIV] = &&R_REG_DIV,
+        [REG_LT] = &&R_REG_LT,
+        [REG_LE] = &&R_REG_LE,
+        [REG_GT] = &&R_REG_GT,
+        [REG_GE] = &&R_REG_GE,
+        [REG_EQ] = &&R_REG_EQ,
+        [REG_NE] = &&R_REG_NE,
+        [REG_STRICT_EQ] = &&R_REG_STRICT_EQ,
+        [REG_STRICT_NE] = &&R_REG_STRICT_NE,
+        [REG_SET_GLOBAL] = &&R_REG_SET_GLOBAL,
+        [REG_GET_LOCAL] = &&R_REG_GET_LOCAL,
+        [REG_SET_LOCAL] = &&R_REG_SET_LOCAL,
+        [REG_GET_UPVAL] = &&R_REG_GET_UPVAL,
+        [REG_SET_UPVAL] = &&R_REG_SET_UPVAL,
+        [REG_PUSH_ENV] = &&R_REG_PUSH_ENV,
+        [REG_POP_ENV] = &&R_REG_POP_ENV,
+        [REG_NEW_OBJECT] = &&R_REG_NEW_OBJECT,
+        [REG_SET_PROP] = &&R_REG_SET_PROP,
+        [REG_GET_PROP] = &&R_REG_GET_PROP,
+        [REG_CLOSURE] = &&R_REG_CLOSURE,
+        [REG_CALL] = &&R_REG_CALL,
+        [REG_RET] = &&R_REG_RET,
+        [REG_PRINT] = &&R_REG_PRINT,
+        [REG_EXIT] = &&R_REG_EXIT,
+    };
+    VM_DIAG_POP
+    static void* const count_table[256] = {
+        [0 ... 255] = &&R_count,
+    };
+#endif
+    // 剖析数据只用来统计执行的指令数（逐条的剖析按栈式指令进行）
+    bool counting = vm->profile && vm->profile->module == vm->module;
+    if (counting) {
+        profile_begin(vm);
+    }
+#ifdef VM_THREADED_DISPATCH
+    void* const* dispatch = counting ? count_table : dispatch_table;
+#endif
+
+    // 主程序的寄存器（值栈已按主程序的最大栈深度预留）
+    for (int i = 0; i < prog->main_size; i++) {
+        vm->stack[i] = val_undefined();
+    }
+    vm->sp = prog->main_size;
+
+    REG_SWITCH() {
+        REG_CASE(REG_MOVE) {
+            reg_store(&frame[in->a], REG_OPERAND(in->b));
+            REG_NEXT();
+        }
+        REG_CASE(REG_ADD) {
+            GC_SAFEPOINT(vm);
+            Value x = REG_OPERAND(in->b);
+            Value y = REG_OPERAND(in->c);
+            if (IS_NUMBER(x) && IS_NUMBER(y)) {
+                reg_store_owned(&frame[in->a], val_number(AS_NUMBER(x) + AS_NUMBER(y)));
+            } else {
+                reg_store(&frame[in->a], add_values(vm, x, y));
+            }
+            REG_NEXT();
+        }
+        // 其余二元运算：两个数值时直接计算，否则按栈式指令 op 的语义
+#define REG_BINARY_CASE(reg_op, op, result)                                   \
+        REG_CASE(reg_op) {                                                    \
+            Value x = REG_OPERAND(in->b);                                     \
+            Value y = REG_OPERAND(in->c);                                     \
+            Value val;                                                        \
+            if (IS_NUMBER(x) && IS_NUMBER(y)) {                               \
+                double l = AS_NUMBER(x);                                      \
+                double r = AS_NUMBER(y);                                      \
+                val = (result);                                               \
+            } else {                                                          \
+                val = binary_op(op, x, y);                                    \
+            }                                                                 \
+            reg_store_owned(&frame[in->a], val);                              \
+            REG_NEXT();                                                       \
+        }
+        REG_BINARY_CASE(REG_SUB, OP_SUB, val_number(l - r))
+        REG_BINARY_CASE(REG_MUL, OP_MUL, val_number(l * r))
+        REG_BINARY_CASE(REG_DIV, OP_DIV, val_number(l / r))
+        REG_BINARY_CASE(REG_LT, OP_LT, val_boolean(l < r))
+        REG_BINARY_CASE(REG_LE, OP_LE, val_boolean(l <= r))
+        REG_BINARY_CASE(REG_GT, OP_GT, val_boolean(l > r))
+        REG_BINARY_CASE(REG_GE, OP_GE, val_boolean(l >= r))
+        REG_BINARY_CASE(REG_EQ, OP_EQ, val_boolean(l == r))
+        REG_BINARY_CASE(REG_NE, OP_NE, val_boolean(l != r))
+        REG_BINARY_CASE(REG_STRICT_EQ, OP_STRICT_EQ, val_boolean(l == r))
+        REG_BINARY_CASE(REG_STRICT_NE, OP_STRICT_NE, val_boolean(l != r))
+#undef REG_BINARY_CASE
+        REG_CASE(REG_SET_GLOBAL) {
+            StringObject* name = (StringObject*)AS_OBJ(vm->constants[in->a]);
+            Value val = REG_OPERAND(in->b);
+            REG_RETAINED(val, env_set(vm->global_env, name, val));
+            REG_NEXT();
+        }
+        REG_CASE(REG_GET_LOCAL) {
+            reg_store_owned(&frame[in->a], env_get_slot(vm->current_env, in->b));
+            REG_NEXT();
+        }
+        REG_CASE(REG_SET_LOCAL) {
+            Value val = REG_OPERAND(in->b);
+            REG_RETAINED(val, env_set_slot(vm->current_env, in->a, val));
+            REG_NEXT();
+        }
+        REG_CASE(REG_GET_UPVAL) {
+            reg_store_owned(&frame[in->a], env_get_slot(env_at_depth(vm->current_env, in->n), in->b));
+            REG_NEXT();
+        }
+        REG_CASE(REG_SET_UPVAL) {
+            Value val = REG_OPERAND(in->b);
+            REG_RETAINED(val, env_set_slot(env_at_depth(vm->current_env, in->n), in->a, val));
+            REG_NEXT();
+        }
+        REG_CASE(REG_PUSH_ENV) {
+            GC_SAFEPOINT(vm);
+            vm->current_env = create_slot_env(vm, vm->current_env, in->n);
+            REG_NEXT();
+        }
+        REG_CASE(REG_POP_ENV) {
+            Env* old_env = vm->current_env;
+            vm->current_env = old_env->parent;
+            free_env(old_env);
+            REG_NEXT();
+        }
+        REG_CASE(REG_NEW_OBJECT) {
+            GC_SAFEPOINT(vm);
+            reg_store_owned(&frame[in->a], val_object(vm));
+            REG_NEXT();
+        }
+        REG_CASE(REG_SET_PROP) {
+            Value obj = REG_OPERAND(in->a);
+            set_prop(vm, obj, REG_OPERAND(in->b), in->c, in->d);
+            REG_NEXT();
+        }
+        REG_CASE(REG_GET_PROP) {
+            reg_store(&frame[in->a], get_prop(vm, REG_OPERAND(in->b), in->c, in->d));
+            REG_NEXT();
+        }
+        REG_CASE(REG_CLOSURE) {
+            GC_SAFEPOINT(vm);
+            FunctionObject* fn = (FunctionObject*)create_object(vm, VAL_FUNCTION, sizeof(FunctionObject));
+            fn->index = in->b;
+            fn->env = vm->current_env != vm->global_env ? vm->current_env : NULL;
+            if (fn->env) {
+#ifndef VM_TRACING_GC
+                fn->env->ref_count++;
+#endif
+            }
+            reg_store_owned(&frame[in->a], val_obj((ObjectHeader*)fn));
+            REG_NEXT();
+        }
+        // 函数调用：实参寄存器原地成为被调函数的前 arity 个槽位。调用者在实参之上的寄存器
+        // 都是已经用完的临时值，与多余的实参一起释放；被调函数的其余寄存器初始化为 undefined
+        REG_CASE(REG_CALL) {
+            Value* args = &frame[in->a + 1];
+            Value callee = args[-1];
+            if (!IS_FUNCTION(callee)) {
+                vm_error(vm, VM_ERROR_RUNTIME, "调用的不是函数！");
+            }
+            FunctionObject* fn = (FunctionObject*)AS_OBJ(callee);
+            const FunctionInfo* info = &vm->module->functions[fn->index];
+            int base = (int)(args - vm->stack);
+            int top = base + vm->frame_sizes[fn->index];
+            if (top > vm->stack_capacity) {
+                vm_reserve_stack(vm, top);
+            }
+            CallFrame call_frame = {(int)(pc - code), base, fn->index, vm->current_env};
+            vm_call(vm, &call_frame);
+            int i = base + (in->n < info->arity ? in->n : info->arity);
+            for (; i < vm->sp; i++) {
+                val_free(vm->stack[i]);
+                vm->stack[i] = val_undefined();
+            }
+            for (; i < top; i++) {
+                vm->stack[i] = val_undefined();
+            }
+            vm->sp = top;
+            vm->current_env = fn->env ? fn->env : vm->global_env;
+            frame = args;
+            pc = code + prog->entries[fn->index];
+            REG_NEXT();
+        }
+        // 函数返回：释放被调函数的寄存器，返回值替换调用者寄存器中的函数
+        REG_CASE(REG_RET) {
+            Value result = REG_OPERAND(in->a);
+            if (IS_HEAP_VALUE(result)) {
+                gc_inc_ref(AS_OBJ(result));
+            }
+            CallFrame call_frame = vm_ret(vm);
+            for (int i = call_frame.base; i < vm->sp; i++) {
+                val_free(vm->stack[i]);
+                vm->stack[i] = val_undefined();
+            }
+            reg_store_owned(&vm->stack[call_frame.base - 1], result);
+            vm->current_env = call_frame.saved_env;
+            if (vm->call_sp > 0) {
+                const CallFrame* caller = &vm->call_stack[vm->call_sp - 1];
+                frame = &vm->stack[caller->base];
+                vm->sp = caller->base + vm->frame_sizes[caller->function];
+            } else {
+                frame = vm->stack;
+                vm->sp = prog->main_size;
+            }
+            pc = code + call_frame.return_ip;
+            REG_NEXT();
+        }
+        REG_CASE(REG_PRINT) {
+            print_values(vm, &frame[in->a], in->n);
+            if (vm->output.length >= vm->output.flush_threshold) {
+                vm_flush_output(vm);
+            }
+            REG_NEXT();
+        }
+        REG_CASE(REG_EXIT) {
+            if (counting) {
+                profile_end(vm);
+            }
+            return;
+        }
+        REG_DEFAULT {
+            vm_error(vm, VM_ERROR_RUNTIME, "未知的寄存器指令：%d", in->op);
+        }
+#ifdef VM_THREADED_DISPATCH
+        R_count: {
+            vm->profile->instructions++;
+            goto *dispatch_table[in->op];
+        }
+#endif
+    }
+}
+
+// --------------- 嵌入接口 ---------------
+// 每个虚拟机的全部可变状态都在 StackVM 及其内存池中，解释器不使用可写的全局变量；
+// 已加载的模块只读。因此每个线程一个虚拟机、共享同一个模块即可并行执行，无需加锁。
+// 这组接口出错时返回错误码（描述由 vm_error_message 取得），不会退出进程
+
+// 创建虚拟机（config 含义同 vm_init_ex），内存不足时返回 NULL
+StackVM* vm_create(const VMConfig* config) {
+    StackVM* volatile vm = calloc(1, sizeof(StackVM)); // setjmp 之后仍要使用
+    if (!vm) {
+        return NULL;
+    }
+    jmp_buf jump;
+    vm->error_jump = &jump;
+    if (setjmp(jump)) {
+        // 初始化中途失败：释放已经预留的栈和已分配的内存（未初始化的字段均为 0）
+        region_release(vm->stack, (size_t)vm->stack_limit * sizeof(Value));
+        region_release(vm->call_stack, (size_t)vm->call_limit * sizeof(CallFrame));
+        free(vm->output.data);
+        table_free(&vm->strings);
+        pool_destroy(&vm->pool);
+        free(vm);
+        return NULL;
+    }
+    vm_setup(vm, config);
+    vm->error_jump = NULL;
+    return vm;
+}
+
+// 从头执行已加载的模块。无论成功与否，返回时调用栈和值栈都已清空，
+// 全局变量保留，可以再次执行或加载其他模块
+VMStatus vm_run(StackVM* vm) {
+    if (!vm->module) {
+        snprintf(vm->error, sizeof(vm->error), "没有加载模块");
+        vm->status = VM_ERROR_RUNTIME;
+        return vm->status;
+    }
+    jmp_buf jump;
+    jmp_buf* saved_jump = vm->error_jump;
+    vm->error_jump = &jump;
+    if (setjmp(jump)) {
+        // 错误发生在某条指令中途，执行状态不再完整，直接整体退回全局作用域
+        vm->error_jump = saved_jump;
+        if (vm->profile) {
+            profile_end(vm); // 出错的那条指令也计入剖析
+        }
+        vm->entry = 0;
+        vm_unwind(vm);
+        vm_flush_output(vm);
+        return vm->status;
+    }
+    if (vm->registers) {
+        vm_execute_registers(vm);
+    } else {
+        vm_execute(vm);
+    }
+    vm->entry = 0; // 再次执行时从主程序开头开始
+    vm_unwind(vm);
+    vm_flush_output(vm);
+    vm->error_jump = saved_jump;
+    vm->status = VM_OK;
+    return VM_OK;
+}
+
+// 最近一次错误的描述
+const char* vm_error_message(const StackVM* vm) {
+    return vm->error;
+}
+
+// 销毁 vm_create 创建的虚拟机（模块由调用方另行释放）
+void vm_destroy(StackVM* vm) {
+    if (vm) {
+        vm_free(vm);
+        free(vm);
+    }
+}
+
 #ifndef COMPILER_TEST
-int main() {
+// 测试：执行「变量赋值 + 函数调用 + 字符串拼接 + 数值运算 + 新类型测试」
+static void run_demo(void) {
     StackVM vm;
     vm_init(&vm);
 
     // 测试作用域功能
+    // 常量池：字符串数据区依次存放 "x=10" "x" "s=global" "s" "x=20" "y=local" "y"
+    static const char string_data[] = "x=10xs=globalsx=20y=localy";
+    static const Constant constants[] = {
+        {CONST_STRING, 4, {.offset = 0}},  // 0: "x=10"
+        {CONST_STRING, 1, {.offset = 4}},  // 1: "x"
+        {CONST_STRING, 8, {.offset = 5}},  // 2: "s=global"
+        {CONST_STRING, 1, {.offset = 13}}, // 3: "s"
+        {CONST_STRING, 4, {.offset = 14}}, // 4: "x=20"
+        {CONST_STRING, 7, {.offset = 18}}, // 5: "y=local"
+        {CONST_STRING, 1, {.offset = 25}}, // 6: "y"
+    };
     uint8_t bytecode[] = {
-        // 全局作用域：定义全局变量
-        OP_PUSH_STR, 4, 'x','=','1','0',                    // 压入字符串 "10"
-        OP_STORE_VAR, 1, 'x',                       // 存储到全局变量 x = "10"
+        // 全局作用域：定义全局变量（按名字访问）
+        OP_PUSH_STR, 0, 0,                          // 压入字符串 "x=10"
+        OP_STORE_VAR, 1, 0,                         // 存储到全局变量 x
         
-        OP_PUSH_STR, 8,'s','=','g','l','o','b','a','l',    // 压入字符串 "global"
-        OP_STORE_VAR, 1, 's',                       // 存储到全局变量 s = "global"
+        OP_PUSH_STR, 2, 0,                          // 压入字符串 "s=global"
+        OP_STORE_VAR, 3, 0,                         // 存储到全局变量 s
         
         // 打印全局变量
-        OP_PUSH_VAR, 1, 'x',                        // 加载全局变量 x
-        OP_PRINT,                                   // 打印 x (预期: 10)
+        OP_PUSH_VAR, 1, 0,                          // 加载全局变量 x
+        OP_PRINT, 1,                                // 打印 x (预期: x=10)
         
-        OP_PUSH_VAR, 1, 's',                        // 加载全局变量 s
-        OP_PRINT,                                   // 打印 s (预期: global)
+        OP_PUSH_VAR, 3, 0,                          // 加载全局变量 s
+        OP_PRINT, 1,                                // 打印 s (预期: s=global)
         
-        // 创建局部作用域
-        OP_PUSH_ENV,                                // 进入局部作用域
+        // 创建局部作用域（2 个槽位：0 = x，1 = y）
+        OP_PUSH_ENV, 2,                             // 进入局部作用域
         
         // 局部作用域：定义局部变量，覆盖全局变量
-        OP_PUSH_STR, 4, 'x','=','2','0',                    // 压入字符串 "20"
-        OP_STORE_VAR, 1, 'x',                       // 存储到局部变量 x = "20"
+        OP_PUSH_STR, 4, 0,                          // 压入字符串 "x=20"
+        OP_STORE_LOCAL, 0,                          // 存储到局部变量 x（槽位 0）
         
-        OP_PUSH_STR, 7, 'y', '=','l','o','c','a','l',        // 压入字符串 "local"
-        OP_STORE_VAR, 1, 'y',                       // 存储到局部变量 y = "local"
+        OP_PUSH_STR, 5, 0,                          // 压入字符串 "y=local"
+        OP_STORE_LOCAL, 1,                          // 存储到局部变量 y（槽位 1）
         
         // 打印局部变量和全局变量
-        OP_PUSH_VAR, 1, 'x',                        // 加载局部变量 x
-        OP_PRINT,                                   // 打印 x (预期: 20)
+        OP_LOAD_LOCAL, 0,                           // 加载局部变量 x
+        OP_PRINT, 1,                                // 打印 x (预期: x=20)
         
-        OP_PUSH_VAR, 1, 'y',                        // 加载局部变量 y
-        OP_PRINT,                                   // 打印 y (预期: local)
+        OP_LOAD_LOCAL, 1,                           // 加载局部变量 y
+        OP_PRINT, 1,                                // 打印 y (预期: y=local)
         
-        OP_PUSH_VAR, 1, 's',                        // 加载全局变量 s (从作用域链查找)
-        OP_PRINT,                                   // 打印 s (预期: global)
+        OP_PUSH_VAR, 3, 0,                          // 加载全局变量 s
+        OP_PRINT, 1,                                // 打印 s (预期: s=global)
         
         // 退出局部作用域
         OP_POP_ENV,                                 // 退出局部作用域
         
         // 验证变量恢复到全局作用域
-        OP_PUSH_VAR, 1, 'x',                        // 加载全局变量 x
-        OP_PRINT,                                   // 打印 x (预期: 10)
+        OP_PUSH_VAR, 1, 0,                          // 加载全局变量 x
+        OP_PRINT, 1,                                // 打印 x (预期: x=10)
         
         // 验证局部变量y已不存在
-        OP_PUSH_VAR, 1, 'y',                        // 尝试加载局部变量 y
-        OP_PRINT,                                   // 这里应该报错，因为y已不存在
+        OP_PUSH_VAR, 6, 0,                          // 尝试加载全局变量 y
+        OP_PRINT, 1,                                // 这里应该报错，因为y不是全局变量
         
         OP_EXIT                                     // 退出程序
     };
     
-    vm_execute(&vm, bytecode, sizeof(bytecode));
+    Module module = {
+        .code = bytecode,
+        .code_len = sizeof(bytecode),
+        .constants = constants,
+        .constant_count = sizeof(constants) / sizeof(constants[0]),
+        .string_data = string_data,
+        .string_data_len = sizeof(string_data) - 1,
+    };
+    vm_load(&vm, &module);
+    vm_execute(&vm);
     
-    // 释放全局环境内存
-    free_env(vm.current_env);
-    return 0;
+    // 释放虚拟机资源
+    vm_free(&vm);
+}
+
+// 虚拟机入口：stack-vm run foo.bin 直接映射并执行编译好的字节码文件
+int main(int argc, char* argv[]) {
+    if (argc == 1) {
+        run_demo();
+        return 0;
+    }
+    if (argc != 3 || strcmp(argv[1], "run") != 0) {
+        fprintf(stderr, "用法: stack-vm run <字节码文件>\n");
+        return 1;
+    }
+    char error[256];
+    Module* module = module_load_file(argv[2], error, sizeof(error));
+    if (!module) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    StackVM* vm = vm_create(NULL);
+    VMStatus status = vm ? vm_load(vm, module) : VM_ERROR_MEMORY;
+    if (status == VM_OK) {
+        status = vm_run(vm);
+    }
+    if (status != VM_OK) {
+        fprintf(stderr, "%s\n", vm ? vm_error_message(vm) : "内存分配失败！");
+    }
+    vm_destroy(vm);
+    module_free(module);
+    return status == VM_OK ? 0 : 1;
 }
 #endif
\ No newline at end of file
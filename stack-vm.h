@@ -3,12 +3,12 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <stdio.h>
 
 // --------------- 类型系统 ---------------
 
-// 常量定义
-#define MAX_PROPS 64
-
 // 值类型枚举
 typedef enum {
     VAL_NUMBER,
@@ -16,109 +16,857 @@ typedef enum {
     VAL_BOOLEAN,
     VAL_UNDEFINED,
     VAL_NULL,
-    VAL_OBJECT
+    VAL_OBJECT,
+    VAL_FUNCTION
 } ValueType;
 
 // 前向声明
-typedef struct Value Value;
 typedef struct Env Env;
+typedef struct StackVM StackVM;
+typedef struct RegProgram RegProgram;
 
+// 内存管理方式：默认按引用计数回收；定义 VM_TRACING_GC（make GC=trace）则改用
+// 标记-清除的追踪式回收，执行期间不再维护引用计数，循环引用也能回收
 // 对象头
 typedef struct ObjectHeader {
+#ifdef VM_TRACING_GC
+    struct ObjectHeader* gc_next; // 所有对象串成链表，供清除阶段遍历
+    bool marked;
+#else
     int ref_count;
+#endif
     ValueType type;
 } ObjectHeader;
 
-// 字符串对象
-typedef struct {
-    ObjectHeader header;
-    size_t length;
-    char* chars;
-} StringObject;
+// 值表示：默认是类型标签 + 联合体（16 字节）；定义 VM_NAN_BOXING（make VALUE=nanbox）
+// 则把所有值装进一个 8 字节的 double：非 NaN 的位模式就是数值本身，
+// 静默 NaN 空间中带符号位的是堆对象指针（类型从对象头读取），不带符号位的低位编码
+// undefined/null/false/true。两种表示都只通过下面的构造函数和访问宏使用
+#ifdef VM_NAN_BOXING
 
-// 基础对象
-typedef struct {
-    ObjectHeader header;
-    int property_count;
-    char** prop_names;
-    Value* prop_values;
-} Object;
+typedef uint64_t Value;
+
+#define NANBOX_QNAN       0x7FFC000000000000ull
+#define NANBOX_SIGN       0x8000000000000000ull
+#define NANBOX_HEAP       (NANBOX_SIGN | NANBOX_QNAN)
+#define NANBOX_CANONICAL_NAN 0x7FF8000000000000ull
+#define NANBOX_UNDEFINED  (NANBOX_QNAN | 1)
+#define NANBOX_FALSE      (NANBOX_QNAN | 2) // false/true 只差最低位
+#define NANBOX_TRUE       (NANBOX_QNAN | 3)
+#define NANBOX_NULL       (NANBOX_QNAN | 4)
 
-// 值类型
-struct Value {
+#define IS_NUMBER(v)      (((v) & NANBOX_QNAN) != NANBOX_QNAN)
+#define IS_HEAP_VALUE(v)  (((v) & NANBOX_HEAP) == NANBOX_HEAP)
+#define IS_BOOLEAN(v)     (((v) | 1) == NANBOX_TRUE)
+#define IS_UNDEFINED(v)   ((v) == NANBOX_UNDEFINED)
+#define IS_NULL(v)        ((v) == NANBOX_NULL)
+#define AS_BOOL(v)        ((v) == NANBOX_TRUE)
+#define AS_OBJ(v)         ((ObjectHeader*)(uintptr_t)((v) & ~NANBOX_HEAP))
+
+static inline double AS_NUMBER(Value v) {
+    double num;
+    memcpy(&num, &v, sizeof(num));
+    return num;
+}
+
+static inline ValueType VAL_TYPE(Value v) {
+    if (IS_NUMBER(v)) return VAL_NUMBER;
+    if (IS_HEAP_VALUE(v)) return AS_OBJ(v)->type;
+    if (IS_BOOLEAN(v)) return VAL_BOOLEAN;
+    return IS_NULL(v) ? VAL_NULL : VAL_UNDEFINED;
+}
+
+static inline Value val_number(double num) {
+    Value v;
+    if (num != num) {
+        return NANBOX_CANONICAL_NAN; // 运算得到的 NaN 可能带任意载荷，统一成不与标签冲突的形式
+    }
+    memcpy(&v, &num, sizeof(v));
+    return v;
+}
+static inline Value val_boolean(bool b) { return b ? NANBOX_TRUE : NANBOX_FALSE; }
+static inline Value val_undefined(void) { return NANBOX_UNDEFINED; }
+static inline Value val_null(void) { return NANBOX_NULL; }
+static inline Value val_obj(ObjectHeader* obj) { return NANBOX_HEAP | (uint64_t)(uintptr_t)obj; }
+
+#else
+
+typedef struct Value {
     ValueType type;
     union {
         double number;
         bool boolean;
         ObjectHeader* obj;
     } data;
+} Value;
+
+#define IS_NUMBER(v)      ((v).type == VAL_NUMBER)
+#define IS_HEAP_VALUE(v)  ((v).type == VAL_STRING || (v).type == VAL_OBJECT || (v).type == VAL_FUNCTION)
+#define IS_BOOLEAN(v)     ((v).type == VAL_BOOLEAN)
+#define IS_UNDEFINED(v)   ((v).type == VAL_UNDEFINED)
+#define IS_NULL(v)        ((v).type == VAL_NULL)
+#define AS_NUMBER(v)      ((v).data.number)
+#define AS_BOOL(v)        ((v).data.boolean)
+#define AS_OBJ(v)         ((v).data.obj)
+#define VAL_TYPE(v)       ((v).type)
+
+static inline Value val_number(double num) {
+    Value v = {.type = VAL_NUMBER};
+    v.data.number = num;
+    return v;
+}
+static inline Value val_boolean(bool b) {
+    Value v = {.type = VAL_BOOLEAN};
+    v.data.boolean = b;
+    return v;
+}
+static inline Value val_undefined(void) {
+    Value v = {.type = VAL_UNDEFINED};
+    return v;
+}
+static inline Value val_null(void) {
+    Value v = {.type = VAL_NULL};
+    return v;
+}
+static inline Value val_obj(ObjectHeader* obj) {
+    Value v = {.type = obj->type, .data.obj = obj};
+    return v;
+}
+
+#endif
+
+// 带类型检查的堆对象判断
+#define IS_STRING(v)      (IS_HEAP_VALUE(v) && AS_OBJ(v)->type == VAL_STRING)
+#define IS_OBJECT(v)      (IS_HEAP_VALUE(v) && AS_OBJ(v)->type == VAL_OBJECT)
+#define IS_FUNCTION(v)    (IS_HEAP_VALUE(v) && AS_OBJ(v)->type == VAL_FUNCTION)
+
+// 字符串对象：平坦字符串的内容在 chars 中；较长的拼接结果是绳索（rope）节点，
+// chars 为 NULL，内容是 left 与 right 的连接，直到需要连续内容时才展平（string_chars）
+typedef struct StringObject StringObject;
+struct StringObject {
+    ObjectHeader header;
+    uint32_t hash; // 平坦字符串创建时预先计算的哈希值（绳索节点为 0）
+    size_t length;
+    char* chars;
+    StringObject* left;  // 绳索节点的左右子串，展平后置为 NULL
+    StringObject* right;
 };
 
+#define STRING_IS_ROPE(s) ((s)->chars == NULL)
+// 拼接结果不短于此长度时创建绳索节点，否则直接复制
+#define STRING_ROPE_MIN_LENGTH 64
+
+// 隐藏类（Shape）：属性插入顺序相同的对象共享同一个转换树节点，
+// 节点只记录新增的那个属性名，属性的槽位就是它在链上的序号
+typedef struct Shape Shape;
+struct Shape {
+    int id;
+    Shape* parent;
+    StringObject* key;  // 本节点新增的属性名（根节点为 NULL，驻留字符串）
+    int slot_count;     // 拥有此形状的对象的属性数
+    Shape* children;    // 转换链表：在本形状上新增不同属性得到的子形状
+    Shape* next_sibling;
+    int child_count;
+};
+
+// 字典模式的属性表：属性很多或者插入顺序杂乱（形状树分叉过多）的对象不再使用形状，
+// 改为按属性名哈希的开放寻址表。每个位置一个控制字节（空位为 DICT_EMPTY，
+// 否则为哈希的低 7 位），查找时一次比较一组 DICT_GROUP 个控制字节，
+// 只有标记相同的位置才比较属性名；属性值仍按加入顺序存放在对象的槽位数组中
+#define DICT_GROUP 8
+#define DICT_EMPTY 0x80
+
+typedef struct {
+    uint8_t* control;      // capacity + DICT_GROUP 个控制字节，末尾重复开头一组，按组读取不必回绕
+    StringObject** keys;   // 各位置的属性名（驻留字符串）
+    int32_t* slots;        // 各位置的属性在槽位数组中的下标
+    uint32_t mask;         // capacity - 1（capacity 为 2 的幂）
+    int count;             // 属性数
+} PropertyDict;
+
+// 基础对象：属性值按形状给出的槽位存放（字典模式下按 dict 给出的下标）
+typedef struct {
+    ObjectHeader header;
+    Shape* shape;          // 字典模式下为虚拟机的 dict_shape
+    Value* slots;
+    int slot_capacity;
+    PropertyDict* dict;    // 字典模式的属性表，使用形状时为 NULL
+} Object;
+
+
 // --------------- 变量环境 ---------------
-#define MAX_VARS 32
+// 环境与它的变量放在同一块内存中：结构体之后依次是值数组和名字数组（按槽位访问的环境没有名字）。
+// 按名字访问的环境（全局环境）放满 ENV_INLINE_VARS 个变量后，变量搬到池外一块两倍大的存储中，
+// 名字数组之后紧跟一个开放寻址索引，变量再多查找也只需探测一两次
+#define ENV_INLINE_VARS 8
 
-// 环境结构体
+// 环境结构体（变量名为驻留字符串，由虚拟机的驻留表持有）
+// 引用计数模式下子环境和捕获它的闭包各持有一个引用；追踪模式下由回收器统一管理
 struct Env {
-    char* names[MAX_VARS];
-    Value values[MAX_VARS];
+    Value* values;          // 变量值：紧跟在结构体之后，或者是池外的存储
+    StringObject** names;   // 变量名，紧跟在 values 之后（按槽位访问的环境为 NULL）
+    int32_t* index;         // 名字索引：哈希 -> 下标 + 1（0 为空位），内联存放时为 NULL
+    uint32_t index_mask;    // 索引容量 - 1
     int var_count;
+    int capacity;
+#ifdef VM_TRACING_GC
+    bool marked;
+    Env* gc_next;
+#else
+    int ref_count;
+#endif
     Env* parent;
 };
 
+// 函数对象（闭包）：函数表中的编号 + 创建时所在的环境
+typedef struct {
+    ObjectHeader header;
+    int index;
+    Env* env;
+} FunctionObject;
+
+// --------------- 字符串驻留表 ---------------
+// 开放寻址哈希表（哈希 -> StringObject*），同一内容的字符串只存在一份
+typedef struct {
+    StringObject** entries;
+    int count;
+    int capacity; // 始终为 2 的幂
+} StringTable;
+
+// --------------- 属性内联缓存 ---------------
+#define IC_WAYS 4 // 多态缓存最多记录的形状数，超过后进入超多态状态
+
+// 缓存项：形状 id -> 槽位；next_shape 非空表示这是一次新增属性的形状转换
+typedef struct {
+    int shape_id;
+    int slot;
+    Shape* next_shape;
+} InlineCacheEntry;
+
+// 每条 OP_GET_PROP / OP_SET_PROP 指令各有一个缓存（编号由编译器分配）
+typedef struct {
+    int count;         // 已记录的形状数，-1 表示超多态
+    InlineCacheEntry entries[IC_WAYS];
+} InlineCache;
+
+// --------------- 模块（编译产物）---------------
+// 常量池项：数值直接存放，字符串（字面量和变量名/属性名）存放在字符串数据区
+typedef enum {
+    CONST_NUMBER,
+    CONST_STRING
+} ConstantType;
+
+typedef struct {
+    uint32_t type;   // ConstantType
+    uint32_t length; // 字符串长度
+    union {
+        double number;
+        uint64_t offset; // 字符串在字符串数据区中的偏移
+    } as;
+} Constant;
+
+// 函数表项：函数体位于指令流中，调用时形参和局部变量都放在值栈上的栈帧槽位中
+typedef struct {
+    uint32_t entry;      // 函数第一条指令的偏移
+    uint16_t arity;      // 形参个数
+    uint16_t slot_count; // 栈帧槽位数（形参 + 局部变量，不少于 arity）
+    uint32_t name;       // 函数名常量编号
+} FunctionInfo;
+
+// 调试信息：指令偏移 -> 源码位置（按偏移递增排列，每条语句一项）
+typedef struct {
+    uint32_t offset;
+    uint32_t line;
+    uint32_t col;
+} DebugLine;
+
+// 模块标记
+#define MODULE_REGISTER_TIER 0x1u // 加载时翻译为寄存器字节码，由寄存器解释器执行
+
+// 模块：指令流 + 常量池，指令通过 2 字节编号引用常量，加载后只读
+typedef struct {
+    const uint8_t* code;
+    uint32_t code_len;
+    const Constant* constants;
+    uint32_t constant_count;
+    const char* string_data;
+    uint32_t string_data_len;
+    const FunctionInfo* functions;
+    uint32_t function_count;
+    const DebugLine* lines;
+    uint32_t line_count;
+    uint32_t cache_count; // 属性访问指令的内联缓存数
+    uint32_t flags;       // MODULE_* 标记
+    const uint8_t* snapshot; // 堆快照段（vm_snapshot 生成的文件才有，否则为 NULL）
+    uint32_t snapshot_size;
+    void* mapping;        // 非空表示各部分都指向这块只读映射（来自 .bin 文件）
+    size_t mapping_size;
+} Module;
+
+// --------------- 字节码容器格式（.bin）---------------
+// 文件头 + 段表 + 各段数据，所有整数为小端，各段起始偏移按 8 字节对齐，
+// 因此 mmap 之后可以直接把段当作数组使用（零拷贝加载）
+#define CONTAINER_MAGIC 0x424D5653u // "SVMB"
+#define CONTAINER_VERSION 2
+#define CONTAINER_ALIGN 8
+
+typedef enum {
+    SECTION_CODE = 1,   // 指令流
+    SECTION_CONSTANTS,  // Constant 数组
+    SECTION_STRINGS,    // 字符串常量数据区
+    SECTION_FUNCTIONS,  // FunctionInfo 数组
+    SECTION_DEBUG,      // DebugLine 数组
+    SECTION_SNAPSHOT    // 堆快照（见下）
+} SectionKind;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t section_count;
+    uint32_t cache_count;
+    uint32_t flags;       // 模块标记（旧文件中为 0）
+} ContainerHeader;
+
+typedef struct {
+    uint32_t kind;   // SectionKind
+    uint32_t offset; // 相对文件开头
+    uint32_t size;   // 字节数
+    uint32_t reserved;
+} SectionEntry;
+
+// --------------- 堆快照 ---------------
+// vm_snapshot 把执行完一个模块（通常是初始化用的前导脚本）的虚拟机的全局变量，以及从全局变量
+// 可达的字符串、对象、函数和块作用域环境写成快照段，和模块本身一起组成一个 .bin 容器。
+// 段中的引用都是各表中的下标而不是指针，恢复时映射文件、按表重建对象并把下标换成新地址。
+// 段的布局：SnapshotHeader，之后依次是 SnapshotVar、SnapshotString、SnapshotObject、
+// SnapshotFunction、SnapshotEnv 各数组和字符串内容（每种记录都是 8 字节的倍数）
+#define SNAPSHOT_MAGIC 0x50414E53u // "SNAP"
+#define SNAPSHOT_NONE UINT32_MAX   // SnapshotVar::name 为空（环境槽位没有名字）
+#define SNAPSHOT_GLOBAL (UINT32_MAX - 1) // 环境编号：全局环境
+
+typedef struct {
+    uint32_t magic;
+    uint32_t resume;         // 恢复后开始执行的指令偏移（快照所在模块主程序末尾的 OP_EXIT）
+    uint32_t global_count;   // 全局变量：SnapshotVar 数组的前 global_count 项
+    uint32_t var_count;
+    uint32_t string_count;
+    uint32_t object_count;
+    uint32_t function_count;
+    uint32_t env_count;
+    uint32_t chars_size;
+    uint32_t reserved;
+} SnapshotHeader;
+
+// 名字（或属性名）加一个值：堆值的 ref 是对应表中的下标
+typedef struct {
+    uint32_t name;           // 字符串表下标（驻留字符串），SNAPSHOT_NONE 表示没有名字
+    uint32_t type;           // ValueType
+    uint32_t ref;
+    uint32_t reserved;
+    double number;           // 数值，布尔值为 0 或 1
+} SnapshotVar;
+
+typedef struct {
+    uint64_t offset;         // 内容在字符串内容区中的偏移（绳索节点已展平）
+    uint32_t length;
+    uint32_t interned;       // 非 0 表示驻留字符串
+} SnapshotString;
+
+// 对象的属性按槽位顺序存放在 SnapshotVar 数组的 [first, first + count) 中
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} SnapshotObject;
+
+// 环境编号：SNAPSHOT_GLOBAL 表示全局环境，否则为 SnapshotEnv 数组的下标
+typedef struct {
+    uint32_t index;          // 函数编号
+    uint32_t env;
+} SnapshotFunction;
+
+// 按槽位访问的块作用域环境，父环境（SNAPSHOT_GLOBAL 或下标）总是排在它之前
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+    uint32_t parent;
+    uint32_t reserved;
+} SnapshotEnv;
+
+// --------------- 内存池 ---------------
+// 每个虚拟机一个分级内存池：对象头、字符串、环境等小块内存按大小分级，
+// 每级从按 POOL_CHUNK_SIZE 对齐的内存块中切分并用空闲链表回收；
+// 释放时由地址找到所属内存块，因此不需要知道所属的虚拟机。虚拟机销毁时整体释放
+#define POOL_CHUNK_SIZE (64 * 1024)
+#define POOL_CLASS_COUNT 9
+#define POOL_MAX_BLOCK 512 // 最大一级的块大小，更大的内容（长字符串、大环境的变量）放在池外
+
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct PoolChunk PoolChunk;
+
+// 池外存储（长字符串的内容、对象的槽位数组和字典、大环境的变量）的块头：
+// 同一个池的池外存储串成双向链表，释放时自行摘下；整体释放内存块时（pool_destroy、
+// pool_recycle）链表中剩下的也一起释放，引用计数无法回收的循环引用因此不会泄漏池外存储
+typedef struct PoolExternal {
+    struct PoolExternal* prev;
+    struct PoolExternal* next;
+} PoolExternal;
+
+// 内存池统计
+typedef struct {
+    size_t chunk_count;   // 已申请的内存块数
+    size_t bytes_reserved; // 内存块占用的总字节数
+    size_t alloc_count;   // 累计分配次数
+    size_t free_count;    // 累计释放次数
+    size_t live_blocks;   // 当前在用的块数
+} PoolStats;
+
+typedef struct {
+    PoolBlock* free_lists[POOL_CLASS_COUNT];
+    PoolChunk* current[POOL_CLASS_COUNT]; // 每级正在切分的内存块
+    PoolChunk* chunks;                    // 全部内存块（销毁时整体释放）
+    PoolChunk* spare;                     // 整体回收后等待复用的内存块
+    PoolStats stats;
+    StackVM* owner;                       // 所属虚拟机（报告分配失败）
+    PoolExternal external;                // 池外存储链表的哨兵（池不能移动）
+} Pool;
+
+// --------------- 追踪式垃圾回收 ---------------
+// 新对象和环境按字节计数，超过阈值后在下一个安全点（指令开始处，所有存活的值都在
+// 值栈或环境中）做一次完整的标记-清除；之后新分配量达到存活字节数时再次回收（堆约翻倍）
+#ifndef GC_INITIAL_THRESHOLD
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#endif
+
+typedef struct {
+    size_t collections;     // 已进行的回收次数
+    size_t bytes_allocated; // 上次回收以来新分配的字节数
+    size_t live_bytes;      // 上次回收后存活的字节数
+    size_t freed_bytes;     // 累计回收的字节数
+} GCStats;
+
 // --------------- 栈式虚拟机 ---------------
+// 栈配置：初始容量决定创建时实际占用的内存，上限决定预留的地址空间，
+// 字段为 0 表示使用默认值
+#define VM_DEFAULT_STACK_SIZE 256
+#define VM_DEFAULT_MAX_STACK_SIZE (1 << 20)
+#define VM_DEFAULT_CALL_DEPTH 64
+#define VM_DEFAULT_MAX_CALL_DEPTH (1 << 16)
+
+// 调用帧：返回地址、栈帧基址（第一个形参在值栈中的位置）、被调用函数和调用前的环境
+typedef struct {
+    int return_ip;
+    int base;
+    int function;
+    Env* saved_env;
+} CallFrame;
+
+// 输出回调：OP_PRINT 的输出先写进虚拟机的缓冲区，攒够后分块交给回调（通常是整行，
+// 超过缓冲区的长字符串会单独成块）。回调为 NULL 时直接写到标准输出
+typedef void (*VMOutputFn)(void* user_data, const char* data, size_t length);
+
+#define VM_DEFAULT_OUTPUT_BUFFER (64 * 1024)
+
+// 同一条指令的特化检查失败这么多次后（操作数类型多变），保持通用指令不再特化
+// （0 表示不特化，最大 255）
+#ifndef VM_QUICKEN_LIMIT
+#define VM_QUICKEN_LIMIT 4
+#endif
+
+// --------------- 基线 JIT ---------------
+// x86-64 上（标签 + 联合体的值表示）把被频繁调用的函数的直线代码前缀按每条指令的
+// 机器码模板翻译成本地代码，本地代码直接操作虚拟机的值栈和栈帧，遇到不支持的指令时
+// 带着该指令的偏移返回解释器继续执行；类型或形状检查失败时同样退回（去优化）到该指令。
+// 定义 VM_NO_JIT（make JIT=off）则只用解释器
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(VM_NAN_BOXING) && !defined(VM_NO_JIT)
+#define VM_JIT
+#endif
+
+#define VM_DEFAULT_JIT_THRESHOLD 1000 // 函数被调用这么多次后编译
+
+// 本地代码：从函数入口执行到退出点，返回解释器继续执行的指令偏移
+typedef int (*JitCode)(StackVM* vm, Value* frame);
+
+typedef enum {
+    JIT_COLD,        // 尚未达到编译阈值
+    JIT_COMPILED,
+    JIT_UNSUPPORTED, // 入口处可翻译的指令太少，或分配可执行内存失败
+    JIT_DISCARDED    // 去优化过于频繁，已丢弃本地代码，之后只解释执行
+} JitState;
+
+typedef struct {
+    JitCode code;
+    void* memory;     // 本地代码所在的可执行映射
+    size_t memory_size;
+    uint32_t calls;    // 解释执行的调用次数
+    uint32_t entries;  // 进入本地代码的次数
+    uint32_t deopts;   // 其中因检查失败退回解释器的次数
+    JitState state;
+} JitFunction;
+
+// JIT 统计（当前加载的模块）
+typedef struct {
+    size_t compiled;   // 正在使用本地代码的函数数
+    size_t discarded;  // 因去优化被丢弃的函数数
+    size_t code_bytes; // 本地代码占用的可执行内存（按页计）
+    size_t entries;
+    size_t deopts;
+} JitStats;
+
+typedef struct {
+    int stack_size;      // 值栈初始容量（值个数）
+    int max_stack_size;  // 值栈容量上限
+    int call_depth;      // 调用栈初始容量（帧数）
+    int max_call_depth;  // 调用栈容量上限
+    size_t output_buffer_size;     // 输出缓冲区大小（字节）
+    size_t output_flush_threshold; // 缓冲的输出达到该字节数时写出（默认为缓冲区大小的一半，
+                                   // 标准输出是终端时每行写出）
+    VMOutputFn output;             // 输出回调
+    void* output_user_data;
+    int jit_threshold;             // 调用次数达到该值的函数编译为本地代码（负数关闭 JIT）
+} VMConfig;
+
+// 输出缓冲区
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    size_t flush_threshold;
+    VMOutputFn write;
+    void* user_data;
+} OutputSink;
+
+// 运行状态：嵌入接口（vm_create/vm_load/vm_run）以错误码报告失败，不退出进程
+typedef enum {
+    VM_OK = 0,
+    VM_ERROR_MEMORY,         // 内存或栈空间分配失败
+    VM_ERROR_VERIFY,         // 字节码未通过校验
+    VM_ERROR_STACK_OVERFLOW, // 值栈或调用栈超过上限
+    VM_ERROR_RUNTIME         // 运行期错误（未定义变量、类型不符等）
+} VMStatus;
+
+#if defined(__GNUC__)
+#define VM_NORETURN __attribute__((noreturn))
+#else
+#define VM_NORETURN
+#endif
+
+// --------------- 性能剖析 ---------------
+// 剖析数据属于一个模块，挂到执行该模块的虚拟机上后，每条指令开始时记录：
+// 各操作码的执行次数、耗时和内存池分配次数，相邻操作码对的频率，每个指令偏移的次数
+// 和耗时，以及按调用路径（调用上下文树）汇总的耗时。耗时在 x86 上以 rdtsc 周期计，
+// 其他平台以纳秒计。没有挂剖析数据时解释器不经过记录代码
+#define VM_PROFILE_OPCODES 256
+
+// 调用上下文树节点：同一调用路径上的同一函数共享一个节点，根节点是主程序
+typedef struct {
+    int parent;           // 父节点（根节点为 -1）
+    int function;         // 函数编号（根节点为 -1）
+    int first_child;
+    int next_sibling;
+    uint64_t cycles;      // 在该函数自身（不含被调函数）中的耗时
+    uint64_t instructions;
+} ProfileNode;
+
+typedef struct {
+    const Module* module;
+    uint64_t instructions;                     // 执行的指令总数
+    uint64_t cycles;                           // 各指令耗时之和（不含记录本身的开销）
+    uint64_t op_counts[VM_PROFILE_OPCODES];
+    uint64_t op_cycles[VM_PROFILE_OPCODES];
+    uint64_t op_allocs[VM_PROFILE_OPCODES];    // 执行期间内存池的分配次数
+    uint64_t* pair_counts;                     // [前一条][后一条]，VM_PROFILE_OPCODES 的平方项
+    uint64_t* offset_counts;                   // 按指令偏移，code_len 项
+    uint64_t* offset_cycles;
+    ProfileNode* nodes;
+    int node_count;
+    int node_capacity;
+    // 执行中的状态：上一条指令及其开始时刻、当前所在的调用上下文
+    int current;
+    int depth;
+    int last_offset;      // -1 表示本次执行尚未记录任何指令
+    uint64_t last_time;
+    size_t last_allocs;
+} VMProfile;
+
+// 数值转字符串缓存（直接映射），字符串拼接中的数值操作数不再每次格式化
+#define NUMBER_STRING_CACHE_SIZE 64
+
+typedef struct {
+    uint64_t bits;         // 数值的位模式（区分 0 与 -0）
+    StringObject* string;  // NULL 表示空槽
+} NumberString;
+
+// 校验得到的函数创建处（OP_CLOSURE）的静态作用域链，恢复快照时据此检查闭包环境
 typedef struct {
-    Value stack[64];
+    bool created;       // 主程序或已校验的函数中有创建该函数的 OP_CLOSURE
+    int depth;          // 块作用域的层数（0 表示在全局作用域中创建）
+    int* slot_counts;   // 从内到外每层块作用域的槽位数，depth 项
+} FunctionScope;
+
+struct StackVM {
+    Value* stack;        // 值栈：连续预留到上限，按需提交，末尾有保护页
+    int stack_capacity;  // 已提交（可用）的容量
+    int stack_limit;     // 容量上限
     int sp;
-    Env* current_env;
-    int call_stack[16];
+    Env* global_env;  // 全局环境（按名字访问的变量）
+    Env* current_env; // 当前块作用域环境（按槽位访问的变量）
+    CallFrame* call_stack; // 调用帧栈，布局同值栈
+    int call_capacity;
+    int call_limit;
     int call_sp;
-} StackVM;
+    StringTable strings;     // 虚拟机级别的字符串驻留表
+    const Module* module;    // 当前加载的模块
+    int entry;               // 下一次 vm_run 开始执行的指令偏移（恢复快照后为快照的位置，否则为 0）
+    Value* constants;        // 加载时物化的常量池（字符串已驻留）
+    int* frame_sizes;        // 每个函数的栈帧最大深度（由校验得到，调用时据此预留值栈）
+    FunctionScope* function_scopes; // 每个函数创建处的作用域链（由校验得到）
+    int function_scope_count;
+    Shape* root_shape;       // 空对象的形状（转换树的根）
+    Shape* dict_shape;       // 字典模式的对象共用的形状（不在转换树中，也不会记入内联缓存）
+    int next_shape_id;
+    InlineCache* caches;     // 属性访问指令的内联缓存
+    uint8_t* code;           // 指令流的可写副本（执行时就地特化）
+    uint8_t* quicken_budget; // 紧接在 code 之后：每个偏移还允许特化失败的次数
+    RegProgram* registers;   // 寄存器字节码（模块带 MODULE_REGISTER_TIER 且翻译成功时非空）
+    int cache_count;
+    Pool pool;               // 对象、字符串和环境的内存池
+    NumberString number_strings[NUMBER_STRING_CACHE_SIZE]; // 数值转字符串的缓存
+    OutputSink output;       // OP_PRINT 的输出缓冲区
+    VMProfile* profile;      // 非空且属于当前模块时记录每条指令（由调用方持有）
+    JitFunction* jit;        // 每个函数的 JIT 状态（加载模块时分配，NULL 表示不使用 JIT）
+    int jit_threshold;
+    jmp_buf* error_jump;     // 非空时错误跳回 vm_load/vm_run，否则打印并退出进程
+    VMStatus status;         // 最近一次错误
+    char error[256];         // 最近一次错误的描述
+#ifdef VM_TRACING_GC
+    ObjectHeader* objects;   // 全部堆对象
+    Env* envs;               // 全部环境
+    size_t next_gc;          // 触发下一次回收的新分配字节数
+    bool gc_pending;         // 已达到阈值，等待安全点
+    ObjectHeader** gray;     // 标记栈
+    int gray_count;
+    int gray_capacity;
+    GCStats gc_stats;
+#endif
+};
 
 // --------------- 字节码指令 ---------------
+// 常量编号和内联缓存编号均为 2 字节小端整数
 typedef enum {
-    OP_PUSH_NUM,
-    OP_PUSH_STR,
+    OP_PUSH_NUM,      // 后续2字节常量编号
+    OP_PUSH_STR,      // 后续2字节常量编号
     OP_PUSH_BOOL,
     OP_PUSH_UNDEFINED,
     OP_PUSH_NULL,
-    OP_PUSH_VAR,
-    OP_STORE_VAR,
+    OP_PUSH_VAR,      // 后续2字节变量名常量编号
+    OP_STORE_VAR,     // 后续2字节变量名常量编号
     OP_ADD,
-    OP_CALL,
-    OP_RET,
+    OP_CALL,          // 后续1字节实参个数：栈上依次为函数、各实参
+    OP_RET,           // 栈顶为返回值
     OP_PRINT,
     OP_EXIT,
     OP_NEW_OBJECT,
-    OP_SET_PROP,
-    OP_GET_PROP,
-    OP_PUSH_ENV,
-    OP_POP_ENV
+    OP_SET_PROP,      // 后续2字节属性名常量编号 + 2字节内联缓存编号
+    OP_GET_PROP,      // 后续2字节属性名常量编号 + 2字节内联缓存编号
+    OP_PUSH_ENV,      // 后续1字节为新作用域的槽位数
+    OP_POP_ENV,
+    OP_LOAD_LOCAL,    // 后续1字节槽位：读取当前作用域变量
+    OP_STORE_LOCAL,   // 后续1字节槽位：写入当前作用域变量
+    OP_LOAD_UPVAL,    // 后续1字节深度 + 1字节槽位：读取外层作用域变量
+    OP_STORE_UPVAL,   // 后续1字节深度 + 1字节槽位：写入外层作用域变量
+    OP_POP,           // 丢弃栈顶值（表达式语句）
+    OP_CLOSURE,       // 后续2字节函数编号：以当前环境创建函数对象
+    OP_LOAD_SLOT,     // 后续1字节槽位：读取当前栈帧的形参/局部变量
+    OP_STORE_SLOT,    // 后续1字节槽位：写入当前栈帧的形参/局部变量
+    // 超级指令：由编译器的窥孔优化合并常见指令序列得到，操作数依次为原各条指令的操作数
+    OP_ADD_VAR_VAR,   // PUSH_VAR a; PUSH_VAR b; ADD
+    OP_ADD_SLOT_SLOT, // LOAD_SLOT a; LOAD_SLOT b; ADD
+    OP_ADD_NUM,       // PUSH_NUM k; ADD
+    OP_GET_VAR_PROP,  // PUSH_VAR o; GET_PROP p
+    OP_GET_SLOT_PROP, // LOAD_SLOT o; GET_PROP p
+    // 算术与比较：栈上依次为左、右操作数，结果入栈（比较的结果为布尔值）。
+    // 减乘除把操作数转换为数值；两个字符串按字节序比较大小，其余按数值比较
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,            // ==（宽松相等：null 与 undefined 相等，数值与字符串/布尔值按数值比较）
+    OP_NE,
+    OP_STRICT_EQ,     // ===（类型相同且值相同）
+    OP_STRICT_NE,
+    // 特化指令：执行时由通用指令按实际遇到的操作数类型就地改写而来，只出现在虚拟机的
+    // 可写代码副本中（模块中出现则校验失败）。检查不通过时改回模块中原来的通用指令
+    OP_ADD_NUM_NUM,
+    OP_ADD_STR_STR,
+    OP_SUB_NUM_NUM,
+    OP_MUL_NUM_NUM,
+    OP_DIV_NUM_NUM,
+    OP_LT_NUM_NUM,
+    OP_LE_NUM_NUM,
+    OP_GT_NUM_NUM,
+    OP_GE_NUM_NUM,
+    OP_EQ_NUM_NUM,    // 由 OP_EQ 或 OP_STRICT_EQ 特化（两个数值时二者相同）
+    OP_NE_NUM_NUM     // 由 OP_NE 或 OP_STRICT_NE 特化
 } OpCode;
 
+#define OP_FIRST_QUICKENED OP_ADD_NUM_NUM
+#define OP_COUNT (OP_NE_NUM_NUM + 1)
+
+// --------------- 寄存器字节码 ---------------
+// 由栈式指令翻译得到的三地址指令：寄存器是当前栈帧中的值（先是形参和局部变量槽位，
+// 之后依次是栈式指令的各个栈深度），因此调用帧、返回值的位置和出错时的退栈都与栈式
+// 执行相同。读操作数可以是寄存器、常量或全局变量（按名字读取），写操作数总是寄存器
+#define REG_CONSTANT 0x8000 // 操作数最高位为 1：低 15 位是常量编号
+#define REG_GLOBAL   0x4000 // 次高位为 1：低 14 位是全局变量名的常量编号
+#define REG_MAX_REGISTERS REG_GLOBAL // 其余为寄存器编号
+
+typedef enum {
+    REG_MOVE,         // a = b
+    // 算术与比较：a = b op c（语义同对应的栈式指令）
+    REG_ADD,
+    REG_SUB,
+    REG_MUL,
+    REG_DIV,
+    REG_LT,
+    REG_LE,
+    REG_GT,
+    REG_GE,
+    REG_EQ,
+    REG_NE,
+    REG_STRICT_EQ,
+    REG_STRICT_NE,
+    REG_SET_GLOBAL,   // 全局变量（名字为常量 a）= b
+    REG_GET_LOCAL,    // a = 当前作用域槽位 b
+    REG_SET_LOCAL,    // 当前作用域槽位 a = b
+    REG_GET_UPVAL,    // a = 外 n 层作用域的槽位 b
+    REG_SET_UPVAL,    // 外 n 层作用域的槽位 a = b
+    REG_PUSH_ENV,     // 创建 n 个槽位的块作用域
+    REG_POP_ENV,
+    REG_NEW_OBJECT,   // a = {}
+    REG_SET_PROP,     // a.(常量 c) = b，d 为内联缓存编号
+    REG_GET_PROP,     // a = b.(常量 c)，d 为内联缓存编号
+    REG_CLOSURE,      // a = 函数 b 的闭包
+    REG_CALL,         // 调用寄存器 a 中的函数，实参为其后的 n 个寄存器，返回值写回 a
+    REG_RET,          // 返回 a
+    REG_PRINT,        // 打印从寄存器 a 开始的 n 个值
+    REG_EXIT
+} RegOpCode;
+
+typedef struct {
+    uint8_t op;       // RegOpCode
+    uint8_t n;
+    uint16_t a, b, c, d;
+} RegInstr;
+
+struct RegProgram {
+    RegInstr* code;
+    int code_len;
+    int* entries;      // 每个函数第一条指令的下标（未被创建的函数为 -1）
+    Value* constants;  // 模块常量之后附加 undefined、null、false、true
+    int main_size;     // 主程序的寄存器数（函数的寄存器数即栈帧深度 frame_sizes）
+};
+
 // --------------- 函数声明 ---------------
 
 // 值操作
-Value val_number(double num);
-Value val_boolean(bool b);
-Value val_undefined();
-Value val_null();
-Value val_string(const char* str);
-Value val_object();
+// （val_number/val_boolean/val_undefined/val_null/val_obj 随值表示定义在上面）
+Value val_string(StackVM* vm, const char* str);
+Value val_object(StackVM* vm);
+#ifdef VM_TRACING_GC
+#define val_free(v) ((void)(v)) // 追踪模式下值的释放由回收器负责
+#else
 void val_free(Value v);
+#endif
 
-// 环境操作
-Value env_get(Env* env, const char* name);
-void env_set(Env* env, const char* name, Value val);
-Env* create_env(Env* parent);
+// 环境操作（name 必须是驻留字符串）
+Value env_get(Env* env, StringObject* name);
+void env_set(Env* env, StringObject* name, Value val);
+Env* create_env(StackVM* vm, Env* parent);
+Env* create_slot_env(StackVM* vm, Env* parent, int slot_count);
+#ifdef VM_TRACING_GC
+#define free_env(env) ((void)(env))
+#else
 void free_env(Env* env);
+#endif
+
+// 字符串驻留（返回的字符串由驻留表持有）
+uint32_t hash_string(const char* chars, size_t length);
+StringObject* vm_intern(StackVM* vm, const char* chars, size_t length);
+// 字符串的连续内容（绳索节点在此时展平）
+const char* string_chars(StringObject* str);
+
+// 内存池（pool_free 由地址找到所属的池）
+void* pool_alloc(Pool* pool, size_t size);
+void pool_free(void* ptr);
+void vm_pool_stats(const StackVM* vm, PoolStats* stats);
+
+#ifdef VM_TRACING_GC
+// 追踪式回收：立即回收一次 / 读取统计
+void vm_gc_collect(StackVM* vm);
+void vm_gc_stats(const StackVM* vm, GCStats* stats);
+#endif
 
-// 虚拟机操作
+// 虚拟机操作（vm_init/vm_execute 等在出错时打印错误并退出进程）
 void vm_init(StackVM* vm);
+void vm_init_ex(StackVM* vm, const VMConfig* config);
+void vm_free(StackVM* vm);
 void vm_push(StackVM* vm, Value val);
 Value vm_pop(StackVM* vm);
 void vm_pop_free(StackVM* vm);
-void vm_call(StackVM* vm, int func_ip);
-int vm_ret(StackVM* vm);
-void vm_execute(StackVM* vm, const uint8_t* bytecode, int len);
+void vm_call(StackVM* vm, const CallFrame* frame);
+CallFrame vm_ret(StackVM* vm);
+// 指令总长度（含操作码，无效操作码返回 0），供编译器按指令遍历字节码
+int vm_op_length(uint8_t op);
+const char* vm_op_name(uint8_t op); // 不带 OP_ 前缀的名字，无效操作码返回 "?"
+// 数值的字符串形式：fixed 为字符串拼接的 "%.2f"，否则为 print 的 "%g"；NaN 和无穷大按 JS 的写法
+#define VM_NUMBER_TEXT_SIZE 320 // 足以容纳 "%.2f" 格式的任意数值
+int vm_format_number(char* buffer, size_t size, double number, bool fixed);
+// 校验失败时返回 false，并把错误描述写入 error（error_size 字节）
+bool vm_verify(const Module* module, int* max_stack, int* frame_sizes, FunctionScope* scopes,
+               char* error, size_t error_size);
+// 加载模块（模块只读，可被多个虚拟机共享；须在这些虚拟机销毁后才能释放）
+VMStatus vm_load(StackVM* vm, const Module* module);
+void vm_execute(StackVM* vm);
+// 执行寄存器字节码（vm_run 在 vm->registers 非空时使用）。挂了剖析数据时只累计指令总数
+void vm_execute_registers(StackVM* vm);
+
+// 嵌入接口：每个虚拟机同一时刻只能由一个线程使用，不同虚拟机之间不共享可写状态
+StackVM* vm_create(const VMConfig* config); // 失败返回 NULL
+VMStatus vm_run(StackVM* vm);               // 从头执行已加载的模块
+VMStatus vm_reset(StackVM* vm);             // 恢复到刚创建时的状态，保留栈和内存池以便复用
+void vm_set_output(StackVM* vm, VMOutputFn output, void* user_data); // 先写出已缓冲的输出
+void vm_flush_output(StackVM* vm);          // vm_run 返回和虚拟机释放时会自动调用
+void vm_jit_stats(const StackVM* vm, JitStats* stats);
+const char* vm_error_message(const StackVM* vm);
+void vm_destroy(StackVM* vm);
+
+// 性能剖析：剖析数据可以先后挂到多个虚拟机上，多次执行的结果累加
+VMProfile* vm_profile_create(const Module* module); // 内存不足时返回 NULL
+void vm_set_profile(StackVM* vm, VMProfile* profile); // NULL 表示停止记录
+void vm_profile_report(const VMProfile* profile, FILE* out); // 文本报告
+bool vm_profile_write_folded(const VMProfile* profile, FILE* out); // 火焰图用的折叠调用栈
+void vm_profile_free(VMProfile* profile);
+
+// 模块操作
+// 失败返回 NULL，并把错误描述写入 error（error_size 字节）
+Module* module_load_file(const char* path, char* error, size_t error_size);
+void module_free(Module* module);
+// 序列化为容器格式（带快照段的模块连同快照一起），由调用方 free；失败时打印错误并返回 NULL
+uint8_t* module_serialize(const Module* module, size_t* size);
+
+// 堆快照：vm_snapshot 在 vm_run 执行完模块之后调用，返回快照文件的内容（调用方 free），
+// 失败返回 NULL（错误描述由 vm_error_message 取得）。
+// vm_restore 先把虚拟机恢复到刚创建时的状态，加载 module 并重建快照中的堆，下一次 vm_run
+// 从快照的位置继续执行。module 的开头必须就是快照所在的模块（指令、常量和函数都相同，
+// 通常是同一份前导脚本后面接上其余的代码），为 NULL 时加载快照文件本身的模块。
+// snapshot 是映射进来的快照文件（module_load_file），恢复之后即可释放（module 为 NULL 时除外）
+uint8_t* vm_snapshot(StackVM* vm, size_t* size);
+VMStatus vm_restore(StackVM* vm, const Module* snapshot, const Module* module);
 
 #endif // STACK_VM_H
\ No newline at end of file